@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2016 Hyeshik Chang
+# 
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+# 
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+# - Hyeshik Chang <hyeshik@snu.ac.kr>
+#
+
+from tailseeker.powersnake import *
+
+
+def generate_options_section(outf):
+    print("""\
+[options]
+threads = {threads}
+rounds = {rounds}
+total-cycles = {total_cycles}
+initial-cutoffs = {input.score_cutoffs}
+""".format(threads=threads, input=input, total_cycles=params.total_cycles,
+           rounds=params.conf['polyA_ruler']['signal_resampling_rounds']), file=outf)
+
+
+def generate_polyA_ruler_section(outf):
+    print("""\
+[polyA_ruler]
+minimum-polya-length = {conf[polyA_finder][signal_analysis_trigger]}
+downhill-extension-weight = {conf[polyA_ruler][downhill_extension_weight]}
+signal-resampling-gap = {conf[polyA_ruler][signal_resampling_gap]}
+""".format(conf=params.conf), file=outf)
+
+
+def generate_polyA_seeder_section(outf):
+    conf = params.conf['polyA_seeder']
+    print("""\
+[polyA_seeder]
+dist-sampling-bins = {conf[dist_sampling_bins]}
+minimum-spots-for-dist-sampling = {conf[minimum_spots_for_dist_sampling]}
+kde-bandwidth-for-dist = {conf[kde_bandwidth_for_dist]}
+cutoff-score-search-low = {conf[cutoff_score_search_low]}
+cutoff-score-search-high = {search_high}
+""".format(conf=conf, search_high=', '.join(map(str, conf['cutoff_score_search_high']))),
+        file=outf)
+
+
+def generate_output_section(outf):
+    print("""\
+[output]
+cutoffs = {output.cutoff_values}
+cutoff-bases = {output.cutoff_bases}
+""".format(output=output), file=outf)
+
+
+def generate_tile_sections(outf):
+    for tileid, tileinfo in sorted(params.tileinfo.items()):
+        print("""\
+[tile:{tileid}]
+source = {tileinfo[source]}
+negative-dists = scratch/sigdists-r00/neg_{tileid}.sigdists\
+""".format(tileid=tileid, tileinfo=tileinfo), file=outf)
+
+        for sample in params.samples:
+            print("""\
+signals:{sample} = scratch/signals/{sample}_{tileid}.sigpack
+taginfo:{sample} = scratch/taginfo/{sample}_{tileid}.txt.gz
+output:{sample} = scratch/taginfo-fl-r{round:02d}/{sample}_{tileid}.txt.gz\
+""".format(sample=sample, tileid=tileid,
+           round=params.conf['polyA_ruler']['signal_resampling_rounds'] + 1), file=outf)
+
+        print('', file=outf)
+
+
+if is_snakemake_child:
+    with open(output.resampler_conf, 'w') as outf:
+        generate_options_section(outf)
+        generate_polyA_ruler_section(outf)
+        generate_polyA_seeder_section(outf)
+        generate_output_section(outf)
+        generate_tile_sections(outf)
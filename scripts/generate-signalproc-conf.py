@@ -75,6 +75,9 @@ keep-no-delimiter = {of[keep_no_delimiter]:d}
 keep-low-quality-balancer = {of[keep_low_quality_balancer]:d}
 threads = {threads}
 read-buffer-size = {pf[maximum_buffer_size]}
+read-buffer-sets = {pf[read_buffer_sets]}
+mmap-cif = {pf[mmap_cif_files]:d}
+transpose-basecalls = {pf[transpose_basecalls]:d}
 """.format(of=params.conf['output_filtering'], pf=params.conf['performance'],
            threads=threads), file=outf)
 
@@ -88,7 +91,11 @@ signal = scratch/signals/{{name}}_{tile}.sigpack
 signal-dists = scratch/sigdists-r00/{{posneg}}_{tile}.sigdists
 stats = scratch/stats/signal-proc-{tile}.csv
 length-dists = scratch/stats/length-dist-{tile}.csv
-""".format(tile=wildcards.tile), file=outf)
+format = {format}
+signal-score-bits = {pf[signal_score_bits]}
+""".format(tile=wildcards.tile, pf=params.conf['performance'],
+           format='binary' if params.conf['performance']['binary_intermediates']
+                  else 'text'), file=outf)
 
     for subdir in 'seqqual taginfo signals sigdists stats'.split():
         subdir = os.path.join('scratch', subdir)
@@ -114,6 +121,8 @@ def generate_control_section(outf):
 phix-match-name = PhiX
 phix-match-start = {conf[phix_match_start]}
 phix-match-length = {conf[phix_match_length]}
+seed-length = {conf[seed_length]}
+min-seed-hits = {conf[min_seed_hits]}
 """.format(conf=params.conf['control']), file=outf)
 
 
@@ -25,47 +25,29 @@
 
 from tailseeker.powersnake import *
 from snakemake.shell import shell
-from snakemake.utils import format
-from tailseeker.fileutils import TemporaryDirectory
-import numpy as np
-import struct
-import gzip
 
 BINDIR = params.BINDIR
-BGZIP_CMD = params.BGZIP_CMD
 CONF = params.CONF
 
-def load_sig_dists(filename):
-    inpf = gzip.open(filename, 'rb')
-    elemsize, cycles, bins = struct.unpack('<III', inpf.read(12))
-    assert elemsize == 4
-
-    counts = np.fromstring(inpf.read(), np.uint32).reshape((cycles, bins))
-    return counts.astype(np.uint64)
-
-def write_sig_dists(counts, filename):
-    with gzip.open(filename, 'wb') as outf:
-        outf.write(struct.pack('<III', 4, counts.shape[0], counts.shape[1]))
-        outf.write(counts.astype(np.uint32).tostring())
-
-counts_aggr = None
-
-for signals, taginfo, out in zip(input.signals, input.taginfo,
-                                 output.taginfo):
-    cmd = format('{BINDIR}/tailseq-polya-ruler {wildcards.tile} {signals} \
-        {input.score_cutoffs} {CONF[polyA_finder][signal_analysis_trigger]} \
-        {CONF[polyA_ruler][downhill_extension_weight]} \
-        {taginfo} {CONF[polyA_seeder][dist_sampling_bins]} \
-        {CONF[polyA_ruler][signal_resampling_gap]} \
-        {output.sigdists} | {BGZIP_CMD} -c > {out}', wildcards=wildcards,
-        input=input, output=output)
-    shell(cmd)
-
-    counts_new = load_sig_dists(output.sigdists)
-    if counts_aggr is None:
-        counts_aggr = counts_new
-    else:
-        counts_aggr += counts_new
-
-write_sig_dists(counts_aggr, output.sigdists)
-
+# Signals of all tiles in the round are measured by a single run of
+# the ruler with the tiles listed in a manifest.
+with open(output.manifest, 'w') as outf:
+    for tile in params.tiles:
+        for sample in params.samples:
+            print(tile,
+                  'scratch/signals/{}_{}.sigpack'.format(sample, tile),
+                  'scratch/taginfo/{}_{}.txt.gz'.format(sample, tile),
+                  'scratch/taginfo-fl-r{}/{}_{}.txt.gz'.format(wildcards.round,
+                                                               sample, tile),
+                  sep='\t', file=outf)
+
+# The positive signal distributions are written per tile by the ruler.
+sigdists_output = 'scratch/sigdists-r{}/pos_{{tile}}.sigdists'.format(wildcards.round)
+
+shell('{BINDIR}/tailseq-polya-ruler --threads {threads} \
+    --manifest {output.manifest} {input.score_cutoffs} \
+    {CONF[polyA_finder][signal_analysis_trigger]} \
+    {CONF[polyA_ruler][downhill_extension_weight]} \
+    {CONF[polyA_seeder][dist_sampling_bins]} \
+    {CONF[polyA_ruler][signal_resampling_gap]} \
+    {sigdists_output}')
@@ -75,6 +75,16 @@ typedef struct {
 	int32_t length;
 } cigar;
 
+/* Scratch memory of sw_sse2_byte owned by a reusable profile */
+typedef struct {
+	uint8_t* maxColumn;
+	__m128i* pvHStore;
+	__m128i* pvHLoad;
+	__m128i* pvE;
+	__m128i* pvHmax;
+	alignment_end bests[2];
+} sw_buffers;
+
 struct _profile{
 	__m128i* profile_byte;	// 0: none
 	__m128i* profile_word;	// 0: none
@@ -83,10 +93,14 @@ struct _profile{
 	int32_t readLen;
 	int32_t n;
 	uint8_t bias;
+	sw_buffers* buffers;	// 0: not reusable
+	int32_t readCapacity;
+	int32_t refCapacity;
 };
 
 /* Generate query profile rearrange query sequence & calculate the weight of match/mismatch. */
-static __m128i* qP_byte (const int8_t* read_num,
+static __m128i* qP_byte_fill (__m128i* vProfile,
+				  const int8_t* read_num,
 				  const int8_t* mat,
 				  const int32_t readLen,
 				  const int32_t n,	/* the edge length of the squre matrix mat */
@@ -96,7 +110,6 @@ static __m128i* qP_byte (const int8_t* read_num,
 								     Each piece is 8 bit. Split the read into 16 segments.
 								     Calculat 16 segments in parallel.
 								   */
-	__m128i* vProfile = (__m128i*)malloc(n * segLen * sizeof(__m128i));
 	int8_t* t = (int8_t*)vProfile;
 	int32_t nt, i, j, segNum;
 
@@ -113,6 +126,17 @@ static __m128i* qP_byte (const int8_t* read_num,
 	return vProfile;
 }
 
+static __m128i* qP_byte (const int8_t* read_num,
+				  const int8_t* mat,
+				  const int32_t readLen,
+				  const int32_t n,
+				  uint8_t bias) {
+
+	int32_t segLen = (readLen + 15) / 16;
+	__m128i* vProfile = (__m128i*)malloc(n * segLen * sizeof(__m128i));
+	return qP_byte_fill(vProfile, read_num, mat, readLen, n, bias);
+}
+
 /* Striped Smith-Waterman
    Record the highest score of each reference position.
    Return the alignment score and ending position of the best alignment, 2nd best alignment, etc.
@@ -132,7 +156,8 @@ static alignment_end* sw_sse2_byte (const int8_t* ref,
 												   alignment beginning point. If this score
 												   is set to 0, it will not be used */
 	 						 uint8_t bias,  /* Shift 0 point to a positive value. */
-							 int32_t maskLen) {
+							 int32_t maskLen,
+							 sw_buffers* buf) {	/* preallocated scratch; 0: allocate here */
 
 #define max16(m, vm) (vm) = _mm_max_epu8((vm), _mm_srli_si128((vm), 8)); \
 					  (vm) = _mm_max_epu8((vm), _mm_srli_si128((vm), 4)); \
@@ -145,19 +170,33 @@ static alignment_end* sw_sse2_byte (const int8_t* ref,
 	int32_t end_ref = -1; /* 0_based best alignment ending point; Initialized as isn't aligned -1. */
 	int32_t segLen = (readLen + 15) / 16; /* number of segment */
 
-	/* array to record the largest score of each reference position */
-	uint8_t* maxColumn = (uint8_t*) calloc(refLen, 1);
-
-	/* array to record the alignment read ending position of the largest score of each reference position */
-	int32_t* end_read_column = (int32_t*) calloc(refLen, sizeof(int32_t));
+	uint8_t* maxColumn;
+	__m128i *pvHStore, *pvHLoad, *pvE, *pvHmax;
+	alignment_end* bests;
 
 	/* Define 16 byte 0 vector. */
 	__m128i vZero = _mm_set1_epi32(0);
 
-	__m128i* pvHStore = (__m128i*) calloc(segLen, sizeof(__m128i));
-	__m128i* pvHLoad = (__m128i*) calloc(segLen, sizeof(__m128i));
-	__m128i* pvE = (__m128i*) calloc(segLen, sizeof(__m128i));
-	__m128i* pvHmax = (__m128i*) calloc(segLen, sizeof(__m128i));
+	if (buf) {
+		maxColumn = buf->maxColumn;
+		pvHStore = buf->pvHStore;
+		pvHLoad = buf->pvHLoad;
+		pvE = buf->pvE;
+		pvHmax = buf->pvHmax;
+		memset(maxColumn, 0, refLen);
+		memset(pvHStore, 0, segLen * sizeof(__m128i));
+		memset(pvHLoad, 0, segLen * sizeof(__m128i));
+		memset(pvE, 0, segLen * sizeof(__m128i));
+		memset(pvHmax, 0, segLen * sizeof(__m128i));
+	} else {
+		/* array to record the largest score of each reference position */
+		maxColumn = (uint8_t*) calloc(refLen, 1);
+
+		pvHStore = (__m128i*) calloc(segLen, sizeof(__m128i));
+		pvHLoad = (__m128i*) calloc(segLen, sizeof(__m128i));
+		pvE = (__m128i*) calloc(segLen, sizeof(__m128i));
+		pvHmax = (__m128i*) calloc(segLen, sizeof(__m128i));
+	}
 
 	int32_t i, j;
 	/* 16 byte insertion begin vector */
@@ -307,13 +346,21 @@ static alignment_end* sw_sse2_byte (const int8_t* ref,
 		}
 	}
 
-	free(pvHmax);
-	free(pvE);
-	free(pvHLoad);
-	free(pvHStore);
+	if (buf) {
+		/* The two H buffers may have been swapped. */
+		buf->pvHStore = pvHStore;
+		buf->pvHLoad = pvHLoad;
+		bests = buf->bests;
+	} else {
+		free(pvHmax);
+		free(pvE);
+		free(pvHLoad);
+		free(pvHStore);
+
+		bests = (alignment_end*) calloc(2, sizeof(alignment_end));
+	}
 
 	/* Find the most possible 2nd best alignment. */
-	alignment_end* bests = (alignment_end*) calloc(2, sizeof(alignment_end));
 	bests[0].score = max + bias >= 255 ? 255 : max;
 	bests[0].ref = end_ref;
 	bests[0].read = end_read;
@@ -339,8 +386,8 @@ static alignment_end* sw_sse2_byte (const int8_t* ref,
 		}
 	}
 
-	free(maxColumn);
-	free(end_read_column);
+	if (!buf)
+		free(maxColumn);
 	return bests;
 }
 
@@ -751,6 +798,7 @@ s_profile* ssw_init (const int8_t* read, const int32_t readLen, const int8_t* ma
 	p->profile_byte = 0;
 	p->profile_word = 0;
 	p->bias = 0;
+	p->buffers = 0;
 
 	if (score_size == 0 || score_size == 2) {
 		/* Find the bias to use in the substitution matrix */
@@ -772,9 +820,83 @@ s_profile* ssw_init (const int8_t* read, const int32_t readLen, const int8_t* ma
 void init_destroy (s_profile* p) {
 	free(p->profile_byte);
 	free(p->profile_word);
+	if (p->buffers) {
+		free(p->buffers->maxColumn);
+		free(p->buffers->pvHStore);
+		free(p->buffers->pvHLoad);
+		free(p->buffers->pvE);
+		free(p->buffers->pvHmax);
+		free(p->buffers);
+	}
 	free(p);
 }
 
+s_profile* ssw_init_reusable (const int32_t maxReadLen, const int32_t maxRefLen, const int32_t n) {
+	int32_t segLen = (maxReadLen + 15) / 16;
+	s_profile* p = (s_profile*)calloc(1, sizeof(struct _profile));
+	sw_buffers* buf;
+
+	if (p == 0) return 0;
+	p->readCapacity = maxReadLen;
+	p->refCapacity = maxRefLen;
+	p->n = n;
+	p->profile_byte = (__m128i*)malloc(n * segLen * sizeof(__m128i));
+	p->buffers = buf = (sw_buffers*)calloc(1, sizeof(sw_buffers));
+	if (p->profile_byte == 0 || buf == 0) {
+		init_destroy(p);
+		return 0;
+	}
+
+	buf->maxColumn = (uint8_t*)malloc(maxRefLen);
+	buf->pvHStore = (__m128i*)malloc(segLen * sizeof(__m128i));
+	buf->pvHLoad = (__m128i*)malloc(segLen * sizeof(__m128i));
+	buf->pvE = (__m128i*)malloc(segLen * sizeof(__m128i));
+	buf->pvHmax = (__m128i*)malloc(segLen * sizeof(__m128i));
+	if (buf->maxColumn == 0 || buf->pvHStore == 0 || buf->pvHLoad == 0 ||
+			buf->pvE == 0 || buf->pvHmax == 0) {
+		init_destroy(p);
+		return 0;
+	}
+
+	return p;
+}
+
+int ssw_reinit (s_profile* p, const int8_t* read, const int32_t readLen, const int8_t* mat) {
+	int32_t bias = 0, i;
+
+	if (p->buffers == 0 || readLen > p->readCapacity) return -1;
+
+	for (i = 0; i < p->n * p->n; i++) if (mat[i] < bias) bias = mat[i];
+	bias = abs(bias);
+
+	p->bias = bias;
+	qP_byte_fill(p->profile_byte, read, mat, readLen, p->n, bias);
+	p->read = read;
+	p->mat = mat;
+	p->readLen = readLen;
+	return 0;
+}
+
+int32_t ssw_align_score (s_profile* prof,
+					const int8_t* ref,
+					int32_t refLen,
+					const uint8_t weight_gapO,
+					const uint8_t weight_gapE,
+					const int32_t maskLen) {
+
+	alignment_end* bests;
+
+	if (prof->buffers == 0 || refLen > prof->refCapacity) return -1;
+
+	bests = sw_sse2_byte(ref, 0, refLen, prof->readLen, weight_gapO, weight_gapE, prof->profile_byte, -1, prof->bias, maskLen, prof->buffers);
+	if (bests[0].score == 255) {
+		fprintf(stderr, "Please set 2 to the score_size parameter of the function ssw_init, otherwise the alignment results will be incorrect.\n");
+		return -1;
+	}
+
+	return bests[0].score;
+}
+
 s_align* ssw_align (const s_profile* prof,
 					const int8_t* ref,
 				  	int32_t refLen,
@@ -801,7 +923,7 @@ s_align* ssw_align (const s_profile* prof,
 
 	// Find the alignment scores and ending positions
 	if (prof->profile_byte) {
-		bests = sw_sse2_byte(ref, 0, refLen, readLen, weight_gapO, weight_gapE, prof->profile_byte, -1, prof->bias, maskLen);
+		bests = sw_sse2_byte(ref, 0, refLen, readLen, weight_gapO, weight_gapE, prof->profile_byte, -1, prof->bias, maskLen, 0);
 		if (prof->profile_word && bests[0].score == 255) {
 			free(bests);
 			bests = sw_sse2_word(ref, 0, refLen, readLen, weight_gapO, weight_gapE, prof->profile_word, -1, maskLen);
@@ -836,7 +958,7 @@ s_align* ssw_align (const s_profile* prof,
 	read_reverse = seq_reverse(prof->read, r->read_end1);
 	if (word == 0) {
 		vP = qP_byte(read_reverse, prof->mat, r->read_end1 + 1, prof->n, prof->bias);
-		bests_reverse = sw_sse2_byte(ref, 1, r->ref_end1 + 1, r->read_end1 + 1, weight_gapO, weight_gapE, vP, r->score1, prof->bias, maskLen);
+		bests_reverse = sw_sse2_byte(ref, 1, r->ref_end1 + 1, r->read_end1 + 1, weight_gapO, weight_gapE, vP, r->score1, prof->bias, maskLen, 0);
 	} else {
 		vP = qP_word(read_reverse, prof->mat, r->read_end1 + 1, prof->n);
 		bests_reverse = sw_sse2_word(ref, 1, r->ref_end1 + 1, r->read_end1 + 1, weight_gapO, weight_gapE, vP, r->score1, maskLen);
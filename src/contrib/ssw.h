@@ -119,6 +119,36 @@ s_align* ssw_align (const s_profile* prof,
 					const int32_t filterd,
 					const int32_t maskLen);
 
+/*!	@function	Create a query profile that is re-filled in place for each read.
+	@param	maxReadLen	the longest read that will be given to ssw_reinit
+	@param	maxRefLen	the longest target sequence that will be given to ssw_align_score
+	@param	n	the square root of the number of elements in the substitution matrix
+	@return	pointer to the query profile structure, or 0 if out of memory; release it with init_destroy
+	@note	The profile holds byte-sized scores only and owns all the scratch memory of the alignment, so
+			ssw_reinit and ssw_align_score never touch the heap. It can't be shared by threads.
+*/
+s_profile* ssw_init_reusable (const int32_t maxReadLen, const int32_t maxRefLen, const int32_t n);
+
+/*!	@function	Load a new query sequence into a profile created by ssw_init_reusable.
+	@param	p	pointer to the reusable query profile
+	@param	read	pointer to the query sequence; it must stay valid while p is used
+	@param	readLen	length of the query sequence
+	@param	mat	pointer to the substitution matrix
+	@return	0 on success, -1 if p is not reusable or readLen exceeds its capacity
+*/
+int ssw_reinit (s_profile* p, const int8_t* read, const int32_t readLen, const int8_t* mat);
+
+/*!	@function	Find the optimal alignment score only, using a profile created by ssw_init_reusable.
+	@return	the optimal alignment score, or -1 if the score overflows a byte or refLen exceeds the capacity
+	@note	Returns the same score1 as ssw_align with a byte-sized profile.
+*/
+int32_t ssw_align_score (s_profile* prof,
+					const int8_t* ref,
+					int32_t refLen,
+					const uint8_t weight_gapO,
+					const uint8_t weight_gapE,
+					const int32_t maskLen);
+
 /*!	@function	Release the memory allocated by function ssw_align.
 	@param	a	pointer to the alignment result structure
 */
@@ -0,0 +1,1659 @@
+/*
+ * partitioner.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Deduplicates the taginfo files of tiles, or unsorted tags in the standard
+ * input, without sorting the text.
+ *
+ * Tags are partitioned by the hash of UMI while the inputs are read. A
+ * partition too large for the memory limit is split again by another hash
+ * before loading. Each partition is grouped by UMI in a hash table, and
+ * the groups go through the same duplicate queue as the sorted stream mode
+ * in the UMI order with the tags ordered by tile and cluster number.
+ * Finally, the representative tags of the partitions are merged in the tile
+ * and cluster order, and the traces in the UMI order. Thus, the outputs are identical to those from the
+ * sorted stream in the C locale.
+ */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <htslib/bgzf.h>
+#include "../utils.h"
+#include "tailseq-dedup-perfect.h"
+
+#define INPUT_READ_BUFFER_SIZE  1024*1024
+/* Records in the spools are padded to keep the headers aligned. */
+#define SPOOL_ALIGN(n)          (((n) + 3) & ~(size_t)3)
+#define PARTITION_RECORD_SIZE(modlen, umilen)   \
+    SPOOL_ALIGN(sizeof(struct PartitionRecord) + (modlen) + (umilen))
+#define PARTITION_RESULT_SIZE(modlen)           \
+    SPOOL_ALIGN(sizeof(struct PartitionResult) + (modlen))
+#define PARTITION_TRACE_GROUP_SIZE(umilen)      \
+    SPOOL_ALIGN(sizeof(struct PartitionTraceGroup) + (umilen))
+
+struct InputFile {
+    const char *filename;
+    char tilename[MAX_TILENAME_LEN+1];
+    size_t tilename_len;
+};
+
+struct DedupContext {
+    struct InputFile *files;    /* sorted by the tile names */
+    int nfiles, files_capacity;
+    uint32_t *source_ranks;     /* tile order of the sources if not sorted */
+    struct PartitionJob *jobs;
+
+    const char *tempdir;
+    size_t partition_budget;    /* memory for a partition being processed */
+
+    pthread_mutex_t lock;
+    int next_task;
+    int error;
+};
+
+struct PartitionBuffer {        /* staged records of a reader */
+    char data[PARTITION_FLUSH_SIZE + PARTITION_RECORD_SIZE(MAX_LINE_LEN, 0)];
+    size_t size, nrecords;
+};
+
+struct MergeCursor {
+    struct Spool *spool;
+    int partition;
+    union {
+        struct PartitionResult result;
+        struct PartitionTraceGroup group;
+    } header;
+    char tail[MAX_LINE_LEN+1];  /* modifications or UMI */
+};
+
+struct MergeHeap {
+    struct MergeCursor **items;
+    int size;
+    int (*less)(const struct MergeCursor *, const struct MergeCursor *);
+};
+
+
+static uint32_t
+hash_umi(const char *umi, size_t length)
+{
+    uint32_t hash;
+    size_t i;
+
+    hash = 2166136261u; /* FNV-1a */
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)umi[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* Hash of UMI for splitting a partition at the given depth. The seed and
+ * the final mixing keep it independent of the hashes of the upper levels. */
+static uint32_t
+hash_umi_at_depth(const char *umi, size_t length, int depth)
+{
+    uint32_t hash;
+    size_t i;
+
+    hash = 2166136261u ^ ((uint32_t)depth * 0x9e3779b9u);
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)umi[i];
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+
+    return hash;
+}
+
+/* Splits a taginfo line into tile, cluster number, flags, poly(A) length,
+ * modifications and UMI. */
+static int
+split_taginfo_line(char *line, char **fields, size_t *lengths)
+{
+    char *start, *end;
+    int i;
+
+    start = line;
+    for (i = 0; i < 6; i++) {
+        end = (i < 5) ? strchr(start, '\t') : strpbrk(start, "\r\n");
+        if (end == NULL) {
+            if (i < 5)
+                return -1;
+            end = start + strlen(start);
+        }
+
+        fields[i] = start;
+        lengths[i] = (size_t)(end - start);
+        start = end + 1;
+    }
+
+    return 0;
+}
+
+static int
+peek_tile_name(struct InputFile *input)
+{
+    char linebuf[MAX_LINE_LEN+1], *tab;
+    gzFile fp;
+
+    fp = gzopen(input->filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s.\n", input->filename);
+        return -1;
+    }
+
+    input->tilename[0] = '\0';
+    input->tilename_len = 0;
+    if (gzgets(fp, linebuf, sizeof(linebuf)) != NULL) {
+        tab = strchr(linebuf, '\t');
+        if (tab == NULL || tab - linebuf > MAX_TILENAME_LEN) {
+            fprintf(stderr, "Unexpected taginfo line in %s.\n",
+                    input->filename);
+            gzclose(fp);
+            return -1;
+        }
+
+        memcpy(input->tilename, linebuf, tab - linebuf);
+        input->tilename[tab - linebuf] = '\0';
+        input->tilename_len = tab - linebuf;
+    }
+
+    gzclose(fp);
+
+    return 0;
+}
+
+static int
+compare_input_files(const void *a, const void *b)
+{
+    return strcmp(((const struct InputFile *)a)->tilename,
+                  ((const struct InputFile *)b)->tilename);
+}
+
+static int
+flush_partition_buffer(struct DedupContext *ctx, int partition,
+                       struct PartitionBuffer *pbuf)
+{
+    struct PartitionJob *job=&ctx->jobs[partition];
+    int r;
+
+    if (pbuf->size == 0)
+        return 0;
+
+    pthread_mutex_lock(&job->lock);
+    r = spool_write(&job->records, pbuf->data, pbuf->size);
+    job->nrecords += pbuf->nrecords;
+    pthread_mutex_unlock(&job->lock);
+
+    pbuf->size = pbuf->nrecords = 0;
+
+    return r;
+}
+
+/* Puts a tag into the buffer of its partition. */
+static int
+stage_record(struct DedupContext *ctx, struct PartitionBuffer *pbufs,
+             int source, uint32_t clusterno, char **fields, size_t *lengths)
+{
+    struct PartitionRecord *rec;
+    struct PartitionBuffer *pbuf;
+    long polyA_len;
+    char *end;
+    int partition;
+
+    polyA_len = strtol(fields[3], &end, 10);
+    if (end == fields[3] || polyA_len < INT16_MIN || polyA_len > INT16_MAX) {
+        fprintf(stderr, "Broken taginfo line in %s.\n",
+                ctx->files[source].filename);
+        return -1;
+    }
+
+    if (lengths[4] > MAX_MODIFICATION_LEN || lengths[5] > MAX_UMI_LEN) {
+        fprintf(stderr, "Too long modification or UMI in %s.\n",
+                ctx->files[source].filename);
+        return -1;
+    }
+
+    partition = hash_umi(fields[5], lengths[5]) % NUM_PARTITIONS;
+    pbuf = &pbufs[partition];
+
+    rec = (struct PartitionRecord *)(pbuf->data + pbuf->size);
+    rec->source = source;
+    rec->clusterno = clusterno;
+    rec->flags = strtol(fields[2], NULL, 10);
+    rec->polyA_len = polyA_len;
+    rec->modification_len = lengths[4];
+    rec->umi_len = lengths[5];
+    memcpy(rec + 1, fields[4], lengths[4]);
+    memcpy((char *)(rec + 1) + lengths[4], fields[5], lengths[5]);
+    pbuf->size += PARTITION_RECORD_SIZE(lengths[4], lengths[5]);
+    pbuf->nrecords++;
+
+    if (pbuf->size >= PARTITION_FLUSH_SIZE)
+        return flush_partition_buffer(ctx, partition, pbuf);
+
+    return 0;
+}
+
+static int
+read_input_file(struct DedupContext *ctx, int source,
+                struct PartitionBuffer *pbufs)
+{
+    const struct InputFile *input=&ctx->files[source];
+    char linebuf[MAX_LINE_LEN+1];
+    int64_t last_clusterno;
+    gzFile fp;
+
+    fp = gzopen(input->filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s.\n", input->filename);
+        return -1;
+    }
+
+    gzbuffer(fp, INPUT_READ_BUFFER_SIZE);
+    last_clusterno = -1;
+
+    while (gzgets(fp, linebuf, sizeof(linebuf)) != NULL) {
+        char *fields[6], *end;
+        size_t lengths[6];
+        int64_t clusterno;
+
+        if (strchr(linebuf, '\n') == NULL && !gzeof(fp)) {
+            fprintf(stderr, "Too long line in %s.\n", input->filename);
+            goto onError;
+        }
+
+        if (split_taginfo_line(linebuf, fields, lengths) < 0)
+            goto onBroken;
+
+        /* The outputs are merged in the tile and cluster order, relying on
+         * the order in the inputs. */
+        if (lengths[0] != input->tilename_len ||
+                memcmp(fields[0], input->tilename, input->tilename_len) != 0) {
+            fprintf(stderr, "%s has tags from more than one tile.\n",
+                    input->filename);
+            goto onError;
+        }
+
+        clusterno = strtoll(fields[1], &end, 10);
+        if (end == fields[1] || clusterno <= last_clusterno ||
+                clusterno > UINT32_MAX) {
+            fprintf(stderr, "%s is not sorted by the cluster number.\n",
+                    input->filename);
+            goto onError;
+        }
+        last_clusterno = clusterno;
+
+        if (stage_record(ctx, pbufs, source, (uint32_t)clusterno,
+                         fields, lengths) < 0)
+            goto onError;
+    }
+
+    if (!gzeof(fp)) {
+        fprintf(stderr, "Error occurred on reading %s.\n", input->filename);
+        goto onError;
+    }
+
+    gzclose(fp);
+
+    return 0;
+
+  onBroken:
+    fprintf(stderr, "Broken taginfo line in %s.\n", input->filename);
+
+  onError:
+    gzclose(fp);
+    return -1;
+}
+
+static int
+next_task(struct DedupContext *ctx, int ntasks)
+{
+    int task;
+
+    pthread_mutex_lock(&ctx->lock);
+    task = ctx->error ? ntasks : ctx->next_task++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return task;
+}
+
+static void
+set_error(struct DedupContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->error = 1;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void *
+run_input_reader(void *arg)
+{
+    struct DedupContext *ctx=arg;
+    struct PartitionBuffer *pbufs;
+    int source, i;
+
+    pbufs = malloc(sizeof(struct PartitionBuffer) * NUM_PARTITIONS);
+    if (pbufs == NULL) {
+        perror("run_input_reader");
+        set_error(ctx);
+        return NULL;
+    }
+
+    for (i = 0; i < NUM_PARTITIONS; i++)
+        pbufs[i].size = pbufs[i].nrecords = 0;
+
+    while ((source = next_task(ctx, ctx->nfiles)) < ctx->nfiles)
+        if (read_input_file(ctx, source, pbufs) < 0) {
+            set_error(ctx);
+            break;
+        }
+
+    for (i = 0; i < NUM_PARTITIONS; i++)
+        if (flush_partition_buffer(ctx, i, &pbufs[i]) < 0)
+            set_error(ctx);
+
+    free(pbufs);
+
+    return NULL;
+}
+
+/* Returns the source number of a tile in the standard input. New tiles are
+ * numbered in the order of appearance. */
+static int
+find_stream_source(struct DedupContext *ctx, const char *tilename,
+                   size_t length)
+{
+    struct InputFile *input;
+    int i;
+
+    for (i = ctx->nfiles - 1; i >= 0; i--)
+        if (ctx->files[i].tilename_len == length &&
+                memcmp(ctx->files[i].tilename, tilename, length) == 0)
+            return i;
+
+    if (length > MAX_TILENAME_LEN) {
+        fprintf(stderr, "Too long tile name in the input.\n");
+        return -1;
+    }
+
+    if (ctx->nfiles >= ctx->files_capacity) {
+        int newcapacity;
+
+        newcapacity = (ctx->files_capacity == 0) ? 64 :
+                      ctx->files_capacity * 2;
+        input = realloc(ctx->files, sizeof(struct InputFile) * newcapacity);
+        if (input == NULL) {
+            perror("find_stream_source");
+            return -1;
+        }
+
+        ctx->files = input;
+        ctx->files_capacity = newcapacity;
+    }
+
+    input = &ctx->files[ctx->nfiles];
+    input->filename = "the standard input";
+    memcpy(input->tilename, tilename, length);
+    input->tilename[length] = '\0';
+    input->tilename_len = length;
+
+    return ctx->nfiles++;
+}
+
+/* Reads unsorted tags of any tiles from a stream. */
+static int
+read_input_stream(struct DedupContext *ctx, FILE *fp)
+{
+    struct PartitionBuffer *pbufs;
+    char linebuf[MAX_LINE_LEN+1];
+    int source, i;
+
+    pbufs = malloc(sizeof(struct PartitionBuffer) * NUM_PARTITIONS);
+    if (pbufs == NULL) {
+        perror("read_input_stream");
+        return -1;
+    }
+
+    for (i = 0; i < NUM_PARTITIONS; i++)
+        pbufs[i].size = pbufs[i].nrecords = 0;
+
+    source = -1;
+    while (fgets(linebuf, sizeof(linebuf), fp) != NULL) {
+        char *fields[6], *end;
+        size_t lengths[6];
+        int64_t clusterno;
+
+        if (strchr(linebuf, '\n') == NULL && !feof(fp)) {
+            fprintf(stderr, "Too long line in the input.\n");
+            goto onError;
+        }
+
+        if (split_taginfo_line(linebuf, fields, lengths) < 0) {
+            fprintf(stderr, "Broken taginfo line in the input.\n");
+            goto onError;
+        }
+
+        /* Consecutive tags are usually from the same tile. */
+        if (source < 0 || ctx->files[source].tilename_len != lengths[0] ||
+                memcmp(ctx->files[source].tilename, fields[0],
+                       lengths[0]) != 0) {
+            source = find_stream_source(ctx, fields[0], lengths[0]);
+            if (source < 0)
+                goto onError;
+        }
+
+        clusterno = strtoll(fields[1], &end, 10);
+        if (end == fields[1] || clusterno < 0 || clusterno > UINT32_MAX) {
+            fprintf(stderr, "Broken taginfo line in the input.\n");
+            goto onError;
+        }
+
+        if (stage_record(ctx, pbufs, source, (uint32_t)clusterno,
+                         fields, lengths) < 0)
+            goto onError;
+    }
+
+    if (ferror(fp)) {
+        perror("fgets");
+        goto onError;
+    }
+
+    for (i = 0; i < NUM_PARTITIONS; i++)
+        if (flush_partition_buffer(ctx, i, &pbufs[i]) < 0)
+            goto onError;
+
+    free(pbufs);
+
+    return 0;
+
+  onError:
+    free(pbufs);
+    return -1;
+}
+
+static int
+compare_input_file_ptrs(const void *a, const void *b)
+{
+    return compare_input_files(*(const struct InputFile **)a,
+                               *(const struct InputFile **)b);
+}
+
+/* Sorts the tiles from a stream and keeps the ranks of the source numbers
+ * given while reading. */
+static int
+sort_stream_sources(struct DedupContext *ctx)
+{
+    const struct InputFile **sorted;
+    struct InputFile *files;
+    int i;
+
+    sorted = malloc(sizeof(struct InputFile *) * (ctx->nfiles + 1));
+    files = malloc(sizeof(struct InputFile) * (ctx->nfiles + 1));
+    ctx->source_ranks = malloc(sizeof(uint32_t) * (ctx->nfiles + 1));
+    if (sorted == NULL || files == NULL || ctx->source_ranks == NULL) {
+        perror("sort_stream_sources");
+        if (sorted != NULL)
+            free(sorted);
+        if (files != NULL)
+            free(files);
+        return -1;
+    }
+
+    for (i = 0; i < ctx->nfiles; i++)
+        sorted[i] = &ctx->files[i];
+
+    qsort(sorted, ctx->nfiles, sizeof(struct InputFile *),
+          compare_input_file_ptrs);
+
+    for (i = 0; i < ctx->nfiles; i++) {
+        ctx->source_ranks[sorted[i] - ctx->files] = i;
+        files[i] = *sorted[i];
+    }
+
+    free(sorted);
+    free(ctx->files);
+    ctx->files = files;
+    ctx->files_capacity = ctx->nfiles + 1;
+
+    return 0;
+}
+
+int
+partition_add_result(struct TagInfoQueue *queue, const struct TagInfo *taginfo,
+                     int polyA_len, int num_duplicates)
+{
+    struct PartitionJob *job=queue->job;
+    struct PartitionResult *res;
+    size_t recsize;
+
+    if (job->num_results >= job->result_offsets_capacity) {
+        size_t newcapacity, *newoffsets;
+
+        newcapacity = (job->result_offsets_capacity == 0) ? 1024 :
+                      job->result_offsets_capacity * 2;
+        newoffsets = realloc(job->result_offsets, sizeof(size_t) * newcapacity);
+        if (newoffsets == NULL)
+            return -1;
+
+        job->result_offsets = newoffsets;
+        job->result_offsets_capacity = newcapacity;
+    }
+
+    recsize = PARTITION_RESULT_SIZE(taginfo->modification_len);
+    if (job->resultbuf_size + recsize > job->resultbuf_capacity) {
+        size_t newcapacity;
+        char *newbuf;
+
+        newcapacity = (job->resultbuf_capacity == 0) ? 65536 :
+                      job->resultbuf_capacity * 2;
+        newbuf = realloc(job->resultbuf, newcapacity);
+        if (newbuf == NULL)
+            return -1;
+
+        job->resultbuf = newbuf;
+        job->resultbuf_capacity = newcapacity;
+    }
+
+    res = (struct PartitionResult *)(job->resultbuf + job->resultbuf_size);
+    res->source = taginfo->source;
+    res->clusterno = taginfo->clusterno;
+    res->flags = taginfo->flags;
+    res->num_duplicates = num_duplicates;
+    res->polyA_len = polyA_len;
+    res->modification_len = taginfo->modification_len;
+    memcpy(res + 1, tag_modifications(queue, taginfo),
+           taginfo->modification_len);
+
+    job->result_offsets[job->num_results++] = job->resultbuf_size;
+    job->resultbuf_size += recsize;
+
+    return 0;
+}
+
+int
+partition_add_trace(struct TagInfoQueue *queue, const struct TagInfo *taginfo,
+                    int value)
+{
+    struct PartitionJob *job=queue->job;
+    struct PartitionTraceEntry entry;
+
+    entry.source = taginfo->source;
+    entry.clusterno = taginfo->clusterno;
+    entry.value = value;
+    job->group_entries++;
+
+    return spool_write(&job->trace_entries, &entry, sizeof(entry));
+}
+
+int
+partition_end_trace_group(struct TagInfoQueue *queue,
+                          const struct TagInfo *taginfo)
+{
+    struct PartitionJob *job=queue->job;
+    char buf[PARTITION_TRACE_GROUP_SIZE(MAX_UMI_LEN)];
+    struct PartitionTraceGroup *group=(struct PartitionTraceGroup *)buf;
+
+    group->num_entries = job->group_entries;
+    group->umi_len = taginfo->umi_len;
+    memcpy(group + 1, tag_umi(queue, taginfo), taginfo->umi_len);
+    job->group_entries = 0;
+
+    return spool_write(&job->trace_groups, buf,
+                       PARTITION_TRACE_GROUP_SIZE(taginfo->umi_len));
+}
+
+#define RECORD_UMI(rec) ((const char *)((rec) + 1) + (rec)->modification_len)
+
+/* Records sharing a UMI in a partition */
+struct UMIGroup {
+    const char *umi;
+    size_t umi_len;
+    size_t first, count;        /* range in the grouped records */
+};
+
+static int
+compare_umi_groups(const void *a, const void *b)
+{
+    const struct UMIGroup *ga=a, *gb=b;
+    int r;
+
+    /* Same as strcmp() for the UMIs. */
+    r = memcmp(ga->umi, gb->umi,
+               ga->umi_len < gb->umi_len ? ga->umi_len : gb->umi_len);
+    if (r != 0)
+        return r;
+
+    return (ga->umi_len > gb->umi_len) - (ga->umi_len < gb->umi_len);
+}
+
+static int
+compare_record_order(const void *a, const void *b)
+{
+    const struct PartitionRecord *ra=*(const struct PartitionRecord **)a;
+    const struct PartitionRecord *rb=*(const struct PartitionRecord **)b;
+
+    if (ra->source != rb->source)
+        return (ra->source < rb->source) ? -1 : 1;
+
+    return (ra->clusterno > rb->clusterno) - (ra->clusterno < rb->clusterno);
+}
+
+/*
+ * Groups the records by UMI with a hash table instead of sorting them all.
+ * The groups are returned in the UMI order, and the records of each group
+ * in the tile and cluster order in `grouped'.
+ */
+static struct UMIGroup *
+group_partition_records(const struct PartitionRecord **records,
+                        size_t nrecords, const struct PartitionRecord **grouped,
+                        size_t *ngroups)
+{
+    struct UMIGroup *groups;
+    size_t *table, *group_of, tablesize, i, j;
+
+    groups = NULL;
+    group_of = NULL;
+
+    for (tablesize = 16; tablesize < nrecords * 2; tablesize *= 2)
+        ;
+
+    table = malloc(sizeof(size_t) * tablesize);
+    group_of = malloc(sizeof(size_t) * (nrecords + 1));
+    groups = malloc(sizeof(struct UMIGroup) * (nrecords + 1));
+    if (table == NULL || group_of == NULL || groups == NULL)
+        goto onError;
+
+    for (i = 0; i < tablesize; i++)
+        table[i] = SIZE_MAX;
+
+    *ngroups = 0;
+    for (i = 0; i < nrecords; i++) {
+        const char *umi=RECORD_UMI(records[i]);
+        size_t umi_len=records[i]->umi_len, slot;
+
+        /* The lower bits of the hash are shared in a partition. */
+        slot = (hash_umi(umi, umi_len) / NUM_PARTITIONS) & (tablesize - 1);
+        for (; table[slot] != SIZE_MAX; slot = (slot + 1) & (tablesize - 1)) {
+            const struct UMIGroup *g=&groups[table[slot]];
+            if (g->umi_len == umi_len && memcmp(g->umi, umi, umi_len) == 0)
+                break;
+        }
+
+        if (table[slot] == SIZE_MAX) {
+            struct UMIGroup *g=&groups[*ngroups];
+
+            g->umi = umi;
+            g->umi_len = umi_len;
+            g->count = 0;
+            table[slot] = (*ngroups)++;
+        }
+
+        group_of[i] = table[slot];
+        groups[table[slot]].count++;
+    }
+
+    free(table);
+    table = NULL;
+
+    /* Place the records by their groups. */
+    for (i = 0, j = 0; i < *ngroups; i++) {
+        groups[i].first = j;
+        j += groups[i].count;
+        groups[i].count = 0;
+    }
+
+    for (i = 0; i < nrecords; i++) {
+        struct UMIGroup *g=&groups[group_of[i]];
+        grouped[g->first + g->count++] = records[i];
+    }
+
+    free(group_of);
+
+    qsort(groups, *ngroups, sizeof(struct UMIGroup), compare_umi_groups);
+
+    for (i = 0; i < *ngroups; i++)
+        if (groups[i].count > 1)
+            qsort(&grouped[groups[i].first], groups[i].count,
+                  sizeof(struct PartitionRecord *), compare_record_order);
+
+    return groups;
+
+  onError:
+    if (table != NULL)
+        free(table);
+    if (group_of != NULL)
+        free(group_of);
+    if (groups != NULL)
+        free(groups);
+
+    return NULL;
+}
+
+static int
+compare_results(const void *a, const void *b)
+{
+    const struct PartitionResult *ra=*(const struct PartitionResult **)a;
+    const struct PartitionResult *rb=*(const struct PartitionResult **)b;
+
+    if (ra->source != rb->source)
+        return (ra->source < rb->source) ? -1 : 1;
+
+    return (ra->clusterno > rb->clusterno) - (ra->clusterno < rb->clusterno);
+}
+
+static int
+write_partition_results(struct PartitionJob *job)
+{
+    const struct PartitionResult **sorted;
+    size_t i;
+    int r;
+
+    if (job->num_results == 0)
+        return 0;
+
+    sorted = malloc(sizeof(struct PartitionResult *) * job->num_results);
+    if (sorted == NULL) {
+        perror("write_partition_results");
+        return -1;
+    }
+
+    for (i = 0; i < job->num_results; i++)
+        sorted[i] = (const struct PartitionResult *)
+                        (job->resultbuf + job->result_offsets[i]);
+
+    qsort(sorted, job->num_results, sizeof(struct PartitionResult *),
+          compare_results);
+
+    r = 0;
+    for (i = 0; i < job->num_results && r == 0; i++)
+        r = spool_write(&job->results, sorted[i],
+                        PARTITION_RESULT_SIZE(sorted[i]->modification_len));
+
+    free(sorted);
+
+    return r;
+}
+
+static int
+deduplicate_partition(struct DedupContext *ctx, struct PartitionJob *job)
+{
+    const struct PartitionRecord **records, **grouped;
+    struct TagInfoQueue *queue;
+    struct UMIGroup *groups;
+    char *data;
+    size_t size, nrecords, ngroups, pos, i;
+    int r;
+
+    r = -1;
+    records = grouped = NULL;
+    groups = NULL;
+    queue = NULL;
+
+    data = spool_load(&job->records, &size);
+    if (data == NULL)
+        return -1;
+
+    nrecords = 0;
+    for (pos = 0; pos < size; nrecords++) {
+        const struct PartitionRecord *rec=(struct PartitionRecord *)(data + pos);
+        pos += PARTITION_RECORD_SIZE(rec->modification_len, rec->umi_len);
+    }
+
+    records = malloc(sizeof(struct PartitionRecord *) * (nrecords + 1));
+    grouped = malloc(sizeof(struct PartitionRecord *) * (nrecords + 1));
+    queue = tqueue_new(DEFAULT_BUFFER_SIZE);
+    if (records == NULL || grouped == NULL || queue == NULL) {
+        perror("deduplicate_partition");
+        goto onExit;
+    }
+
+    for (pos = 0, i = 0; i < nrecords; i++) {
+        struct PartitionRecord *rec=(struct PartitionRecord *)(data + pos);
+
+        /* Tiles from the standard input are numbered in the order of
+         * appearance until all of them are seen. */
+        if (ctx->source_ranks != NULL)
+            rec->source = ctx->source_ranks[rec->source];
+
+        records[i] = rec;
+        pos += PARTITION_RECORD_SIZE(rec->modification_len, rec->umi_len);
+    }
+
+    groups = group_partition_records(records, nrecords, grouped, &ngroups);
+    if (groups == NULL) {
+        perror("group_partition_records");
+        goto onExit;
+    }
+
+    queue->job = job;
+
+    for (i = 0; i < ngroups; i++) {
+        size_t j;
+
+        for (j = groups[i].first; j < groups[i].first + groups[i].count; j++) {
+            const struct PartitionRecord *rec=grouped[j];
+            struct TagInfo *current=&tqueue_head(queue);
+
+            current->clusterno = rec->clusterno;
+            current->flags = rec->flags;
+            current->polyA_len = rec->polyA_len;
+            current->tilename_len = 0;
+            current->modification_len = rec->modification_len;
+            current->source = rec->source;
+
+            if (tqueue_set_strings(queue, (const char *)(rec + 1),
+                                   rec->modification_len, RECORD_UMI(rec),
+                                   rec->umi_len) < 0 ||
+                    tqueue_feed(queue) < 0) {
+                perror("tqueue_feed");
+                goto onExit;
+            }
+        }
+    }
+
+    if (process_tag_duplicates(queue) < 0) {
+        perror("process_tag_duplicates");
+        goto onExit;
+    }
+
+    r = write_partition_results(job);
+
+  onExit:
+    if (queue != NULL)
+        tqueue_free(queue);
+    if (records != NULL)
+        free(records);
+    if (grouped != NULL)
+        free(grouped);
+    if (groups != NULL)
+        free(groups);
+    free(data);
+
+    if (job->resultbuf != NULL)
+        free(job->resultbuf);
+    if (job->result_offsets != NULL)
+        free(job->result_offsets);
+    job->resultbuf = NULL;
+    job->result_offsets = NULL;
+    job->resultbuf_size = job->resultbuf_capacity = 0;
+    job->num_results = job->result_offsets_capacity = 0;
+
+    return r;
+}
+
+/* Runs the function in the given number of threads including the caller. */
+static int
+run_parallel(struct DedupContext *ctx, void *(*func)(void *), int threads)
+{
+    pthread_t *tids;
+    int i, nstarted;
+
+    ctx->next_task = 0;
+
+    tids = malloc(sizeof(pthread_t) * threads);
+    if (tids == NULL) {
+        perror("run_parallel");
+        return -1;
+    }
+
+    for (nstarted = 0; nstarted < threads - 1; nstarted++)
+        if (pthread_create(&tids[nstarted], NULL, func, ctx) != 0) {
+            perror("pthread_create");
+            set_error(ctx);
+            break;
+        }
+
+    func(ctx);
+
+    for (i = 0; i < nstarted; i++)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+
+    return ctx->error ? -1 : 0;
+}
+
+/* Merging the partitions */
+
+static int
+merge_heap_push(struct MergeHeap *heap, struct MergeCursor *cursor)
+{
+    int i, parent;
+
+    i = heap->size++;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!heap->less(cursor, heap->items[parent]))
+            break;
+        heap->items[i] = heap->items[parent];
+        i = parent;
+    }
+    heap->items[i] = cursor;
+
+    return 0;
+}
+
+static struct MergeCursor *
+merge_heap_pop(struct MergeHeap *heap)
+{
+    struct MergeCursor *top, *last;
+    int i, child;
+
+    if (heap->size == 0)
+        return NULL;
+
+    top = heap->items[0];
+    last = heap->items[--heap->size];
+
+    for (i = 0; (child = i * 2 + 1) < heap->size; i = child) {
+        if (child + 1 < heap->size &&
+                heap->less(heap->items[child + 1], heap->items[child]))
+            child++;
+        if (!heap->less(heap->items[child], last))
+            break;
+        heap->items[i] = heap->items[child];
+    }
+    heap->items[i] = last;
+
+    return top;
+}
+
+static int
+less_result(const struct MergeCursor *a, const struct MergeCursor *b)
+{
+    if (a->header.result.source != b->header.result.source)
+        return a->header.result.source < b->header.result.source;
+
+    return a->header.result.clusterno < b->header.result.clusterno;
+}
+
+static int
+less_trace_group(const struct MergeCursor *a, const struct MergeCursor *b)
+{
+    size_t alen=a->header.group.umi_len, blen=b->header.group.umi_len;
+    int r;
+
+    r = memcmp(a->tail, b->tail, alen < blen ? alen : blen);
+    if (r != 0)
+        return r < 0;
+
+    return alen < blen;
+}
+
+/* Reads the next record of the spool. Returns 0 at the end. */
+static int
+advance_result_cursor(struct MergeCursor *cursor)
+{
+    int r;
+
+    r = spool_read(cursor->spool, &cursor->header.result,
+                   sizeof(struct PartitionResult));
+    if (r <= 0)
+        return r;
+
+    return spool_read(cursor->spool, cursor->tail,
+                      PARTITION_RESULT_SIZE(cursor->header.result.modification_len) -
+                      sizeof(struct PartitionResult)) < 0 ? -1 : 1;
+}
+
+static int
+advance_trace_group_cursor(struct MergeCursor *cursor)
+{
+    int r;
+
+    r = spool_read(cursor->spool, &cursor->header.group,
+                   sizeof(struct PartitionTraceGroup));
+    if (r <= 0)
+        return r;
+
+    return spool_read(cursor->spool, cursor->tail,
+                      PARTITION_TRACE_GROUP_SIZE(cursor->header.group.umi_len) -
+                      sizeof(struct PartitionTraceGroup)) < 0 ? -1 : 1;
+}
+
+/* Memory taken by deduplicate_partition(): the records, the results of
+ * about the same size, and the pointers, the hash table and the groups. */
+static size_t
+partition_load_size(const struct PartitionJob *job)
+{
+    return (job->records.spilled + job->records.size) * 2 +
+           job->nrecords * (sizeof(void *) * 2 + sizeof(size_t) * 6 +
+                            sizeof(struct UMIGroup));
+}
+
+static void
+init_partition_job(struct PartitionJob *job, const char *tempdir,
+                   size_t records_limit, size_t results_limit, int tracing)
+{
+    spool_init(&job->records, tempdir, records_limit);
+    spool_init(&job->results, tempdir, results_limit);
+    spool_init(&job->trace_groups, tempdir, results_limit);
+    spool_init(&job->trace_entries, tempdir, results_limit);
+    pthread_mutex_init(&job->lock, NULL);
+    job->tracing = tracing;
+}
+
+static void
+free_partition_job(struct PartitionJob *job)
+{
+    int i;
+
+    if (job->subjobs != NULL) {
+        for (i = 0; i < NUM_SUBPARTITIONS; i++)
+            free_partition_job(&job->subjobs[i]);
+        free(job->subjobs);
+    }
+
+    spool_free(&job->records);
+    spool_free(&job->results);
+    spool_free(&job->trace_groups);
+    spool_free(&job->trace_entries);
+    pthread_mutex_destroy(&job->lock);
+}
+
+/* Moves the records of a partition into its subpartitions, streaming them
+ * from the spool. */
+static int
+split_partition(struct DedupContext *ctx, struct PartitionJob *job)
+{
+    uint32_t buf[PARTITION_RECORD_SIZE(MAX_MODIFICATION_LEN, MAX_UMI_LEN) / 4];
+    struct PartitionRecord *rec=(struct PartitionRecord *)buf;
+    struct PartitionJob *sub;
+    int i, r;
+
+    job->subjobs = calloc(NUM_SUBPARTITIONS, sizeof(struct PartitionJob));
+    if (job->subjobs == NULL) {
+        perror("split_partition");
+        return -1;
+    }
+
+    for (i = 0; i < NUM_SUBPARTITIONS; i++) {
+        sub = &job->subjobs[i];
+        init_partition_job(sub, ctx->tempdir,
+                           ctx->partition_budget / NUM_SUBPARTITIONS,
+                           job->results.limit / NUM_SUBPARTITIONS, job->tracing);
+        sub->depth = job->depth + 1;
+    }
+
+    if (spool_rewind(&job->records) < 0)
+        return -1;
+
+    while ((r = spool_read(&job->records, rec, sizeof(*rec))) > 0) {
+        size_t recsize=PARTITION_RECORD_SIZE(rec->modification_len,
+                                             rec->umi_len);
+
+        if (recsize > sizeof(buf) ||
+                spool_read(&job->records, rec + 1, recsize - sizeof(*rec)) <= 0) {
+            fprintf(stderr, "Broken record in a partition.\n");
+            return -1;
+        }
+
+        sub = &job->subjobs[hash_umi_at_depth(RECORD_UMI(rec), rec->umi_len,
+                                              job->depth + 1) % NUM_SUBPARTITIONS];
+        if (spool_write(&sub->records, buf, recsize) < 0)
+            return -1;
+        sub->nrecords++;
+    }
+
+    if (r < 0)
+        return -1;
+
+    /* Splitting again does not help if all records share a UMI. */
+    for (i = 0; i < NUM_SUBPARTITIONS; i++)
+        if (job->subjobs[i].nrecords == job->nrecords)
+            job->subjobs[i].depth = MAX_PARTITION_DEPTH;
+
+    spool_free(&job->records);
+
+    return 0;
+}
+
+/* Merges the results and the traces of the subpartitions back into the
+ * spools of the partition, in the orders of an unsplit partition. */
+static int
+merge_subpartitions(struct PartitionJob *job)
+{
+    struct MergeCursor *cursors, *cursor;
+    struct MergeCursor *items[NUM_SUBPARTITIONS];
+    struct MergeHeap heap;
+    uint32_t j;
+    int i, r;
+
+    cursors = malloc(sizeof(struct MergeCursor) * NUM_SUBPARTITIONS);
+    if (cursors == NULL) {
+        perror("merge_subpartitions");
+        return -1;
+    }
+
+    heap.items = items;
+    heap.size = 0;
+    heap.less = less_result;
+
+    for (i = 0; i < NUM_SUBPARTITIONS; i++) {
+        cursors[i].spool = &job->subjobs[i].results;
+        cursors[i].partition = i;
+        if (spool_rewind(cursors[i].spool) < 0 ||
+                (r = advance_result_cursor(&cursors[i])) < 0)
+            goto onError;
+        if (r > 0)
+            merge_heap_push(&heap, &cursors[i]);
+    }
+
+    while ((cursor = merge_heap_pop(&heap)) != NULL) {
+        const struct PartitionResult *res=&cursor->header.result;
+
+        if (spool_write(&job->results, res, sizeof(*res)) < 0 ||
+                spool_write(&job->results, cursor->tail,
+                            PARTITION_RESULT_SIZE(res->modification_len) -
+                            sizeof(*res)) < 0 ||
+                (r = advance_result_cursor(cursor)) < 0)
+            goto onError;
+        if (r > 0)
+            merge_heap_push(&heap, cursor);
+    }
+
+    heap.size = 0;
+    heap.less = less_trace_group;
+
+    for (i = 0; i < NUM_SUBPARTITIONS; i++) {
+        cursors[i].spool = &job->subjobs[i].trace_groups;
+        if (spool_rewind(cursors[i].spool) < 0 ||
+                spool_rewind(&job->subjobs[i].trace_entries) < 0 ||
+                (r = advance_trace_group_cursor(&cursors[i])) < 0)
+            goto onError;
+        if (r > 0)
+            merge_heap_push(&heap, &cursors[i]);
+    }
+
+    while ((cursor = merge_heap_pop(&heap)) != NULL) {
+        const struct PartitionTraceGroup *group=&cursor->header.group;
+        struct Spool *entries=&job->subjobs[cursor->partition].trace_entries;
+
+        if (spool_write(&job->trace_groups, group, sizeof(*group)) < 0 ||
+                spool_write(&job->trace_groups, cursor->tail,
+                            PARTITION_TRACE_GROUP_SIZE(group->umi_len) -
+                            sizeof(*group)) < 0)
+            goto onError;
+
+        for (j = 0; j < group->num_entries; j++) {
+            struct PartitionTraceEntry entry;
+
+            if (spool_read(entries, &entry, sizeof(entry)) <= 0) {
+                fprintf(stderr, "Truncated duplicate traces.\n");
+                goto onError;
+            }
+
+            if (spool_write(&job->trace_entries, &entry, sizeof(entry)) < 0)
+                goto onError;
+        }
+
+        r = advance_trace_group_cursor(cursor);
+        if (r < 0)
+            goto onError;
+        else if (r > 0)
+            merge_heap_push(&heap, cursor);
+    }
+
+    free(cursors);
+
+    for (i = 0; i < NUM_SUBPARTITIONS; i++)
+        free_partition_job(&job->subjobs[i]);
+    free(job->subjobs);
+    job->subjobs = NULL;
+
+    return 0;
+
+  onError:
+    free(cursors);
+
+    return -1;
+}
+
+/* Deduplicates a partition in memory if it fits in the share of a worker,
+ * or its subpartitions otherwise. */
+static int
+process_partition(struct DedupContext *ctx, struct PartitionJob *job)
+{
+    int i;
+
+    if (job->depth >= MAX_PARTITION_DEPTH ||
+            partition_load_size(job) <= ctx->partition_budget)
+        return deduplicate_partition(ctx, job);
+
+    if (split_partition(ctx, job) < 0)
+        return -1;
+
+    for (i = 0; i < NUM_SUBPARTITIONS; i++)
+        if (process_partition(ctx, &job->subjobs[i]) < 0)
+            return -1;
+
+    return merge_subpartitions(job);
+}
+
+static void *
+run_partition_worker(void *arg)
+{
+    struct DedupContext *ctx=arg;
+    int partition;
+
+    while ((partition = next_task(ctx, NUM_PARTITIONS)) < NUM_PARTITIONS)
+        if (process_partition(ctx, &ctx->jobs[partition]) < 0) {
+            set_error(ctx);
+            break;
+        }
+
+    return NULL;
+}
+
+static int
+merge_results(struct DedupContext *ctx, struct MergeCursor *cursors,
+              struct MergeHeap *heap, BGZF *out)
+{
+    struct MergeCursor *cursor;
+    struct OutputBuffer ob;
+    int i, r;
+
+    outbuf_init(&ob, stdout, out);
+    heap->size = 0;
+    heap->less = less_result;
+
+    for (i = 0; i < NUM_PARTITIONS; i++) {
+        cursors[i].spool = &ctx->jobs[i].results;
+        cursors[i].partition = i;
+        if (spool_rewind(cursors[i].spool) < 0 ||
+                (r = advance_result_cursor(&cursors[i])) < 0)
+            return -1;
+        if (r > 0)
+            merge_heap_push(heap, &cursors[i]);
+    }
+
+    while ((cursor = merge_heap_pop(heap)) != NULL) {
+        const struct PartitionResult *res=&cursor->header.result;
+        const struct InputFile *input=&ctx->files[res->source];
+
+        if (outbuf_write(&ob, input->tilename, input->tilename_len) < 0 ||
+                outbuf_write(&ob, "\t", 1) < 0 ||
+                outbuf_write_int(&ob, res->clusterno) < 0 ||
+                outbuf_write(&ob, "\t", 1) < 0 ||
+                outbuf_write_int(&ob, res->flags) < 0 ||
+                outbuf_write(&ob, "\t", 1) < 0 ||
+                outbuf_write_int(&ob, res->polyA_len) < 0 ||
+                outbuf_write(&ob, "\t", 1) < 0 ||
+                outbuf_write(&ob, cursor->tail, res->modification_len) < 0 ||
+                outbuf_write(&ob, "\t", 1) < 0 ||
+                outbuf_write_int(&ob, res->num_duplicates) < 0 ||
+                outbuf_write(&ob, "\n", 1) < 0) {
+            fprintf(stderr, "Failed to write the output.\n");
+            goto onError;
+        }
+
+        r = advance_result_cursor(cursor);
+        if (r < 0)
+            goto onError;
+        else if (r > 0)
+            merge_heap_push(heap, cursor);
+    }
+
+    if (outbuf_flush(&ob) < 0 || (out == NULL && fflush(stdout) != 0)) {
+        fprintf(stderr, "Failed to write the output.\n");
+        goto onError;
+    }
+
+    outbuf_free(&ob);
+
+    return 0;
+
+  onError:
+    outbuf_free(&ob);
+
+    return -1;
+}
+
+static int
+merge_traces(struct DedupContext *ctx, struct MergeCursor *cursors,
+             struct MergeHeap *heap, BGZF *traceout)
+{
+    struct MergeCursor *cursor;
+    struct OutputBuffer ob;
+    uint64_t groupno;
+    uint32_t j;
+    int i, r;
+
+    outbuf_init(&ob, NULL, traceout);
+    heap->size = 0;
+    heap->less = less_trace_group;
+
+    for (i = 0; i < NUM_PARTITIONS; i++) {
+        cursors[i].spool = &ctx->jobs[i].trace_groups;
+        cursors[i].partition = i;
+        if (spool_rewind(cursors[i].spool) < 0 ||
+                spool_rewind(&ctx->jobs[i].trace_entries) < 0 ||
+                (r = advance_trace_group_cursor(&cursors[i])) < 0)
+            return -1;
+        if (r > 0)
+            merge_heap_push(heap, &cursors[i]);
+    }
+
+    for (groupno = 0; (cursor = merge_heap_pop(heap)) != NULL; groupno++) {
+        struct Spool *entries=&ctx->jobs[cursor->partition].trace_entries;
+
+        for (j = 0; j < cursor->header.group.num_entries; j++) {
+            struct PartitionTraceEntry entry;
+
+            const struct InputFile *input;
+
+            if (spool_read(entries, &entry, sizeof(entry)) <= 0) {
+                fprintf(stderr, "Truncated duplicate traces.\n");
+                goto onError;
+            }
+
+            input = &ctx->files[entry.source];
+            if (outbuf_write(&ob, input->tilename, input->tilename_len) < 0 ||
+                    outbuf_write(&ob, "\t", 1) < 0 ||
+                    outbuf_write_int(&ob, entry.clusterno) < 0 ||
+                    outbuf_write(&ob, "\t", 1) < 0 ||
+                    outbuf_write_int(&ob, (int64_t)groupno) < 0 ||
+                    outbuf_write(&ob, "\t", 1) < 0 ||
+                    outbuf_write_int(&ob, entry.value) < 0 ||
+                    outbuf_write(&ob, "\n", 1) < 0) {
+                fprintf(stderr, "Failed to write the duplicate traces.\n");
+                goto onError;
+            }
+        }
+
+        r = advance_trace_group_cursor(cursor);
+        if (r < 0)
+            goto onError;
+        else if (r > 0)
+            merge_heap_push(heap, cursor);
+    }
+
+    if (outbuf_flush(&ob) < 0) {
+        fprintf(stderr, "Failed to write the duplicate traces.\n");
+        goto onError;
+    }
+
+    outbuf_free(&ob);
+
+    return 0;
+
+  onError:
+    outbuf_free(&ob);
+
+    return -1;
+}
+
+struct TraceMergeTask {
+    struct DedupContext *ctx;
+    BGZF *traceout;
+    int r;
+};
+
+static void *
+run_trace_merge(void *arg)
+{
+    struct TraceMergeTask *task=arg;
+    struct MergeCursor *cursors;
+    struct MergeCursor *items[NUM_PARTITIONS];
+    struct MergeHeap heap;
+
+    task->r = -1;
+
+    cursors = malloc(sizeof(struct MergeCursor) * NUM_PARTITIONS);
+    if (cursors == NULL) {
+        perror("run_trace_merge");
+        return NULL;
+    }
+
+    heap.items = items;
+    task->r = merge_traces(task->ctx, cursors, &heap, task->traceout);
+    free(cursors);
+
+    return NULL;
+}
+
+static BGZF *
+open_bgzf_output(const char *filename, int threads)
+{
+    BGZF *fp;
+
+    fp = bgzf_open(filename, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s.\n", filename);
+        return NULL;
+    }
+
+    if (threads > 1 && bgzf_mt(fp, threads, 256) < 0)
+        fprintf(stderr, "Failed to start the compression threads.\n");
+
+    return fp;
+}
+
+/* Writes the merged results and traces at the same time. */
+static int
+write_outputs(struct DedupContext *ctx, const char *output_file,
+              const char *trace_file, int threads)
+{
+    struct TraceMergeTask tracetask;
+    struct MergeCursor *cursors;
+    struct MergeCursor *items[NUM_PARTITIONS];
+    struct MergeHeap heap;
+    pthread_t trace_tid;
+    BGZF *out;
+    int trace_started, r;
+
+    r = -1;
+    out = NULL;
+    trace_started = 0;
+    tracetask.ctx = ctx;
+    tracetask.traceout = NULL;
+    tracetask.r = 0;
+
+    cursors = malloc(sizeof(struct MergeCursor) * NUM_PARTITIONS);
+    if (cursors == NULL) {
+        perror("write_outputs");
+        return -1;
+    }
+
+    if (output_file != NULL) {
+        out = open_bgzf_output(output_file, threads);
+        if (out == NULL)
+            goto onExit;
+    }
+
+    if (trace_file != NULL) {
+        tracetask.traceout = open_bgzf_output(trace_file, threads);
+        if (tracetask.traceout == NULL)
+            goto onExit;
+
+        if (pthread_create(&trace_tid, NULL, run_trace_merge, &tracetask) != 0) {
+            perror("pthread_create");
+            goto onExit;
+        }
+        trace_started = 1;
+    }
+
+    heap.items = items;
+    r = merge_results(ctx, cursors, &heap, out);
+
+  onExit:
+    if (trace_started) {
+        pthread_join(trace_tid, NULL);
+        if (tracetask.r < 0)
+            r = -1;
+    }
+
+    if (tracetask.traceout != NULL && bgzf_close(tracetask.traceout) < 0)
+        r = -1;
+    if (out != NULL && bgzf_close(out) < 0)
+        r = -1;
+
+    free(cursors);
+
+    return r;
+}
+
+/*
+ * Half of the memory limit is for the staged records of the partitions,
+ * and the other half for the partitions being processed by the workers.
+ * Partitions larger than the share of a worker are split before loading.
+ */
+static int
+init_dedup_context(struct DedupContext *ctx, const char *trace_file,
+                   const char *tempdir, size_t memory_limit, int threads)
+{
+    size_t staging_limit;
+    int i;
+
+    memset(ctx, 0, sizeof(*ctx));
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    ctx->jobs = calloc(NUM_PARTITIONS, sizeof(struct PartitionJob));
+    if (ctx->jobs == NULL) {
+        perror("init_dedup_context");
+        return -1;
+    }
+
+    ctx->tempdir = tempdir;
+    ctx->partition_budget = memory_limit / 2 / threads;
+    staging_limit = memory_limit / 2;
+
+    for (i = 0; i < NUM_PARTITIONS; i++)
+        init_partition_job(&ctx->jobs[i], tempdir,
+                           staging_limit / NUM_PARTITIONS,
+                           staging_limit / NUM_PARTITIONS / 3,
+                           trace_file != NULL);
+
+    return 0;
+}
+
+static void
+free_dedup_context(struct DedupContext *ctx)
+{
+    int i;
+
+    if (ctx->jobs != NULL) {
+        for (i = 0; i < NUM_PARTITIONS; i++)
+            free_partition_job(&ctx->jobs[i]);
+        free(ctx->jobs);
+    }
+
+    if (ctx->files != NULL)
+        free(ctx->files);
+    if (ctx->source_ranks != NULL)
+        free(ctx->source_ranks);
+
+    pthread_mutex_destroy(&ctx->lock);
+}
+
+int
+deduplicate_taginfo_files(char **filenames, int nfiles,
+                          const char *output_file, const char *trace_file,
+                          const char *tempdir, size_t memory_limit,
+                          int threads)
+{
+    struct DedupContext ctx;
+    int i, r;
+
+    r = -1;
+    if (init_dedup_context(&ctx, trace_file, tempdir, memory_limit,
+                           threads) < 0)
+        goto onExit;
+
+    ctx.files = calloc(nfiles, sizeof(struct InputFile));
+    if (ctx.files == NULL) {
+        perror("deduplicate_taginfo_files");
+        goto onExit;
+    }
+
+    /* Sort the inputs by the tile names for the output order. */
+    ctx.nfiles = ctx.files_capacity = nfiles;
+    for (i = 0; i < nfiles; i++) {
+        ctx.files[i].filename = filenames[i];
+        if (peek_tile_name(&ctx.files[i]) < 0)
+            goto onExit;
+    }
+
+    qsort(ctx.files, nfiles, sizeof(struct InputFile), compare_input_files);
+
+    for (i = 1; i < nfiles; i++)
+        if (ctx.files[i].tilename[0] != '\0' &&
+                strcmp(ctx.files[i - 1].tilename, ctx.files[i].tilename) == 0) {
+            fprintf(stderr, "%s and %s have the same tile.\n",
+                    ctx.files[i - 1].filename, ctx.files[i].filename);
+            goto onExit;
+        }
+
+    if (run_parallel(&ctx, run_input_reader, threads) < 0 ||
+            run_parallel(&ctx, run_partition_worker, threads) < 0)
+        goto onExit;
+
+    r = write_outputs(&ctx, output_file, trace_file, threads);
+
+  onExit:
+    free_dedup_context(&ctx);
+
+    return r;
+}
+
+/* Deduplicates unsorted tags of any tiles in the standard input. The input
+ * is read by a thread while the partitions are processed in parallel. */
+int
+deduplicate_taginfo_stream(const char *output_file, const char *trace_file,
+                           const char *tempdir, size_t memory_limit,
+                           int threads)
+{
+    struct DedupContext ctx;
+    int r;
+
+    r = -1;
+    if (init_dedup_context(&ctx, trace_file, tempdir, memory_limit,
+                           threads) < 0)
+        goto onExit;
+
+    if (read_input_stream(&ctx, stdin) < 0 ||
+            sort_stream_sources(&ctx) < 0 ||
+            run_parallel(&ctx, run_partition_worker, threads) < 0)
+        goto onExit;
+
+    r = write_outputs(&ctx, output_file, trace_file, threads);
+
+  onExit:
+    free_dedup_context(&ctx);
+
+    return r;
+}
@@ -0,0 +1,215 @@
+/*
+ * spool.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tailseq-dedup-perfect.h"
+
+#define SPOOL_MIN_CAPACITY      4096
+
+
+void
+spool_init(struct Spool *sp, const char *tempdir, size_t limit)
+{
+    memset(sp, 0, sizeof(*sp));
+    sp->tempdir = tempdir;
+    sp->limit = limit;
+}
+
+static int
+spool_spill(struct Spool *sp)
+{
+    if (sp->fp == NULL) {
+        char *path;
+        int fd;
+
+        path = malloc(strlen(sp->tempdir) + 32);
+        if (path == NULL) {
+            perror("spool_spill");
+            return -1;
+        }
+
+        sprintf(path, "%s/tailseq-dedup.XXXXXX", sp->tempdir);
+        fd = mkstemp(path);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to create a temporary file in %s.\n",
+                    sp->tempdir);
+            free(path);
+            return -1;
+        }
+
+        /* Nobody else needs the name. */
+        unlink(path);
+        free(path);
+
+        sp->fp = fdopen(fd, "w+");
+        if (sp->fp == NULL) {
+            perror("spool_spill");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (fwrite(sp->buf, 1, sp->size, sp->fp) != sp->size) {
+        perror("spool_spill");
+        return -1;
+    }
+
+    sp->spilled += sp->size;
+    sp->size = 0;
+
+    return 0;
+}
+
+int
+spool_write(struct Spool *sp, const void *data, size_t length)
+{
+    if (sp->size > 0 && sp->size + length > sp->limit &&
+            spool_spill(sp) < 0)
+        return -1;
+
+    if (sp->size + length > sp->capacity) {
+        size_t newcapacity;
+        char *newbuf;
+
+        newcapacity = (sp->capacity == 0) ? SPOOL_MIN_CAPACITY :
+                                            sp->capacity * 2;
+        while (newcapacity < sp->size + length)
+            newcapacity *= 2;
+
+        newbuf = realloc(sp->buf, newcapacity);
+        if (newbuf == NULL) {
+            perror("spool_write");
+            return -1;
+        }
+
+        sp->buf = newbuf;
+        sp->capacity = newcapacity;
+    }
+
+    memcpy(sp->buf + sp->size, data, length);
+    sp->size += length;
+
+    return 0;
+}
+
+/* Prepares for reading from the beginning. No more writes are allowed. */
+int
+spool_rewind(struct Spool *sp)
+{
+    sp->rspilled = sp->rpos = 0;
+
+    if (sp->fp != NULL && (fflush(sp->fp) != 0 ||
+                           fseek(sp->fp, 0, SEEK_SET) != 0)) {
+        perror("spool_rewind");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns 1 if the data was read, 0 at the end of the spool. */
+int
+spool_read(struct Spool *sp, void *data, size_t length)
+{
+    char *wptr;
+    size_t chunk;
+
+    wptr = data;
+
+    if (sp->rspilled < sp->spilled) {
+        chunk = sp->spilled - sp->rspilled;
+        if (chunk > length)
+            chunk = length;
+
+        if (fread(wptr, 1, chunk, sp->fp) != chunk) {
+            perror("spool_read");
+            return -1;
+        }
+
+        sp->rspilled += chunk;
+        wptr += chunk;
+        length -= chunk;
+    }
+    else if (length > 0 && sp->rpos >= sp->size)
+        return 0;
+
+    if (length > 0) {
+        if (sp->rpos + length > sp->size) {
+            fprintf(stderr, "Truncated record in a spool.\n");
+            return -1;
+        }
+
+        memcpy(wptr, sp->buf + sp->rpos, length);
+        sp->rpos += length;
+    }
+
+    return 1;
+}
+
+/* Returns the whole contents in a buffer and empties the spool. */
+char *
+spool_load(struct Spool *sp, size_t *length)
+{
+    char *contents;
+
+    *length = sp->spilled + sp->size;
+    contents = malloc(*length > 0 ? *length : 1);
+    if (contents == NULL) {
+        perror("spool_load");
+        return NULL;
+    }
+
+    if (spool_rewind(sp) < 0 ||
+            (sp->spilled > 0 && fread(contents, 1, sp->spilled, sp->fp) !=
+                                    sp->spilled)) {
+        perror("spool_load");
+        free(contents);
+        return NULL;
+    }
+
+    if (sp->size > 0)
+        memcpy(contents + sp->spilled, sp->buf, sp->size);
+
+    spool_free(sp);
+
+    return contents;
+}
+
+void
+spool_free(struct Spool *sp)
+{
+    if (sp->buf != NULL)
+        free(sp->buf);
+    if (sp->fp != NULL)
+        fclose(sp->fp);
+
+    spool_init(sp, sp->tempdir, sp->limit);
+}
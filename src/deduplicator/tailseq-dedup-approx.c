@@ -40,13 +40,9 @@
 #include "../sigproc-flags.h"
 #include "tailseq-dedup-approx.h"
 
-/* Set a temporary limit of clusters in buffer. This will be
- * removed again once I implement a scalable routine that works for
- * larger clusters. */
-#define XXX_TAGCLUSTER_LIMIT            4096
-
 #define DEFAULT_TAGALN_BUFFER_LEN       8192
 #define DEFAULT_TAGCLUSTER_BUFFER_LEN   8192
+#define DEFAULT_UMI_CANDIDATES_LEN      1024
 
 static inline int16_t
 calculate_tag_prority(int flags)
@@ -103,49 +99,249 @@ count_trimers(const char *seq, union trimer_composition *counts)
 //    fprintf(stderr, "\n");
 }
 
+static uint32_t
+hash_umi_segment(int segment, const char *seq, int length)
+{
+    uint32_t hash;
+    int i;
+
+    hash = (2166136261u ^ (uint32_t)segment) * 16777619u; /* FNV-1a */
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)seq[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void
+umi_index_insert(struct deduppool *pool, ssize_t idx)
+{
+    const char *umi=pool->tagclusters[idx].umi_rep;
+    int i;
+
+    for (i = 0; i < pool->umi_segments; i++) {
+        ssize_t entry_ix=idx * pool->umi_segments + i;
+        struct umi_entry *entry=&pool->umi_entries[entry_ix];
+        ssize_t *bucket;
+
+        entry->key = hash_umi_segment(i, umi + pool->umi_segment_start[i],
+                                      pool->umi_segment_len[i]);
+        entry->serial = pool->tagclusters[idx].serial;
+        bucket = &pool->umi_buckets[entry->key & pool->umi_bucket_mask];
+        entry->prev = -1;
+        entry->next = *bucket;
+        if (*bucket >= 0)
+            pool->umi_entries[*bucket].prev = entry_ix;
+        *bucket = entry_ix;
+    }
+}
+
+static void
+umi_index_remove(struct deduppool *pool, ssize_t idx)
+{
+    int i;
+
+    for (i = 0; i < pool->umi_segments; i++) {
+        struct umi_entry *entry=&pool->umi_entries[idx * pool->umi_segments + i];
+
+        if (entry->prev >= 0)
+            pool->umi_entries[entry->prev].next = entry->next;
+        else
+            pool->umi_buckets[entry->key & pool->umi_bucket_mask] = entry->next;
+        if (entry->next >= 0)
+            pool->umi_entries[entry->next].prev = entry->prev;
+    }
+}
+
+/* Fits the UMI index to the capacity of the cluster pool. */
+static int
+umi_index_resize(struct deduppool *pool)
+{
+    size_t nentries, nbuckets, i;
+    struct umi_entry *newentries;
+    ssize_t *newbuckets, idx;
+
+    nentries = (size_t)pool->tagcluster_capacity * pool->umi_segments;
+    for (nbuckets = 1024; nbuckets < nentries * 2; nbuckets *= 2)
+        ;
+
+    newentries = realloc(pool->umi_entries, sizeof(struct umi_entry) * nentries);
+    if (newentries == NULL)
+        return -1;
+    pool->umi_entries = newentries;
+
+    newbuckets = realloc(pool->umi_buckets, sizeof(ssize_t) * nbuckets);
+    if (newbuckets == NULL)
+        return -1;
+    pool->umi_buckets = newbuckets;
+    pool->umi_bucket_mask = nbuckets - 1;
+
+    for (i = 0; i < nbuckets; i++)
+        pool->umi_buckets[i] = -1;
+
+    for (idx = pool->tagcluster_left; idx >= 0;
+            idx = pool->tagclusters[idx].next)
+        umi_index_insert(pool, idx);
+
+    return 0;
+}
+
+/* Collects the clusters sharing any segment of the UMI, shifted by up to the
+ * edit distance tolerance, in pool->umi_candidates. Only the clusters with
+ * the serial in [serial_from, serial_to) are taken. */
+static int
+umi_index_lookup(struct deduppool *pool, const char *umi,
+                 uint64_t serial_from, uint64_t serial_to)
+{
+    int i, shift;
+
+    pool->umi_candidates_size = 0;
+    pool->visit++;
+
+    for (i = 0; i < pool->umi_segments; i++)
+        for (shift = -pool->editdist_tolerance;
+                shift <= pool->editdist_tolerance; shift++) {
+            int start=pool->umi_segment_start[i] + shift;
+            uint32_t key;
+            ssize_t entry_ix;
+
+            if (start < 0 ||
+                    start + pool->umi_segment_len[i] > pool->umi_length)
+                continue;
+
+            key = hash_umi_segment(i, umi + start, pool->umi_segment_len[i]);
+            for (entry_ix = pool->umi_buckets[key & pool->umi_bucket_mask];
+                    entry_ix >= 0; entry_ix = pool->umi_entries[entry_ix].next) {
+                const struct umi_entry *entry=&pool->umi_entries[entry_ix];
+                ssize_t cluster_ix=entry_ix / pool->umi_segments;
+                struct tagcluster *clstr;
+
+                if (entry->key != key || entry->serial < serial_from ||
+                        entry->serial >= serial_to)
+                    continue;
+
+                clstr = &pool->tagclusters[cluster_ix];
+                if (clstr->visited == pool->visit)
+                    continue;
+                clstr->visited = pool->visit;
+
+                if (pool->umi_candidates_size >= pool->umi_candidates_capacity) {
+                    size_t newcapacity=pool->umi_candidates_capacity * 2;
+                    ssize_t *newptr;
+
+                    newptr = realloc(pool->umi_candidates,
+                                     sizeof(ssize_t) * newcapacity);
+                    if (newptr == NULL)
+                        return -1;
+
+                    pool->umi_candidates = newptr;
+                    pool->umi_candidates_capacity = newcapacity;
+                }
+
+                pool->umi_candidates[pool->umi_candidates_size++] = cluster_ix;
+            }
+        }
+
+    return 0;
+}
+
+/* Logs a new representative UMI to be compared in the next tag clustering. */
+static int
+record_umi_change(struct deduppool *pool, ssize_t idx)
+{
+    if (pool->umi_changes_size >= pool->umi_changes_capacity) {
+        size_t newcapacity=pool->umi_changes_capacity * 2;
+        struct umi_change *newptr;
+
+        newptr = realloc(pool->umi_changes, sizeof(struct umi_change) * newcapacity);
+        if (newptr == NULL)
+            return -1;
+
+        pool->umi_changes = newptr;
+        pool->umi_changes_capacity = newcapacity;
+    }
+
+    pool->tagclusters[idx].changed_stamp = ++pool->stamp;
+    pool->umi_changes[pool->umi_changes_size].cluster = idx;
+    pool->umi_changes[pool->umi_changes_size].stamp = pool->stamp;
+    pool->umi_changes_size++;
+
+    return 0;
+}
+
+static void
+deduppool_destroy(struct deduppool *pool)
+{
+    free(pool->umi_changes);
+    free(pool->umi_candidates);
+    free(pool->umi_buckets);
+    free(pool->umi_entries);
+    free(pool->umi_segment_len);
+    free(pool->umi_segment_start);
+    free(pool->tagclusters);
+    free(pool->tagalns);
+    free(pool);
+}
+
 static struct deduppool *
 deduppool_init(ssize_t tagaln_capacity, ssize_t tagcluster_capacity,
-               ssize_t cologroup_capacity, int umi_length)
+               ssize_t cologroup_capacity, int umi_length,
+               int editdist_tolerance)
 {
     struct deduppool *pool;
+    int i;
 
-    pool = malloc(sizeof(struct deduppool));
+    pool = calloc(1, sizeof(struct deduppool));
     if (pool == NULL)
         return NULL;
 
     pool->tagalns = calloc(tagaln_capacity, sizeof(struct tagaln));
-    if (pool->tagalns == NULL) {
-        free(pool);
-        return NULL;
-    }
+    if (pool->tagalns == NULL)
+        goto onError;
     pool->tagaln_capacity = tagaln_capacity;
     pool->tagaln_tryalloc_next = 0;
 
     pool->tagclusters = calloc(tagcluster_capacity, sizeof(struct tagcluster));
-    if (pool->tagclusters == NULL) {
-        free(pool->tagalns);
-        free(pool);
-        return NULL;
-    }
+    if (pool->tagclusters == NULL)
+        goto onError;
     pool->tagcluster_capacity = tagcluster_capacity;
     pool->tagcluster_tryalloc_next = 0;
 
     pool->tagcluster_left = pool->tagcluster_right = -1;
     pool->tagclusters_live = 0;
     pool->umi_length = umi_length;
+    pool->editdist_tolerance = editdist_tolerance;
+
+    /* Segments for the UMI index. Some are empty for very short UMIs. */
+    pool->umi_segments = editdist_tolerance + 1;
+    pool->umi_segment_start = malloc(sizeof(int) * pool->umi_segments);
+    pool->umi_segment_len = malloc(sizeof(int) * pool->umi_segments);
+    if (pool->umi_segment_start == NULL || pool->umi_segment_len == NULL)
+        goto onError;
+
+    for (i = 0; i < pool->umi_segments; i++) {
+        pool->umi_segment_start[i] = i * umi_length / pool->umi_segments;
+        pool->umi_segment_len[i] = (i + 1) * umi_length / pool->umi_segments -
+                                   pool->umi_segment_start[i];
+    }
+
+    if (umi_index_resize(pool) < 0)
+        goto onError;
 
-    memset(pool->tagalns, 0, sizeof(struct tagaln) * tagaln_capacity);
-    memset(pool->tagclusters, 0, sizeof(struct tagcluster) * tagcluster_capacity);
+    pool->umi_candidates_capacity = DEFAULT_UMI_CANDIDATES_LEN;
+    pool->umi_candidates = malloc(sizeof(ssize_t) * pool->umi_candidates_capacity);
+    pool->umi_changes_capacity = DEFAULT_TAGCLUSTER_BUFFER_LEN;
+    pool->umi_changes = malloc(sizeof(struct umi_change) *
+                               pool->umi_changes_capacity);
+    if (pool->umi_candidates == NULL || pool->umi_changes == NULL)
+        goto onError;
 
     return pool;
-}
 
-static void
-deduppool_destroy(struct deduppool *pool)
-{
-    free(pool->tagclusters);
-    free(pool->tagalns);
-    free(pool);
+  onError:
+    deduppool_destroy(pool);
+    return NULL;
 }
 
 static ssize_t
@@ -155,13 +351,13 @@ tagaln_new(struct deduppool *pool)
 
     for (i = pool->tagaln_tryalloc_next; i < pool->tagaln_capacity; i++)
         if (!is_tagaln_occupied(&pool->tagalns[i])) {
-            pool->tagaln_tryalloc_next = (pool->tagaln_tryalloc_next + 1) % pool->tagaln_capacity;
+            pool->tagaln_tryalloc_next = (i + 1) % pool->tagaln_capacity;
             return i;
         }
 
     for (i = 0; i < pool->tagaln_tryalloc_next; i++)
         if (!is_tagaln_occupied(&pool->tagalns[i])) {
-            pool->tagaln_tryalloc_next = (pool->tagaln_tryalloc_next + 1) % pool->tagaln_capacity;
+            pool->tagaln_tryalloc_next = (i + 1) % pool->tagaln_capacity;
             return i;
         }
 
@@ -216,15 +412,13 @@ tagcluster_new(struct deduppool *pool)
 
     for (i = pool->tagcluster_tryalloc_next; i < pool->tagcluster_capacity; i++)
         if (!is_tagcluster_occupied(&pool->tagclusters[i])) {
-            pool->tagcluster_tryalloc_next = (pool->tagcluster_tryalloc_next + 1)
-                                             % pool->tagcluster_capacity;
+            pool->tagcluster_tryalloc_next = (i + 1) % pool->tagcluster_capacity;
             return i;
         }
 
     for (i = 0; i < pool->tagcluster_tryalloc_next; i++)
         if (!is_tagcluster_occupied(&pool->tagclusters[i])) {
-            pool->tagcluster_tryalloc_next = (pool->tagcluster_tryalloc_next + 1)
-                                             % pool->tagcluster_capacity;
+            pool->tagcluster_tryalloc_next = (i + 1) % pool->tagcluster_capacity;
             return i;
         }
 
@@ -245,6 +439,9 @@ tagcluster_new(struct deduppool *pool)
         pool->tagcluster_tryalloc_next = pool->tagcluster_capacity;
         pool->tagcluster_capacity = newcapacity;
 
+        if (umi_index_resize(pool) < 0)
+            return -1;
+
         return pool->tagcluster_tryalloc_next++;
     }
 }
@@ -264,11 +461,15 @@ tagcluster_create(struct deduppool *pool, int32_t tid, int32_t pos,
     clstr = &pool->tagclusters[idx];
     strcpy(clstr->umi_rep, umiseq);
     count_trimers(umiseq, &clstr->trimer_counts);
+    clstr->umi_rep_ndups = umi_rep_ndups;
     clstr->tid = tid;
     clstr->pos = pos;
     clstr->tagaln_head = clstr->tagaln_tail = tagaln;
     clstr->prev = -1;
     clstr->next = -1;
+    clstr->scanned_stamp = 0;
+    clstr->visited = 0;
+    clstr->dirty = 0;
 
     return idx;
 }
@@ -288,6 +489,12 @@ tagcluster_free(struct deduppool *pool, struct tagcluster *clstr)
 static struct tagcluster *
 tagcluster_pushright(struct deduppool *pool, ssize_t idx)
 {
+    if (record_umi_change(pool, idx) < 0)
+        return NULL;
+
+    pool->tagclusters[idx].serial = pool->next_serial++;
+    umi_index_insert(pool, idx);
+
     if (pool->tagcluster_right < 0)
         pool->tagcluster_left = pool->tagcluster_right = idx;
     else {
@@ -324,6 +531,7 @@ tagcluster_popleft_not_after_pos(struct deduppool *pool, int32_t tid, int32_t po
     if (clstr->tid == tid && clstr->pos >= pos)
         return NULL;
 
+    umi_index_remove(pool, pool->tagcluster_left);
     pool->tagcluster_left = clstr->next;
     if (clstr->next < 0)
         pool->tagcluster_right = -1;
@@ -344,6 +552,7 @@ tagcluster_popleft(struct deduppool *pool)
 
     assert(pool->tagcluster_right >= 0);
     clstr = &pool->tagclusters[pool->tagcluster_left];
+    umi_index_remove(pool, pool->tagcluster_left);
     pool->tagcluster_left = clstr->next;
     if (clstr->next < 0)
         pool->tagcluster_right = -1;
@@ -359,6 +568,7 @@ tagcluster_popmiddle(struct deduppool *pool, struct tagcluster *clstr)
 {
     assert(clstr->prev >= 0);
 
+    umi_index_remove(pool, clstr - pool->tagclusters);
     pool->tagclusters[clstr->prev].next = clstr->next;
     if (clstr->next >= 0)
         pool->tagclusters[clstr->next].prev = clstr->prev;
@@ -571,60 +781,77 @@ write_tagcluster(struct deduppool *pool, struct tagcluster *clstr,
     return 0;
 }
 
+static int
+is_umi_similar(struct deduppool *tpool, struct tagcluster *query,
+               struct tagcluster *target, int editdist_threshold,
+               int trimercomp_threshold)
+{
+    if ((int)diffcount_trimer_compositions(&query->trimer_counts,
+            &target->trimer_counts) >= trimercomp_threshold)
+        return 0;
+
+    return edit_distance(query->umi_rep, target->umi_rep, tpool->umi_length,
+                         editdist_threshold - 1) < editdist_threshold;
+}
+
 static int
 merge_similar_umi_clusters(struct deduppool *tpool, struct tagcluster *query,
                            int editdist_threshold, int trimercomp_threshold)
 {
-    struct tagcluster *target;
-    ssize_t target_ix;
+    ssize_t query_ix=query - tpool->tagclusters;
+
+    for (;;) {
+        struct tagcluster *target;
+        size_t i;
 
-    assert(query->next >= 0);
-    target = query;
+        /* Find the first one in the following clusters within the
+         * tolerance. */
+        if (umi_index_lookup(tpool, query->umi_rep, query->serial + 1,
+                             UINT64_MAX) < 0)
+            return -1;
 
-    while (target->next >= 0) {
-        int dist;
+        target = NULL;
+        for (i = 0; i < tpool->umi_candidates_size; i++) {
+            struct tagcluster *clstr=&tpool->tagclusters[tpool->umi_candidates[i]];
 
-        target_ix = target->next;
-        target = &tpool->tagclusters[target_ix];
+            if ((target == NULL || clstr->serial < target->serial) &&
+                    is_umi_similar(tpool, query, clstr, editdist_threshold,
+                                   trimercomp_threshold))
+                target = clstr;
+        }
 
-        if ((int)diffcount_trimer_compositions(&query->trimer_counts,
-                &target->trimer_counts) >= trimercomp_threshold)
-            dist = editdist_threshold;
-        else
-            dist = edit_distance(query->umi_rep, target->umi_rep, tpool->umi_length,
-                                 editdist_threshold - 1);
-
-//        fprintf(stderr, "[%d] DISTANCE %s-%s = %d\n", (int)target_ix,
-//                query->umi_rep, target->umi_rep, dist);
-
-        if (dist < editdist_threshold) {
-            /* Merge the target into the query cluster. */
-            if (query->umi_rep_ndups < target->umi_rep_ndups) {
-                /* Change the cluster rep UMI sequence when target
-                 * is more abundant. */
-                strcpy(query->umi_rep, target->umi_rep);
-                query->umi_rep_ndups = target->umi_rep_ndups;
-                memcpy(&query->trimer_counts.count,
-                       &target->trimer_counts.count, sizeof(query->trimer_counts));
-            }
+        if (target == NULL)
+            break;
 
-            if (query->tagaln_tail < 0) {
-                query->tagaln_head = target->tagaln_head;
-                query->tagaln_tail = target->tagaln_tail;
-            }
-            else if (target->tagaln_tail < 0)
-                /* pass */;
-            else {
-                assert(tpool->tagalns[query->tagaln_tail].next == -1);
-                tpool->tagalns[query->tagaln_tail].next = target->tagaln_head;
-                query->tagaln_tail = target->tagaln_tail;
-            }
+        /* Merge the target into the query cluster. */
+        if (query->umi_rep_ndups < target->umi_rep_ndups) {
+            /* Change the cluster rep UMI sequence when target
+             * is more abundant. */
+            umi_index_remove(tpool, query_ix);
+            strcpy(query->umi_rep, target->umi_rep);
+            query->umi_rep_ndups = target->umi_rep_ndups;
+            memcpy(&query->trimer_counts.count,
+                   &target->trimer_counts.count, sizeof(query->trimer_counts));
+            umi_index_insert(tpool, query_ix);
+            if (record_umi_change(tpool, query_ix) < 0)
+                return -1;
+        }
 
-            target->tagaln_head = target->tagaln_tail = -1;
-            (void)tagcluster_popmiddle(tpool, target);
-            tagcluster_free(tpool, target);
-            target = query;
+        if (query->tagaln_tail < 0) {
+            query->tagaln_head = target->tagaln_head;
+            query->tagaln_tail = target->tagaln_tail;
+        }
+        else if (target->tagaln_tail < 0)
+            /* pass */;
+        else {
+            assert(tpool->tagalns[query->tagaln_tail].next == -1);
+            tpool->tagalns[query->tagaln_tail].next = target->tagaln_head;
+            query->tagaln_tail = target->tagaln_tail;
         }
+
+        target->tagaln_head = target->tagaln_tail = -1;
+        (void)tagcluster_popmiddle(tpool, target);
+        tagcluster_free(tpool, target);
     }
 
     return 0;
@@ -635,26 +862,68 @@ perform_tag_clustering(struct deduppool *tpool, int editdist_threshold,
                        int trimercomp_threshold)
 {
     struct tagcluster *clstr;
+    ssize_t clstr_ix;
+    uint64_t first_clean;
+    size_t i, j;
 
-    if (tpool->tagclusters_live <= 1)
+    if (tpool->tagclusters_live <= 1) {
+        tpool->umi_changes_size = 0;
         return 0;
+    }
+
+    /* A cluster needs comparisons with the following ones only if its UMI
+     * has changed since the last comparisons, or any of them got a UMI
+     * within the tolerance since then. */
+    first_clean = UINT64_MAX;
+    for (clstr_ix = tpool->tagcluster_left; clstr_ix >= 0;
+            clstr_ix = clstr->next) {
+        clstr = &tpool->tagclusters[clstr_ix];
+        if (clstr->changed_stamp <= clstr->scanned_stamp) {
+            first_clean = clstr->serial;
+            break;
+        }
+    }
+
+    for (i = 0; i < tpool->umi_changes_size; i++) {
+        const struct umi_change *change=&tpool->umi_changes[i];
+        struct tagcluster *changed=&tpool->tagclusters[change->cluster];
+
+        if (!is_tagcluster_occupied(changed) ||
+                changed->changed_stamp != change->stamp ||
+                changed->serial <= first_clean)
+            continue; /* removed, changed again or nothing to mark */
+
+        if (umi_index_lookup(tpool, changed->umi_rep, first_clean,
+                             changed->serial) < 0)
+            return -1;
+
+        for (j = 0; j < tpool->umi_candidates_size; j++) {
+            clstr = &tpool->tagclusters[tpool->umi_candidates[j]];
+            if (!clstr->dirty && clstr->changed_stamp <= clstr->scanned_stamp &&
+                    clstr->scanned_stamp < change->stamp &&
+                    is_umi_similar(tpool, clstr, changed, editdist_threshold,
+                                   trimercomp_threshold))
+                clstr->dirty = 1;
+        }
+    }
+
+    /* Changes from here are compared in the next round. */
+    tpool->umi_changes_size = 0;
+
+    for (clstr_ix = tpool->tagcluster_left; clstr_ix >= 0;
+            clstr_ix = clstr->next) {
+        clstr = &tpool->tagclusters[clstr_ix];
+        if (!clstr->dirty && clstr->changed_stamp <= clstr->scanned_stamp)
+            continue;
 
-//    fprintf(stderr, "==> Tag clustering! CLUSTERS %d-%d // %d->",
-//            (int)tpool->tagcluster_left,
-//            (int)tpool->tagcluster_right,
-//            (int)tpool->tagclusters_live);
-    for (clstr = &tpool->tagclusters[tpool->tagcluster_left];
-            clstr->next >= 0; clstr = &tpool->tagclusters[clstr->next]) {
         if (merge_similar_umi_clusters(tpool, clstr, editdist_threshold,
                                        trimercomp_threshold) < 0)
             return -1;
 
-        /* Next pointer can be modified during cluster merging. */
-        if (clstr->next < 0)
-            break;
+        clstr->dirty = 0;
+        clstr->scanned_stamp = tpool->stamp;
     }
 
-    //fprintf(stderr, "%d\n", (int)tpool->tagclusters_live);
     return 0;
 }
 
@@ -710,18 +979,14 @@ deduplicate_tailseq_bam(struct taskpool *tasks, samFile *samf, hts_idx_t *bamidx
         if (!is_deduppool_empty(tpool)) {
             struct tagcluster *clstr;
             int32_t validfrom=bamentry->core.pos - coorddist_tolerance;
-            int XXX_force_flushing=(tpool->tagclusters_live >= XXX_TAGCLUSTER_LIMIT);
 
             clstr = tagcluster_peekleft(tpool);
-            /*if (clstr->tid != bamentry->core.tid || clstr->pos < validfrom) { XXX */
-            if (XXX_force_flushing ||
-                    clstr->tid != bamentry->core.tid || clstr->pos < validfrom) {
+            if (clstr->tid != bamentry->core.tid || clstr->pos < validfrom) {
                 if (perform_tag_clustering(tpool, editdist_threshold,
                                            trimercomp_threshold) < 0)
                     return -1;
 
-                while ((XXX_force_flushing && (clstr = tagcluster_popleft(tpool)) != NULL) ||
-                       (clstr = tagcluster_popleft_not_after_pos(tpool, bamentry->core.tid,
+                while ((clstr = tagcluster_popleft_not_after_pos(tpool, bamentry->core.tid,
                                                                  validfrom)) != NULL) {
                     if (write_tagcluster(tpool, clstr, &tasks->writelock) < 0)
                         return -1;
@@ -746,7 +1011,10 @@ deduplicate_tailseq_bam(struct taskpool *tasks, samFile *samf, hts_idx_t *bamidx
             perror("tagcluster_create");
             return -1;
         }
-        (void)tagcluster_pushright(tpool, cluster_ix);
+        if (tagcluster_pushright(tpool, cluster_ix) == NULL) {
+            perror("tagcluster_pushright");
+            return -1;
+        }
 
 //        fprintf(stderr, "\ntid=%d pos=%d qname=%s ZM=%s Za=%d ZF=%d ZD=%d\n",
 //                (int)bamentry->core.tid, (int)bamentry->core.pos,
@@ -836,7 +1104,8 @@ process_deduplications(struct taskpool *tasks)
     }
 
     tpool = deduppool_init(DEFAULT_TAGALN_BUFFER_LEN, DEFAULT_TAGCLUSTER_BUFFER_LEN,
-                           tasks->coorddist_tolerance + 2, tasks->umi_length);
+                           tasks->coorddist_tolerance + 2, tasks->umi_length,
+                           tasks->editdist_tolerance);
     if (tpool == NULL) {
         perror("deduppool_init");
         set_error_and_exit(5);
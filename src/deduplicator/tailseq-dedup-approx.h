@@ -91,6 +91,28 @@ struct tagcluster {
     ssize_t tagaln_tail;
     ssize_t prev;
     ssize_t next;
+
+    uint64_t serial;        /* order in the list */
+    uint64_t changed_stamp; /* when umi_rep was set */
+    uint64_t scanned_stamp; /* when the following clusters were last compared */
+    uint64_t visited;       /* the last UMI index lookup that returned this */
+    int dirty;              /* needs comparisons with the following ones */
+};
+
+/* The representative UMI of each live cluster is split into
+ * (edit distance tolerance + 1) segments indexed by their hashes. Any UMI
+ * within the tolerance shares at least one segment exactly, shifted by up to
+ * the tolerance. Entries of the cluster i are at i * umi_segments. */
+struct umi_entry {
+    uint32_t key;
+    ssize_t prev;
+    ssize_t next;
+    uint64_t serial;        /* of the cluster */
+};
+
+struct umi_change {
+    ssize_t cluster;
+    uint64_t stamp;
 };
 
 #define is_deduppool_empty(pool)   ((pool)->tagcluster_left == -1)
@@ -109,6 +131,24 @@ struct deduppool {
     ssize_t tagclusters_live;
 
     int umi_length;
+    int editdist_tolerance;
+
+    int umi_segments;
+    int *umi_segment_start;
+    int *umi_segment_len;
+    struct umi_entry *umi_entries;
+    ssize_t *umi_buckets;
+    size_t umi_bucket_mask;
+
+    ssize_t *umi_candidates;    /* results of a UMI index lookup */
+    size_t umi_candidates_size, umi_candidates_capacity;
+
+    struct umi_change *umi_changes; /* since the last tag clustering */
+    size_t umi_changes_size, umi_changes_capacity;
+
+    uint64_t next_serial;
+    uint64_t stamp;
+    uint64_t visit;
 };
 
 /* tailseq-dedup-approx.c */
@@ -33,57 +33,11 @@
 #include <inttypes.h>
 #include <math.h>
 #include <assert.h>
+#include <getopt.h>
 #include <htslib/bgzf.h>
 #include "../sigproc-flags.h"
 #include "../utils.h"
-
-#define DEFAULT_BUFFER_SIZE     1024
-#define MAX_TILENAME_LEN        63
-#define MAX_MODIFICATION_LEN    50
-#define MAX_UMI_LEN             50
-#define MAX_LINE_LEN            511
-#define BUFFER_EXPANSION_FACTOR 1.5
-
-struct TagInfo {
-    char line[MAX_LINE_LEN+1];
-
-    char tilename[MAX_TILENAME_LEN+1];
-    int clusterno;
-    int flags;
-    int polyA_len;
-
-    char modifications[MAX_MODIFICATION_LEN+1];
-    size_t modification_len;
-
-    char umi[MAX_UMI_LEN+1];
-    size_t umi_len;
-};
-
-struct TagInfoQueue { /* a circular queue */
-    struct TagInfo *el;
-
-    ssize_t size;
-    ssize_t front;
-    ssize_t rear;
-
-    int num_duplicates;
-    int highest_priority;
-
-    BGZF *traceout;
-    uint64_t next_group;
-};
-
-
-#define tqueue_length(q)    (((q)->front + (q)->size - (q)->rear) % (q)->size)
-#define tqueue_head(q)      ((q)->el[(q)->front])
-#define tqueue_tail(q)      ((q)->el[(q)->rear])
-#define tqueue_next(q, eln) ((eln + 1) % (q)->size)
-#define tqueue_inc(q)       do { (q)->front = tqueue_next((q), (q)->front); } while(0)
-#define tqueue_dec(q)       do { (q)->rear = tqueue_next((q), (q)->rear); } while(0)
-#define tqueue_isempty(q)   ((q)->front == (q)->rear)
-#define tqueue_isfull(q)    (tqueue_length(q) == (q)->size - 1)
-#define tqueue_foreach(q, v) for ((v) = (q)->rear; (v) != (q)->front; (v) = tqueue_next((q), (v)))
-#define tqueue_empty(q)     do { (q)->rear = (q)->front; } while(0)
+#include "tailseq-dedup-perfect.h"
 
 
 static inline int
@@ -106,7 +60,7 @@ calculate_tag_prority(int flags)
 #undef NOTSET
 }
 
-static struct TagInfoQueue *
+struct TagInfoQueue *
 tqueue_new(ssize_t size)
 {
     struct TagInfoQueue *queue;
@@ -115,54 +69,226 @@ tqueue_new(ssize_t size)
     if (queue == NULL)
         return NULL;
 
-    queue->el = calloc(size, sizeof(struct TagInfo));
+    queue->el = malloc(sizeof(struct TagInfo) * size);
     if (queue->el == NULL) {
         free(queue);
         return NULL;
     }
 
+    queue->arena.buf = NULL;
+    queue->arena.size = queue->arena.capacity = 0;
     queue->size = size;
     queue->front = 0;
     queue->rear = 0;
     queue->num_duplicates = 0;
     queue->highest_priority = -1;
-    queue->traceout = NULL;
+    outbuf_init(&queue->output, stdout, NULL);
+    outbuf_init(&queue->traceout, NULL, NULL);
     queue->next_group = 0;
+    queue->job = NULL;
 
     return queue;
 }
 
-static void
+void
 tqueue_free(struct TagInfoQueue *queue)
 {
     free(queue->el);
-    if (queue->traceout != NULL)
-        bgzf_close(queue->traceout);
+    if (queue->arena.buf != NULL)
+        free(queue->arena.buf);
+    outbuf_free(&queue->output);
+    outbuf_free(&queue->traceout);
+    if (queue->traceout.bgzf != NULL)
+        bgzf_close(queue->traceout.bgzf);
     free(queue);
 }
 
 static int
 tqueue_expand(struct TagInfoQueue *queue, float factor)
 {
-    ssize_t newsize, wptr, rptr;
+    ssize_t newsize, nwrapped;
     struct TagInfo *newel;
 
     newsize = (ssize_t)(queue->size * factor);
-    newel = calloc(newsize, sizeof(struct TagInfo));
+    newel = realloc(queue->el, sizeof(struct TagInfo) * newsize);
     if (newel == NULL)
         return -1;
 
-    wptr = 0;
-    tqueue_foreach(queue, rptr)
-        memcpy(&newel[wptr++], &queue->el[rptr], sizeof(struct TagInfo));
-
-    assert(wptr == tqueue_length(queue));
+    /* Only the entries from the rear to the end of the old buffer need to
+     * be moved when the queue wraps around. */
+    if (queue->front < queue->rear) {
+        nwrapped = queue->size - queue->rear;
+        memmove(&newel[newsize - nwrapped], &newel[queue->rear],
+                sizeof(struct TagInfo) * nwrapped);
+        queue->rear = newsize - nwrapped;
+    }
 
-    free(queue->el);
     queue->el = newel;
     queue->size = newsize;
-    queue->rear = 0;
-    queue->front = wptr;
+
+    return 0;
+}
+
+/* Copies the strings of the tag at the front to the end of the arena. */
+int
+tqueue_set_strings(struct TagInfoQueue *queue, const char *line,
+                   size_t line_len, const char *umi, size_t umi_len)
+{
+    struct TagArena *arena=&queue->arena;
+    struct TagInfo *current;
+
+    if (arena->size + line_len + umi_len > arena->capacity) {
+        size_t newcapacity;
+        char *newbuf;
+
+        newcapacity = (arena->capacity == 0) ? TAG_ARENA_INITIAL_SIZE :
+                      arena->capacity;
+        while (arena->size + line_len + umi_len > newcapacity)
+            newcapacity *= 2;
+
+        newbuf = realloc(arena->buf, newcapacity);
+        if (newbuf == NULL)
+            return -1;
+
+        arena->buf = newbuf;
+        arena->capacity = newcapacity;
+    }
+
+    current = &tqueue_head(queue);
+    current->line = arena->size;
+    current->line_len = line_len;
+    current->umi_len = umi_len;
+    memcpy(arena->buf + arena->size, line, line_len);
+    memcpy(arena->buf + arena->size + line_len, umi, umi_len);
+    arena->size += line_len + umi_len;
+
+    return 0;
+}
+
+/* Moves the strings of the tag at the front, which are the last ones in the
+ * arena, to the beginning when the other tags are not needed anymore. */
+static void
+tqueue_rebase_head(struct TagInfoQueue *queue)
+{
+    struct TagInfo *current=&tqueue_head(queue);
+    size_t length=(size_t)current->line_len + current->umi_len;
+
+    if (current->line > 0) {
+        memmove(queue->arena.buf, tag_line(queue, current), length);
+        current->line = 0;
+    }
+    queue->arena.size = length;
+}
+
+void
+outbuf_init(struct OutputBuffer *ob, FILE *fp, BGZF *bgzf)
+{
+    ob->buf = NULL;
+    ob->size = ob->capacity = 0;
+    ob->fp = fp;
+    ob->bgzf = bgzf;
+}
+
+int
+outbuf_flush(struct OutputBuffer *ob)
+{
+    if (ob->size == 0)
+        return 0;
+
+    if (ob->bgzf != NULL) {
+        if (bgzf_write(ob->bgzf, ob->buf, ob->size) < 0)
+            return -1;
+    }
+    else if (fwrite(ob->buf, 1, ob->size, ob->fp) != ob->size)
+        return -1;
+
+    ob->size = 0;
+
+    return 0;
+}
+
+int
+outbuf_write(struct OutputBuffer *ob, const char *data, size_t length)
+{
+    if (ob->buf == NULL) {
+        ob->buf = malloc(OUTPUT_BUFFER_SIZE);
+        if (ob->buf == NULL)
+            return -1;
+        ob->capacity = OUTPUT_BUFFER_SIZE;
+    }
+
+    if (ob->size + length > ob->capacity) {
+        if (outbuf_flush(ob) < 0)
+            return -1;
+        if (length > ob->capacity)
+            return (ob->bgzf != NULL) ?
+                (bgzf_write(ob->bgzf, data, length) < 0 ? -1 : 0) :
+                (fwrite(data, 1, length, ob->fp) != length ? -1 : 0);
+    }
+
+    memcpy(ob->buf + ob->size, data, length);
+    ob->size += length;
+
+    return 0;
+}
+
+int
+outbuf_write_int(struct OutputBuffer *ob, int64_t value)
+{
+    char digits[24], *p;
+    uint64_t v;
+
+    p = digits + sizeof(digits);
+    v = (value < 0) ? -(uint64_t)value : (uint64_t)value;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    if (value < 0)
+        *--p = '-';
+
+    return outbuf_write(ob, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+void
+outbuf_free(struct OutputBuffer *ob)
+{
+    if (ob->buf != NULL)
+        free(ob->buf);
+    ob->buf = NULL;
+    ob->size = ob->capacity = 0;
+}
+
+#define tqueue_tracing(q)   ((q)->traceout.bgzf != NULL || \
+                             ((q)->job != NULL && (q)->job->tracing))
+
+static int
+write_trace(struct TagInfoQueue *queue, const struct TagInfo *taginfo,
+            int value)
+{
+    struct OutputBuffer *out=&queue->traceout;
+
+    if (queue->job != NULL)
+        return partition_add_trace(queue, taginfo, value);
+
+    return (outbuf_write(out, tag_line(queue, taginfo),
+                         taginfo->tilename_len) < 0 ||
+            outbuf_write(out, "\t", 1) < 0 ||
+            outbuf_write_int(out, taginfo->clusterno) < 0 ||
+            outbuf_write(out, "\t", 1) < 0 ||
+            outbuf_write_int(out, (int64_t)queue->next_group) < 0 ||
+            outbuf_write(out, "\t", 1) < 0 ||
+            outbuf_write_int(out, value) < 0 ||
+            outbuf_write(out, "\n", 1) < 0) ? -1 : 0;
+}
+
+static int
+end_trace_group(struct TagInfoQueue *queue, const struct TagInfo *taginfo)
+{
+    queue->next_group++;
+
+    if (queue->job != NULL)
+        return partition_end_trace_group(queue, taginfo);
 
     return 0;
 }
@@ -178,17 +304,15 @@ tqueue_append(struct TagInfoQueue *queue)
     tagprio = calculate_tag_prority(current->flags);
 
     if (tqueue_isempty(queue) || tagprio > queue->highest_priority) {
-        if (queue->traceout != NULL) {
+        if (tqueue_tracing(queue)) {
             /* print out the suboptimal tags */
             ssize_t ptr;
-            tqueue_foreach(queue, ptr) {
-                struct TagInfo *taginfo=&queue->el[ptr];
-                bgzf_printf(queue->traceout, "%s\t%d\t%" PRIu64 "\t-3\n",
-                            taginfo->tilename, taginfo->clusterno,
-                            queue->next_group);
-            }
+            tqueue_foreach(queue, ptr)
+                if (write_trace(queue, &queue->el[ptr], -3) < 0)
+                    return -1;
         }
         tqueue_empty(queue);
+        tqueue_rebase_head(queue);
         tqueue_inc(queue);
         queue->highest_priority = tagprio;
         queue->num_duplicates++;
@@ -200,85 +324,79 @@ tqueue_append(struct TagInfoQueue *queue)
         return -1;
 
     queue->num_duplicates++;
+    /* the elements may have re-allocated for the expansion. */
+    current = &tqueue_head(queue);
     if (tagprio >= queue->highest_priority) {
         tqueue_inc(queue);
         queue->highest_priority = tagprio;
     }
-    else if (queue->traceout != NULL) { /* print out the suboptimal tag */
-        /* the elements may have re-allocated for the expansion. */
-        current = &tqueue_head(queue);
-        bgzf_printf(queue->traceout, "%s\t%d\t%" PRIu64 "\t-3\n",
-                    current->tilename, current->clusterno,
-                    queue->next_group);
+    else {
+        if (tqueue_tracing(queue) && /* print out the suboptimal tag */
+                write_trace(queue, current, -3) < 0)
+            return -1;
+
+        /* The strings of the dropped tag are at the end of the arena. */
+        queue->arena.size = current->line;
     }
 
     return 0;
 }
 
+/* Parses a line into the tag at the front of the queue. */
 static inline int
-parse_line(struct TagInfo *taginfo)
+parse_line(struct TagInfoQueue *queue, const char *line)
 {
-    size_t length;
-    char *pos, *start;
+    struct TagInfo *taginfo=&tqueue_head(queue);
+    const char *pos, *start;
+    char *end;
 
-    /* Locate tilename and copy */
-    pos = strchr(taginfo->line, '\t');
+    /* Locate tilename */
+    pos = strchr(line, '\t');
     if (pos == NULL)
         return -1;
-    length = (size_t)(pos - taginfo->line);
-    memcpy(taginfo->tilename, taginfo->line, length);
-    taginfo->tilename[length] = '\0';
+    taginfo->tilename_len = (size_t)(pos - line);
 
     /* Locate cluster number and parse it */
     start = pos + 1;
-    taginfo->clusterno = strtoul(start, &pos, 10);
-    if (pos == NULL)
+    taginfo->clusterno = strtoul(start, &end, 10);
+    if (*end != '\t')
         return -1;
 
     /* Locate flags and parse it */
-    start = pos + 1;
-    taginfo->flags = strtol(start, &pos, 10);
-    if (pos == NULL)
+    start = end + 1;
+    taginfo->flags = strtol(start, &end, 10);
+    if (*end != '\t')
         return -1;
 
     /* Locate poly(A) length and parse it */
-    start = pos + 1;
-    taginfo->polyA_len = strtol(start, &pos, 10);
-    if (pos == NULL)
+    start = end + 1;
+    taginfo->polyA_len = strtol(start, &end, 10);
+    if (*end != '\t')
         return -1;
 
-    /* Locate 3' end modification sequence and copy */
-    start = pos + 1;
+    /* Locate 3' end modification sequence */
+    start = end + 1;
     pos = strchr(start, '\t');
     if (pos == NULL)
         return -1;
-    length = (size_t)(pos - start);
-    if (length > 0)
-        memcpy(taginfo->modifications, start, length);
-    taginfo->modifications[length] = '\0';
-    taginfo->modification_len = length;
-
-    /* Trim the UMI from the input buffer as we'll append a new column to the lines. */
-    *pos = '\0';
+    taginfo->modification_len = (size_t)(pos - start);
 
-    /* Locate UMI sequence and copy */
+    /* Locate UMI sequence. The line is kept without the UMI as we'll append
+     * a new column to it. */
     start = pos + 1;
     pos = strchr(start, '\n');
     if (pos == NULL)
         return -1;
-    length = (size_t)(pos - start);
-    if (length > 0)
-        memcpy(taginfo->umi, start, length);
-    taginfo->umi[length] = '\0';
-    taginfo->umi_len = length;
 
-    return 0;
+    return tqueue_set_strings(queue, line, (size_t)(start - 1 - line),
+                              start, (size_t)(pos - start)) < 0 ? -2 : 0;
 }
 
 
-static int
+int
 process_tag_duplicates(struct TagInfoQueue *queue)
 {
+    struct OutputBuffer *out=&queue->output;
     ssize_t ptr, length;
 
     length = tqueue_length(queue);
@@ -286,12 +404,24 @@ process_tag_duplicates(struct TagInfoQueue *queue)
         return 0;
 
     if (length == 1) {
-        printf("%s\t%d\n", tqueue_tail(queue).line, queue->num_duplicates);
-        if (queue->traceout != NULL) {
-            struct TagInfo *taginfo=&tqueue_tail(queue);
-            bgzf_printf(queue->traceout, "%s\t%d\t%" PRIu64 "\t%d\n", taginfo->tilename,
-                        taginfo->clusterno, queue->next_group++, taginfo->polyA_len);
+        struct TagInfo *taginfo=&tqueue_tail(queue);
+
+        if (queue->job != NULL) {
+            if (partition_add_result(queue, taginfo, taginfo->polyA_len,
+                                     queue->num_duplicates) < 0)
+                return -1;
         }
+        else if (outbuf_write(out, tag_line(queue, taginfo),
+                              taginfo->line_len) < 0 ||
+                 outbuf_write(out, "\t", 1) < 0 ||
+                 outbuf_write_int(out, queue->num_duplicates) < 0 ||
+                 outbuf_write(out, "\n", 1) < 0)
+            return -1;
+
+        if (tqueue_tracing(queue) &&
+                (write_trace(queue, taginfo, taginfo->polyA_len) < 0 ||
+                 end_trace_group(queue, taginfo) < 0))
+            return -1;
     }
     else {
         int polyA_len_sum, nearest_ptr;
@@ -323,20 +453,36 @@ process_tag_duplicates(struct TagInfoQueue *queue)
 
             rep = &queue->el[nearest_ptr];
             final_polyA = rep->polyA_len >= 0 ? (int)roundf(mean_polyA_len) : -1;
-            printf("%s\t%d\t%d\t%d\t%s\t%d\n",
-                rep->tilename, rep->clusterno, rep->flags, final_polyA,
-                rep->modifications, queue->num_duplicates);
+            if (queue->job != NULL) {
+                if (partition_add_result(queue, rep, final_polyA,
+                                         queue->num_duplicates) < 0)
+                    return -1;
+            }
+            else if (outbuf_write(out, tag_line(queue, rep),
+                                  rep->tilename_len) < 0 ||
+                     outbuf_write(out, "\t", 1) < 0 ||
+                     outbuf_write_int(out, rep->clusterno) < 0 ||
+                     outbuf_write(out, "\t", 1) < 0 ||
+                     outbuf_write_int(out, rep->flags) < 0 ||
+                     outbuf_write(out, "\t", 1) < 0 ||
+                     outbuf_write_int(out, final_polyA) < 0 ||
+                     outbuf_write(out, "\t", 1) < 0 ||
+                     outbuf_write(out, tag_modifications(queue, rep),
+                                  rep->modification_len) < 0 ||
+                     outbuf_write(out, "\t", 1) < 0 ||
+                     outbuf_write_int(out, queue->num_duplicates) < 0 ||
+                     outbuf_write(out, "\n", 1) < 0)
+                return -1;
 
             /* Output poly(A) length calls for accuracy assessments of clones */
-            if (queue->traceout != NULL) {
-                tqueue_foreach(queue, ptr) {
-                    struct TagInfo *taginfo=&queue->el[ptr];
-                    bgzf_printf(queue->traceout, "%s\t%d\t%" PRIu64 "\t%d\n",
-                                taginfo->tilename, taginfo->clusterno,
-                                queue->next_group,
-                                ptr == nearest_ptr ? final_polyA : -2);
-                }
-                queue->next_group++;
+            if (tqueue_tracing(queue)) {
+                tqueue_foreach(queue, ptr)
+                    if (write_trace(queue, &queue->el[ptr],
+                                    ptr == nearest_ptr ? final_polyA : -2) < 0)
+                        return -1;
+
+                if (end_trace_group(queue, rep) < 0)
+                    return -1;
             }
         }
     }
@@ -347,11 +493,37 @@ process_tag_duplicates(struct TagInfoQueue *queue)
 }
 
 
+/* Takes in the tag placed at the front of the queue. Tags are expected to
+ * come sorted by the UMI. */
 int
-main(int argc, char *argv[])
+tqueue_feed(struct TagInfoQueue *queue)
+{
+    struct TagInfo *current, *last;
+
+    current = &tqueue_head(queue);
+    last = &tqueue_tail(queue);
+
+    if (!tqueue_isempty(queue) &&
+            (current->umi_len != last->umi_len ||
+             memcmp(tag_umi(queue, current), tag_umi(queue, last),
+                    current->umi_len) != 0)) {
+        if (process_tag_duplicates(queue) < 0)
+            return -1;
+
+        queue->num_duplicates = 0;
+        queue->highest_priority = -1;
+    }
+
+    return tqueue_append(queue);
+}
+
+
+static int
+deduplicate_sorted_stream(const char *trace_file)
 {
     struct TagInfoQueue *queue;
-    int lineno;
+    char line[MAX_LINE_LEN+1];
+    int lineno, r;
 
     queue = tqueue_new(DEFAULT_BUFFER_SIZE);
     if (queue == NULL) {
@@ -359,39 +531,27 @@ main(int argc, char *argv[])
         goto onError;
     }
 
-    if (argc >= 2) {
-        queue->traceout = bgzf_open(argv[1], "w");
-        if (queue->traceout == NULL) {
-            fprintf(stderr, "ERROR: Cannot open %s.", argv[1]);
+    if (trace_file != NULL) {
+        queue->traceout.bgzf = bgzf_open(trace_file, "w");
+        if (queue->traceout.bgzf == NULL) {
+            fprintf(stderr, "ERROR: Cannot open %s.", trace_file);
             goto onError;
         }
     }
 
-    for (lineno = 0;
-         fgets(tqueue_head(queue).line, MAX_LINE_LEN, stdin) != NULL;
-         lineno++) {
-        struct TagInfo *current;
-
-        current = &tqueue_head(queue);
-
-        if (parse_line(current) < 0) {
-            fprintf(stderr, "Could line parse line %d: %s", lineno, current->line);
+    for (lineno = 0; fgets(line, MAX_LINE_LEN, stdin) != NULL; lineno++) {
+        r = parse_line(queue, line);
+        if (r == -1) {
+            fprintf(stderr, "Could line parse line %d: %s", lineno, line);
             break;
         }
-
-        if (!tqueue_isempty(queue) &&
-                strcmp(current->umi, tqueue_tail(queue).umi) != 0) {
-            if (process_tag_duplicates(queue) < 0) {
-                perror("process_tag_duplicates");
-                goto onError;
-            }
-
-            queue->num_duplicates = 0;
-            queue->highest_priority = -1;
+        else if (r < 0) {
+            perror("parse_line");
+            goto onError;
         }
 
-        if (tqueue_append(queue) < 0) {
-            perror("tqueue_append");
+        if (tqueue_feed(queue) < 0) {
+            perror("tqueue_feed");
             goto onError;
         }
     }
@@ -401,6 +561,12 @@ main(int argc, char *argv[])
         goto onError;
     }
 
+    if (outbuf_flush(&queue->output) < 0 || fflush(stdout) != 0 ||
+            outbuf_flush(&queue->traceout) < 0) {
+        perror("outbuf_flush");
+        goto onError;
+    }
+
     tqueue_free(queue);
 
     if (ferror(stdin)) {
@@ -416,3 +582,95 @@ main(int argc, char *argv[])
 
     return -1;
 }
+
+static void
+print_usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [duptrace] < sorted-taginfo\n", progname);
+    fprintf(stderr, "       %s {--threads N | --output FILE} [--temp-dir DIR] "
+                    "[--memory-limit MB] [duptrace] < taginfo\n", progname);
+    fprintf(stderr, "       %s [--threads N] [--output FILE] [--temp-dir DIR] "
+                    "[--memory-limit MB] {duptrace} {taginfo} [taginfo ...]\n",
+                    progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *output_file, *tempdir, *trace_file;
+    size_t memory_limit;
+    int threads, partitioned;
+
+    struct option long_options[] =
+    {
+        {"threads",         required_argument,  0,  't'},
+        {"output",          required_argument,  0,  'o'},
+        {"temp-dir",        required_argument,  0,  'T'},
+        {"memory-limit",    required_argument,  0,  'm'},
+        {0, 0, 0, 0}
+    };
+
+    threads = 1;
+    partitioned = 0;
+    output_file = NULL;
+    tempdir = getenv("TMPDIR");
+    if (tempdir == NULL)
+        tempdir = "/tmp";
+    memory_limit = (size_t)DEFAULT_MEMORY_LIMIT << 20;
+
+    while (1) {
+        int option_index=0;
+        int c;
+
+        c = getopt_long(argc, argv, "t:o:T:m:", long_options, &option_index);
+
+        /* Detect the end of the options. */
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 't': /* --threads */
+                threads = atoi(optarg);
+                partitioned = 1;
+                break;
+
+            case 'o': /* --output */
+                output_file = optarg;
+                partitioned = 1;
+                break;
+
+            case 'T': /* --temp-dir */
+                tempdir = optarg;
+                break;
+
+            case 'm': /* --memory-limit */
+                memory_limit = (size_t)atoi(optarg) << 20;
+                break;
+
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (threads < 1 || memory_limit == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* Taginfo files of the tiles are given: group them by UMI here. */
+    if (argc - optind >= 2)
+        return (deduplicate_taginfo_files(argv + optind + 1, argc - optind - 1,
+                                          output_file, argv[optind], tempdir,
+                                          memory_limit, threads) < 0) ? -1 : 0;
+
+    trace_file = (argc - optind >= 1) ? argv[optind] : NULL;
+
+    /* Unsorted tags in stdin are partitioned by UMI with --threads. */
+    if (partitioned)
+        return (deduplicate_taginfo_stream(output_file, trace_file, tempdir,
+                                           memory_limit, threads) < 0) ? -1 : 0;
+
+    /* Otherwise, the input is a stream sorted by UMI in stdin. */
+    return deduplicate_sorted_stream(trace_file);
+}
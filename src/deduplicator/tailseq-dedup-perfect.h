@@ -0,0 +1,229 @@
+/*
+ * tailseq-dedup-perfect.h
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+#ifndef _TAILSEQ_DEDUP_PERFECT_H_
+#define _TAILSEQ_DEDUP_PERFECT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <htslib/bgzf.h>
+
+#define DEFAULT_BUFFER_SIZE     1024
+#define MAX_TILENAME_LEN        63
+#define MAX_MODIFICATION_LEN    50
+#define MAX_UMI_LEN             50
+#define MAX_LINE_LEN            511
+#define BUFFER_EXPANSION_FACTOR 1.5
+#define TAG_ARENA_INITIAL_SIZE  65536
+#define OUTPUT_BUFFER_SIZE      1048576
+
+#define NUM_PARTITIONS          64
+#define NUM_SUBPARTITIONS       16      /* for splitting a large partition */
+#define MAX_PARTITION_DEPTH     4
+#define DEFAULT_MEMORY_LIMIT    2048    /* in megabytes */
+#define PARTITION_FLUSH_SIZE    65536   /* per-reader buffer of a partition */
+
+struct PartitionJob;
+
+/* The strings of a tag are kept in the arena of the queue: the line without
+ * the UMI column is immediately followed by the UMI. In the partitioned mode,
+ * the line consists of the modifications only. */
+struct TagInfo {
+    size_t line;                /* offset in the arena */
+    uint32_t clusterno;
+    int32_t flags;
+    int32_t polyA_len;
+    uint32_t source;            /* input file in the partitioned mode */
+
+    uint16_t line_len;
+    uint16_t tilename_len;
+    uint16_t modification_len;
+    uint16_t umi_len;
+};
+
+struct TagArena {
+    char *buf;
+    size_t size, capacity;
+};
+
+#define tag_line(q, t)          ((q)->arena.buf + (t)->line)
+#define tag_modifications(q, t) (tag_line(q, t) + (t)->line_len - \
+                                 (t)->modification_len)
+#define tag_umi(q, t)           (tag_line(q, t) + (t)->line_len)
+
+/* Output lines are collected and written to either stdio or BGZF in chunks. */
+struct OutputBuffer {
+    char *buf;
+    size_t size, capacity;
+    FILE *fp;
+    BGZF *bgzf;
+};
+
+struct TagInfoQueue { /* a circular queue */
+    struct TagInfo *el;
+    struct TagArena arena;
+
+    ssize_t size;
+    ssize_t front;
+    ssize_t rear;
+
+    int num_duplicates;
+    int highest_priority;
+
+    struct OutputBuffer output;
+    struct OutputBuffer traceout;   /* enabled if the BGZF is set */
+    uint64_t next_group;
+
+    /* Results go to the partition instead of the outputs if set. */
+    struct PartitionJob *job;
+};
+
+#define tqueue_length(q)    (((q)->front + (q)->size - (q)->rear) % (q)->size)
+#define tqueue_head(q)      ((q)->el[(q)->front])
+#define tqueue_tail(q)      ((q)->el[(q)->rear])
+#define tqueue_next(q, eln) ((eln + 1) % (q)->size)
+#define tqueue_inc(q)       do { (q)->front = tqueue_next((q), (q)->front); } while(0)
+#define tqueue_dec(q)       do { (q)->rear = tqueue_next((q), (q)->rear); } while(0)
+#define tqueue_isempty(q)   ((q)->front == (q)->rear)
+#define tqueue_isfull(q)    (tqueue_length(q) == (q)->size - 1)
+#define tqueue_foreach(q, v) for ((v) = (q)->rear; (v) != (q)->front; (v) = tqueue_next((q), (v)))
+#define tqueue_empty(q)     do { (q)->rear = (q)->front; } while(0)
+
+/*
+ * A spool keeps records in memory up to its limit and spills the rest to
+ * an unlinked temporary file. Records are read back in the written order.
+ */
+struct Spool {
+    char *buf;
+    size_t size, capacity;
+    size_t limit;
+    const char *tempdir;
+
+    FILE *fp;
+    size_t spilled;
+
+    size_t rspilled, rpos;      /* read positions */
+};
+
+/* Records in the spools of the partitioned mode. Each is followed by the
+ * variable-length fields noted. */
+struct PartitionRecord {        /* + modifications + UMI */
+    uint32_t source;
+    uint32_t clusterno;
+    int32_t flags;
+    int16_t polyA_len;
+    uint16_t modification_len;
+    uint16_t umi_len;
+};
+
+struct PartitionResult {        /* + modifications */
+    uint32_t source;
+    uint32_t clusterno;
+    int32_t flags;
+    int32_t num_duplicates;
+    int16_t polyA_len;
+    uint16_t modification_len;
+};
+
+struct PartitionTraceGroup {    /* + UMI */
+    uint32_t num_entries;
+    uint16_t umi_len;
+};
+
+struct PartitionTraceEntry {
+    uint32_t source;
+    uint32_t clusterno;
+    int32_t value;
+};
+
+struct PartitionJob {
+    struct Spool records;
+    size_t nrecords;
+    pthread_mutex_t lock;       /* for the records while reading inputs */
+
+    /* A partition too large for the memory limit is split by another hash
+     * of UMI into NUM_SUBPARTITIONS partitions, recursively. Their results
+     * are merged back into the spools above once processed. */
+    int depth;
+    struct PartitionJob *subjobs;
+
+    struct Spool results;
+    struct Spool trace_groups;
+    struct Spool trace_entries;
+
+    /* results of the partition being processed */
+    char *resultbuf;
+    size_t resultbuf_size, resultbuf_capacity;
+    size_t *result_offsets;
+    size_t num_results, result_offsets_capacity;
+    uint32_t group_entries;
+    int tracing;
+};
+
+/* tailseq-dedup-perfect.c */
+extern struct TagInfoQueue *tqueue_new(ssize_t size);
+extern void tqueue_free(struct TagInfoQueue *queue);
+extern int tqueue_set_strings(struct TagInfoQueue *queue,
+                              const char *line, size_t line_len,
+                              const char *umi, size_t umi_len);
+extern int tqueue_feed(struct TagInfoQueue *queue);
+extern int process_tag_duplicates(struct TagInfoQueue *queue);
+extern void outbuf_init(struct OutputBuffer *ob, FILE *fp, BGZF *bgzf);
+extern int outbuf_write(struct OutputBuffer *ob, const char *data,
+                        size_t length);
+extern int outbuf_write_int(struct OutputBuffer *ob, int64_t value);
+extern int outbuf_flush(struct OutputBuffer *ob);
+extern void outbuf_free(struct OutputBuffer *ob);
+
+/* spool.c */
+extern void spool_init(struct Spool *sp, const char *tempdir, size_t limit);
+extern int spool_write(struct Spool *sp, const void *data, size_t length);
+extern int spool_rewind(struct Spool *sp);
+extern int spool_read(struct Spool *sp, void *data, size_t length);
+extern char *spool_load(struct Spool *sp, size_t *length);
+extern void spool_free(struct Spool *sp);
+
+/* partitioner.c */
+extern int partition_add_result(struct TagInfoQueue *queue,
+                                const struct TagInfo *taginfo,
+                                int polyA_len, int num_duplicates);
+extern int partition_add_trace(struct TagInfoQueue *queue,
+                               const struct TagInfo *taginfo, int value);
+extern int partition_end_trace_group(struct TagInfoQueue *queue,
+                                     const struct TagInfo *taginfo);
+extern int deduplicate_taginfo_files(char **filenames, int nfiles,
+                                     const char *output_file,
+                                     const char *trace_file,
+                                     const char *tempdir,
+                                     size_t memory_limit, int threads);
+extern int deduplicate_taginfo_stream(const char *output_file,
+                                      const char *trace_file,
+                                      const char *tempdir,
+                                      size_t memory_limit, int threads);
+
+#endif
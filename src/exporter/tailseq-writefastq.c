@@ -33,6 +33,7 @@
 #include <zlib.h>
 #include <htslib/bgzf.h>
 #include "../utils.h"
+#include "../tagpack.h"
 
 #define GZIP_READ_BUFFER_SIZE   1024*1024
 
@@ -106,13 +107,34 @@ parse_taginfo_line(struct TagInfo *taginfo, const char *line)
     return 0;
 }
 
+/* A seqqual file is either text or in the block format. */
+struct SeqQualSource {
+    gzFile fp;
+    struct TagPackReader *packed;
+    char line[LINE_BUFFER_SIZE];
+};
+
+static void
+close_seqqual_source(struct SeqQualSource *src)
+{
+    if (src->fp != NULL) {
+        gzclose(src->fp);
+        src->fp = NULL;
+    }
+
+    if (src->packed != NULL) {
+        close_tagpack(src->packed);
+        src->packed = NULL;
+    }
+}
+
 static int
-exchange_seqqual_handle(gzFile *fp, const char *filename_format, const char *tileid)
+exchange_seqqual_handle(struct SeqQualSource *src, const char *filename_format,
+                        const char *tileid)
 {
     char *filename;
 
-    if (*fp != NULL)
-        gzclose(*fp);
+    close_seqqual_source(src);
 
     filename = replace_placeholder(filename_format, "@tile@", tileid);
     if (filename == NULL) {
@@ -120,123 +142,153 @@ exchange_seqqual_handle(gzFile *fp, const char *filename_format, const char *til
         return -1;
     }
 
-    *fp = gzopen(filename, "rt");
-    if (*fp == NULL) {
-        fprintf(stderr, "Failed to open %s.\n", filename);
-        free(filename);
-        return -1;
+    if (tagpack_probe(filename) == 1) {
+        src->packed = open_tagpack(filename, TAGPACK_TYPE_SEQQUAL);
+        if (src->packed == NULL) {
+            free(filename);
+            return -1;
+        }
+    }
+    else {
+        src->fp = gzopen(filename, "rt");
+        if (src->fp == NULL) {
+            fprintf(stderr, "Failed to open %s.\n", filename);
+            free(filename);
+            return -1;
+        }
     }
 
     free(filename);
     return 0;
 }
 
-static inline int
-read_and_peek_seqqual(gzFile fp, char *line)
+static inline const char *
+locate_seqqual_field(const char *start, int delimiter, int *length)
 {
+    const char *end;
+
+    end = strchr(start, delimiter);
+    if (end == NULL)
+        return NULL;
+
+    *length = (int)(end - start);
+    return end + 1;
+}
+
+static int
+parse_seqqual_line(const char *line, struct TagPackSeqQual *record)
+{
+    const char *pos;
     char *endptr;
-    int clusterno;
+    int length;
 
-    if (gzgets(fp, line, LINE_BUFFER_SIZE) == NULL)
+    record->clusterno = strtoul(line, &endptr, 10);
+    if (endptr == NULL || *endptr != '\t')
         return -1;
 
-    clusterno = (int)strtol(line, &endptr, 10);
-    if (endptr == NULL || *endptr != '\t')
+    record->seq5 = endptr + 1;
+    if ((record->qual5 = locate_seqqual_field(record->seq5, '\t',
+                                              &record->len5)) == NULL ||
+            (record->seq3 = locate_seqqual_field(record->qual5, '\t',
+                                                 &length)) == NULL ||
+            length != record->len5 ||
+            (record->qual3 = locate_seqqual_field(record->seq3, '\t',
+                                                  &record->len3)) == NULL ||
+            (pos = locate_seqqual_field(record->qual3, '\n', &length)) == NULL ||
+            length != record->len3)
         return -1;
 
-    return clusterno;
+    return 0;
 }
 
+/* Reads seqqual entries until the cluster number reaches the given one.
+ * Returns the cluster number of the entry last read, or -1. */
 static int
-write_fastq_entry(BGZF *fastq5out, BGZF *fastq3out,
-                  struct TagInfo *taginfo, const char *seqqual_line,
-                  int verbose_id)
+read_seqqual_entry(struct SeqQualSource *src, int clusterno,
+                   struct TagPackSeqQual *record)
 {
-    char entryname[MAX_ENTRYNAME_LEN];
-    char buf[LINE_BUFFER_SIZE], *bufp, *sqptr_1, *sqptr_2;
-    int entryname_len, seq_len;
-
-    if (verbose_id)
-        entryname_len = snprintf(entryname, MAX_ENTRYNAME_LEN, "%s:%08u:%04x:%d:%d:%s",
-                               taginfo->tilename, (unsigned)taginfo->clusterno,
-                               taginfo->flags, taginfo->num_duplicates, taginfo->polyA_len,
-                               taginfo->modifications);
-    else
-        entryname_len = snprintf(entryname, MAX_ENTRYNAME_LEN, "%s:%08u",
-                                 taginfo->tilename, (unsigned)taginfo->clusterno);
-
-    bufp = buf;
+    if (src->packed != NULL) {
+        /* The block headers let the blocks before the cluster be skipped. */
+        if (tagpack_skip_to(src->packed, clusterno) < 0 ||
+                tagpack_next_seqqual(src->packed, record) <= 0)
+            return -1;
 
-    /* Line 1 of the 5'-side FASTQ */
-    *bufp++ = '@';
-    memcpy(bufp, entryname, entryname_len);
-    bufp += entryname_len;
-    *bufp++ = '\n';
+        return (int)record->clusterno;
+    }
 
-    /* Line 2 of the 5'-side FASTQ */
-    /* - find the tab between cluster no. and 5' seq */
-    sqptr_1 = strchr(seqqual_line, '\t');
-    if (sqptr_1 == NULL)
-        return -1;
+    do {
+        if (gzgets(src->fp, src->line, LINE_BUFFER_SIZE) == NULL ||
+                parse_seqqual_line(src->line, record) < 0)
+            return -1;
+    } while ((int)record->clusterno < clusterno);
 
-    /* - find the tab between 5' seq and 5' qual */
-    sqptr_2 = strchr(++sqptr_1, '\t');
-    if (sqptr_2 == NULL)
-        return -1;
+    return (int)record->clusterno;
+}
 
-    seq_len = (int)(sqptr_2 - sqptr_1);
-    memcpy(bufp, sqptr_1, seq_len);
+static inline char *
+put_fastq_lines(char *bufp, const char *entryname, int entryname_len,
+                const char *seq, const char *qual, int seq_len)
+{
+    /* Line 2 */
+    memcpy(bufp, seq, seq_len);
     bufp += seq_len;
     *bufp++ = '\n';
 
-    /* Line 3 of the 5'-side FASTQ */
+    /* Line 3 */
     *bufp++ = '+';
     memcpy(bufp, entryname, entryname_len);
     bufp += entryname_len;
     *bufp++ = '\n';
 
-    /* Line 4 of the 5'-side FASTQ */
-    sqptr_1 = strchr(++sqptr_2, '\t');
-    if (sqptr_1 == NULL)
-        return -1;
-    if (seq_len != (int)(sqptr_1 - sqptr_2))
-        return -1;
-    memcpy(bufp, sqptr_2, seq_len);
+    /* Line 4 */
+    memcpy(bufp, qual, seq_len);
     bufp += seq_len;
     *bufp++ = '\n';
 
-    if (bgzf_write(fastq5out, buf, (size_t)(bufp - buf)) < 0)
-        return -1;
+    return bufp;
+}
 
+static int
+write_fastq_entry(BGZF *fastq5out, BGZF *fastq3out,
+                  struct TagInfo *taginfo, const struct TagPackSeqQual *seqqual,
+                  int verbose_id)
+{
+    char entryname[MAX_ENTRYNAME_LEN];
+    char buf[LINE_BUFFER_SIZE], *bufp;
+    int entryname_len;
 
-    /* Line 1 of the 3'-side FASTQ. The first line is identical to
-     * 5'-side FASTQ's. Just skip to the first letter of line 2. */
-    bufp = buf + entryname_len + 2;
+    if (verbose_id)
+        entryname_len = snprintf(entryname, MAX_ENTRYNAME_LEN, "%s:%08u:%04x:%d:%d:%s",
+                               taginfo->tilename, (unsigned)taginfo->clusterno,
+                               taginfo->flags, taginfo->num_duplicates, taginfo->polyA_len,
+                               taginfo->modifications);
+    else
+        entryname_len = snprintf(entryname, MAX_ENTRYNAME_LEN, "%s:%08u",
+                                 taginfo->tilename, (unsigned)taginfo->clusterno);
 
-    /* Line 2 of the 3'-side FASTQ */
-    sqptr_2 = strchr(++sqptr_1, '\t');
-    if (sqptr_2 == NULL)
+    if (entryname_len >= MAX_ENTRYNAME_LEN ||
+            (entryname_len + seqqual->len5) * 2 + 6 > LINE_BUFFER_SIZE ||
+            (entryname_len + seqqual->len3) * 2 + 6 > LINE_BUFFER_SIZE)
         return -1;
-    seq_len = (int)(sqptr_2 - sqptr_1);
-    memcpy(bufp, sqptr_1, seq_len);
-    bufp += seq_len;
-    *bufp++ = '\n';
 
-    /* Line 3 of the 3'-side FASTQ */
-    *bufp++ = '+';
+    bufp = buf;
+
+    /* Line 1 of the 5'-side FASTQ */
+    *bufp++ = '@';
     memcpy(bufp, entryname, entryname_len);
     bufp += entryname_len;
     *bufp++ = '\n';
 
-    /* Line 4 of the 3'-side FASTQ */
-    sqptr_1 = strchr(++sqptr_2, '\n');
-    if (sqptr_1 == NULL)
-        return -1;
-    if (seq_len != (int)(sqptr_1 - sqptr_2))
+    bufp = put_fastq_lines(bufp, entryname, entryname_len,
+                           seqqual->seq5, seqqual->qual5, seqqual->len5);
+
+    if (bgzf_write(fastq5out, buf, (size_t)(bufp - buf)) < 0)
         return -1;
-    memcpy(bufp, sqptr_2, seq_len);
-    bufp += seq_len;
-    *bufp++ = '\n';
+
+    /* Line 1 of the 3'-side FASTQ is identical to 5'-side FASTQ's. Just
+     * skip to the first letter of line 2. */
+    bufp = put_fastq_lines(buf + entryname_len + 2, entryname, entryname_len,
+                           seqqual->seq3, seqqual->qual3, seqqual->len3);
 
     return bgzf_write(fastq3out, buf, (size_t)(bufp - buf));
 }
@@ -248,18 +300,20 @@ process_write_fastq(gzFile taginfof, const char *seqqual_filename,
     char tile_current[MAX_TILENAME_LEN];
     char line[LINE_BUFFER_SIZE];
     struct TagInfo taginfo;
+    struct TagPackSeqQual seqqual;
+    struct SeqQualSource seqqualsrc;
     int errnum;
     const char *message;
-    gzFile seqqualf;
 
     tile_current[0] = '\0';
-    seqqualf = NULL;
+    memset(&seqqualsrc, 0, sizeof(seqqualsrc));
 
     for (; gzgets(taginfof, line, LINE_BUFFER_SIZE) != NULL;) {
         int seqqual_clusterno;
 
         if (parse_taginfo_line(&taginfo, line) < 0) {
             fprintf(stderr, "Failed to parse a line: %s", line);
+            close_seqqual_source(&seqqualsrc);
             return -1;
         }
 
@@ -267,42 +321,41 @@ process_write_fastq(gzFile taginfof, const char *seqqual_filename,
         if (tile_current[0] == '\0' || strcmp(tile_current, taginfo.tilename) != 0) {
             strcpy(tile_current, taginfo.tilename);
 
-            if (exchange_seqqual_handle(&seqqualf, seqqual_filename, tile_current) < 0)
+            if (exchange_seqqual_handle(&seqqualsrc, seqqual_filename,
+                                        tile_current) < 0)
                 return -1;
         }
 
-        /* Read lines from the seqqual file until cluster number matches to taginfo's. */
-        do {
-            seqqual_clusterno = read_and_peek_seqqual(seqqualf, line);
-
-            if (seqqual_clusterno < 0) {
-                fprintf(stderr, "Unexpected format in a seqqual file.\n");
-                gzclose(seqqualf);
-                return -1;
-            }
-            else if (seqqual_clusterno > taginfo.clusterno) {
-                fprintf(stderr, "The taginfo file must be a subset of seqqual.\n");
-                gzclose(seqqualf);
-                return -1;
-            }
-        } while (seqqual_clusterno < taginfo.clusterno);
+        /* Read seqqual entries until cluster number matches to taginfo's. */
+        seqqual_clusterno = read_seqqual_entry(&seqqualsrc, taginfo.clusterno,
+                                               &seqqual);
+        if (seqqual_clusterno < 0) {
+            fprintf(stderr, "Unexpected format in a seqqual file.\n");
+            close_seqqual_source(&seqqualsrc);
+            return -1;
+        }
+        else if (seqqual_clusterno > taginfo.clusterno) {
+            fprintf(stderr, "The taginfo file must be a subset of seqqual.\n");
+            close_seqqual_source(&seqqualsrc);
+            return -1;
+        }
 
-        if (write_fastq_entry(fastq5out, fastq3out, &taginfo, line, verbose_id) < 0) {
+        if (write_fastq_entry(fastq5out, fastq3out, &taginfo, &seqqual,
+                              verbose_id) < 0) {
             fprintf(stderr, "Failed to write an entry in %s.\n", tile_current);
-            gzclose(seqqualf);
+            close_seqqual_source(&seqqualsrc);
             return -1;
         }
     }
 
+    close_seqqual_source(&seqqualsrc);
+
     message = gzerror(taginfof, &errnum);
     if (errnum != 0) {
         fprintf(stderr, "process_write_fastq: %s\n", message);
         return -1;
     }
 
-    if (seqqualf != NULL)
-        gzclose(seqqualf);
-
     return 0;
 }
 
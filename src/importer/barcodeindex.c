@@ -0,0 +1,290 @@
+/*
+ * barcodeindex.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Every index sequence within the largest allowed mismatch count of any
+ * barcode is enumerated in advance and kept in an open-addressing hash
+ * table keyed on the 2-bit packed sequence. Each slot remembers the
+ * closest barcode and its distance, or that two or more barcodes are
+ * equally close. A read is then assigned with a single probe.
+ */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "tailseq-import.h"
+
+#define BARCODE_INDEX_EMPTY         UINT64_MAX
+#define BARCODE_INDEX_MAX_LENGTH    31
+#define BARCODE_INDEX_MAX_ENTRIES   (1 << 22)
+
+static inline int
+pack_base(char base)
+{
+    switch (base) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+    }
+}
+
+
+static inline size_t
+hash_packed_index(uint64_t key, int hashbits)
+{
+    return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> (64 - hashbits));
+}
+
+
+static void
+insert_neighbor(struct BarcodeIndex *bindex, uint64_t key,
+                struct SampleInfo *sample, int mismatches)
+{
+    struct BarcodeIndexEntry *entry;
+    size_t slot;
+
+    slot = hash_packed_index(key, bindex->hashbits);
+    for (;;) {
+        entry = &bindex->table[slot];
+        if (entry->key == BARCODE_INDEX_EMPTY) {
+            entry->key = key;
+            entry->sample = sample;
+            entry->mismatches = mismatches;
+            return;
+        }
+        else if (entry->key == key)
+            break;
+
+        slot = (slot + 1) & bindex->hashmask;
+    }
+
+    if (mismatches < entry->mismatches) {
+        entry->sample = sample;
+        entry->mismatches = mismatches;
+    }
+    else if (mismatches == entry->mismatches)
+        entry->sample = NULL; /* two barcodes are equally close */
+}
+
+
+static void
+enumerate_neighbors(struct BarcodeIndex *bindex, struct SampleInfo *sample,
+                    uint64_t key, int firstpos, int mismatches, int maxmismatches)
+{
+    int pos, shift, orig, b;
+
+    insert_neighbor(bindex, key, sample, mismatches);
+    if (mismatches >= maxmismatches)
+        return;
+
+    for (pos = firstpos; pos < bindex->length; pos++) {
+        shift = 2 * (bindex->length - 1 - pos);
+        orig = (key >> shift) & 3;
+
+        for (b = 0; b < 4; b++)
+            if (b != orig)
+                enumerate_neighbors(bindex, sample,
+                        (key & ~((uint64_t)3 << shift)) | ((uint64_t)b << shift),
+                        pos + 1, mismatches + 1, maxmismatches);
+    }
+}
+
+
+/* Number of sequences within the given Hamming distance, or -1 if too many */
+static ssize_t
+count_neighborhood(int length, int maxmismatches)
+{
+    ssize_t total, term;
+    int k;
+
+    total = term = 1;
+    for (k = 1; k <= maxmismatches; k++) {
+        term = term * (length - k + 1) / k * 3;
+        total += term;
+        if (total > BARCODE_INDEX_MAX_ENTRIES)
+            return -1;
+    }
+
+    return total;
+}
+
+
+/*
+ * Returns NULL if the barcodes can't be indexed (non-ACGT barcodes other
+ * than the all-'X' placeholders, no regular barcode, too long indices or
+ * too large neighbourhoods) or memory is short. assign_barcode falls back
+ * to the linear scan in that case.
+ */
+struct BarcodeIndex *
+build_barcode_index(struct SampleInfo *barcodes, int barcode_length)
+{
+    struct BarcodeIndex *bindex;
+    struct SampleInfo *sample;
+    ssize_t neighborhood;
+    size_t capacity, i;
+    int nindexed, maxmismatches;
+
+    if (barcode_length <= 0 || barcode_length > BARCODE_INDEX_MAX_LENGTH)
+        return NULL;
+
+    bindex = malloc(sizeof(*bindex));
+    if (bindex == NULL)
+        return NULL;
+
+    memset(bindex, 0, sizeof(*bindex));
+    bindex->length = barcode_length;
+
+    /* The first entry in barcodes is "Unknown", thus skip it. */
+    nindexed = maxmismatches = 0;
+    for (sample = barcodes->next; sample != NULL; sample = sample->next) {
+        int nonacgt;
+
+        for (i = nonacgt = 0; i < barcode_length; i++)
+            nonacgt += (pack_base(sample->index[i]) < 0);
+
+        if (nonacgt == 0) {
+            nindexed++;
+            if (sample->maximum_index_mismatches > maxmismatches)
+                maxmismatches = sample->maximum_index_mismatches;
+        }
+        else if (nonacgt == barcode_length)
+            /* placeholders never match a read, their distance is fixed */
+            bindex->nplaceholders++;
+        else
+            goto onError;
+    }
+
+    if (nindexed == 0)
+        goto onError;
+
+    if (maxmismatches > barcode_length)
+        maxmismatches = barcode_length;
+
+    neighborhood = count_neighborhood(barcode_length, maxmismatches);
+    if (neighborhood < 0 || neighborhood * nindexed > BARCODE_INDEX_MAX_ENTRIES)
+        goto onError;
+
+    for (capacity = 16, bindex->hashbits = 4;
+         capacity < (size_t)(neighborhood * nindexed) * 2;
+         capacity <<= 1, bindex->hashbits++)
+        /* do nothing */;
+
+    bindex->hashmask = capacity - 1;
+    bindex->table = malloc(sizeof(struct BarcodeIndexEntry) * capacity);
+    if (bindex->table == NULL)
+        goto onError;
+
+    for (i = 0; i < capacity; i++)
+        bindex->table[i].key = BARCODE_INDEX_EMPTY;
+
+    for (sample = barcodes->next; sample != NULL; sample = sample->next) {
+        uint64_t key;
+
+        if (pack_base(sample->index[0]) < 0)
+            continue;
+
+        for (i = 0, key = 0; i < barcode_length; i++)
+            key = (key << 2) | pack_base(sample->index[i]);
+
+        enumerate_neighbors(bindex, sample, key, 0, 0, maxmismatches);
+    }
+
+    return bindex;
+
+  onError:
+    free_barcode_index(bindex);
+    return NULL;
+}
+
+
+void
+free_barcode_index(struct BarcodeIndex *bindex)
+{
+    if (bindex == NULL)
+        return;
+
+    if (bindex->table != NULL)
+        free(bindex->table);
+    free(bindex);
+}
+
+
+/*
+ * Returns 1 and sets *psample (NULL for no assignment) if the index sequence
+ * was resolved, or 0 if it must be matched by the linear scan.
+ */
+int
+lookup_barcode_index(const struct BarcodeIndex *bindex, const char *indexseq,
+                     struct SampleInfo **psample, int *pmismatches)
+{
+    const struct BarcodeIndexEntry *entry;
+    struct SampleInfo *best;
+    uint64_t key;
+    size_t slot;
+    int i, code, bestmismatches;
+
+    for (i = 0, key = 0; i < bindex->length; i++) {
+        code = pack_base(indexseq[i]);
+        if (code < 0)
+            return 0;
+        key = (key << 2) | code;
+    }
+
+    /* An index missing in the table is farther than any allowed mismatches
+     * from every barcode, and still closer to one of them than to the
+     * placeholders. Nothing is assigned then. */
+    best = NULL;
+    bestmismatches = -1;
+
+    slot = hash_packed_index(key, bindex->hashbits);
+    for (entry = &bindex->table[slot]; entry->key != BARCODE_INDEX_EMPTY;
+         slot = (slot + 1) & bindex->hashmask, entry = &bindex->table[slot])
+        if (entry->key == key) {
+            best = entry->sample;
+            bestmismatches = entry->mismatches;
+            break;
+        }
+
+    /* placeholders are exactly as far as the index length */
+    if (bestmismatches == bindex->length && bindex->nplaceholders > 0)
+        best = NULL;
+
+    if (best == NULL || bestmismatches > best->maximum_index_mismatches) {
+        *psample = NULL;
+        *pmismatches = -1;
+    }
+    else {
+        *psample = best;
+        *pmismatches = bestmismatches;
+    }
+
+    return 1;
+}
@@ -31,6 +31,10 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <pthread.h>
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
 #include "tailseq-import.h"
 
 
@@ -41,6 +45,10 @@
 
 static const char CALL_BASES[4] = "ACGT";
 
+/* base and quality characters for every possible BCL byte */
+static char DECODED_BASE[256], DECODED_QUALITY[256];
+static pthread_once_t decoding_tables_initialized = PTHREAD_ONCE_INIT;
+
 
 struct BCLReader *
 open_bcl_file(const char *filename)
@@ -121,6 +129,73 @@ load_bcl_data(struct BCLReader *bcl, struct BCLData *data, uint32_t nclusters)
 }
 
 
+void
+init_bcl_decoding(struct BCLDecodingPool *pool, struct BCLReader **readers,
+                  struct BCLData **data, int ncycles, uint32_t nclusters,
+                  double *decode_time)
+{
+    pool->readers = readers;
+    pool->data = data;
+    pool->ncycles = ncycles;
+    pool->nclusters = nclusters;
+    pool->cycle_next = 0;
+    pool->error_occurred = 0;
+    pool->decode_time = decode_time;
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+
+/* Decompresses the cycles of the pool one at a time until none is left.
+ * Any number of threads may run this on the same pool. Time spent for each
+ * cycle is added to decode_time[cycleno]. */
+void
+run_bcl_decoding(struct BCLDecodingPool *pool)
+{
+    while (1) {
+        double started;
+        int cycleno, r;
+
+        { /* Pick a cycle to decode. */
+            pthread_mutex_lock(&pool->lock);
+
+            if (pool->error_occurred > 0 || pool->cycle_next >= pool->ncycles) {
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+            cycleno = pool->cycle_next++;
+
+            pthread_mutex_unlock(&pool->lock);
+        }
+
+        if (pool->readers[cycleno] == BCLREADER_OVERRIDDEN)
+            continue;
+
+        started = elapsed_seconds();
+        r = load_bcl_data(pool->readers[cycleno], pool->data[cycleno], pool->nclusters);
+
+        /* each cycle is decoded by only one thread */
+        pool->decode_time[cycleno] += elapsed_seconds() - started;
+
+        if (r == -1) {
+            pthread_mutex_lock(&pool->lock);
+            pool->error_occurred++;
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+    }
+}
+
+
+/* No thread may be running run_bcl_decoding() on the pool any more. */
+int
+finish_bcl_decoding(struct BCLDecodingPool *pool)
+{
+    pthread_mutex_destroy(&pool->lock);
+
+    return (pool->error_occurred > 0) ? -1 : 0;
+}
+
+
 struct BCLData *
 new_bcl_data(uint32_t size)
 {
@@ -168,6 +243,122 @@ format_basecalls(char *seq, char *qual, struct BCLData **basecalls,
 }
 
 
+static void
+initialize_decoding_tables(void)
+{
+    int bq;
+
+    DECODED_BASE[0] = NOCALL_BASE;
+    DECODED_QUALITY[0] = NOCALL_QUALITY + PHRED_BASE;
+
+    for (bq = 1; bq < 256; bq++) {
+        DECODED_BASE[bq] = CALL_BASES[bq & 3];
+        DECODED_QUALITY[bq] = (bq >> 2) + PHRED_BASE;
+    }
+}
+
+
+#ifdef USE_SSE2
+static inline void
+transpose_16x16_bytes(__m128i *r)
+{
+    __m128i t[16];
+    int i, round;
+
+    /* Four rounds of perfect shuffles, interleaving row i with row i+8,
+     * turn 16 rows of 16 bytes into 16 columns. */
+    for (round = 0; round < 4; round += 2) {
+        for (i = 0; i < 8; i++) {
+            t[i * 2] = _mm_unpacklo_epi8(r[i], r[i + 8]);
+            t[i * 2 + 1] = _mm_unpackhi_epi8(r[i], r[i + 8]);
+        }
+        for (i = 0; i < 8; i++) {
+            r[i * 2] = _mm_unpacklo_epi8(t[i], t[i + 8]);
+            r[i * 2 + 1] = _mm_unpackhi_epi8(t[i], t[i + 8]);
+        }
+    }
+}
+#endif
+
+
+/* Rewrites the base calls of up to BASECALL_TILE_CLUSTERS clusters from the
+ * cycle-major BCL buffers into NUL-terminated per-cluster sequence and
+ * quality strings. The results are the same as format_basecalls(). */
+void
+transpose_basecalls(struct BasecallTile *tile, struct BCLData **basecalls,
+                    int ncycles, uint32_t first_cluster, uint32_t nclusters)
+{
+    size_t stride;
+    uint32_t cl;
+    int cycle;
+
+    pthread_once(&decoding_tables_initialized, initialize_decoding_tables);
+
+    stride = ncycles + 1;
+    tile->first_cluster = first_cluster;
+    tile->nclusters = nclusters;
+    tile->stride = stride;
+
+    cl = 0;
+
+#ifdef USE_SSE2
+    for (; cl + 16 <= nclusters; cl += 16) {
+        char *seqrow, *qualrow;
+        int k;
+
+        for (cycle = 0; cycle + 16 <= ncycles; cycle += 16) {
+            union {
+                __m128i v[16];
+                uint8_t b[16][16];
+            } blk;
+
+            for (k = 0; k < 16; k++)
+                blk.v[k] = _mm_loadu_si128((const __m128i *)
+                        (basecalls[cycle + k]->basequality + first_cluster + cl));
+
+            transpose_16x16_bytes(blk.v);
+
+            for (k = 0; k < 16; k++) {
+                const uint8_t *bq = blk.b[k];
+                int j;
+
+                seqrow = tile->seq + (cl + k) * stride + cycle;
+                qualrow = tile->qual + (cl + k) * stride + cycle;
+                for (j = 0; j < 16; j++) {
+                    seqrow[j] = DECODED_BASE[bq[j]];
+                    qualrow[j] = DECODED_QUALITY[bq[j]];
+                }
+            }
+        }
+
+        /* cycles left after the last 16-cycle group */
+        for (; cycle < ncycles; cycle++) {
+            const uint8_t *bq = basecalls[cycle]->basequality + first_cluster + cl;
+
+            for (k = 0; k < 16; k++) {
+                tile->seq[(cl + k) * stride + cycle] = DECODED_BASE[bq[k]];
+                tile->qual[(cl + k) * stride + cycle] = DECODED_QUALITY[bq[k]];
+            }
+        }
+    }
+#endif
+
+    if (cl < nclusters)
+        for (cycle = 0; cycle < ncycles; cycle++) {
+            const uint8_t *bq = basecalls[cycle]->basequality + first_cluster;
+            uint32_t i;
+
+            for (i = cl; i < nclusters; i++) {
+                tile->seq[i * stride + cycle] = DECODED_BASE[bq[i]];
+                tile->qual[i * stride + cycle] = DECODED_QUALITY[bq[i]];
+            }
+        }
+
+    for (cl = 0; cl < nclusters; cl++)
+        tile->seq[cl * stride + ncycles] = tile->qual[cl * stride + ncycles] = 0;
+}
+
+
 struct BCLReader **
 open_bcl_readers(const char *msgprefix, const char *datadir, int lane, int tile, int ncycles,
                  struct AlternativeCallInfo *altcalls)
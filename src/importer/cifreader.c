@@ -31,14 +31,52 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stddef.h>
 #include "tailseq-import.h"
 
 
 #define CIF_HEADER_SIZE 13
 
 
+/* Maps the whole CIF file into memory. The reader keeps using stdio when
+ * the file system refuses to map it. */
+static int
+map_cif_file(struct CIFReader *cif, const char *filename)
+{
+    struct stat st;
+    size_t required;
+    void *mapped;
+
+    if (fstat(fileno(cif->fptr), &st) != 0)
+        return 0;
+
+    required = CIF_HEADER_SIZE + (size_t)cif->nclusters * NUM_CHANNELS * sizeof(int16_t);
+    if ((size_t)st.st_size < required) {
+        fprintf(stderr, "CIF file %s is truncated.\n", filename);
+        return -1;
+    }
+
+    mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(cif->fptr), 0);
+    if (mapped == MAP_FAILED)
+        return 0;
+
+    /* Every channel is read front to back, block by block. Let the kernel read
+     * ahead aggressively and drop the pages that are already consumed. */
+    madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+
+    cif->mapped = mapped;
+    cif->mapped_size = st.st_size;
+
+    return 0;
+}
+
+
 struct CIFReader *
-open_cif_file(const char *filename)
+open_cif_file(const char *filename, int use_mmap)
 {
     FILE *fp;
     struct CIFReader *hdl;
@@ -94,6 +132,11 @@ open_cif_file(const char *filename)
     hdl->read = 0;
     hdl->readbuf = NULL;
     hdl->readbuf_size = 0;
+    hdl->mapped = NULL;
+    hdl->mapped_size = 0;
+
+    if (use_mmap && map_cif_file(hdl, filename) == -1)
+        goto onError;
 
     return hdl;
 
@@ -107,6 +150,9 @@ open_cif_file(const char *filename)
 void
 close_cif_file(struct CIFReader *cif)
 {
+    if (cif->mapped != NULL)
+        munmap((void *)cif->mapped, cif->mapped_size);
+
     if (cif->readbuf != NULL)
         free(cif->readbuf);
 
@@ -117,38 +163,129 @@ close_cif_file(struct CIFReader *cif)
 }
 
 
-int
-load_cif_data(struct CIFReader *cif, struct CIFData *data, uint32_t nclusters)
+/* Copies the intensities of a cycle from channel-major runs of little-endian
+ * values into the lane sets of the blocked layout. All channels of a lane set
+ * are written at once, since consecutive lane sets of a cycle are ncycles
+ * sets apart. */
+static void
+scatter_cycle_to_lanes(struct CIFData *data, int cycleno, const uint8_t **chanptr,
+                       uint32_t count)
 {
-    uint32_t toread, i;
+    struct IntensityLaneSet *lanes;
+    uint32_t i;
+
+    lanes = &data->lanes[cycleno];
+
+    for (i = 0; i < count; i += INTENSITY_LANES, lanes += data->ncycles) {
+        uint32_t j, n;
+        int chan;
+
+        n = (count - i < INTENSITY_LANES) ? count - i : INTENSITY_LANES;
+
+        for (chan = 0; chan < NUM_CHANNELS; chan++) {
+            const uint8_t *src = chanptr[chan] + i * sizeof(int16_t);
+            int16_t *dst = lanes->value[chan];
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+            memcpy(dst, src, n * sizeof(int16_t));
+#else
+            for (j = 0; j < n; j++)
+                dst[j] = (int16_t)(src[j * 2] | (src[j * 2 + 1] << 8));
+#endif
+            for (j = n; j < INTENSITY_LANES; j++)
+                dst[j] = 0;
+        }
+    }
+}
+
+
+static void
+load_mapped_cif_data(struct CIFReader *cif, struct CIFData *data, int cycleno,
+                     uint32_t toread)
+{
+    const uint8_t *chanptr[NUM_CHANNELS];
+    uint32_t nextread;
     int chan;
 
-    if (cif->read >= cif->nclusters) {
-        data->nclusters = 0;
-        return 0;
+    for (chan = 0; chan < NUM_CHANNELS; chan++)
+        chanptr[chan] = cif->mapped + CIF_HEADER_SIZE +
+                        ((size_t)cif->nclusters * chan + cif->read) * sizeof(int16_t);
+
+    scatter_cycle_to_lanes(data, cycleno, chanptr, toread);
+
+    /* ask for the pages of the next block while this one is being analyzed */
+    nextread = cif->nclusters - cif->read - toread;
+    if (nextread > toread)
+        nextread = toread;
+
+    if (nextread > 0) {
+        long pagesize;
+
+        pagesize = sysconf(_SC_PAGESIZE);
+
+        for (chan = 0; chan < NUM_CHANNELS; chan++) {
+            uintptr_t start, end;
+
+            start = (uintptr_t)(chanptr[chan] + toread * sizeof(int16_t));
+            end = start + nextread * sizeof(int16_t);
+            start -= start % pagesize;
+            madvise((void *)start, end - start, MADV_WILLNEED);
+        }
     }
+}
+
 
-    if (cif->read + nclusters >= cif->nclusters) /* does file has enough clusters to read? */
+/* Loads the next block of clusters from a CIF file of a cycle into the
+ * cycleno-th cycle of the blocked intensity buffer. */
+int
+load_cif_data(struct CIFReader *cif, struct CIFData *data, int cycleno, uint32_t nclusters)
+{
+    const uint8_t *chanptr[NUM_CHANNELS];
+    uint32_t toread;
+    int chan;
+
+    if (cif->read >= cif->nclusters)
+        toread = 0;
+    else if (cif->read + nclusters >= cif->nclusters) /* does file has enough clusters to read? */
         toread = cif->nclusters - cif->read; /* all clusters left */
     else
         toread = nclusters;
 
+    if (cycleno == 0)
+        data->nclusters = toread;
+    else if (data->nclusters != toread) {
+        fprintf(stderr, "Inconsistent number of clusters in CIF cycle %d.\n",
+                cif->first_cycle);
+        return -1;
+    }
+
+    if (toread == 0)
+        return 0;
+
+    if (cif->mapped != NULL) {
+        load_mapped_cif_data(cif, data, cycleno, toread);
+        cif->read += toread;
+        return 0;
+    }
+
     if (cif->readbuf_size < toread) {
         free(cif->readbuf);
         cif->readbuf = NULL;
         cif->readbuf_size = 0;
     }
 
+    /* readbuf_size counts the values of a channel */
     if (cif->readbuf == NULL) {
-        cif->readbuf = calloc(toread, sizeof(int16_t));
+        cif->readbuf = calloc((size_t)toread * NUM_CHANNELS, sizeof(int16_t));
         if (cif->readbuf == NULL) {
             perror("load_cif_data");
             return -1;
         }
+        cif->readbuf_size = toread;
     }
 
-    data->nclusters = toread;
     for (chan = 0; chan < NUM_CHANNELS; chan++) {
+        int16_t *chanbuf = cif->readbuf + (size_t)toread * chan;
         long readpos;
 
         readpos = CIF_HEADER_SIZE + (cif->nclusters * chan + cif->read) * sizeof(int16_t);
@@ -157,15 +294,16 @@ load_cif_data(struct CIFReader *cif, struct CIFData *data, uint32_t nclusters)
             return -1;
         }
 
-        if (fread(cif->readbuf, sizeof(int16_t), toread, cif->fptr) != toread) {
+        if (fread(chanbuf, sizeof(int16_t), toread, cif->fptr) != toread) {
             fprintf(stderr, "Not all data were loaded from a CIF.\n");
             return -1;
         }
 
-        for (i = 0; i < toread; i++)
-            data->intensity[i].value[chan] = le16toh(cif->readbuf[i]);
+        chanptr[chan] = (const uint8_t *)chanbuf;
     }
 
+    scatter_cycle_to_lanes(data, cycleno, chanptr, toread);
+
     cif->read += toread;
 
     return 0;
@@ -173,17 +311,21 @@ load_cif_data(struct CIFReader *cif, struct CIFData *data, uint32_t nclusters)
 
 
 struct CIFData *
-new_cif_data(uint32_t size)
+new_cif_data(uint32_t size, int ncycles)
 {
     struct CIFData *cdata;
+    size_t ngroups;
 
-    cdata = malloc(sizeof(size_t) + sizeof(struct IntensitySet) * size);
+    ngroups = (size + INTENSITY_LANES - 1) / INTENSITY_LANES;
+    cdata = malloc(offsetof(struct CIFData, lanes) +
+                   sizeof(struct IntensityLaneSet) * ngroups * ncycles);
     if (cdata == NULL) {
         perror("new_cif_data");
         return NULL;
     }
 
     cdata->nclusters = 0;
+    cdata->ncycles = ncycles;
     return cdata;
 }
 
@@ -196,26 +338,28 @@ free_cif_data(struct CIFData *data)
 
 
 void
-fetch_intensity(struct IntensitySet *signalout, struct CIFData **intensities,
+fetch_intensity(struct IntensitySet *signalout, struct CIFData *intensities,
                 int firstcycle, int ncycles, uint32_t clusterno)
 {
-    int i;
-
-    for (i = 0; i < ncycles; i++) {
-        int16_t *valueset;
-
-        valueset = intensities[firstcycle + i]->intensity[clusterno].value;
-        signalout[i].value[0] = valueset[0];
-        signalout[i].value[1] = valueset[1];
-        signalout[i].value[2] = valueset[2];
-        signalout[i].value[3] = valueset[3];
+    const struct IntensityLaneSet *lanes;
+    int i, lane;
+
+    /* all cycles of a cluster are in a single run of lane sets */
+    lanes = CIFDATA_LANESET(intensities, clusterno, firstcycle);
+    lane = clusterno % INTENSITY_LANES;
+
+    for (i = 0; i < ncycles; i++, lanes++) {
+        signalout[i].value[0] = lanes->value[0][lane];
+        signalout[i].value[1] = lanes->value[1][lane];
+        signalout[i].value[2] = lanes->value[2][lane];
+        signalout[i].value[3] = lanes->value[3][lane];
     }
 }
 
 
 struct CIFReader **
 open_cif_readers(const char *msgprefix, const char *datadir, int lane, int tile,
-                 int firstcycle, int ncycles)
+                 int firstcycle, int ncycles, int use_mmap)
 {
     char path[PATH_MAX];
     struct CIFReader **readers;
@@ -237,7 +381,7 @@ open_cif_readers(const char *msgprefix, const char *datadir, int lane, int tile,
         snprintf(path, PATH_MAX, "%s/L%03d/C%d.1/s_%d_%04d.cif", datadir, lane, cycleno,
                  lane, tile);
 
-        readers[i] = open_cif_file(path);
+        readers[i] = open_cif_file(path, use_mmap);
         if (readers[i] == NULL) {
             while (--i >= 0)
                 close_cif_file(readers[i]);
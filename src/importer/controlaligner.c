@@ -39,6 +39,9 @@
 
 
 #define CONTROL_SEQUENCE_SPACING            20 /* space between forward and reverse strands */
+#define CONTROL_SEED_MAX_HITS               256
+#define CONTROL_SEED_DIAGONAL_BAND          16 /* diagonal spread of seeds in a candidate */
+#define CONTROL_SEED_WINDOW_PADDING         16 /* covers the longest gap above the minimum score */
 
 
 static const int8_t DNABASE2NUM[128] = {
@@ -106,42 +109,261 @@ load_control_sequence(int8_t **control_seq)
 }
 
 
+static inline size_t
+hash_seed(uint32_t key, int hashbits)
+{
+    return (size_t)((key * 0x9e3779b1U) >> (32 - hashbits));
+}
+
+
+static int32_t
+lookup_seed(const struct ControlSeedIndex *seeds, uint32_t key)
+{
+    size_t slot;
+
+    for (slot = hash_seed(key, seeds->hashbits); seeds->seed_heads[slot] >= 0;
+         slot = (slot + 1) & seeds->hashmask)
+        if (seeds->seed_keys[slot] == key)
+            return seeds->seed_heads[slot];
+
+    return -1;
+}
+
+
+static int
+build_seed_index(struct ControlFilterInfo *ctlinfo)
+{
+    struct ControlSeedIndex *seeds=&ctlinfo->seeds;
+    uint32_t key, keymask;
+    size_t capacity, slot;
+    ssize_t i;
+    int valid;
+
+    for (capacity = 16, seeds->hashbits = 4;
+         capacity < (size_t)ctlinfo->control_seq_length * 2;
+         capacity <<= 1, seeds->hashbits++)
+        /* do nothing */;
+
+    seeds->hashmask = capacity - 1;
+    seeds->seed_keys = malloc(sizeof(uint32_t) * capacity);
+    seeds->seed_heads = malloc(sizeof(int32_t) * capacity);
+    seeds->seed_next = malloc(sizeof(int32_t) * ctlinfo->control_seq_length);
+    if (seeds->seed_keys == NULL || seeds->seed_heads == NULL || seeds->seed_next == NULL) {
+        perror("build_seed_index");
+        return -1;
+    }
+
+    for (slot = 0; slot < capacity; slot++)
+        seeds->seed_heads[slot] = -1;
+
+    keymask = (ctlinfo->seed_length >= 16) ? UINT32_MAX :
+              ((uint32_t)1 << (2 * ctlinfo->seed_length)) - 1;
+
+    /* Insert from the end so that each chain is sorted by the position. */
+    for (i = ctlinfo->control_seq_length - 1, key = 0, valid = 0; i >= 0; i--) {
+        int8_t base=ctlinfo->control_seq[i];
+
+        if (base >= 4) {
+            valid = 0;
+            continue;
+        }
+
+        key = (key >> 2) | ((uint32_t)base << (2 * ctlinfo->seed_length - 2));
+        if (++valid < ctlinfo->seed_length)
+            continue;
+
+        for (slot = hash_seed(key & keymask, seeds->hashbits);
+             seeds->seed_heads[slot] >= 0 && seeds->seed_keys[slot] != (key & keymask);
+             slot = (slot + 1) & seeds->hashmask)
+            /* do nothing */;
+
+        seeds->seed_next[i] = seeds->seed_heads[slot];
+        seeds->seed_keys[slot] = key & keymask;
+        seeds->seed_heads[slot] = i;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Same as searching the read in both strands with my_strnstr. An exact match
+ * must start with a seed found in the control, thus only those positions
+ * are compared.
+ */
+static int
+find_exact_control_match(struct ControlFilterInfo *control_info,
+                         const char *sequence_read)
+{
+    ssize_t strandlen, pos;
+    uint32_t key;
+    int i;
+
+    if (control_info->read_length < control_info->seed_length)
+        return (my_strnstr(phix_control_sequence, sequence_read,
+                           control_info->read_length) != NULL ||
+                my_strnstr(phix_control_sequence_rev, sequence_read,
+                           control_info->read_length) != NULL);
+
+    for (i = 0, key = 0; i < control_info->seed_length; i++) {
+        int8_t base=DNABASE2NUM[(int)sequence_read[i]];
+
+        if (base >= 4)
+            return 0;
+        key = (key << 2) | base;
+    }
+
+    strandlen = (control_info->control_seq_length - CONTROL_SEQUENCE_SPACING) / 2;
+
+    for (pos = lookup_seed(&control_info->seeds, key); pos >= 0;
+         pos = control_info->seeds.seed_next[pos]) {
+        const char *strand;
+        ssize_t strandpos;
+
+        if (pos < strandlen) {
+            strand = phix_control_sequence;
+            strandpos = pos;
+        }
+        else {
+            strand = phix_control_sequence_rev;
+            strandpos = pos - strandlen - CONTROL_SEQUENCE_SPACING;
+        }
+
+        if (strandpos + control_info->read_length <= strandlen &&
+                memcmp(strand + strandpos, sequence_read, control_info->read_length) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Collects the diagonals (control position - read position) of all seed hits
+ * in the read, sorted. Returns the number of hits.
+ */
+static int
+collect_seed_diagonals(struct ControlFilterInfo *control_info, const int8_t *read_seq,
+                       int32_t *diagonals)
+{
+    uint32_t key, keymask;
+    int i, valid, nhits;
+
+    keymask = (control_info->seed_length >= 16) ? UINT32_MAX :
+              ((uint32_t)1 << (2 * control_info->seed_length)) - 1;
+
+    for (i = valid = nhits = 0, key = 0; i < control_info->read_length; i++) {
+        int32_t pos;
+
+        if (read_seq[i] >= 4) {
+            valid = 0;
+            continue;
+        }
+
+        key = ((key << 2) | read_seq[i]) & keymask;
+        if (++valid < control_info->seed_length)
+            continue;
+
+        for (pos = lookup_seed(&control_info->seeds, key);
+             pos >= 0 && nhits < CONTROL_SEED_MAX_HITS;
+             pos = control_info->seeds.seed_next[pos])
+            diagonals[nhits++] = pos - (i - control_info->seed_length + 1);
+    }
+
+    /* insertion sort; qsort may allocate and hits are few for usual seeds */
+    for (i = 1; i < nhits; i++) {
+        int32_t diag=diagonals[i];
+        int j;
+
+        for (j = i; j > 0 && diagonals[j - 1] > diag; j--)
+            diagonals[j] = diagonals[j - 1];
+        diagonals[j] = diag;
+    }
+
+    return nhits;
+}
+
+
+static int
+align_read_to_control(struct ControlFilterInfo *control_info,
+                      struct ControlAlignerContext *aligner,
+                      const int8_t *ref, int32_t reflen)
+{
+    int32_t score;
+
+    score = ssw_align_score(aligner->profile, ref, reflen,
+                            CONTROL_ALIGN_GAP_OPEN_SCORE,
+                            CONTROL_ALIGN_GAP_EXTENSION_SCORE,
+                            control_info->control_alignment_mask_len);
+
+    return (score >= control_info->min_control_alignment_score);
+}
+
+
 int
 try_alignment_to_control(struct ControlFilterInfo *control_info,
+                         struct ControlAlignerContext *aligner,
                          const char *sequence_read)
 {
-    s_profile *alnprof;
-    s_align *alnresult;
-    int8_t read_seq[control_info->read_length];
+    int8_t *read_seq=aligner->read_seq;
+    int32_t diagonals[CONTROL_SEED_MAX_HITS];
     size_t i, j;
-    int r;
+    int r, nhits, first, last;
 
     /* fast path for perfect matches */
-    if (my_strnstr(phix_control_sequence, sequence_read, control_info->read_length) != NULL ||
-        my_strnstr(phix_control_sequence_rev, sequence_read, control_info->read_length) != NULL)
+    if (control_info->seed_length > 0) {
+        if (find_exact_control_match(control_info, sequence_read))
+            return 1;
+    }
+    else if (my_strnstr(phix_control_sequence, sequence_read, control_info->read_length) != NULL ||
+             my_strnstr(phix_control_sequence_rev, sequence_read, control_info->read_length) != NULL)
         return 1;
 
     for (i = 0, j = control_info->first_cycle; i < control_info->read_length; i++, j++)
         read_seq[i] = DNABASE2NUM[(int)sequence_read[j]];
 
-    alnprof = ssw_init(read_seq, control_info->read_length, control_info->ssw_score_mat, 5, 0);
-    if (alnprof == NULL) {
-        perror("try_alignment_to_control");
-        return -1;
+    nhits = 0;
+    if (control_info->seed_length > 0) {
+        /* reads sharing too few seeds with the control are not aligned at all */
+        nhits = collect_seed_diagonals(control_info, read_seq, diagonals);
+        if (nhits < control_info->min_seed_hits || nhits == 0)
+            return 0;
     }
 
-    alnresult = ssw_align(alnprof, control_info->control_seq,
-                          control_info->control_seq_length,
-                          CONTROL_ALIGN_GAP_OPEN_SCORE,
-                          CONTROL_ALIGN_GAP_EXTENSION_SCORE, 2,
-                          control_info->min_control_alignment_score,
-                          0, control_info->control_alignment_mask_len);
-    r = (alnresult != NULL && alnresult->score1 >= control_info->min_control_alignment_score);
-
-    if (alnresult != NULL)
-        align_destroy(alnresult);
+    if (ssw_reinit(aligner->profile, read_seq, control_info->read_length,
+                   control_info->ssw_score_mat) < 0) {
+        fprintf(stderr, "Failed to load a read into the control aligner.\n");
+        return -1;
+    }
 
-    init_destroy(alnprof);
+    /* Too short seeds hit everywhere; one full alignment is cheaper then. */
+    if (control_info->seed_length == 0 || nhits >= CONTROL_SEED_MAX_HITS)
+        r = align_read_to_control(control_info, aligner, control_info->control_seq,
+                                  control_info->control_seq_length);
+    else
+        /* Align to a narrow window around each group of seeds on nearby
+         * diagonals until one of them passes. */
+        for (first = 0, r = 0; first < nhits && !r; first = last) {
+            int32_t wbegin, wend;
+
+            for (last = first + 1; last < nhits &&
+                    diagonals[last] - diagonals[first] <= CONTROL_SEED_DIAGONAL_BAND; last++)
+                /* do nothing */;
+
+            if (last - first < control_info->min_seed_hits)
+                continue;
+
+            wbegin = diagonals[first] - CONTROL_SEED_WINDOW_PADDING;
+            wend = diagonals[last - 1] + control_info->read_length +
+                   CONTROL_SEED_WINDOW_PADDING;
+            if (wbegin < 0)
+                wbegin = 0;
+            if (wend > control_info->control_seq_length)
+                wend = control_info->control_seq_length;
+
+            r = align_read_to_control(control_info, aligner,
+                                      control_info->control_seq + wbegin, wend - wbegin);
+        }
 
     return r;
 }
@@ -153,6 +375,7 @@ initialize_control_aligner(struct ControlFilterInfo *ctlinfo)
     ctlinfo->control_seq = NULL;
     ctlinfo->control_seq_length = -1;
     ctlinfo->control_alignment_mask_len = ctlinfo->min_control_alignment_score = -1;
+    memset(&ctlinfo->seeds, 0, sizeof(ctlinfo->seeds));
 
     if (ctlinfo->name[0] != '\0') {
         initialize_ssw_score_matrix(ctlinfo->ssw_score_mat,
@@ -166,6 +389,9 @@ initialize_control_aligner(struct ControlFilterInfo *ctlinfo)
         ctlinfo->min_control_alignment_score =
                 ctlinfo->read_length * CONTROL_ALIGN_MINIMUM_SCORE;
         ctlinfo->control_alignment_mask_len = ctlinfo->read_length / 2;
+
+        if (ctlinfo->seed_length > 0 && build_seed_index(ctlinfo) < 0)
+            return -1;
     }
 
     return 0;
@@ -178,4 +404,52 @@ free_control_aligner(struct ControlFilterInfo *ctlinfo)
         free(ctlinfo->control_seq);
         ctlinfo->control_seq = NULL;
     }
+
+    if (ctlinfo->seeds.seed_keys != NULL)
+        free(ctlinfo->seeds.seed_keys);
+    if (ctlinfo->seeds.seed_heads != NULL)
+        free(ctlinfo->seeds.seed_heads);
+    if (ctlinfo->seeds.seed_next != NULL)
+        free(ctlinfo->seeds.seed_next);
+    memset(&ctlinfo->seeds, 0, sizeof(ctlinfo->seeds));
+}
+
+
+/*
+ * Each worker thread aligns with its own context. The profile and the
+ * scratch memory are sized for the control read length and the whole
+ * control sequence once, and re-filled in place for every read.
+ */
+struct ControlAlignerContext *
+new_control_aligner_context(struct ControlFilterInfo *ctlinfo)
+{
+    struct ControlAlignerContext *aligner;
+
+    aligner = malloc(sizeof(*aligner));
+    if (aligner == NULL) {
+        perror("new_control_aligner_context");
+        return NULL;
+    }
+
+    aligner->read_seq = malloc(ctlinfo->read_length > 0 ? ctlinfo->read_length : 1);
+    aligner->profile = ssw_init_reusable(ctlinfo->read_length, ctlinfo->control_seq_length,
+                                         CONTROL_ALIGN_BASE_COUNT);
+    if (aligner->read_seq == NULL || aligner->profile == NULL) {
+        perror("new_control_aligner_context");
+        free_control_aligner_context(aligner);
+        return NULL;
+    }
+
+    return aligner;
+}
+
+
+void
+free_control_aligner_context(struct ControlAlignerContext *aligner)
+{
+    if (aligner->profile != NULL)
+        init_destroy(aligner->profile);
+    if (aligner->read_seq != NULL)
+        free(aligner->read_seq);
+    free(aligner);
 }
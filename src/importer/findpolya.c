@@ -34,8 +34,9 @@
 #include "tailseq-import.h"
 
 
-uint32_t
-find_polya(const char *seq, size_t seqlen, struct PolyAFinderParameters *params)
+/* Tries every pair of [i, j]. This is the original reference routine. */
+static uint32_t
+find_polya_exhaustive(const char *seq, size_t seqlen, struct PolyAFinderParameters *params)
 {
     short *polyA_weights, *nonA_weights;
     int max_term_mod, nonA_score;
@@ -84,3 +85,75 @@ find_polya(const char *seq, size_t seqlen, struct PolyAFinderParameters *params)
     else
         return ((uint32_t)best_i << 16) | (best_j + 1);
 }
+
+
+/*
+ * The score of [i, j] is nonA[0..i) + polyA[i..j], which is
+ * (N[i] - P[i]) + P[j + 1] with prefix sums N and P. For each i, the best
+ * j is found from the running maximum of P over the allowed ends, scanned
+ * from the right. Ties are resolved toward the smallest i and then the
+ * smallest j, just like the strict comparisons of the exhaustive scan.
+ */
+static uint32_t
+find_polya_linear(const char *seq, size_t seqlen, struct PolyAFinderParameters *params)
+{
+    int polyA_prefix[seqlen + 1], best_end_score[seqlen + 2], best_end[seqlen + 2];
+    int max_term_mod, min_len, nonA_score;
+    int best_i, best_j, best_score;
+    int i, t;
+
+    max_term_mod = params->max_terminal_modifications;
+    min_len = (params->min_polya_length > 1) ? params->min_polya_length : 1;
+
+    if (seqlen < max_term_mod)
+        max_term_mod = seqlen;
+
+    polyA_prefix[0] = 0;
+    for (t = 0; t < seqlen; t++)
+        polyA_prefix[t + 1] = polyA_prefix[t] + params->weights_polyA[(int)seq[t]];
+
+    /* best_end_score[t] = max(P[t..seqlen]) at its leftmost position */
+    best_end_score[seqlen + 1] = INT_MIN;
+    best_end[seqlen + 1] = -1;
+    for (t = seqlen; t >= 1; t--)
+        if (polyA_prefix[t] >= best_end_score[t + 1]) {
+            best_end_score[t] = polyA_prefix[t];
+            best_end[t] = t;
+        }
+        else {
+            best_end_score[t] = best_end_score[t + 1];
+            best_end[t] = best_end[t + 1];
+        }
+
+    best_i = best_j = -1;
+    best_score = -1;
+    nonA_score = 0;
+
+    for (i = 0; i < max_term_mod && i + min_len <= seqlen; i++) {
+        int scoresum;
+
+        scoresum = nonA_score - polyA_prefix[i] + best_end_score[i + min_len];
+        if (scoresum > best_score) {
+            best_i = i;
+            best_j = best_end[i + min_len] - 1;
+            best_score = scoresum;
+        }
+
+        nonA_score += params->weights_nonA[(int)seq[i]];
+    }
+
+    if (best_i < 0 || best_score < 1)
+        return 0;
+    else
+        return ((uint32_t)best_i << 16) | (best_j + 1);
+}
+
+
+uint32_t
+find_polya(const char *seq, size_t seqlen, struct PolyAFinderParameters *params)
+{
+    if (params->exhaustive_search)
+        return find_polya_exhaustive(seq, seqlen, params);
+    else
+        return find_polya_linear(seq, seqlen, params);
+}
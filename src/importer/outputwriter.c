@@ -0,0 +1,469 @@
+/*
+ * outputwriter.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Workers fill an output batch per job and hand it to the writer thread
+ * without waiting for the jobs before it. The writer puts the batches into
+ * the streams in the job order. A worker blocks only when its job is too
+ * far ahead of the writer, which bounds the memory used by the write
+ * buffers.
+ */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "tailseq-import.h"
+
+
+static int
+write_batch(struct TailseekerConfig *cfg, struct OutputBatch *batch)
+{
+    struct SampleInfo *sample;
+
+    for (sample = cfg->samples; sample != NULL; sample = sample->next) {
+        struct WriteBuffer *wb = &batch->buffers[sample->numindex];
+
+        if (sample->stream_seqqual != NULL && wb->seqqual.size > 0 &&
+                bgzf_write(sample->stream_seqqual, wb->seqqual.data,
+                           wb->seqqual.size) < 0)
+            return -1;
+
+        if (sample->stream_taginfo != NULL && wb->taginfo.size > 0 &&
+                bgzf_write(sample->stream_taginfo, wb->taginfo.data,
+                           wb->taginfo.size) < 0)
+            return -1;
+
+        if (sample->stream_signal != NULL && wb->signal.size > 0 &&
+                bgzf_write(sample->stream_signal, wb->signal.data,
+                           wb->signal.size) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/* Puts the queued batches back to the free list without writing them.
+ * Called with the lock held. */
+static void
+discard_queued_batches(struct OutputWriter *writer)
+{
+    int slot;
+
+    for (slot = 0; slot < writer->nbatches; slot++)
+        if (writer->queue[slot] != NULL) {
+            writer->queue[slot]->next = writer->freelist;
+            writer->freelist = writer->queue[slot];
+            writer->queue[slot] = NULL;
+        }
+
+    pthread_cond_broadcast(&writer->released);
+}
+
+
+static void *
+run_output_writer(void *arg)
+{
+    struct OutputWriter *writer = (struct OutputWriter *)arg;
+    struct OutputBatch *batch;
+    int slot;
+
+    pthread_mutex_lock(&writer->lock);
+
+    while (1) {
+        slot = writer->batches_written % writer->nbatches;
+
+        while (writer->queue[slot] == NULL && writer->error_occurred == 0 &&
+                !(writer->finishing &&
+                  writer->batches_written == writer->batches_reserved))
+            pthread_cond_wait(&writer->submitted, &writer->lock);
+
+        if (writer->error_occurred > 0) {
+            discard_queued_batches(writer);
+            break;
+        }
+
+        if (writer->queue[slot] == NULL)
+            break;
+
+        batch = writer->queue[slot];
+        writer->queue[slot] = NULL;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (write_batch(writer->cfg, batch) < 0) {
+            perror("run_output_writer");
+            abort_output_writer(writer);
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        batch->next = writer->freelist;
+        writer->freelist = batch;
+        writer->batches_written++;
+        pthread_cond_broadcast(&writer->released);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+
+static void
+free_output_batches(struct OutputWriter *writer)
+{
+    int i, j;
+
+    if (writer->batches != NULL) {
+        for (i = 0; i < writer->nbatches; i++) {
+            struct WriteBuffer *buffers = writer->batches[i].buffers;
+
+            if (buffers == NULL)
+                continue;
+
+            for (j = 0; j < writer->cfg->num_samples; j++) {
+                if (buffers[j].seqqual.data != NULL)
+                    free(buffers[j].seqqual.data);
+                if (buffers[j].taginfo.data != NULL)
+                    free(buffers[j].taginfo.data);
+                if (buffers[j].signal.data != NULL)
+                    free(buffers[j].signal.data);
+            }
+            free(buffers);
+        }
+        free(writer->batches);
+    }
+
+    if (writer->queue != NULL)
+        free(writer->queue);
+}
+
+
+/*
+ * Makes room for maxlen more bytes and returns where to append. The caller
+ * updates obuf->size after writing. Returns NULL if memory is short.
+ */
+char *
+reserve_output_buffer(struct OutputBuffer *obuf, size_t maxlen)
+{
+    if (obuf->size + maxlen > obuf->capacity) {
+        size_t newcapacity;
+        char *newdata;
+
+        newcapacity = (obuf->capacity > 0) ? obuf->capacity :
+                      OUTPUT_BUFFER_INITIAL_RECORDS * maxlen;
+        while (newcapacity < obuf->size + maxlen)
+            newcapacity *= 2;
+
+        newdata = realloc(obuf->data, newcapacity);
+        if (newdata == NULL) {
+            perror("reserve_output_buffer");
+            return NULL;
+        }
+
+        obuf->data = newdata;
+        obuf->capacity = newcapacity;
+    }
+
+    return obuf->data + obuf->size;
+}
+
+
+/* Encodes the staged rows of obuf into a block in the scratch of the worker,
+ * and copies the block back over the rows. The scratch is sized exactly to
+ * the bound of the largest buffer, and a block is no larger than its rows
+ * unless most of the bases are N. Thus the buffers of the batch keep their
+ * capacity, and obuf grows only in that rare case. */
+static int
+pack_output_buffer(int type, struct OutputBuffer *obuf, struct OutputBuffer *packbuf)
+{
+    ssize_t packedsize;
+    size_t bound;
+    char *out;
+
+    bound = TAGPACK_BLOCK_BOUND(obuf->size);
+    if (bound > packbuf->capacity) {
+        char *newdata;
+
+        newdata = realloc(packbuf->data, bound);
+        if (newdata == NULL) {
+            perror("pack_output_buffer");
+            return -1;
+        }
+
+        packbuf->data = newdata;
+        packbuf->capacity = bound;
+    }
+
+    packedsize = tagpack_encode_block(type, obuf->data, obuf->size, packbuf->data);
+    if (packedsize < 0) {
+        fprintf(stderr, "Failed to encode a block.\n");
+        return -1;
+    }
+
+    obuf->size = 0;
+    out = reserve_output_buffer(obuf, packedsize);
+    if (out == NULL)
+        return -1;
+
+    memcpy(out, packbuf->data, packedsize);
+    obuf->size = packedsize;
+
+    return 0;
+}
+
+
+/* Converts the staged rows of a filled batch into a block per stream. */
+int
+pack_output_batch(struct TailseekerConfig *cfg, struct OutputBatch *batch,
+                  struct OutputBuffer *packbuf)
+{
+    int i;
+
+    for (i = 0; i < cfg->num_samples; i++) {
+        struct WriteBuffer *wb = &batch->buffers[i];
+
+        if (wb->seqqual.size > 0 &&
+                pack_output_buffer(TAGPACK_TYPE_SEQQUAL, &wb->seqqual, packbuf) < 0)
+            return -1;
+
+        if (wb->taginfo.size > 0 &&
+                pack_output_buffer(TAGPACK_TYPE_TAGINFO, &wb->taginfo, packbuf) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+struct OutputWriter *
+new_output_writer(struct TailseekerConfig *cfg)
+{
+    struct OutputWriter *writer;
+    struct SampleInfo *sample;
+    int i;
+
+    writer = malloc(sizeof(*writer));
+    if (writer == NULL)
+        return NULL;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->cfg = cfg;
+    writer->nbatches = OUTPUT_BATCHES_PER_THREAD * cfg->threads;
+
+    writer->batches = calloc(writer->nbatches, sizeof(struct OutputBatch));
+    writer->queue = calloc(writer->nbatches, sizeof(struct OutputBatch *));
+    if (writer->batches == NULL || writer->queue == NULL)
+        goto onError;
+
+    for (i = 0; i < writer->nbatches; i++) {
+        struct OutputBatch *batch = &writer->batches[i];
+
+        /* The buffers start empty and grow to the actual output. */
+        batch->buffers = calloc(cfg->num_samples, sizeof(struct WriteBuffer));
+        if (batch->buffers == NULL)
+            goto onError;
+
+        batch->next = writer->freelist;
+        writer->freelist = batch;
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->submitted, NULL);
+    pthread_cond_init(&writer->released, NULL);
+
+    if (pthread_create(&writer->thread, NULL, run_output_writer, (void *)writer) != 0) {
+        perror("new_output_writer");
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->submitted);
+        pthread_cond_destroy(&writer->released);
+        goto onError;
+    }
+
+    /* All streams share a pool of compression threads. A stream that fails
+     * to join the pool is compressed in the writer thread instead. */
+    if (cfg->compression_threads > 0) {
+        writer->compressors = hts_tpool_init(cfg->compression_threads);
+        if (writer->compressors == NULL)
+            fprintf(stderr, "Failed to start the compression threads.\n");
+        else
+            for (sample = cfg->samples; sample != NULL; sample = sample->next)
+                if ((sample->stream_seqqual != NULL &&
+                        bgzf_thread_pool(sample->stream_seqqual,
+                                         writer->compressors, 0) < 0) ||
+                    (sample->stream_taginfo != NULL &&
+                        bgzf_thread_pool(sample->stream_taginfo,
+                                         writer->compressors, 0) < 0) ||
+                    (sample->stream_signal != NULL &&
+                        bgzf_thread_pool(sample->stream_signal,
+                                         writer->compressors, 0) < 0))
+                    fprintf(stderr, "Failed to attach the compression threads "
+                            "to the output of %s.\n", sample->name);
+    }
+
+    return writer;
+
+  onError:
+    free_output_batches(writer);
+    free(writer);
+    return NULL;
+}
+
+
+/* Waits until every reserved batch is written. Returns -1 if any failed. */
+int
+finish_output_writer(struct OutputWriter *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->finishing = 1;
+    pthread_cond_broadcast(&writer->submitted);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+
+    return (writer->error_occurred > 0) * -1;
+}
+
+
+/* The streams must be closed before the compression threads go away. */
+void
+free_output_writer(struct OutputWriter *writer)
+{
+    if (writer->compressors != NULL)
+        hts_tpool_destroy(writer->compressors);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->submitted);
+    pthread_cond_destroy(&writer->released);
+
+    free_output_batches(writer);
+    free(writer);
+}
+
+
+/* Allocates numbers for the batches of the next block. Called only while no
+ * worker is running. */
+uint32_t
+reserve_output_batches(struct OutputWriter *writer, int nbatches)
+{
+    uint32_t first;
+
+    pthread_mutex_lock(&writer->lock);
+    first = writer->batches_reserved;
+    writer->batches_reserved += nbatches;
+    pthread_mutex_unlock(&writer->lock);
+
+    return first;
+}
+
+
+/*
+ * Returns a free batch for the given batch number, or NULL after an error.
+ * Only the batches within nbatches from the next one to write are handed
+ * out. Thus the batch that the writer is waiting for can always be taken,
+ * however the jobs are dispatched, and the queue slots never collide.
+ */
+struct OutputBatch *
+acquire_output_batch(struct OutputWriter *writer, uint32_t batchno)
+{
+    struct OutputBatch *batch;
+
+    pthread_mutex_lock(&writer->lock);
+
+    while ((writer->freelist == NULL ||
+            batchno - writer->batches_written >= (uint32_t)writer->nbatches) &&
+           writer->error_occurred == 0)
+        pthread_cond_wait(&writer->released, &writer->lock);
+
+    batch = NULL;
+    if (writer->error_occurred == 0) {
+        batch = writer->freelist;
+        writer->freelist = batch->next;
+        batch->batchno = batchno;
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+
+    if (batch != NULL) {
+        int i;
+
+        for (i = 0; i < writer->cfg->num_samples; i++)
+            batch->buffers[i].seqqual.size = batch->buffers[i].taginfo.size =
+                batch->buffers[i].signal.size = 0;
+    }
+
+    return batch;
+}
+
+
+/* Puts back a batch that was not submitted. */
+void
+release_output_batch(struct OutputWriter *writer, struct OutputBatch *batch)
+{
+    pthread_mutex_lock(&writer->lock);
+    batch->next = writer->freelist;
+    writer->freelist = batch;
+    pthread_cond_broadcast(&writer->released);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+
+/* Queues a filled batch. */
+int
+submit_output_batch(struct OutputWriter *writer, struct OutputBatch *batch)
+{
+    int r;
+
+    pthread_mutex_lock(&writer->lock);
+
+    r = (writer->error_occurred > 0) * -1;
+    if (r == 0) {
+        writer->queue[batch->batchno % writer->nbatches] = batch;
+        pthread_cond_broadcast(&writer->submitted);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+
+    if (r < 0)
+        release_output_batch(writer, batch);
+
+    return r;
+}
+
+
+/* Stops the writer. The batches not written yet are discarded. */
+void
+abort_output_writer(struct OutputWriter *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->error_occurred++;
+    pthread_cond_broadcast(&writer->submitted);
+    pthread_cond_broadcast(&writer->released);
+    pthread_mutex_unlock(&writer->lock);
+}
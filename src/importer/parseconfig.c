@@ -114,10 +114,45 @@ feed_options_entry(struct TailseekerConfig *cfg,
             return -1;
         }
     }
+    else if (MATCH("mmap-cif")) {
+        if (strcasecmp(value, "yes") == 0 || strcmp(value, "1") == 0)
+            cfg->mmap_cif = 1;
+        else if (strcasecmp(value, "no") == 0 || strcmp(value, "0") == 0)
+            cfg->mmap_cif = 0;
+        else {
+            fprintf(stderr, "\"%s\" must be either yes or no.\n", name);
+            return -1;
+        }
+    }
+    else if (MATCH("transpose-basecalls")) {
+        if (strcasecmp(value, "yes") == 0 || strcmp(value, "1") == 0)
+            cfg->transpose_basecalls = 1;
+        else if (strcasecmp(value, "no") == 0 || strcmp(value, "0") == 0)
+            cfg->transpose_basecalls = 0;
+        else {
+            fprintf(stderr, "\"%s\" must be either yes or no.\n", name);
+            return -1;
+        }
+    }
     else if (MATCH("threads"))
         cfg->threads = atoi(value);
+    else if (MATCH("compression-threads")) {
+        cfg->compression_threads = atoi(value);
+        if (cfg->compression_threads < 0) {
+            fprintf(stderr, "\"%s\" must not be negative.\n", name);
+            return -1;
+        }
+    }
     else if (MATCH("read-buffer-size"))
         cfg->read_buffer_size = (size_t)atoll(value);
+    else if (MATCH("read-buffer-sets")) {
+        cfg->read_buffer_sets = atoi(value);
+        if (cfg->read_buffer_sets < 1 || cfg->read_buffer_sets > MAX_READ_BUFFER_SETS) {
+            fprintf(stderr, "\"%s\" must be between 1 and %d.\n", name,
+                    MAX_READ_BUFFER_SETS);
+            return -1;
+        }
+    }
     else {
         fprintf(stderr, "Unknown key \"%s\" in [options].\n", name);
         return -1;
@@ -143,6 +178,24 @@ feed_output_entry(struct TailseekerConfig *cfg,
         cfg->stats_output = strdup(value);
     else if (MATCH("length-dists"))
         cfg->length_dists_output = strdup(value);
+    else if (MATCH("signal-score-bits")) {
+        cfg->signal_score_bits = atoi(value);
+        if (cfg->signal_score_bits != SIGNALPACK_V1_SCORE_BITS &&
+                cfg->signal_score_bits != 12 && cfg->signal_score_bits != 8) {
+            fprintf(stderr, "\"%s\" must be one of 8, 12 and 24.\n", name);
+            return -1;
+        }
+    }
+    else if (MATCH("format")) {
+        if (strcasecmp(value, "text") == 0)
+            cfg->binary_output = 0;
+        else if (strcasecmp(value, "binary") == 0)
+            cfg->binary_output = 1;
+        else {
+            fprintf(stderr, "\"%s\" must be either text or binary.\n", name);
+            return -1;
+        }
+    }
     else {
         fprintf(stderr, "Unknown key \"%s\" in [output].\n", name);
         return -1;
@@ -197,6 +250,17 @@ feed_control_entry(struct TailseekerConfig *cfg,
         cfg->controlinfo.first_cycle = atoi(value) - 1;
     else if (MATCH("phix-match-length"))
         cfg->controlinfo.read_length = atoi(value);
+    else if (MATCH("seed-length")) {
+        cfg->controlinfo.seed_length = atoi(value);
+        if (cfg->controlinfo.seed_length < 0 ||
+                cfg->controlinfo.seed_length > CONTROL_SEED_MAX_LENGTH) {
+            fprintf(stderr, "\"%s\" must be between 0 and %d.\n", name,
+                    CONTROL_SEED_MAX_LENGTH);
+            return -1;
+        }
+    }
+    else if (MATCH("min-seed-hits"))
+        cfg->controlinfo.min_seed_hits = atoi(value);
     else {
         fprintf(stderr, "Unknown key \"%s\" in [control].\n", name);
         return -1;
@@ -298,6 +362,16 @@ feed_polyA_finder_entry(struct TailseekerConfig *cfg,
         cfg->finderparams.max_terminal_modifications = atoi(value);
     else if (MATCH("signal-analysis-trigger"))
         cfg->finderparams.sigproc_trigger_polya_length = atoi(value);
+    else if (MATCH("search-method")) {
+        if (strcasecmp(value, "linear") == 0)
+            cfg->finderparams.exhaustive_search = 0;
+        else if (strcasecmp(value, "exhaustive") == 0)
+            cfg->finderparams.exhaustive_search = 1;
+        else {
+            fprintf(stderr, "\"%s\" must be either linear or exhaustive.\n", name);
+            return -1;
+        }
+    }
     else {
         fprintf(stderr, "Unknown key \"%s\" in [polyA_finder].\n", name);
         return -1;
@@ -492,9 +566,18 @@ set_default_configuration(struct TailseekerConfig *cfg)
     cfg->keep_no_delimiter = 0;
     cfg->keep_low_quality_balancer = 0;
     cfg->threads = 1;
+    cfg->compression_threads = -1;
+    cfg->mmap_cif = 0;
+    cfg->transpose_basecalls = 0;
+    cfg->binary_output = 0;
+    cfg->signal_score_bits = SIGNALPACK_V1_SCORE_BITS;
     cfg->index_length = 6;
 
     cfg->read_buffer_size = 536870912; /* 500 MiB */
+    cfg->read_buffer_sets = 2;
+
+    cfg->controlinfo.seed_length = 0;
+    cfg->controlinfo.min_seed_hits = 1;
 
     cfg->balancerparams.start = 0;
     cfg->balancerparams.end = 20;
@@ -519,6 +602,7 @@ set_default_configuration(struct TailseekerConfig *cfg)
     cfg->finderparams.max_terminal_modifications = 20;
     cfg->finderparams.min_polya_length = 5;
     cfg->finderparams.sigproc_trigger_polya_length = 10;
+    cfg->finderparams.exhaustive_search = 0;
     cfg->finderparams.weights_polyA[(int)'T'] = 2;
     cfg->finderparams.weights_polyA[(int)'A'] = cfg->finderparams.weights_polyA[(int)'C'] =
         cfg->finderparams.weights_polyA[(int)'G'] = -9;
@@ -626,7 +710,6 @@ compute_derived_values(struct TailseekerConfig *cfg)
     nsamples = 0;
     for (sample = cfg->samples; sample != NULL; sample = sample->next) {
         sample->numindex = nsamples++;
-        pthread_mutex_init(&sample->signal_writer_lock, NULL);
         pthread_mutex_init(&sample->statslock, NULL);
 
         sample->signal_dump_length = cfg->threep_length;
@@ -642,20 +725,48 @@ compute_derived_values(struct TailseekerConfig *cfg)
     }
     cfg->num_samples = nsamples;
 
-    /* Compute maximum write buffer sizes per output entry */
+    /* Version 1 signal records are zero-padded to the full dump length of
+     * the sample. Version 2 records may come with a chunk header. */
+    cfg->max_bufsize_signal = sizeof(struct SignalRecordHeader);
+    for (sample = cfg->samples; sample != NULL; sample = sample->next) {
+        size_t recordsize;
+
+        if (sample->signal_dump_length <= 0)
+            continue;
+
+        if (cfg->signal_score_bits == SIGNALPACK_V1_SCORE_BITS)
+            recordsize = sizeof(struct SignalRecordHeader) +
+                         sizeof(signal_packet_t) * sample->signal_dump_length;
+        else
+            recordsize = sizeof(struct SignalChunkHeader) +
+                         SIGNALPACK_V2_MAX_RECORD_SIZE(cfg->signal_score_bits,
+                                                       sample->signal_dump_length);
+
+        if (recordsize > cfg->max_bufsize_signal)
+            cfg->max_bufsize_signal = recordsize;
+    }
+
+    /* Index the barcode neighbourhoods for assignment with a single probe. */
+    cfg->barcode_index = build_barcode_index(cfg->samples, cfg->index_length);
+
+    /* Compute maximum write buffer sizes per output entry. The staged rows
+     * of the block format fit in them, too. */
     if (cfg->threep_seqqual_output_length > cfg->threep_length)
         cfg->threep_seqqual_output_length = cfg->threep_length;
 
-    cfg->max_bufsize_seqqual = nsamples * (
+    cfg->max_bufsize_seqqual = (
             MAX_CLUSTERID_LEN +
             cfg->fivep_length * 2 +
             cfg->threep_seqqual_output_length * 2 +
             6 /* field separators */);
-    cfg->max_bufsize_taginfo = nsamples * (
+    cfg->max_bufsize_taginfo = (
             5 /* tabs and eol */ + 30 /* other fields */ +
             cfg->finderparams.max_terminal_modifications +
             longest_umi_length);
 
+    if (cfg->compression_threads < 0)
+        cfg->compression_threads = cfg->threads;
+
     /* Compute number of entries in a read buffer from the byte size. */
     {
         int memory_footprint_per_entry;
@@ -664,11 +775,31 @@ compute_derived_values(struct TailseekerConfig *cfg)
         memory_footprint_per_entry = 2 * cfg->total_cycles + /* 2 bytes for BCL */
                                      8 * cfg->threep_length; /* 8 bytes for CIF */
 
-        write_buffer_memory_footprint = cfg->threads * NUM_CLUSTERS_PER_JOB *
-                        (cfg->max_bufsize_seqqual + cfg->max_bufsize_taginfo);
-
-        cfg->read_buffer_entry_count = (cfg->read_buffer_size - write_buffer_memory_footprint)
-                                       / memory_footprint_per_entry;
+        /* A cluster goes to one sample at most, thus the records of a job
+         * take no more than NUM_CLUSTERS_PER_JOB records in total. Doubling
+         * leaves up to half of a buffer unused, and every sample holds at
+         * least the initial records once it has any output. */
+        write_buffer_memory_footprint = OUTPUT_BATCHES_PER_THREAD * cfg->threads *
+                        (2 * NUM_CLUSTERS_PER_JOB +
+                         OUTPUT_BUFFER_INITIAL_RECORDS * cfg->num_samples) *
+                        (cfg->max_bufsize_seqqual + cfg->max_bufsize_taginfo +
+                         cfg->max_bufsize_signal);
+
+        /* Each worker encodes the blocks of a job in its own scratch buffer,
+         * which holds the block of the largest stream of a job. */
+        if (cfg->binary_output)
+            write_buffer_memory_footprint += cfg->threads *
+                        TAGPACK_BLOCK_BOUND(NUM_CLUSTERS_PER_JOB *
+                                            cfg->max_bufsize_seqqual);
+
+        /* The read buffer is split evenly among the buffer sets, one of which is
+         * filled by the background loader while the other is being analyzed. */
+        if (cfg->read_buffer_size > write_buffer_memory_footprint)
+            cfg->read_buffer_entry_count = (cfg->read_buffer_size -
+                                            write_buffer_memory_footprint)
+                                / memory_footprint_per_entry / cfg->read_buffer_sets;
+        else
+            cfg->read_buffer_entry_count = 0;
     }
 }
 
@@ -678,6 +809,17 @@ check_configuration_requirements(struct TailseekerConfig *cfg)
 {
     /* TODO */
 
+    if (cfg->threads < 1) {
+        fprintf(stderr, "\"threads\" must be at least 1.\n");
+        return -1;
+    }
+
+    if (cfg->read_buffer_entry_count < 1) {
+        fprintf(stderr, "\"read-buffer-size\" is too small for the output "
+                "buffers of %d threads.\n", cfg->threads);
+        return -1;
+    }
+
     return 0;
 }
 
@@ -726,6 +868,7 @@ free_config(struct TailseekerConfig *cfg)
     free_if_not_null(cfg->threep_colormatrix_filename);
 
     free_if_not_null(cfg->controlinfo.control_seq);
+    free_barcode_index(cfg->barcode_index);
 
     while (cfg->samples != NULL) {
         struct SampleInfo *bk;
@@ -733,7 +876,6 @@ free_config(struct TailseekerConfig *cfg)
         if (cfg->samples->stream_seqqual != NULL)
             abort();
 
-        pthread_mutex_destroy(&cfg->samples->signal_writer_lock);
         pthread_mutex_destroy(&cfg->samples->statslock);
 
         free_if_not_null(cfg->samples->name);
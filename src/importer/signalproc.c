@@ -34,6 +34,9 @@
 #include <assert.h>
 #include <math.h>
 #include <ctype.h>
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
 #include "tailseq-import.h"
 
 //#define DEBUG_SIGNAL_PROCESSING
@@ -268,67 +271,248 @@ normalize_signals(float *normalized, const float *signals,
 }
 
 
-int
-compute_polya_score(struct IntensitySet *intensities, int ncycles,
-                    const float *signal_range_low,
-                    const float *signal_range_bandwidth,
-                    struct PolyARulerParameters *params,
-                    float *scores, char *downhill, int *procflags)
+#if NUM_CHANNELS != 4
+#error Unsupported signal channel count.
+#endif
+#define CHANNEL_T   3
+
+#if !defined(USE_SSE2) || !defined(NDEBUG) || defined(SCORE_LANE_REFERENCE)
+/* Computes the score of a lane in a cycle. This is the reference for the
+ * vectorized routine below, and both must produce identical values.
+ * tests/test-polya-score.c compares them. */
+static void
+score_lane_cycle(const struct IntensityLaneSet *lanes, int lane,
+                 const float *signal_range_low, const float *signal_range_bandwidth,
+                 const struct PolyARulerParameters *params,
+                 float *score, float *entropy)
 {
-    int cycle, chan, ndarkcycles;
-    float entropy_prev;
+    struct IntensitySet intensity;
+    float signals[NUM_CHANNELS], normsignals[NUM_CHANNELS];
+    float range_low[NUM_CHANNELS], range_bandwidth[NUM_CHANNELS];
+    float signal_sum, entropy_score, t_intensity_score;
+    int chan;
 
-    ndarkcycles = 0;
-    entropy_prev = NAN;
+    for (chan = 0; chan < NUM_CHANNELS; chan++) {
+        intensity.value[chan] = lanes->value[chan][lane];
+        range_low[chan] = signal_range_low[chan * INTENSITY_LANES + lane];
+        range_bandwidth[chan] = signal_range_bandwidth[chan * INTENSITY_LANES + lane];
+    }
 
-    for (cycle = 0; cycle < ncycles; cycle++) {
-        float signals[NUM_CHANNELS];
-        float normsignals[NUM_CHANNELS];
-        float signal_sum;
-        float entropy_score, t_intensity_score;
+    decrosstalk_intensity(signals, &intensity, params->colormatrix);
 
-        decrosstalk_intensity(signals, &intensities[cycle],
-                              params->colormatrix);
+    /* Skip assigning scores if spot is dark. */
+    signal_sum = 0.f;
+    for (chan = 0; chan < NUM_CHANNELS; chan++)
+        if (signals[chan] > 0.f)
+            signal_sum += signals[chan];
 
-        /* Skip assigning scores if spot is dark. */
-        signal_sum = 0.f;
-        for (chan = 0; chan < NUM_CHANNELS; chan++)
-            if (signals[chan] > 0.f)
-                signal_sum += signals[chan];
+    if (signal_sum < params->dark_cycles_threshold) {
+        *score = *entropy = NAN;
+        return;
+    }
 
-        if (signal_sum < params->dark_cycles_threshold) {
-            ndarkcycles++;
-            *scores++ = entropy_prev = NAN;
-            *downhill++ = 0;
-            continue;
-        }
+    /* Adjust signals to fit in the spot dynamic range */
+    normalize_signals(normsignals, signals, range_low, range_bandwidth);
+    if (isnan(normsignals[0])) {
+        /* Normalized signals can be NaNs altogether if intensities of
+         * all channels are zero or negative after normalization.
+         * It is treated as a dark cycle in this case. */
+        *score = *entropy = NAN;
+        return;
+    }
 
-        /* Adjust signals to fit in the spot dynamic range */
-        normalize_signals(normsignals, signals, signal_range_low,
-                          signal_range_bandwidth);
-        if (isnan(normsignals[0])) {
-            /* Normalized signals can be NaNs altogether if intensities of
-             * all channels are zero or negative after normalization.
-             * It is treated as a dark cycle in this case. */
-            ndarkcycles++;
-            *scores++ = entropy_prev = NAN;
-            *downhill++ = 0;
+    entropy_score = 1.f - shannon_entropy(normsignals) /
+                    params->maximum_entropy;
+    t_intensity_score = params->t_intensity_score[
+            (int)(normsignals[CHANNEL_T] * T_INTENSITY_SCORE_BINS)];
+
+    *score = entropy_score * t_intensity_score;
+    *entropy = entropy_score;
+}
+#endif
+
+
+#ifdef USE_SSE2
+/* Scores four lanes starting from lane0 in a cycle. Lanes not set in
+ * activemask are left as dark. Every operation is done in the same order as
+ * score_lane_cycle() so that the results are bit-identical.
+ * logf() is still evaluated per lane: the scores are summed, binned and
+ * compared downstream, so an approximation would not give identical output. */
+static void
+score_lanes_cycle_sse2(const struct IntensityLaneSet *lanes, int lane0, int activemask,
+                       const float *signal_range_low,
+                       const float *signal_range_bandwidth,
+                       const struct PolyARulerParameters *params,
+                       float *score, float *entropy)
+{
+    const float *mtx = params->colormatrix;
+    __m128 raw[NUM_CHANNELS], signals[NUM_CHANNELS], normsignals[NUM_CHANNELS];
+    __m128 zero, signal_sum, normsignal_sum, dark;
+    union {
+        __m128 v;
+        float f[4];
+    } norm[NUM_CHANNELS], entropy_score, t_intensity_score;
+    int chan, i, darkmask;
+
+    zero = _mm_setzero_ps();
+
+    for (chan = 0; chan < NUM_CHANNELS; chan++) {
+        __m128i v;
+
+        /* sign-extend four int16 values to int32 */
+        v = _mm_loadl_epi64((const __m128i *)&lanes->value[chan][lane0]);
+        v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        raw[chan] = _mm_cvtepi32_ps(v);
+    }
+
+    /* decrosstalk_intensity() */
+    for (chan = 0; chan < NUM_CHANNELS; chan++, mtx += NUM_CHANNELS)
+        signals[chan] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(_mm_set1_ps(mtx[0]), raw[0]),
+                _mm_mul_ps(_mm_set1_ps(mtx[1]), raw[1])),
+                _mm_mul_ps(_mm_set1_ps(mtx[2]), raw[2])),
+                _mm_mul_ps(_mm_set1_ps(mtx[3]), raw[3]));
+
+    /* Sum of positive signals; max(x, 0) gives 0 for x <= 0 as skipping
+     * them does. */
+    signal_sum = zero;
+    for (chan = 0; chan < NUM_CHANNELS; chan++)
+        signal_sum = _mm_add_ps(signal_sum, _mm_max_ps(signals[chan], zero));
+
+    dark = _mm_cmplt_ps(signal_sum, _mm_set1_ps(params->dark_cycles_threshold));
+
+    /* normalize_signals(); max(0, x) keeps NaNs as the scalar comparison does. */
+    normsignal_sum = zero;
+    for (chan = 0; chan < NUM_CHANNELS; chan++) {
+        __m128 low, bandwidth;
+
+        low = _mm_loadu_ps(&signal_range_low[chan * INTENSITY_LANES + lane0]);
+        bandwidth = _mm_loadu_ps(&signal_range_bandwidth[chan * INTENSITY_LANES + lane0]);
+        normsignals[chan] = _mm_max_ps(zero,
+                _mm_div_ps(_mm_sub_ps(signals[chan], low), bandwidth));
+        normsignal_sum = _mm_add_ps(normsignal_sum, normsignals[chan]);
+    }
+
+    for (chan = 0; chan < NUM_CHANNELS; chan++)
+        norm[chan].v = _mm_div_ps(normsignals[chan], normsignal_sum);
+
+    dark = _mm_or_ps(dark, _mm_cmpunord_ps(norm[0].v, norm[0].v));
+    darkmask = _mm_movemask_ps(dark) | (~activemask & 15);
+
+    /* shannon_entropy() */
+    for (i = 0; i < 4; i++) {
+        float res;
+
+        if (darkmask & (1 << i)) {
+            entropy_score.f[i] = t_intensity_score.f[i] = 0.f;
             continue;
         }
 
-        entropy_score = 1.f - shannon_entropy(normsignals) /
-                        params->maximum_entropy;
-#if NUM_CHANNELS == 4
-#define CHANNEL_T   3
-        t_intensity_score = params->t_intensity_score[
-                (int)(normsignals[CHANNEL_T] * T_INTENSITY_SCORE_BINS)];
-#undef CHANNEL_T
+        res = 0.f;
+        for (chan = 0; chan < NUM_CHANNELS; chan++)
+            if (norm[chan].f[i] > 0.f)
+                res -= norm[chan].f[i] * logf(norm[chan].f[i]);
+        entropy_score.f[i] = res;
+
+        t_intensity_score.f[i] = params->t_intensity_score[
+                (int)(norm[CHANNEL_T].f[i] * T_INTENSITY_SCORE_BINS)];
+    }
+
+    entropy_score.v = _mm_sub_ps(_mm_set1_ps(1.f),
+            _mm_div_ps(entropy_score.v, _mm_set1_ps(params->maximum_entropy)));
+
+    /* dark lanes get NaNs */
+    _mm_storeu_ps(entropy, _mm_or_ps(_mm_andnot_ps(dark, entropy_score.v),
+                                     _mm_and_ps(dark, _mm_set1_ps(NAN))));
+    _mm_storeu_ps(score, _mm_or_ps(
+            _mm_andnot_ps(dark, _mm_mul_ps(entropy_score.v, t_intensity_score.v)),
+            _mm_and_ps(dark, _mm_set1_ps(NAN))));
+}
+#endif
+
+
+/* Computes poly(A) scores of cycles [firstcycle, lastcycle) for a group of
+ * INTENSITY_LANES clusters at once. Only the lanes set in active_lanes are
+ * guaranteed to be filled. Signal ranges are given per channel for each lane
+ * (signal_range_low[chan * INTENSITY_LANES + lane]). Scores and entropy
+ * scores are written to scores[cycle * INTENSITY_LANES + lane]; dark cycles
+ * get NaNs. */
+void
+compute_polya_score_lanes(const struct IntensityLaneSet *lanes,
+                          int firstcycle, int lastcycle, uint32_t active_lanes,
+                          const float *signal_range_low,
+                          const float *signal_range_bandwidth,
+                          struct PolyARulerParameters *params,
+                          float *scores, float *entropies)
+{
+    int cycle, lane;
+
+    for (cycle = firstcycle; cycle < lastcycle; cycle++) {
+        const struct IntensityLaneSet *cyclelanes = &lanes[cycle];
+        float *cyclescores = scores + cycle * INTENSITY_LANES;
+        float *cycleentropies = entropies + cycle * INTENSITY_LANES;
+
+#ifdef USE_SSE2
+        for (lane = 0; lane < INTENSITY_LANES; lane += 4)
+            if ((active_lanes >> lane) & 15)
+                score_lanes_cycle_sse2(cyclelanes, lane, (active_lanes >> lane) & 15,
+                                       signal_range_low,
+                                       signal_range_bandwidth, params,
+                                       cyclescores + lane, cycleentropies + lane);
+
+#ifndef NDEBUG
+        /* check the vectorized scores against the scalar routine */
+        for (lane = 0; lane < INTENSITY_LANES; lane++)
+            if (active_lanes & (1 << lane)) {
+                float score, entropy;
+
+                score_lane_cycle(cyclelanes, lane, signal_range_low,
+                                 signal_range_bandwidth, params, &score, &entropy);
+                assert(memcmp(&score, cyclescores + lane, sizeof(float)) == 0);
+                assert(memcmp(&entropy, cycleentropies + lane, sizeof(float)) == 0);
+            }
+#endif
 #else
-#error Unsupported signal channel count.
+        for (lane = 0; lane < INTENSITY_LANES; lane++)
+            if (active_lanes & (1 << lane))
+                score_lane_cycle(cyclelanes, lane, signal_range_low,
+                                 signal_range_bandwidth, params,
+                                 cyclescores + lane, cycleentropies + lane);
 #endif
+    }
+}
+
+
+/* Takes out the scores of a cluster from the output of
+ * compute_polya_score_lanes(), and counts dark cycles in the range. */
+int
+collect_polya_scores(const float *scores, const float *entropies,
+                     int firstcycle, int ncycles, int lane,
+                     struct PolyARulerParameters *params,
+                     float *scoresout, char *downhill, int *procflags)
+{
+    float entropy_prev;
+    int i, ndarkcycles;
+
+    ndarkcycles = 0;
+    entropy_prev = NAN;
+
+    scores += firstcycle * INTENSITY_LANES + lane;
+    entropies += firstcycle * INTENSITY_LANES + lane;
+
+    for (i = 0; i < ncycles; i++) {
+        float entropy_score;
+
+        scoresout[i] = scores[i * INTENSITY_LANES];
+        entropy_score = entropies[i * INTENSITY_LANES];
+
+        if (isnan(entropy_score)) {
+            ndarkcycles++;
+            downhill[i] = 0;
+        }
+        else
+            downhill[i] = (char)(entropy_score < entropy_prev);
 
-        *scores++ = entropy_score * t_intensity_score;
-        *downhill++ = (char)(entropy_score < entropy_prev);
         entropy_prev = entropy_score;
     }
 
@@ -343,6 +527,8 @@ compute_polya_score(struct IntensitySet *intensities, int ncycles,
     return 0;
 }
 
+#undef CHANNEL_T
+
 
 int
 load_color_matrix(float *mtx, const char *filename)
@@ -66,13 +66,17 @@ static const char IUPAC_ambiguity_codes[][5] = {
 #define IUPAC_ambiguity_codes_last      'Z'
 
 
-static struct SampleInfo *
+struct SampleInfo *
 assign_barcode(const char *indexseq, int barcode_length, struct SampleInfo *barcodes,
-               int *pmismatches)
+               const struct BarcodeIndex *bindex, int *pmismatches)
 {
     struct SampleInfo *bestidx, *pidx;
     int bestmismatches, secondbestfound, i;
 
+    /* Index sequences with N are left to the full scan below. */
+    if (bindex != NULL && lookup_barcode_index(bindex, indexseq, &bestidx, pmismatches))
+        return bestidx;
+
     bestidx = NULL;
     bestmismatches = barcode_length + 1;
     secondbestfound = 0;
@@ -174,7 +178,7 @@ count_fingerprint_mismatches(const char *seq, int pos, struct SampleInfo *barcod
 
 static int
 check_balancer_basecall_quality(struct TailseekerConfig *cfg,
-                                struct SampleInfo *sample,
+                                struct DemultiplexingStats *stats,
                                 const char *phredscore, int *procflags)
 {
 #define PHRED_BASE  33
@@ -192,12 +196,12 @@ check_balancer_basecall_quality(struct TailseekerConfig *cfg,
         if (qualsum < bparams->min_bases_passes) {
             *procflags |= PAFLAG_BALANCER_CALL_QUALITY_BAD;
 
-            pthread_mutex_lock(&sample->statslock);
-            sample->clusters_qcfailed++;
-            pthread_mutex_unlock(&sample->statslock);
+            stats->clusters_qcfailed++;
 
-            if (!cfg->keep_low_quality_balancer)
+            if (!cfg->keep_low_quality_balancer) {
+                stats->clusters_qcfailed_dropped++;
                 return -1;
+            }
         }
     }
 
@@ -281,16 +285,23 @@ write_taginfo_entry(char **pbuffer, struct TailseekerConfig *cfg,
 
     buf = *pbuffer;
 
-    sprintf(buf, "%u\t%d\t%d\t", (unsigned int)clusterno, procflags,
-            polya_len);
-    buf += strlen(buf);
+    if (cfg->binary_output)
+        buf = tagpack_stage_taginfo(buf, clusterno, procflags, polya_len,
+                                    (terminal_mods > 0 ? terminal_mods : 0),
+                                    sample->umi_total_length);
+    else {
+        sprintf(buf, "%u\t%d\t%d\t", (unsigned int)clusterno, procflags,
+                polya_len);
+        buf += strlen(buf);
+    }
 
     if (terminal_mods > 0) {
         get_modification_sequence(buf, sequence, delimiter_end,
                                   terminal_mods);
         buf += terminal_mods;
     }
-    *buf++ = '\t';
+    if (!cfg->binary_output)
+        *buf++ = '\t';
 
     for (i = 0; i < sample->umi_ranges_count; i++) {
         struct UMIInterval *umi;
@@ -300,7 +311,8 @@ write_taginfo_entry(char **pbuffer, struct TailseekerConfig *cfg,
         buf += umi->length;
     }
 
-    *buf++ = '\n';
+    if (!cfg->binary_output)
+        *buf++ = '\n';
 
     written = buf - *pbuffer;
     *pbuffer = buf;
@@ -319,6 +331,7 @@ write_measurements_to_buffers(struct TailseekerConfig *cfg,
                               int terminal_mods)
 {
     struct WriteBuffer *wb;
+    char *buf;
 
     wb = &wbuf[sample->numindex];
 
@@ -337,67 +350,128 @@ write_measurements_to_buffers(struct TailseekerConfig *cfg,
         if (length_3p > cfg->threep_seqqual_output_length)
             length_3p = cfg->threep_seqqual_output_length;
 
-        if (write_seqqual_entry(&wb->buf_seqqual, clusterno,
-                                sequence_formatted, quality_formatted,
-                                cfg->fivep_start, cfg->fivep_length,
-                                start_3p, length_3p) < 0)
+        buf = reserve_output_buffer(&wb->seqqual, cfg->max_bufsize_seqqual);
+        if (buf == NULL)
+            return -1;
+
+        if (cfg->binary_output)
+            buf += tagpack_stage_seqqual(buf, clusterno,
+                        sequence_formatted + cfg->fivep_start,
+                        quality_formatted + cfg->fivep_start, cfg->fivep_length,
+                        sequence_formatted + start_3p,
+                        quality_formatted + start_3p, length_3p);
+        else if (write_seqqual_entry(&buf, clusterno,
+                                     sequence_formatted, quality_formatted,
+                                     cfg->fivep_start, cfg->fivep_length,
+                                     start_3p, length_3p) < 0)
             return -1;
+        wb->seqqual.size = buf - wb->seqqual.data;
     }
 
-    if (sample->stream_taginfo != NULL &&
-        write_taginfo_entry(&wb->buf_taginfo, cfg, sample,
-                            clusterno, sequence_formatted, delimiter_end,
-                            procflags, polya_len, terminal_mods) < 0)
-        return -1;
+    if (sample->stream_taginfo != NULL) {
+        buf = reserve_output_buffer(&wb->taginfo, cfg->max_bufsize_taginfo);
+        if (buf == NULL ||
+                write_taginfo_entry(&buf, cfg, sample,
+                                    clusterno, sequence_formatted, delimiter_end,
+                                    procflags, polya_len, terminal_mods) < 0)
+            return -1;
+        wb->taginfo.size = buf - wb->taginfo.data;
+    }
 
     return 0;
 }
 
 
-static ssize_t
-sync_write_out_buffer(BGZF *stream, const char *content, size_t size,
-                      struct WriteHandleSync *sync, int jobid)
+/* Appends a record to the signal chunk of the job. The chunk header is
+ * updated in place as the records come in. */
+static int
+write_polya_score_v2(struct SampleInfo *sample, struct WriteBuffer *wbuf,
+                     const float *score, int length, const char *downhill,
+                     uint32_t clusterno, int first_cycle, int score_bits)
 {
-    ssize_t written;
+    struct SignalChunkHeader chunk;
+    struct OutputBuffer *obuf;
+    uint8_t *start, *p;
+    uint32_t acc, scoremax;
+    int i, accbits;
 
-    while (1) {
-        pthread_mutex_lock(&sync->lock);
-        if (sync->jobs_written >= jobid) {
-            pthread_mutex_unlock(&sync->lock);
-            break;
-        }
+    if (length > sample->signal_dump_length)
+        length = sample->signal_dump_length;
 
-        pthread_cond_wait(&sync->wakeup, &sync->lock);
-        pthread_mutex_unlock(&sync->lock);
-    }
+    obuf = &wbuf[sample->numindex].signal;
+    if (reserve_output_buffer(obuf, sizeof(chunk) +
+                SIGNALPACK_V2_MAX_RECORD_SIZE(score_bits, length)) == NULL)
+        return -1;
 
-    if (size > 0) {
-        written = bgzf_write(stream, content, size);
-        if (written < 0)
-            return -1;
+    if (obuf->size == 0) {
+        chunk.nrecords = chunk.payload_size = 0;
+        chunk.first_clusterno = chunk.last_clusterno = clusterno;
+        obuf->size = sizeof(chunk);
     }
     else
-        written = 0;
+        memcpy(&chunk, obuf->data, sizeof(chunk));
 
-    pthread_mutex_lock(&sync->lock);
-    sync->jobs_written++;
-    pthread_cond_broadcast(&sync->wakeup);
-    pthread_mutex_unlock(&sync->lock);
+    start = p = (uint8_t *)obuf->data + obuf->size;
+    p = put_signalpack_varint(p, clusterno - chunk.last_clusterno);
+    p = put_signalpack_varint(p, first_cycle);
+    p = put_signalpack_varint(p, length);
 
-    return written;
+    scoremax = SIGNALPACK_V2_SCORE_MAX(score_bits);
+    acc = 0;
+    accbits = 0;
+    for (i = 0; i < length; i++) {
+        uint32_t packet = 0;
+
+        if (!isnan(score[i])) {
+            uint32_t s;
+
+            assert(score[i] >= 0.f && score[i] <= 1.f);
+            s = 1 + (int)(score[i] * (float)(scoremax - 1));
+            if (s >= scoremax)
+                s = scoremax;
+            packet = s | ((uint32_t)(downhill[i] != 0) << (score_bits - 1));
+        }
+
+        acc |= packet << accbits;
+        for (accbits += score_bits; accbits >= 8; accbits -= 8) {
+            *p++ = acc & 0xff;
+            acc >>= 8;
+        }
+    }
+    if (accbits > 0)
+        *p++ = acc & 0xff;
+
+    chunk.nrecords++;
+    chunk.last_clusterno = clusterno;
+    chunk.payload_size += p - start;
+    memcpy(obuf->data, &chunk, sizeof(chunk));
+    obuf->size += p - start;
+
+    return 0;
 }
 
 
+/* Appends a signal record to the job buffer. The writer puts the buffers
+ * out in the job order, thus the records come out sorted by the cluster
+ * number. */
 static int
-write_polya_score(struct SampleInfo *sample, const float *score, int length,
+write_polya_score(struct TailseekerConfig *cfg, struct SampleInfo *sample,
+                  struct WriteBuffer *wbuf, const float *score, int length,
                   const char *downhill, uint32_t clusterno, int first_cycle)
 {
-    static const signal_packet_t zeropad[256] = {{0, 0}};
     struct SignalRecordHeader header;
-    signal_packet_t sigscores[length];
+    struct OutputBuffer *obuf;
+    signal_packet_t *sigscores;
+    size_t recordsize;
+    char *buf;
     unsigned int s;
     int i;
 
+    if (cfg->signal_score_bits != SIGNALPACK_V1_SCORE_BITS)
+        return write_polya_score_v2(sample, wbuf, score, length, downhill,
+                                    clusterno, first_cycle,
+                                    cfg->signal_score_bits);
+
     if (length > sample->signal_dump_length)
         length = sample->signal_dump_length;
 
@@ -405,7 +479,19 @@ write_polya_score(struct SampleInfo *sample, const float *score, int length,
     header.first_cycle = first_cycle;
     header.valid_cycle_count = length;
 
-    memset(sigscores, 0, sizeof(signal_packet_t) * length);
+    /* zero-padded up to the fixed record length */
+    recordsize = sizeof(header) + sizeof(signal_packet_t) * sample->signal_dump_length;
+
+    obuf = &wbuf[sample->numindex].signal;
+    buf = reserve_output_buffer(obuf, recordsize);
+    if (buf == NULL)
+        return -1;
+
+    memcpy(buf, &header, sizeof(header));
+    sigscores = (signal_packet_t *)(buf + sizeof(header));
+    memset(sigscores, 0, sizeof(signal_packet_t) * sample->signal_dump_length);
+    obuf->size += recordsize;
+
     for (i = 0; i < length; i++)
         if (!isnan(score[i])) {
             assert(score[i] >= 0.f && score[i] <= 1.f);
@@ -416,26 +502,6 @@ write_polya_score(struct SampleInfo *sample, const float *score, int length,
             sigscores[i].downhill = downhill[i];
         }
 
-    pthread_mutex_lock(&sample->signal_writer_lock);
-
-    if (bgzf_write(sample->stream_signal, (void *)&header,
-                sizeof(header)) < 0 ||
-            bgzf_write(sample->stream_signal, (void *)sigscores,
-                    sizeof(signal_packet_t) * length) < 0) {
-        perror("write_polya_score");
-        return -1;
-    }
-
-    if (length < sample->signal_dump_length &&
-            bgzf_write(sample->stream_signal, (void *)zeropad,
-                       sizeof(signal_packet_t) *
-                       (sample->signal_dump_length - length)) < 0) {
-        perror("write_polya_score");
-        return -1;
-    }
-
-    pthread_mutex_unlock(&sample->signal_writer_lock);
-
     return 0;
 }
 
@@ -459,14 +525,14 @@ add_polya_score_sample(cluster_count_t *samplecounts, float *scores,
 }
 
 
-static int
+int
 check_sequence_for_fair_sampling(struct FairSamplingCount *fair_sampling,
                                  struct PolyASeederParameters *params,
                                  const char *sequence)
 {
     const char *end, *hashptr;
+    uint8_t *slot, count;
     uint64_t v;
-    int r;
 
     end = sequence + params->fair_sampling_fingerprint_length;
 
@@ -475,58 +541,50 @@ check_sequence_for_fair_sampling(struct FairSamplingCount *fair_sampling,
         v = ((v << 3) | ((*hashptr & 7) ^ (v >> 60))) & ((1UL << 63) - 1UL);
     v %= params->fair_sampling_hash_space_size;
 
-    pthread_mutex_lock(&fair_sampling->lock);
-
-    if (params->fair_sampling_max_count == 0 ||
-            fair_sampling->count[v] < params->fair_sampling_max_count) {
-        fair_sampling->count[v]++;
-        r = 0;
-    }
-    else
-        r = -1;
+    if (params->fair_sampling_max_count == 0)
+        return 0;
 
-    pthread_mutex_unlock(&fair_sampling->lock);
+    /* Bump the slot unless it is saturated. A failed exchange reloads the
+     * current count, so the loop retries only while others update it. */
+    slot = &fair_sampling->count[v];
+    count = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    do {
+        if (count >= params->fair_sampling_max_count)
+            return -1;
+    } while (!__atomic_compare_exchange_n(slot, &count, count + 1, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-    return r;
+    return 0;
 }
 
 
+/* Locates the poly(A) tail and checks the balancer signals of a spot. The
+ * poly(A) scores are computed later for a group of spots at once, and then
+ * evaluated by finish_polya_signal(). */
 static int
-process_polya_signal(struct TailseekerConfig *cfg, uint32_t clusterno,
-                     uint32_t global_clusterno, struct SampleInfo *sample,
-                     const char *sequence,
-                     struct CIFData **intensities, int delimiter_end,
-                     int *terminal_mods,
-                     cluster_count_t *pos_score_counts,
-                     cluster_count_t *neg_score_counts,
-                     struct FairSamplingCount *fair_sampling,
-                     int *procflags)
+prepare_polya_signal(struct TailseekerConfig *cfg, uint32_t clusterno,
+                     struct SpotRecord *spot, struct CIFData *intensities)
 {
     int polya_start, polya_end, balancer_len, insert_len, polya_len;
     uint32_t polya_ret;
-    float signal_range_bandwidth[NUM_CHANNELS];
-    float signal_range_low[NUM_CHANNELS];
-    struct PolyASeederParameters params;
-
-    memcpy(&params, &cfg->seederparams, sizeof(params));
 
     /* Locate the starting position of poly(A) tail if available */
-    polya_ret = find_polya(sequence + delimiter_end,
-                           cfg->threep_start + cfg->threep_length - delimiter_end,
+    polya_ret = find_polya(spot->sequence + spot->delimiter_end,
+                           cfg->threep_start + cfg->threep_length - spot->delimiter_end,
                            &cfg->finderparams);
     polya_start = polya_ret >> 16;
     polya_end = polya_ret & 0xffff;
     polya_len = polya_end - polya_start;
-    *terminal_mods = polya_start;
+    spot->terminal_mods = polya_start;
 
-    balancer_len = delimiter_end - cfg->threep_start;
+    balancer_len = spot->delimiter_end - cfg->threep_start;
     if (balancer_len > cfg->balancerparams.length)
         balancer_len = cfg->balancerparams.length;
 
     if (polya_start > 0)
-        *procflags |= PAFLAG_HAVE_3P_MODIFICATION;
+        spot->procflags |= PAFLAG_HAVE_3P_MODIFICATION;
     if (polya_len > 0)
-        *procflags |= PAFLAG_POLYA_DETECTED;
+        spot->procflags |= PAFLAG_POLYA_DETECTED;
 
     /* Check balancer region for all spots including non-poly(A)
      * ones. This can be used to suppress the biased filtering of
@@ -537,38 +595,64 @@ process_polya_signal(struct TailseekerConfig *cfg, uint32_t clusterno,
 
         fetch_intensity(spot_intensities, intensities, 0, balancer_len, clusterno);
 
-        if (check_balancer(signal_range_low, signal_range_bandwidth,
+        if (check_balancer(spot->signal_range_low, spot->signal_range_bandwidth,
                            spot_intensities, cfg->rulerparams.colormatrix,
-                           sequence + cfg->threep_start,
-                           &cfg->balancerparams, balancer_len, procflags) < 0)
+                           spot->sequence + cfg->threep_start,
+                           &cfg->balancerparams, balancer_len, &spot->procflags) < 0)
             return -1;
     }
 
-    insert_len = cfg->threep_start + cfg->threep_length - delimiter_end;
-    if (sample->limit_threep_processing > 0 &&
-            sample->limit_threep_processing < insert_len)
-        insert_len = sample->limit_threep_processing;
+    insert_len = cfg->threep_start + cfg->threep_length - spot->delimiter_end;
+    if (spot->sample->limit_threep_processing > 0 &&
+            spot->sample->limit_threep_processing < insert_len)
+        insert_len = spot->sample->limit_threep_processing;
+
+    spot->polya_start = polya_start;
+    spot->insert_len = insert_len;
+    spot->signal_pending = 1;
+
+    return polya_len;
+}
+
+
+/* Stores the final poly(A) status in the spot. Returns -1 only if the
+ * poly(A) scores could not be written out. */
+static int
+finish_polya_signal(struct TailseekerConfig *cfg, struct SpotRecord *spot,
+                    uint32_t global_clusterno, int lane,
+                    const float *group_scores, const float *group_entropies,
+                    cluster_count_t *pos_score_counts,
+                    cluster_count_t *neg_score_counts,
+                    struct FairSamplingCount *fair_sampling,
+                    struct WriteBuffer *wbuf)
+{
+    int polya_start, insert_len, polya_len, delimiter_end;
+    struct PolyASeederParameters params;
+
+    memcpy(&params, &cfg->seederparams, sizeof(params));
+
+    polya_start = spot->polya_start;
+    polya_len = spot->polya_status;
+    insert_len = spot->insert_len;
+    delimiter_end = spot->delimiter_end;
 
     {
-        struct IntensitySet spot_intensities[insert_len];
         float scores[insert_len], contrast_score;
         char downhill[insert_len];
         int max_contrast_pos, scan_len;
 
-        /* Fetch signal intensities and calculate poly(A) scores. */
-        fetch_intensity(spot_intensities, intensities,
-                        delimiter_end - cfg->threep_start,
-                        insert_len, clusterno);
-
-        if (compute_polya_score(spot_intensities, insert_len,
-                                signal_range_low, signal_range_bandwidth,
-                                &cfg->rulerparams, scores, downhill,
-                                procflags) < 0)
-            return -1;
+        /* Take the poly(A) scores out of the group. */
+        if (collect_polya_scores(group_scores, group_entropies,
+                                 delimiter_end - cfg->threep_start, insert_len, lane,
+                                 &cfg->rulerparams, scores, downhill,
+                                 &spot->procflags) < 0) {
+            spot->polya_status = -1;
+            return 0;
+        }
 
         scan_len = insert_len - polya_start;
         if (scan_len <= 0)
-            return polya_len;
+            return 0;
 
         /* Evaluate the signal trends if it stems from a poly(A) tail.
          * A poly(A) tail has a great contrast among score values
@@ -595,40 +679,179 @@ process_polya_signal(struct TailseekerConfig *cfg, uint32_t clusterno,
         else if (polya_len <= params.negative_sample_polya_length &&
                     scan_len >= params.fair_sampling_fingerprint_length &&
                     check_sequence_for_fair_sampling(fair_sampling,
-                        &params, sequence + delimiter_end + polya_start) == 0)
+                        &params, spot->sequence + delimiter_end + polya_start) == 0)
             add_polya_score_sample(neg_score_counts, scores + polya_start,
                                    scan_len, delimiter_end + polya_start,
                                    params.dist_sampling_bins);
 
         /* Write computed poly(A) scores of long poly(A) candidates
          * for later evaluation. */
-        if (polya_len >= cfg->finderparams.sigproc_trigger_polya_length) {
-            if (write_polya_score(sample, scores + polya_start, scan_len,
-                                  downhill, global_clusterno,
+        if (polya_len >= cfg->finderparams.sigproc_trigger_polya_length &&
+                spot->sample->stream_signal != NULL &&
+                write_polya_score(cfg, spot->sample, wbuf, scores + polya_start,
+                                  scan_len, downhill, global_clusterno,
                                   delimiter_end + polya_start) < 0) {
-                fprintf(stderr, "Failed to write a poly(A) score.\n");
-                return polya_len;
+            fprintf(stderr, "Failed to write a poly(A) score.\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Demultiplexes a spot and runs all per-spot filters. Spots that are filtered
+ * out are left with a NULL sample. */
+static int
+analyze_spot(struct TailseekerConfig *cfg, uint32_t clusterno,
+             struct SampleInfo *noncontrol_samples, struct CIFData *intensities,
+             struct ControlAlignerContext *aligner, struct DemultiplexingStats *allstats,
+             struct SpotRecord *spot)
+{
+    struct DemultiplexingStats *stats;
+    struct SampleInfo *sample;
+    int mismatches;
+
+    spot->sample = NULL;
+    spot->procflags = 0;
+    spot->terminal_mods = -1;
+    spot->signal_pending = 0;
+
+    sample = assign_barcode(spot->sequence + cfg->index_start, cfg->index_length,
+                            noncontrol_samples, cfg->barcode_index, &mismatches);
+    if (sample != NULL)
+        /* barcode is assigned to a regular sample. do nothing here. */;
+    else if (cfg->controlinfo.name[0] == '\0') /* no control sequence is given. treat it Unknown. */
+        sample = cfg->samples; /* the first samples in the list is "Unknown". */
+    else
+        switch (try_alignment_to_control(&cfg->controlinfo, aligner, spot->sequence)) {
+            case 0: /* not aligned to control, set as Unknown. */
+                sample = cfg->samples;
+                break;
+            case 1: /* aligned. set as control. */
+                sample = cfg->controlinfo.barcode; /* set as control */
+                break;
+            case -1: /* error */
+            default:
+                fprintf(stderr, "Failed to align read sequence to control.\n");
+                return -1;
+        }
+
+    stats = &allstats[sample->numindex];
+    if (sample == cfg->controlinfo.barcode)
+        stats->clusters_control_aligned++;
+
+    if (mismatches <= 0) /* no mismatches or falling back to PhiX/Unknown. */
+        stats->clusters_mm0++;
+    else {
+        spot->procflags |= PAFLAG_BARCODE_HAS_MISMATCHES;
+
+        if (mismatches == 1)
+            stats->clusters_mm1++;
+        else
+            stats->clusters_mm2plus++;
+    }
+
+    /* Check fingerprint sequences with defined allowed mismatches. */
+    if (sample->fingerprint_length > 0) {
+        mismatches = count_fingerprint_mismatches(spot->sequence,
+                                                  sample->fingerprint_pos, sample);
+        if (mismatches > sample->maximum_fingerprint_mismatches) {
+            stats->clusters_fpmismatch++;
+            return 0;
+        }
+    }
+
+    /* Check basecalling quality scores in the balancer in 3'-side read.
+     * This will represent how good the signal quality is. Using any
+     * among other regions leads to a biased sampling against long poly(A)
+     * tails. */
+    if (sample->umi_ranges_count > 0 &&
+            check_balancer_basecall_quality(cfg, stats, spot->quality,
+                                            &spot->procflags) < 0)
+        return 0;
+
+    spot->sample = sample;
+
+    if (sample->delimiter_length <= 0)
+        spot->polya_status = spot->delimiter_end = -1;
+    else {
+        spot->delimiter_end = find_delimiter_end_position(spot->sequence,
+                                                          sample, &spot->procflags);
+        if (spot->delimiter_end < 0) {
+            stats->clusters_nodelim++;
+            if (!cfg->keep_no_delimiter) {
+                stats->clusters_nodelim_dropped++;
+                spot->sample = NULL;
+                return 0;
             }
+
+            spot->polya_status = -1;
         }
+        else
+            spot->polya_status = prepare_polya_signal(cfg, clusterno, spot,
+                                                      intensities);
     }
 
-    return polya_len;
+    stats->clusters_passed++;
+
+    return 0;
+}
+
+
+/* Adds up the counters of a job into the samples and clears them. */
+static void
+reduce_demultiplexing_stats(struct TailseekerConfig *cfg,
+                            struct DemultiplexingStats *stats)
+{
+    struct SampleInfo *sample;
+
+    for (sample = cfg->samples; sample != NULL; sample = sample->next) {
+        struct DemultiplexingStats *st=&stats[sample->numindex];
+
+        pthread_mutex_lock(&sample->statslock);
+        sample->clusters_mm0 += st->clusters_mm0;
+        sample->clusters_mm1 += st->clusters_mm1;
+        sample->clusters_mm2plus += st->clusters_mm2plus;
+        sample->clusters_nodelim += st->clusters_nodelim;
+        sample->clusters_fpmismatch += st->clusters_fpmismatch;
+        sample->clusters_qcfailed += st->clusters_qcfailed;
+        sample->clusters_control_aligned += st->clusters_control_aligned;
+        sample->clusters_qcfailed_dropped += st->clusters_qcfailed_dropped;
+        sample->clusters_nodelim_dropped += st->clusters_nodelim_dropped;
+        sample->clusters_passed += st->clusters_passed;
+        pthread_mutex_unlock(&sample->statslock);
+    }
+
+    memset(stats, 0, sizeof(struct DemultiplexingStats) * cfg->num_samples);
 }
 
 
 int
 process_spots(struct TailseekerConfig *cfg, uint32_t firstclusterno,
-              struct CIFData **intensities, struct BCLData **basecalls,
-              struct WriteBuffer *wbuf0, struct WriteBuffer *wbuf,
+              struct CIFData *intensities, struct BCLData **basecalls,
+              struct WriteBuffer *wbuf,
               cluster_count_t *pos_score_counts,
               cluster_count_t *neg_score_counts,
               struct FairSamplingCount *fair_sampling,
-              int jobid, uint32_t cln_start, uint32_t cln_end)
+              struct ControlAlignerContext *aligner,
+              struct DemultiplexingStats *stats,
+              float *group_scores,
+              uint32_t cln_start, uint32_t cln_end)
 {
-    uint32_t clusterno;
-    char sequence_formatted[cfg->total_cycles+1], quality_formatted[cfg->total_cycles+1];
+    uint32_t clusterno, groupstart, groupend;
+    size_t stride=cfg->total_cycles + 1;
+    char groupseqbuf[cfg->transpose_basecalls ? 1 : INTENSITY_LANES * stride];
+    char groupqualbuf[cfg->transpose_basecalls ? 1 : INTENSITY_LANES * stride];
+    size_t tilesize=(cfg->transpose_basecalls ? BASECALL_TILE_CLUSTERS * stride : 1);
+    char tileseqbuf[tilesize], tilequalbuf[tilesize];
+    struct SpotRecord spots[INTENSITY_LANES];
+    float range_low[NUM_CHANNELS * INTENSITY_LANES];
+    float range_bandwidth[NUM_CHANNELS * INTENSITY_LANES];
+    float *group_entropies;
     struct SampleInfo *noncontrol_samples;
-    int mismatches;
+    struct BasecallTile bctile;
+    int i;
 
     /* set the starting point of index matching to non-special (other than Unknown and control)
      * samples */
@@ -637,121 +860,124 @@ process_spots(struct TailseekerConfig *cfg, uint32_t firstclusterno,
          noncontrol_samples = noncontrol_samples->next)
         /* do nothing */;
 
-    mismatches = 0;
+    bctile.nclusters = 0;
+    bctile.seq = bctile.qual = NULL;
+    if (cfg->transpose_basecalls) {
+        bctile.seq = tileseqbuf;
+        bctile.qual = tilequalbuf;
+    }
 
-    for (clusterno = cln_start; clusterno < cln_end; clusterno++) {
-        struct SampleInfo *sample;
-        int delimiter_end, procflags=0;
-        int polya_status, terminal_mods=-1;
+    /* lanes without a spot to score are computed along in vectors */
+    for (i = 0; i < NUM_CHANNELS * INTENSITY_LANES; i++) {
+        range_low[i] = 0.f;
+        range_bandwidth[i] = 1.f;
+    }
 
-        format_basecalls(sequence_formatted, quality_formatted, basecalls,
-                         cfg->total_cycles, clusterno);
+    /* group_scores is a scratch of the worker with room for the scores
+     * and the entropies of all 3'-side cycles of a group. */
+    group_entropies = group_scores + INTENSITY_LANES * cfg->threep_length;
 
-        sample = assign_barcode(sequence_formatted + cfg->index_start, cfg->index_length,
-                                noncontrol_samples, &mismatches);
-        if (sample != NULL)
-            /* barcode is assigned to a regular sample. do nothing here. */;
-        else if (cfg->controlinfo.name[0] == '\0') /* no control sequence is given. treat it Unknown. */
-            sample = cfg->samples; /* the first samples in the list is "Unknown". */
-        else
-            switch (try_alignment_to_control(&cfg->controlinfo, sequence_formatted)) {
-                case 0: /* not aligned to control, set as Unknown. */
-                    sample = cfg->samples;
-                    break;
-                case 1: /* aligned. set as control. */
-                    sample = cfg->controlinfo.barcode; /* set as control */
-                    break;
-                case -1: /* error */
-                default:
-                    fprintf(stderr, "Failed to align read sequence to control.\n");
-                    return -1;
-            }
+    /* Spots are processed in the groups that share lane sets of intensities.
+     * The poly(A) scores of a group are computed at once between the
+     * demultiplexing and the output stages. */
+    for (groupstart = cln_start; groupstart < cln_end; groupstart = groupend) {
+        uint32_t active_lanes;
+        int firstcycle, lastcycle;
 
-        pthread_mutex_lock(&sample->statslock);
-        if (mismatches <= 0) /* no mismatches or falling back to PhiX/Unknown. */
-            sample->clusters_mm0++;
-        else {
-            procflags |= PAFLAG_BARCODE_HAS_MISMATCHES;
+        groupend = groupstart - groupstart % INTENSITY_LANES + INTENSITY_LANES;
+        if (groupend > cln_end)
+            groupend = cln_end;
 
-            if (mismatches == 1)
-                sample->clusters_mm1++;
-            else
-                sample->clusters_mm2plus++;
-        }
-        pthread_mutex_unlock(&sample->statslock);
+        active_lanes = 0;
+        firstcycle = cfg->threep_length;
+        lastcycle = 0;
 
-        /* Check fingerprint sequences with defined allowed mismatches. */
-        if (sample->fingerprint_length > 0) {
-            mismatches = count_fingerprint_mismatches(sequence_formatted,
-                                                      sample->fingerprint_pos, sample);
-            if (mismatches > sample->maximum_fingerprint_mismatches) {
-                pthread_mutex_lock(&sample->statslock);
-                sample->clusters_fpmismatch++;
-                pthread_mutex_unlock(&sample->statslock);
-                continue;
+        for (clusterno = groupstart; clusterno < groupend; clusterno++) {
+            struct SpotRecord *spot;
+            int lane;
+
+            lane = clusterno % INTENSITY_LANES;
+            spot = &spots[lane];
+
+            if (bctile.seq == NULL) {
+                char *seq, *qual;
+
+                seq = groupseqbuf + lane * stride;
+                qual = groupqualbuf + lane * stride;
+                format_basecalls(seq, qual, basecalls, cfg->total_cycles, clusterno);
+                spot->sequence = seq;
+                spot->quality = qual;
             }
-        }
+            else {
+                size_t offset;
 
-        /* Check basecalling quality scores in the balancer in 3'-side read.
-         * This will represent how good the signal quality is. Using any
-         * among other regions leads to a biased sampling against long poly(A)
-         * tails. */
-        if (sample->umi_ranges_count > 0 &&
-                check_balancer_basecall_quality(cfg, sample, quality_formatted,
-                                                &procflags) < 0)
-            continue;
-
-        if (sample->delimiter_length <= 0)
-            polya_status = delimiter_end = -1;
-        else {
-            delimiter_end = find_delimiter_end_position(sequence_formatted,
-                                                        sample, &procflags);
-            if (delimiter_end < 0) {
-                pthread_mutex_lock(&sample->statslock);
-                sample->clusters_nodelim++;
-                pthread_mutex_unlock(&sample->statslock);
-                if (!cfg->keep_no_delimiter)
-                    continue;
-
-                polya_status = -1;
+                if (clusterno == cln_start ||
+                        clusterno >= bctile.first_cluster + bctile.nclusters)
+                    transpose_basecalls(&bctile, basecalls, cfg->total_cycles, clusterno,
+                                        min_int(BASECALL_TILE_CLUSTERS, cln_end - clusterno));
+
+                offset = (clusterno - bctile.first_cluster) * bctile.stride;
+                spot->sequence = bctile.seq + offset;
+                spot->quality = bctile.qual + offset;
             }
-            else
-                polya_status = process_polya_signal(cfg, clusterno,
-                      firstclusterno + clusterno, sample,
-                      sequence_formatted,
-                      intensities, delimiter_end, &terminal_mods,
-                      pos_score_counts, neg_score_counts,
-                      fair_sampling, &procflags);
-        }
 
-        if (write_measurements_to_buffers(cfg, wbuf, sample,
-                firstclusterno + clusterno, sequence_formatted, quality_formatted,
-                procflags, delimiter_end, polya_status, terminal_mods) < 0) {
-            perror("process_spots");
+            if (analyze_spot(cfg, clusterno, noncontrol_samples, intensities,
+                             aligner, stats, spot) < 0)
+                return -1;
+
+            if (spot->signal_pending) {
+                int chan, spotfirst;
 
-            return -1;
+                for (chan = 0; chan < NUM_CHANNELS; chan++) {
+                    range_low[chan * INTENSITY_LANES + lane] = spot->signal_range_low[chan];
+                    range_bandwidth[chan * INTENSITY_LANES + lane] =
+                            spot->signal_range_bandwidth[chan];
+                }
+
+                spotfirst = spot->delimiter_end - cfg->threep_start;
+                if (spotfirst < firstcycle)
+                    firstcycle = spotfirst;
+                if (spotfirst + spot->insert_len > lastcycle)
+                    lastcycle = spotfirst + spot->insert_len;
+
+                active_lanes |= 1 << lane;
+            }
         }
-    }
 
-    {
-        struct SampleInfo *sample;
-
-        for (sample = cfg->samples; sample != NULL; sample = sample->next) {
-            if (sync_write_out_buffer(sample->stream_seqqual,
-                                      wbuf0[sample->numindex].buf_seqqual,
-                                      (size_t)(wbuf[sample->numindex].buf_seqqual -
-                                               wbuf0[sample->numindex].buf_seqqual),
-                                      &sample->wsync_seqqual, jobid) < 0)
+        if (active_lanes != 0)
+            compute_polya_score_lanes(CIFDATA_LANESET(intensities, groupstart, 0),
+                                      firstcycle, lastcycle, active_lanes,
+                                      range_low, range_bandwidth, &cfg->rulerparams,
+                                      group_scores, group_entropies);
+
+        for (clusterno = groupstart; clusterno < groupend; clusterno++) {
+            struct SpotRecord *spot;
+            int lane;
+
+            lane = clusterno % INTENSITY_LANES;
+            spot = &spots[lane];
+
+            if (spot->sample == NULL)
+                continue;
+
+            if (spot->signal_pending &&
+                    finish_polya_signal(cfg, spot, firstclusterno + clusterno, lane,
+                        group_scores, group_entropies,
+                        pos_score_counts, neg_score_counts, fair_sampling,
+                        wbuf) < 0)
                 return -1;
 
-            if (sync_write_out_buffer(sample->stream_taginfo,
-                                      wbuf0[sample->numindex].buf_taginfo,
-                                      (size_t)(wbuf[sample->numindex].buf_taginfo -
-                                               wbuf0[sample->numindex].buf_taginfo),
-                                      &sample->wsync_taginfo, jobid) < 0)
+            if (write_measurements_to_buffers(cfg, wbuf, spot->sample,
+                    firstclusterno + clusterno, spot->sequence, spot->quality,
+                    spot->procflags, spot->delimiter_end, spot->polya_status,
+                    spot->terminal_mods) < 0) {
+                perror("process_spots");
                 return -1;
+            }
         }
     }
 
+    reduce_demultiplexing_stats(cfg, stats);
+
     return 0;
 }
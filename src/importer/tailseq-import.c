@@ -103,7 +103,21 @@ write_output_file_headers(struct TailseekerConfig *cfg, uint32_t total_clusters)
     struct SampleInfo *sample;
 
     for (sample = cfg->samples; sample != NULL; sample = sample->next) {
-        if (sample->stream_signal != NULL) {
+        if (sample->stream_signal != NULL &&
+                cfg->signal_score_bits != SIGNALPACK_V1_SCORE_BITS) {
+            struct SignalFileHeaderV2 sigdumpheader;
+
+            sigdumpheader.magic = SIGNALPACK_V2_MAGIC;
+            sigdumpheader.total_clusters = total_clusters;
+            sigdumpheader.max_cycles = sample->signal_dump_length;
+            sigdumpheader.score_bits = cfg->signal_score_bits;
+            if (bgzf_write(sample->stream_signal, (void *)&sigdumpheader,
+                           sizeof(sigdumpheader)) < 0) {
+                perror("write_output_file_headers");
+                return -1;
+            }
+        }
+        else if (sample->stream_signal != NULL) {
             /* Write header for signal dumps */
             uint32_t sigdumpheader[3];
             sigdumpheader[0] = sizeof(signal_packet_t);
@@ -115,6 +129,57 @@ write_output_file_headers(struct TailseekerConfig *cfg, uint32_t total_clusters)
                 return -1;
             }
         }
+
+        if (cfg->binary_output) {
+            struct TagPackFileHeader header;
+
+            tagpack_init_file_header(&header, TAGPACK_TYPE_SEQQUAL,
+                                     cfg->fivep_length, 0);
+            if (sample->stream_seqqual != NULL &&
+                    bgzf_write(sample->stream_seqqual, (void *)&header,
+                               sizeof(header)) < 0) {
+                perror("write_output_file_headers");
+                return -1;
+            }
+
+            tagpack_init_file_header(&header, TAGPACK_TYPE_TAGINFO,
+                                     0, sample->umi_total_length);
+            if (sample->stream_taginfo != NULL &&
+                    bgzf_write(sample->stream_taginfo, (void *)&header,
+                               sizeof(header)) < 0) {
+                perror("write_output_file_headers");
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/* Marks the end of the block format files. Readers take the files without
+ * the marker as truncated. */
+static int
+write_output_file_trailers(struct TailseekerConfig *cfg)
+{
+    struct SampleInfo *sample;
+    struct TagPackBlockHeader endmarker;
+
+    if (!cfg->binary_output)
+        return 0;
+
+    tagpack_init_end_marker(&endmarker);
+
+    for (sample = cfg->samples; sample != NULL; sample = sample->next) {
+        if ((sample->stream_seqqual != NULL &&
+                bgzf_write(sample->stream_seqqual, (void *)&endmarker,
+                           sizeof(endmarker)) < 0) ||
+            (sample->stream_taginfo != NULL &&
+                bgzf_write(sample->stream_taginfo, (void *)&endmarker,
+                           sizeof(endmarker)) < 0)) {
+            perror("write_output_file_trailers");
+            return -1;
+        }
     }
 
     return 0;
@@ -145,34 +210,25 @@ close_writers(struct SampleInfo *sample)
 
 static int
 initialize_cif_bcl_buffers(struct TailseekerConfig *cfg,
-                           struct CIFData ***intensities, struct BCLData ***basecalls)
+                           struct CIFData **intensities, struct BCLData ***basecalls)
 {
-    struct CIFData **cifdata;
+    struct CIFData *cifdata;
     struct BCLData **bcldata;
     int i;
 
-    cifdata = malloc(sizeof(struct CIFData *) * cfg->threep_length);
-    if (cifdata == NULL) {
-        perror("initialize_cif_bcl_buffers");
+    cifdata = new_cif_data(cfg->read_buffer_entry_count, cfg->threep_length);
+    if (cifdata == NULL)
         return -1;
-    }
 
     bcldata = malloc(sizeof(struct BCLData *) * cfg->total_cycles);
     if (bcldata == NULL) {
-        free(cifdata);
+        free_cif_data(cifdata);
         perror("initialize_cif_bcl_buffers");
         return -1;
     }
 
-    memset(cifdata, 0, sizeof(struct CIFData *) * cfg->threep_length);
     memset(bcldata, 0, sizeof(struct BCLData *) * cfg->total_cycles);
 
-    for (i = 0; i < cfg->threep_length; i++) {
-        cifdata[i] = new_cif_data(cfg->read_buffer_entry_count);
-        if (cifdata[i] == NULL)
-            goto onError;
-    }
-
     for (i = 0; i < cfg->total_cycles; i++) {
         bcldata[i] = new_bcl_data(cfg->read_buffer_entry_count);
         if (bcldata[i] == NULL)
@@ -187,26 +243,73 @@ initialize_cif_bcl_buffers(struct TailseekerConfig *cfg,
   onError:
     perror("initialize_cif_bcl_buffers");
 
-    for (i = 0; i < cfg->threep_length; i++)
-        if (cifdata[i] != NULL)
-            free_cif_data(cifdata[i]);
+    free_cif_data(cifdata);
 
     for (i = 0; i < cfg->total_cycles; i++)
         if (bcldata[i] != NULL)
             free_bcl_data(bcldata[i]);
 
     free(bcldata);
-    free(cifdata);
 
     return -1;
 }
 
 
+static void
+free_cif_bcl_buffers(struct TailseekerConfig *cfg,
+                     struct CIFData *intensities, struct BCLData **basecalls)
+{
+    int cycleno;
+
+    if (intensities != NULL)
+        free_cif_data(intensities);
+
+    if (basecalls != NULL) {
+        for (cycleno = 0; cycleno < cfg->total_cycles; cycleno++)
+            if (basecalls[cycleno] != NULL)
+                free_bcl_data(basecalls[cycleno]);
+        free(basecalls);
+    }
+}
+
+
+/* Decodes the BCL files of a block in this thread together with the workers
+ * that have no job left, so the decoding adds no threads of its own. */
+static int
+decode_basecalls(struct ParallelJobPool *workers, struct BCLReader **bclreader,
+                 struct BCLData **basecalls, int ncycles, uint32_t nclusters,
+                 double *bcl_decode_time)
+{
+    struct BCLDecodingPool decoding;
+
+    init_bcl_decoding(&decoding, bclreader, basecalls, ncycles, nclusters,
+                      bcl_decode_time);
+
+    pthread_mutex_lock(&workers->poollock);
+    workers->decoding = &decoding;
+    workers->decodings_started++;
+    pthread_cond_broadcast(&workers->block_ready);
+    pthread_mutex_unlock(&workers->poollock);
+
+    run_bcl_decoding(&decoding);
+
+    /* Wait for the cycles still being decoded by the workers. */
+    pthread_mutex_lock(&workers->poollock);
+    workers->decoding = NULL;
+    while (workers->decoding_helpers > 0)
+        pthread_cond_wait(&workers->decoding_done, &workers->poollock);
+    pthread_mutex_unlock(&workers->poollock);
+
+    return finish_bcl_decoding(&decoding);
+}
+
+
 static int
-load_intensities_and_basecalls(struct TailseekerConfig *cfg,
+load_intensities_and_basecalls(struct TailseekerConfig *cfg, struct ParallelJobPool *workers,
                                struct CIFReader **cifreader, struct BCLReader **bclreader,
                                int blocksize,
-                               struct CIFData **intensities, struct BCLData **basecalls)
+                               struct CIFData *intensities, struct BCLData **basecalls,
+                               double *bcl_decode_time)
 {
     struct AlternativeCallInfo *altcalls;
     int cycleno;
@@ -217,16 +320,11 @@ load_intensities_and_basecalls(struct TailseekerConfig *cfg,
             return -1;
 
     for (cycleno = 0; cycleno < cfg->threep_length; cycleno++)
-        if (load_cif_data(cifreader[cycleno], intensities[cycleno], blocksize) == -1)
+        if (load_cif_data(cifreader[cycleno], intensities, cycleno, blocksize) == -1)
             return -1;
 
-    for (cycleno = 0; cycleno < cfg->total_cycles; cycleno++)
-        if (bclreader[cycleno] == BCLREADER_OVERRIDDEN)
-            /* do nothing */;
-        else if (load_bcl_data(bclreader[cycleno], basecalls[cycleno], blocksize) == -1)
-            return -1;
-
-    return 0;
+    return decode_basecalls(workers, bclreader, basecalls, cfg->total_cycles, blocksize,
+                            bcl_decode_time);
 }
 
 
@@ -247,6 +345,7 @@ allocate_global_stats_buffer(struct TailseekerConfig *cfg,
             free(buf->pos_score_counts);
         if (buf->neg_score_counts != NULL)
             free(buf->neg_score_counts);
+        buf->pos_score_counts = buf->neg_score_counts = NULL;
         return -1;
     }
 
@@ -257,6 +356,20 @@ allocate_global_stats_buffer(struct TailseekerConfig *cfg,
 }
 
 
+static void
+reset_global_stats_buffer(struct TailseekerConfig *cfg,
+                          struct GloballyAggregatedOutput *buf)
+{
+    size_t scoresamplesize;
+
+    scoresamplesize = sizeof(cluster_count_t) * cfg->seederparams.dist_sampling_bins *
+                      cfg->total_cycles;
+
+    memset(buf->pos_score_counts, 0, scoresamplesize);
+    memset(buf->neg_score_counts, 0, scoresamplesize);
+}
+
+
 static void
 free_global_stats_buffer(struct GloballyAggregatedOutput *buf)
 {
@@ -339,247 +452,450 @@ accumulate_global_stats_buffer(struct GloballyAggregatedOutput *dest,
 }
 
 
-static struct ParallelJobPool *
-prepare_split_jobs(struct TailseekerConfig *cfg, uint32_t nclusters, int clusters_per_job)
+/* Takes the job at the head (owner) or the tail (thief) of a deque.
+ * Returns the position in the deque or -1 if it's empty. */
+static int
+pop_job(struct JobDeque *deque, int steal)
 {
-    struct ParallelJobPool *pool;
-    struct SampleInfo *sample;
-    size_t poolmemsize;
-    int njobs, i;
+    uint64_t range, newrange;
+    uint32_t head, tail;
+    int pos;
+
+    range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+    do {
+        head = (uint32_t)range;
+        tail = (uint32_t)(range >> 32);
+        if (head >= tail)
+            return -1;
 
-    njobs = (nclusters + clusters_per_job - 1) / clusters_per_job;
-    poolmemsize = sizeof(struct ParallelJobPool) + sizeof(struct ParallelJob) * njobs;
-    pool = malloc(poolmemsize);
-    if (pool == NULL)
-        return NULL;
+        if (steal)
+            pos = --tail;
+        else
+            pos = head++;
 
-    memset(pool, 0, poolmemsize);
-    pool->jobs_total = njobs;
-    pthread_mutex_init(&pool->poollock, NULL);
+        newrange = head | ((uint64_t)tail << 32);
+    } while (!__atomic_compare_exchange_n(&deque->range, &range, newrange, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-    if (allocate_global_stats_buffer(cfg, &pool->global_stats) < 0) {
-        free(pool);
-        return NULL;
-    }
+    return pos;
+}
 
-    pool->fair_sampling.count = malloc(cfg->seederparams.fair_sampling_hash_space_size);
-    if (pool->fair_sampling.count == NULL) {
-        free_global_stats_buffer(&pool->global_stats);
-        free(pool);
-        return NULL;
-    }
-    memset(pool->fair_sampling.count, 0, cfg->seederparams.fair_sampling_hash_space_size);
-    pthread_mutex_init(&pool->fair_sampling.lock, NULL);
-
-    for (i = 0; i < njobs; i++) {
-        pool->jobs[i].jobid = i;
-        pool->jobs[i].start = i * clusters_per_job;
-        pool->jobs[i].end = (i + 1) * clusters_per_job;
-        if (pool->jobs[i].end > nclusters)
-            pool->jobs[i].end = nclusters;
-    }
 
-    for (sample = cfg->samples; sample != NULL; sample = sample->next) {
-        sample->wsync_seqqual.jobs_written = 0;
-        sample->wsync_taginfo.jobs_written = 0;
+/* Returns the next job id for the worker or -1 if no job is left anywhere. */
+static int
+take_job(struct SpotWorker *worker)
+{
+    struct ParallelJobPool *pool = worker->pool;
+    int i, pos;
 
-        pthread_cond_init(&sample->wsync_seqqual.wakeup, NULL);
-        pthread_cond_init(&sample->wsync_taginfo.wakeup, NULL);
+    pos = pop_job(&worker->deque, 0);
+    if (pos >= 0)
+        return worker->workerid + pos * pool->nworkers;
 
-        pthread_mutex_init(&sample->wsync_seqqual.lock, NULL);
-        pthread_mutex_init(&sample->wsync_taginfo.lock, NULL);
+    for (i = 1; i < pool->nworkers; i++) {
+        struct SpotWorker *victim;
+
+        victim = &pool->workers[(worker->workerid + i) % pool->nworkers];
+        pos = pop_job(&victim->deque, 1);
+        if (pos >= 0)
+            return victim->workerid + pos * pool->nworkers;
     }
 
-    return pool;
+    return -1;
 }
 
 
-static void
-free_parallel_jobs(struct ParallelJobPool *pool, struct SampleInfo *samples)
+static int
+run_block_jobs(struct SpotWorker *worker)
 {
-    free(pool->fair_sampling.count);
-    pthread_mutex_destroy(&pool->fair_sampling.lock);
-    free_global_stats_buffer(&pool->global_stats);
-    pthread_mutex_destroy(&pool->poollock);
-    free(pool);
+    struct ParallelJobPool *pool = worker->pool;
+    struct OutputBatch *batch;
+    int jobid;
 
-    for (; samples != NULL; samples = samples->next) {
-        pthread_cond_destroy(&samples->wsync_seqqual.wakeup);
-        pthread_cond_destroy(&samples->wsync_taginfo.wakeup);
+    while ((jobid = take_job(worker)) >= 0) {
+        uint32_t start, end;
 
-        pthread_mutex_destroy(&samples->wsync_seqqual.lock);
-        pthread_mutex_destroy(&samples->wsync_taginfo.lock);
-    }
-}
+        batch = acquire_output_batch(pool->writer, pool->first_batchno + jobid);
+        if (batch == NULL)
+            return -1;
 
+        start = jobid * NUM_CLUSTERS_PER_JOB;
+        end = start + NUM_CLUSTERS_PER_JOB;
+        if (end > pool->nclusters)
+            end = pool->nclusters;
+
+        if (process_spots(pool->cfg, pool->firstclusterno, pool->intensities,
+                          pool->basecalls, batch->buffers,
+                          worker->gstats.pos_score_counts,
+                          worker->gstats.neg_score_counts,
+                          &pool->fair_sampling, worker->aligner, worker->stats,
+                          worker->group_scores, start, end) < 0 ||
+                (pool->cfg->binary_output &&
+                 pack_output_batch(pool->cfg, batch, &worker->packbuf) < 0)) {
+            release_output_batch(pool->writer, batch);
+            return -1;
+        }
 
-static int
-run_spot_processing(struct ParallelJobPool *pool)
-{
-    struct WriteBuffer *wbuf, *wbuf0;
-    struct GloballyAggregatedOutput gstats;
-    size_t memsize, wbufsize;
-    char *buf, *buf0;
-    int i, r=0;
-
-    buf = buf0 = NULL;
-    wbuf = wbuf0 = NULL;
-
-    memsize = (pool->bufsize_seqqual + pool->bufsize_taginfo) *
-              pool->cfg->num_samples;
-    buf = buf0 = malloc(memsize);
-    if (buf == NULL)
-        goto onError;
+        if (submit_output_batch(pool->writer, batch) < 0)
+            return -1;
+    }
 
-    wbufsize = sizeof(struct WriteBuffer) * pool->cfg->num_samples;
-    wbuf = malloc(wbufsize);
-    if (wbuf == NULL)
-        goto onError;
+    return 0;
+}
 
-    wbuf0 = malloc(wbufsize);
-    if (wbuf0 == NULL)
-        goto onError;
 
-    if (allocate_global_stats_buffer(pool->cfg, &gstats) < 0)
-        goto onError;
+static void *
+run_spot_worker(void *arg)
+{
+    struct SpotWorker *worker = (struct SpotWorker *)arg;
+    struct ParallelJobPool *pool = worker->pool;
+    uint32_t blocks_seen, decodings_seen;
+    int r;
 
-    for (i = 0; i < pool->cfg->num_samples; i++) {
-        wbuf0[i].buf_seqqual = buf;
-        buf += pool->bufsize_seqqual;
-        wbuf0[i].buf_taginfo = buf;
-        buf += pool->bufsize_taginfo;
-    }
+    blocks_seen = decodings_seen = 0;
 
     while (1) {
-        struct ParallelJob *job;
+        pthread_mutex_lock(&pool->poollock);
+        while (pool->blocks_started == blocks_seen &&
+               pool->decodings_started == decodings_seen && !pool->shutting_down)
+            pthread_cond_wait(&pool->block_ready, &pool->poollock);
 
-        { /* Select a job to run. */
-            pthread_mutex_lock(&pool->poollock);
+        if (pool->shutting_down) {
+            pthread_mutex_unlock(&pool->poollock);
+            break;
+        }
+
+        /* Jobs of a block go before the decoding of the next one. */
+        if (pool->blocks_started == blocks_seen) {
+            struct BCLDecodingPool *decoding;
 
-            if (pool->error_occurred > 0 || pool->job_next >= pool->jobs_total) {
+            decodings_seen = pool->decodings_started;
+            decoding = pool->decoding;
+            if (decoding == NULL) { /* already finished */
                 pthread_mutex_unlock(&pool->poollock);
-                break;
+                continue;
             }
-            job = &pool->jobs[pool->job_next++];
+            pool->decoding_helpers++;
+            pthread_mutex_unlock(&pool->poollock);
+
+            run_bcl_decoding(decoding);
 
+            pthread_mutex_lock(&pool->poollock);
+            if (--pool->decoding_helpers == 0)
+                pthread_cond_signal(&pool->decoding_done);
             pthread_mutex_unlock(&pool->poollock);
+            continue;
         }
 
-        memcpy(wbuf, wbuf0, wbufsize);
+        blocks_seen = pool->blocks_started;
+        pthread_mutex_unlock(&pool->poollock);
 
-        r = process_spots(pool->cfg, pool->firstclusterno, pool->intensities,
-                          pool->basecalls, wbuf0, wbuf,
-                          gstats.pos_score_counts, gstats.neg_score_counts,
-                          &pool->fair_sampling, job->jobid,
-                          job->start, job->end);
+        r = run_block_jobs(worker);
         if (r < 0)
-            break;
-
-        pthread_mutex_lock(&pool->poollock);
-        pool->jobs_done++;
-        pthread_mutex_unlock(&pool->poollock);
-    }
+            /* The writer would wait forever for the batch of the failed job. */
+            abort_output_writer(pool->writer);
 
-    {   /* Accumulate the collected counts into the global stats. */
         pthread_mutex_lock(&pool->poollock);
-        accumulate_global_stats_buffer(&pool->global_stats, &gstats,
+        accumulate_global_stats_buffer(&pool->global_stats, &worker->gstats,
                                        pool->cfg->seederparams.dist_sampling_bins *
                                        pool->cfg->total_cycles);
+        if (r < 0)
+            pool->error_occurred++;
+        if (--pool->workers_running == 0)
+            pthread_cond_signal(&pool->block_done);
         pthread_mutex_unlock(&pool->poollock);
+
+        reset_global_stats_buffer(pool->cfg, &worker->gstats);
     }
 
-    free_global_stats_buffer(&gstats);
-    free(wbuf0);
-    free(wbuf);
-    free(buf0);
+    return NULL;
+}
 
-    if (r >= 0) {
-        pthread_exit((void *)0);
-        return 0;
+
+static void
+free_spot_worker(struct SpotWorker *worker)
+{
+    if (worker->aligner != NULL)
+        free_control_aligner_context(worker->aligner);
+    if (worker->stats != NULL)
+        free(worker->stats);
+    free_global_stats_buffer(&worker->gstats);
+    if (worker->packbuf.data != NULL)
+        free(worker->packbuf.data);
+    if (worker->group_scores != NULL)
+        free(worker->group_scores);
+}
+
+
+static int
+initialize_spot_worker(struct ParallelJobPool *pool, struct SpotWorker *worker,
+                       int workerid)
+{
+    struct TailseekerConfig *cfg = pool->cfg;
+
+    memset(worker, 0, sizeof(*worker));
+    worker->pool = pool;
+    worker->workerid = workerid;
+
+    if (cfg->controlinfo.name[0] != '\0') {
+        worker->aligner = new_control_aligner_context(&cfg->controlinfo);
+        if (worker->aligner == NULL)
+            goto onError;
+    }
+
+    /* one cache line per sample keeps the workers off each other's counters */
+    if (posix_memalign((void **)&worker->stats, CACHE_LINE_SIZE,
+                       sizeof(struct DemultiplexingStats) * cfg->num_samples) != 0) {
+        worker->stats = NULL;
+        goto onError;
     }
+    memset(worker->stats, 0, sizeof(struct DemultiplexingStats) * cfg->num_samples);
 
-onError:
-    if (wbuf0 != NULL)
-        free(wbuf0);
-    if (wbuf != NULL)
-        free(wbuf);
-    if (buf0 != NULL)
-        free(buf0);
+    if (allocate_global_stats_buffer(cfg, &worker->gstats) < 0)
+        goto onError;
+
+    worker->group_scores = malloc(sizeof(float) * INTENSITY_LANES *
+                                  cfg->threep_length * 2);
+    if (worker->group_scores == NULL)
+        goto onError;
+
+    return 0;
+
+  onError:
+    free_spot_worker(worker);
+    return -1;
+}
+
+
+static void
+free_parallel_job_pool(struct ParallelJobPool *pool)
+{
+    int i;
 
     pthread_mutex_lock(&pool->poollock);
-    pool->error_occurred++;
+    pool->shutting_down = 1;
+    pthread_cond_broadcast(&pool->block_ready);
     pthread_mutex_unlock(&pool->poollock);
 
-    pthread_exit((void *)1);
-    return -1;
+    for (i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        free_spot_worker(&pool->workers[i]);
+    }
+
+    free(pool->workers);
+    free(pool->fair_sampling.count);
+    free_global_stats_buffer(&pool->global_stats);
+    pthread_cond_destroy(&pool->block_ready);
+    pthread_cond_destroy(&pool->block_done);
+    pthread_cond_destroy(&pool->decoding_done);
+    pthread_mutex_destroy(&pool->poollock);
+    free(pool);
+}
+
+
+static struct ParallelJobPool *
+new_parallel_job_pool(struct TailseekerConfig *cfg, struct OutputWriter *writer)
+{
+    struct ParallelJobPool *pool;
+    int i;
+
+    pool = malloc(sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->cfg = cfg;
+    pool->writer = writer;
+    pthread_mutex_init(&pool->poollock, NULL);
+    pthread_cond_init(&pool->block_ready, NULL);
+    pthread_cond_init(&pool->block_done, NULL);
+    pthread_cond_init(&pool->decoding_done, NULL);
+
+    if (allocate_global_stats_buffer(cfg, &pool->global_stats) < 0)
+        goto onError;
+
+    pool->fair_sampling.count = malloc(cfg->seederparams.fair_sampling_hash_space_size);
+    if (pool->fair_sampling.count == NULL)
+        goto onError;
+
+    if (posix_memalign((void **)&pool->workers, CACHE_LINE_SIZE,
+                       sizeof(struct SpotWorker) * cfg->threads) != 0) {
+        pool->workers = NULL;
+        goto onError;
+    }
+
+    /* nworkers counts the threads started, so that they can be joined. */
+    for (i = 0; i < cfg->threads; i++) {
+        if (initialize_spot_worker(pool, &pool->workers[i], i) < 0)
+            goto onError;
+
+        if (pthread_create(&pool->workers[i].thread, NULL, run_spot_worker,
+                           (void *)&pool->workers[i]) != 0) {
+            perror("new_parallel_job_pool");
+            free_spot_worker(&pool->workers[i]);
+            goto onError;
+        }
+
+        pool->nworkers++;
+    }
+
+    return pool;
+
+  onError:
+    if (pool->workers != NULL)
+        free_parallel_job_pool(pool);
+    else {
+        if (pool->fair_sampling.count != NULL)
+            free(pool->fair_sampling.count);
+        free_global_stats_buffer(&pool->global_stats);
+        pthread_cond_destroy(&pool->block_ready);
+        pthread_cond_destroy(&pool->block_done);
+        pthread_cond_destroy(&pool->decoding_done);
+        pthread_mutex_destroy(&pool->poollock);
+        free(pool);
+    }
+
+    return NULL;
 }
 
 
 static int
-distribute_processing(struct TailseekerConfig *cfg, struct CIFData **intensities,
+distribute_processing(struct ParallelJobPool *pool, struct CIFData *intensities,
                       struct BCLData **basecalls, uint32_t firstclusterno)
 {
+    struct TailseekerConfig *cfg = pool->cfg;
     uint32_t cycleno, clustersinblock;
-    struct ParallelJobPool *pool;
-    pthread_t threads[cfg->threads];
-    int i, r;
+    int njobs, i, r;
 
-    clustersinblock = intensities[0]->nclusters;
+    clustersinblock = intensities->nclusters;
 
-    for (cycleno = 0; cycleno < cfg->threep_length; cycleno++)
-        if (clustersinblock != intensities[cycleno]->nclusters) {
-            fprintf(stderr, "Inconsistent number of clusters in CIF cycle %d.\n",
-                    cfg->threep_length + cycleno + 1);
-            return -1;
-        }
     for (cycleno = 0; cycleno < cfg->total_cycles; cycleno++)
         if (clustersinblock != basecalls[cycleno]->nclusters) {
             fprintf(stderr, "Inconsistent number of clusters in cycle %d.\n", cycleno + 1);
             return -1;
         }
 
-    pool = prepare_split_jobs(cfg, clustersinblock, NUM_CLUSTERS_PER_JOB);
-    if (pool == NULL)
-        return -1;
+    njobs = (clustersinblock + NUM_CLUSTERS_PER_JOB - 1) / NUM_CLUSTERS_PER_JOB;
+
+    /* The sampling counts are kept per block. */
+    memset(pool->fair_sampling.count, 0, cfg->seederparams.fair_sampling_hash_space_size);
+    reset_global_stats_buffer(cfg, &pool->global_stats);
 
-    pool->error_occurred = 0;
-    pool->cfg = cfg;
     pool->intensities = intensities;
     pool->basecalls = basecalls;
     pool->firstclusterno = firstclusterno;
-    pool->bufsize_seqqual = NUM_CLUSTERS_PER_JOB * cfg->max_bufsize_seqqual;
-    pool->bufsize_taginfo = NUM_CLUSTERS_PER_JOB * cfg->max_bufsize_taginfo;
+    pool->nclusters = clustersinblock;
+    pool->jobs_total = njobs;
+    pool->first_batchno = reserve_output_batches(pool->writer, njobs);
+
+    /* Jobs are dealt round-robin, so the workers go through a block roughly
+     * in the output order. */
+    for (i = 0; i < pool->nworkers; i++) {
+        uint32_t count;
+
+        count = (i < njobs) ? (njobs - i + pool->nworkers - 1) / pool->nworkers : 0;
+        pool->workers[i].deque.range = (uint64_t)count << 32;
+    }
 
-    for (i = 0; i < cfg->threads; i++)
-        pthread_create(&threads[i], NULL, (void *)run_spot_processing, (void *)pool);
+    pthread_mutex_lock(&pool->poollock);
+    pool->workers_running = pool->nworkers;
+    pool->blocks_started++;
+    pthread_cond_broadcast(&pool->block_ready);
 
-    for (i = 0; i < cfg->threads; i++)
-        pthread_join(threads[i], NULL);
+    while (pool->workers_running > 0)
+        pthread_cond_wait(&pool->block_done, &pool->poollock);
 
     r = (pool->error_occurred > 0) * -1;
+    pthread_mutex_unlock(&pool->poollock);
 
     if (r == 0 && write_global_stats_data(cfg, &pool->global_stats) < 0)
         r = -1;
 
-    free_parallel_jobs(pool, cfg->samples);
-
     return r;
 }
 
 
+static void
+report_bcl_decode_time(const char *msgprefix, struct BCLReader **bclreader,
+                       const double *decode_time, int ncycles)
+{
+    double total, slowest;
+    int cycleno, slowest_cycle, ndecoded;
+
+    total = slowest = 0.;
+    slowest_cycle = ndecoded = 0;
+
+    for (cycleno = 0; cycleno < ncycles; cycleno++) {
+        if (bclreader[cycleno] == BCLREADER_OVERRIDDEN)
+            continue;
+
+        ndecoded++;
+        total += decode_time[cycleno];
+        if (decode_time[cycleno] > slowest) {
+            slowest = decode_time[cycleno];
+            slowest_cycle = cycleno;
+        }
+    }
+
+    if (ndecoded > 0)
+        printf("%sBCL decoding took %.2f s over %d cycles (%.1f ms per cycle, "
+               "slowest %.1f ms at cycle %d).\n", msgprefix, total, ndecoded,
+               total / ndecoded * 1000., slowest * 1000., slowest_cycle + 1);
+}
+
+
+/* Counters that are not in the demultiplexing statistics CSV */
+static void
+report_filtering_counts(const char *msgprefix, struct TailseekerConfig *cfg)
+{
+    struct SampleInfo *sample;
+
+    for (sample = cfg->samples; sample != NULL; sample = sample->next) {
+        if (sample == cfg->controlinfo.barcode)
+            printf("%s%s: %u clusters aligned to the control.\n", msgprefix,
+                   sample->name, sample->clusters_control_aligned);
+
+        printf("%s%s: %u clusters passed, dropped %u (fingerprint), "
+               "%u (balancer quality), %u (no delimiter).\n", msgprefix,
+               sample->name, sample->clusters_passed, sample->clusters_fpmismatch,
+               sample->clusters_qcfailed_dropped, sample->clusters_nodelim_dropped);
+    }
+}
+
+
+static void *
+run_block_loading(void *arg)
+{
+    struct BlockLoadingJob *job = (struct BlockLoadingJob *)arg;
+
+    job->result = load_intensities_and_basecalls(job->cfg, job->workers,
+                                                 job->cifreader, job->bclreader,
+                                                 job->blocksize, job->intensities,
+                                                 job->basecalls, job->bcl_decode_time);
+    return NULL;
+}
+
+
 static int
 process(struct TailseekerConfig *cfg)
 {
     struct CIFReader **cifreader;
     struct BCLReader **bclreader;
-    struct CIFData **intensities;
-    struct BCLData **basecalls;
+    struct CIFData *intensities[MAX_READ_BUFFER_SETS];
+    struct BCLData **basecalls[MAX_READ_BUFFER_SETS];
+    struct BlockLoadingJob loadjob;
+    struct OutputWriter *writer;
+    struct ParallelJobPool *workers;
+    pthread_t loader;
+    double *bcl_decode_time;
     uint32_t clusters_to_go, blockno, nclusters, totalblocks;
-    int cycleno, clusters_to_read, blocksize;
+    int clusters_to_read, blocksize, nbufsets, bufset;
     char msgprefix[BUFSIZ];
 
     blocksize = cfg->read_buffer_entry_count;
-    initialize_control_aligner(&cfg->controlinfo);
+    nbufsets = cfg->read_buffer_sets;
+    if (initialize_control_aligner(&cfg->controlinfo) < 0)
+        return -1;
 
     snprintf(msgprefix, BUFSIZ, "[%s%d] ", cfg->laneid, cfg->tile);
 
@@ -590,14 +906,17 @@ process(struct TailseekerConfig *cfg)
 
     cifreader = NULL;
     bclreader = NULL;
-    intensities = NULL;
-    basecalls = NULL;
+    bcl_decode_time = NULL;
+    writer = NULL;
+    workers = NULL;
+    memset(intensities, 0, sizeof(intensities));
+    memset(basecalls, 0, sizeof(basecalls));
 
     if (open_alternative_calls_bundle(msgprefix, cfg->altcalls) == -1)
         return -1;
 
     cifreader = open_cif_readers(msgprefix, cfg->datadir, cfg->lane, cfg->tile,
-                                 cfg->threep_start, cfg->threep_length);
+                                 cfg->threep_start, cfg->threep_length, cfg->mmap_cif);
     if (cifreader == NULL)
         goto onError;
 
@@ -606,8 +925,15 @@ process(struct TailseekerConfig *cfg)
     if (bclreader == NULL)
         goto onError;
 
-    if (initialize_cif_bcl_buffers(cfg, &intensities, &basecalls) == -1)
-        return -1;
+    for (bufset = 0; bufset < nbufsets; bufset++)
+        if (initialize_cif_bcl_buffers(cfg, &intensities[bufset], &basecalls[bufset]) == -1)
+            goto onError;
+
+    bcl_decode_time = calloc(cfg->total_cycles, sizeof(double));
+    if (bcl_decode_time == NULL) {
+        perror("process");
+        goto onError;
+    }
 
     clusters_to_go = nclusters = cifreader[0]->nclusters;
     totalblocks = nclusters / blocksize + ((nclusters % blocksize > 0) ? 1 : 0);
@@ -616,41 +942,109 @@ process(struct TailseekerConfig *cfg)
     if (write_output_file_headers(cfg, nclusters) == -1)
         goto onError;
 
+    writer = new_output_writer(cfg);
+    if (writer == NULL)
+        goto onError;
+
+    workers = new_parallel_job_pool(cfg, writer);
+    if (workers == NULL)
+        goto onError;
+
+    loadjob.cfg = cfg;
+    loadjob.cifreader = cifreader;
+    loadjob.bclreader = bclreader;
+    loadjob.bcl_decode_time = bcl_decode_time;
+    loadjob.workers = workers;
+
     for (blockno = 0; clusters_to_go > 0; blockno++) {
+        int prefetching;
+
         clusters_to_read = (clusters_to_go >= blocksize) ? blocksize : clusters_to_go;
+        bufset = blockno % nbufsets;
 
         snprintf(msgprefix, BUFSIZ, "[%s%d#%d/%d] ", cfg->laneid, cfg->tile, blockno + 1,
                                                      totalblocks);
-        printf("%sLoading CIF and BCL files\n", msgprefix);
 
-        if (load_intensities_and_basecalls(cfg, cifreader, bclreader,
-                                           clusters_to_read, intensities, basecalls) == -1)
-            goto onError;
+        /* The first block is always loaded here. With a single buffer set, every
+         * block is. Otherwise, the block was already loaded while the previous
+         * one was being analyzed. */
+        if (blockno == 0 || nbufsets == 1) {
+            printf("%sLoading CIF and BCL files\n", msgprefix);
+
+            if (load_intensities_and_basecalls(cfg, workers, cifreader, bclreader,
+                                               clusters_to_read,
+                                               intensities[bufset], basecalls[bufset],
+                                               bcl_decode_time) == -1)
+                goto onError;
+        }
+
+        /* Start loading the next block into the other buffer set. */
+        prefetching = (nbufsets > 1 && clusters_to_go > clusters_to_read);
+        if (prefetching) {
+            uint32_t clusters_left;
+
+            clusters_left = clusters_to_go - clusters_to_read;
+            loadjob.blocksize = (clusters_left >= blocksize) ? blocksize : clusters_left;
+            loadjob.intensities = intensities[(blockno + 1) % nbufsets];
+            loadjob.basecalls = basecalls[(blockno + 1) % nbufsets];
+            loadjob.result = 0;
+
+            printf("%sLoading CIF and BCL files for the next block in background\n",
+                   msgprefix);
+
+            if (pthread_create(&loader, NULL, run_block_loading, (void *)&loadjob) != 0) {
+                perror("process");
+                goto onError;
+            }
+        }
 
         printf("%sAnalyzing and writing out\n", msgprefix);
 
-        if (distribute_processing(cfg, intensities, basecalls,
-                                  nclusters - clusters_to_go) < 0)
+        if (distribute_processing(workers, intensities[bufset], basecalls[bufset],
+                                  nclusters - clusters_to_go) < 0) {
+            if (prefetching)
+                pthread_join(loader, NULL);
             goto onError;
+        }
+
+        if (prefetching) {
+            pthread_join(loader, NULL);
+            if (loadjob.result == -1)
+                goto onError;
+        }
 
         clusters_to_go -= clusters_to_read;
     }
 
-    printf("%sClearing\n", msgprefix);
-    for (cycleno = 0; cycleno < cfg->threep_length; cycleno++)
-        free_cif_data(intensities[cycleno]);
-    for (cycleno = 0; cycleno < cfg->total_cycles; cycleno++)
-        free_bcl_data(basecalls[cycleno]);
+    free_parallel_job_pool(workers);
+    workers = NULL;
+
+    {   /* Wait for the remaining batches before closing the streams. */
+        int r;
+
+        r = finish_output_writer(writer);
+        if (r == 0)
+            r = write_output_file_trailers(cfg);
+        close_writers(cfg->samples);
+        free_output_writer(writer);
+        writer = NULL;
+        if (r < 0)
+            goto onError;
+    }
 
-    free(intensities);
-    free(basecalls);
+    report_bcl_decode_time(msgprefix, bclreader, bcl_decode_time, cfg->total_cycles);
+    report_filtering_counts(msgprefix, cfg);
+
+    printf("%sClearing\n", msgprefix);
+    for (bufset = 0; bufset < nbufsets; bufset++)
+        free_cif_bcl_buffers(cfg, intensities[bufset], basecalls[bufset]);
+    free(bcl_decode_time);
 
     close_bcl_readers(bclreader, cfg->total_cycles);
     close_cif_readers(cifreader, cfg->threep_length);
     if (close_alternative_calls_bundle(cfg->altcalls, 1) < 0)
         goto onError;
 
-    close_writers(cfg->samples);
     free_control_aligner(&cfg->controlinfo);
 
     printf("[%s%d] Finished.\n", cfg->laneid, cfg->tile);
@@ -666,18 +1060,22 @@ process(struct TailseekerConfig *cfg)
     if (bclreader != NULL)
         close_bcl_readers(bclreader, cfg->total_cycles);
 
-    for (cycleno = 0; cycleno < cfg->threep_length; cycleno++)
-        if (intensities != NULL && intensities[cycleno] != NULL)
-            free_cif_data(intensities[cycleno]);
+    for (bufset = 0; bufset < nbufsets; bufset++)
+        free_cif_bcl_buffers(cfg, intensities[bufset], basecalls[bufset]);
 
-    for (cycleno = 0; cycleno < cfg->total_cycles; cycleno++)
-        if (basecalls != NULL && basecalls[cycleno] != NULL)
-            free_bcl_data(basecalls[cycleno]);
+    if (bcl_decode_time != NULL)
+        free(bcl_decode_time);
 
-    free(intensities);
-    free(basecalls);
+    if (workers != NULL)
+        free_parallel_job_pool(workers);
 
+    if (writer != NULL) {
+        abort_output_writer(writer);
+        finish_output_writer(writer);
+    }
     close_writers(cfg->samples);
+    if (writer != NULL)
+        free_output_writer(writer);
     free_control_aligner(&cfg->controlinfo);
 
     return -1;
@@ -32,9 +32,11 @@
 #include <zlib.h>
 #include <pthread.h>
 #include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
 #include "../sigproc-flags.h"
 #include "../signal-packs.h"
 #include "../utils.h"
+#include "../tagpack.h"
 
 
 #define NUM_CHANNELS        4
@@ -54,6 +56,29 @@ struct BCLData {
     uint8_t basequality[1];
 };
 
+#define BASECALL_TILE_CLUSTERS  64
+
+struct BasecallTile {       /* cluster-major copy of a few clusters' base calls */
+    uint32_t first_cluster;
+    uint32_t nclusters;
+    size_t stride;          /* ncycles + 1 for a terminating NUL */
+    char *seq;
+    char *qual;
+};
+
+/* Cycles of a block, decoded by whichever threads are free */
+struct BCLDecodingPool {
+    struct BCLReader **readers;
+    struct BCLData **data;
+    int ncycles;
+    uint32_t nclusters;
+
+    int cycle_next;
+    int error_occurred;
+    double *decode_time;
+    pthread_mutex_t lock;
+};
+
 struct IntensitySet {
     int16_t value[NUM_CHANNELS];
 };
@@ -70,25 +95,34 @@ struct CIFReader {
     uint32_t read;
     int16_t *readbuf;
     size_t readbuf_size;
+
+    const uint8_t *mapped;  /* whole file mapped by mmap, or NULL when using stdio */
+    size_t mapped_size;
+};
+
+#define INTENSITY_LANES     16
+
+struct IntensityLaneSet {   /* intensities of 16 neighboring clusters in a cycle */
+    int16_t value[NUM_CHANNELS][INTENSITY_LANES];
 };
 
+/* Intensities of all 3'-side cycles for a block of clusters. Every group of
+ * 16 clusters keeps its cycles in a contiguous run of lane sets. */
 struct CIFData {
     size_t nclusters;
-    struct IntensitySet intensity[1];
+    size_t ncycles;
+    struct IntensityLaneSet lanes[1];
 };
 
+#define CIFDATA_LANESET(data, clusterno, cycleno)                           \
+    (&(data)->lanes[((clusterno) / INTENSITY_LANES) * (data)->ncycles + (cycleno)])
+
 struct UMIInterval {
     int start;
     int end;
     int length;
 };
 
-struct WriteHandleSync {
-    int jobs_written;
-    pthread_mutex_t lock;
-    pthread_cond_t wakeup;
-};
-
 struct SampleInfo;
 struct SampleInfo {
     char *name;
@@ -118,10 +152,7 @@ struct SampleInfo {
     BGZF *stream_taginfo;
     BGZF *stream_signal;
 
-    struct WriteHandleSync wsync_seqqual;
-    struct WriteHandleSync wsync_taginfo;
 
-    pthread_mutex_t signal_writer_lock;
     pthread_mutex_t statslock;
     uint32_t clusters_mm0;
     uint32_t clusters_mm1;
@@ -129,9 +160,29 @@ struct SampleInfo {
     uint32_t clusters_nodelim;
     uint32_t clusters_fpmismatch;
     uint32_t clusters_qcfailed;
+    uint32_t clusters_control_aligned;  /* rescued from Unknown by the control aligner */
+    uint32_t clusters_qcfailed_dropped;
+    uint32_t clusters_nodelim_dropped;
+    uint32_t clusters_passed;           /* written to the outputs */
     struct SampleInfo *next;
 };
 
+/* A slot is either the closest barcode for a packed index or, with sample
+ * set to NULL, a mark that two or more barcodes are equally close. */
+struct BarcodeIndexEntry {
+    uint64_t key;
+    struct SampleInfo *sample;
+    int mismatches;
+};
+
+struct BarcodeIndex {
+    int length;
+    int hashbits;
+    size_t hashmask;
+    int nplaceholders;      /* all-'X' entries such as the control */
+    struct BarcodeIndexEntry *table;
+};
+
 struct AlternativeCallReader {
     gzFile fptr;
     char *filename;
@@ -156,6 +207,18 @@ struct AlternativeCallInfo {
 #define CONTROL_ALIGN_MINIMUM_SCORE         0.65
 
 #define CONTROL_NAME_MAX    128
+#define CONTROL_SEED_MAX_LENGTH             16
+
+/* k-mer index of the control sequence: seed_heads holds the first position
+ * of each k-mer in a hash slot and seed_next chains the later ones. */
+struct ControlSeedIndex {
+    uint32_t *seed_keys;
+    int32_t *seed_heads;
+    int32_t *seed_next;
+    size_t hashmask;
+    int hashbits;
+};
+
 struct ControlFilterInfo {
     char name[CONTROL_NAME_MAX];
     int first_cycle;
@@ -167,6 +230,16 @@ struct ControlFilterInfo {
     ssize_t control_seq_length;
     int32_t min_control_alignment_score;
     int32_t control_alignment_mask_len;
+
+    int seed_length;            /* 0 to align every read to the whole control */
+    int min_seed_hits;
+    struct ControlSeedIndex seeds;
+};
+
+/* Per-thread state of the control aligner, reused for every read */
+struct ControlAlignerContext {
+    struct _profile *profile;   /* s_profile of ../contrib/ssw.h */
+    int8_t *read_seq;
 };
 
 struct BalancerParameters {
@@ -201,6 +274,7 @@ struct PolyAFinderParameters {
     size_t max_terminal_modifications;
     size_t min_polya_length;
     size_t sigproc_trigger_polya_length;
+    int exhaustive_search;  /* use the quadratic reference scan instead of the linear one */
 };
 
 #define T_INTENSITY_SCORE_BINS              200
@@ -234,7 +308,11 @@ struct TailseekerConfig {
     int keep_no_delimiter;
     int keep_low_quality_balancer;
     int threads;
+    int compression_threads;    /* -1 for the same as threads */
+    int mmap_cif;
+    int transpose_basecalls;
     size_t read_buffer_size;
+    int read_buffer_sets;
     int read_buffer_entry_count;
 
     /* section output */
@@ -244,6 +322,8 @@ struct TailseekerConfig {
     char *signal_dists_output;
     char *stats_output;
     char *length_dists_output;
+    int binary_output;          /* seqqual and taginfo in the block format */
+    int signal_score_bits;      /* 24 for the version 1 signal dumps */
 
     /* section alternative_calls */
     struct AlternativeCallInfo *altcalls;
@@ -269,23 +349,121 @@ struct TailseekerConfig {
     int num_samples;
 
     /* calculated values */
-    size_t max_bufsize_seqqual;
+    size_t max_bufsize_seqqual; /* per record */
     size_t max_bufsize_taginfo;
+    size_t max_bufsize_signal;
+    struct BarcodeIndex *barcode_index; /* NULL if barcodes are matched linearly */
 };
 
 
 #define NUM_CLUSTERS_PER_JOB    512
+#define MAX_READ_BUFFER_SETS    2
+#define CACHE_LINE_SIZE         64
+
+/* Jobs of a worker in a block: jobid = workerid + k * nworkers for
+ * head <= k < tail, packed into one word to be updated atomically. The owner
+ * takes from the head and the others steal from the tail. */
+struct JobDeque {
+    uint64_t range;                 /* head | tail << 32 */
+    uint8_t __pad[CACHE_LINE_SIZE - sizeof(uint64_t)];
+};
+
+struct BlockLoadingJob {
+    struct TailseekerConfig *cfg;
+    struct CIFReader **cifreader;
+    struct BCLReader **bclreader;
+    int blocksize;
+    struct CIFData *intensities;
+    struct BCLData **basecalls;
+    double *bcl_decode_time;
+    struct ParallelJobPool *workers;
+    int result;
+};
 
-struct ParallelJob {
-    uint32_t jobid;
-    uint32_t start;
-    uint32_t end;
-    uint32_t __pad;
+/* State of a spot between the demultiplexing and the output stages */
+struct SpotRecord {
+    struct SampleInfo *sample;      /* NULL if the spot is filtered out */
+    const char *sequence;
+    const char *quality;
+    int procflags;
+    int delimiter_end;
+    int polya_status;
+    int terminal_mods;
+
+    /* poly(A) signal analysis; valid only if signal_pending is set */
+    int signal_pending;
+    int polya_start;
+    int insert_len;
+    float signal_range_low[NUM_CHANNELS];
+    float signal_range_bandwidth[NUM_CHANNELS];
 };
 
+#define NUM_DEMULTIPLEXING_COUNTERS     10
+
+/* Counters of a worker for one sample. They are reduced into SampleInfo
+ * after every job. */
+struct DemultiplexingStats {
+    uint32_t clusters_mm0;
+    uint32_t clusters_mm1;
+    uint32_t clusters_mm2plus;
+    uint32_t clusters_nodelim;
+    uint32_t clusters_fpmismatch;
+    uint32_t clusters_qcfailed;
+    uint32_t clusters_control_aligned;
+    uint32_t clusters_qcfailed_dropped;
+    uint32_t clusters_nodelim_dropped;
+    uint32_t clusters_passed;
+    uint8_t __pad[CACHE_LINE_SIZE - NUM_DEMULTIPLEXING_COUNTERS * sizeof(uint32_t)];
+};
+
+/* Grows on demand and is kept for the next job. */
+struct OutputBuffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+/* A buffer starts with room for this many records of the first request, so
+ * that samples without much output stay small. */
+#define OUTPUT_BUFFER_INITIAL_RECORDS   4
+
 struct WriteBuffer {
-    char *buf_seqqual;
-    char *buf_taginfo;
+    struct OutputBuffer seqqual;
+    struct OutputBuffer taginfo;
+    struct OutputBuffer signal;
+};
+
+/* Output of a job: a set of buffers for each sample */
+struct OutputBatch;
+struct OutputBatch {
+    uint32_t batchno;
+    struct WriteBuffer *buffers;
+    struct OutputBatch *next;       /* in the free list */
+};
+
+#define OUTPUT_BATCHES_PER_THREAD   2
+
+/* The writer thread owns all output streams while the workers run. Batches
+ * are taken in the order of batchno and compressed by a thread pool shared
+ * among the streams. */
+struct OutputWriter {
+    struct TailseekerConfig *cfg;
+    hts_tpool *compressors;         /* NULL if compressed in the writer thread */
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t released;
+
+    int nbatches;
+    struct OutputBatch *batches;
+    struct OutputBatch *freelist;
+    struct OutputBatch **queue;     /* indexed by batchno % nbatches */
+
+    uint32_t batches_written;
+    uint32_t batches_reserved;
+    int finishing;
+    int error_occurred;
 };
 
 struct GloballyAggregatedOutput {
@@ -293,30 +471,60 @@ struct GloballyAggregatedOutput {
     cluster_count_t *neg_score_counts;
 };
 
+/* Slots are updated with atomic compare-and-swap, saturating at
+ * fair_sampling_max_count. */
 struct FairSamplingCount {
-    pthread_mutex_t lock;
     uint8_t *count;
 };
 
+struct ParallelJobPool;
+
+/* Per-thread state; allocated once and reset between blocks */
+struct SpotWorker {
+    struct JobDeque deque;
+    struct ParallelJobPool *pool;
+    int workerid;
+    pthread_t thread;
+
+    struct ControlAlignerContext *aligner;
+    struct DemultiplexingStats *stats;
+    struct GloballyAggregatedOutput gstats;
+    struct OutputBuffer packbuf;        /* for the block format */
+    float *group_scores;    /* scores and entropies of a group of lanes */
+};
+
+/* Worker threads live through the whole run and wait for a block between
+ * the blocks. Those without a job help decoding the BCL files of the next
+ * block. */
 struct ParallelJobPool {
-    int job_next;
-    int jobs_done;
-    int jobs_total;
     int error_occurred;
     pthread_mutex_t poollock;
+    pthread_cond_t block_ready;     /* also signals a new decoding */
+    pthread_cond_t block_done;
+    pthread_cond_t decoding_done;
+    uint32_t blocks_started;
+    int workers_running;
+    int shutting_down;
+
+    struct BCLDecodingPool *decoding;   /* NULL if no decoding is open */
+    uint32_t decodings_started;
+    int decoding_helpers;
 
     struct TailseekerConfig *cfg;
-    struct CIFData **intensities;
+    struct CIFData *intensities;
     struct BCLData **basecalls;
     uint32_t firstclusterno;
-
-    size_t bufsize_seqqual;
-    size_t bufsize_taginfo;
+    uint32_t nclusters;
+    int jobs_total;
 
     struct GloballyAggregatedOutput global_stats;
     struct FairSamplingCount fair_sampling;
 
-    struct ParallelJob jobs[1];
+    struct OutputWriter *writer;
+    uint32_t first_batchno;
+
+    int nworkers;
+    struct SpotWorker *workers;
 };
 
 
@@ -338,25 +546,34 @@ struct ParallelJobPool {
 extern struct BCLReader *open_bcl_file(const char *filename);
 extern void close_bcl_file(struct BCLReader *bcl);
 extern int load_bcl_data(struct BCLReader *bcl, struct BCLData *data, uint32_t nclusters);
+extern void init_bcl_decoding(struct BCLDecodingPool *pool, struct BCLReader **readers,
+                              struct BCLData **data, int ncycles, uint32_t nclusters,
+                              double *decode_time);
+extern void run_bcl_decoding(struct BCLDecodingPool *pool);
+extern int finish_bcl_decoding(struct BCLDecodingPool *pool);
 extern struct BCLData *new_bcl_data(uint32_t size);
 extern void free_bcl_data(struct BCLData *data);
 extern void format_basecalls(char *seq, char *qual, struct BCLData **basecalls,
                              int ncycles, uint32_t clusterno);
+extern void transpose_basecalls(struct BasecallTile *tile, struct BCLData **basecalls,
+                                int ncycles, uint32_t first_cluster, uint32_t nclusters);
 extern struct BCLReader **open_bcl_readers(const char *msgprefix, const char *datadir,
                                            int lane, int tile,
                                            int ncycles, struct AlternativeCallInfo *altcalls);
 extern void close_bcl_readers(struct BCLReader **readers, int ncycles);
 
 /* cifreader.c */
-extern struct CIFReader *open_cif_file(const char *filename);
+extern struct CIFReader *open_cif_file(const char *filename, int use_mmap);
 extern void close_cif_file(struct CIFReader *cif);
-extern struct CIFData *new_cif_data(uint32_t size);
-extern int load_cif_data(struct CIFReader *cif, struct CIFData *data, uint32_t nclusters);
+extern struct CIFData *new_cif_data(uint32_t size, int ncycles);
+extern int load_cif_data(struct CIFReader *cif, struct CIFData *data, int cycleno,
+                         uint32_t nclusters);
 extern void free_cif_data(struct CIFData *data);
-extern void fetch_intensity(struct IntensitySet *signalout, struct CIFData **intensities,
+extern void fetch_intensity(struct IntensitySet *signalout, struct CIFData *intensities,
                             int firstcycle, int ncycles, uint32_t clusterno);
 extern struct CIFReader **open_cif_readers(const char *msgprefix, const char *datadir,
-                                           int lane, int tile, int firstcycle, int ncycles);
+                                           int lane, int tile, int firstcycle, int ncycles,
+                                           int use_mmap);
 extern void close_cif_readers(struct CIFReader **readers, int ncycles);
 
 /* altcalls.c */
@@ -369,15 +586,27 @@ extern int open_alternative_calls_bundle(const char *msgprefix,
 extern int close_alternative_calls_bundle(struct AlternativeCallInfo *altcallinfo,
                                           int checkend);
 
+/* barcodeindex.c */
+extern struct BarcodeIndex *build_barcode_index(struct SampleInfo *barcodes,
+                                                int barcode_length);
+extern void free_barcode_index(struct BarcodeIndex *bindex);
+extern int lookup_barcode_index(const struct BarcodeIndex *bindex,
+                                const char *indexseq, struct SampleInfo **psample,
+                                int *pmismatches);
+
 /* phix_control.c */
 extern const char *phix_control_sequence;
 extern const char *phix_control_sequence_rev;
 
 /* controlaligner.c */
 extern int try_alignment_to_control(struct ControlFilterInfo *control_info,
+                                    struct ControlAlignerContext *aligner,
                                     const char *sequence_read);
 extern int initialize_control_aligner(struct ControlFilterInfo *ctlinfo);
 extern void free_control_aligner(struct ControlFilterInfo *ctlinfo);
+extern struct ControlAlignerContext *new_control_aligner_context(
+                                    struct ControlFilterInfo *ctlinfo);
+extern void free_control_aligner_context(struct ControlAlignerContext *aligner);
 
 /* my_strstr.c */
 extern char *my_strnstr(const char *s, const char *find, size_t len);
@@ -394,22 +623,51 @@ extern int check_balancer(float *signal_range_low, float *signal_range_bandwidth
                struct IntensitySet *intensities, const float *colormatrix,
                const char *seq, struct BalancerParameters *params,
                int balancer_len, int *flags);
-extern int compute_polya_score(struct IntensitySet *intensities, int ncycles,
+extern void compute_polya_score_lanes(const struct IntensityLaneSet *lanes,
+                int firstcycle, int lastcycle, uint32_t active_lanes,
                 const float *signal_range_low,
                 const float *signal_range_bandwidth,
                 struct PolyARulerParameters *params,
-                float *scores, char *downhill, int *procflags);
+                float *scores, float *entropies);
+extern int collect_polya_scores(const float *scores, const float *entropies,
+                int firstcycle, int ncycles, int lane,
+                struct PolyARulerParameters *params,
+                float *scoresout, char *downhill, int *procflags);
 extern int find_max_cumulative_contrast(const float *scores, int length,
                 int leftspace, int rightspace, float *pmax_score);
 
 /* spotanalyzer.c */
+extern struct SampleInfo *assign_barcode(const char *indexseq, int barcode_length,
+                                        struct SampleInfo *barcodes,
+                                        const struct BarcodeIndex *bindex,
+                                        int *pmismatches);
+extern int check_sequence_for_fair_sampling(struct FairSamplingCount *fair_sampling,
+                                            struct PolyASeederParameters *params,
+                                            const char *sequence);
 extern int process_spots(struct TailseekerConfig *cfg, uint32_t firstclusterno,
-                         struct CIFData **intensities, struct BCLData **basecalls,
-                         struct WriteBuffer *wbuf0, struct WriteBuffer *wbuf,
+                         struct CIFData *intensities, struct BCLData **basecalls,
+                         struct WriteBuffer *wbuf,
                          cluster_count_t *pos_score_counts,
                          cluster_count_t *neg_score_counts,
                          struct FairSamplingCount *fair_sampling,
-                         int jobid, uint32_t cln_start, uint32_t cln_end);
+                         struct ControlAlignerContext *aligner,
+                         struct DemultiplexingStats *stats,
+                         float *group_scores,
+                         uint32_t cln_start, uint32_t cln_end);
+
+/* outputwriter.c */
+extern struct OutputWriter *new_output_writer(struct TailseekerConfig *cfg);
+extern int finish_output_writer(struct OutputWriter *writer);
+extern void free_output_writer(struct OutputWriter *writer);
+extern uint32_t reserve_output_batches(struct OutputWriter *writer, int nbatches);
+extern struct OutputBatch *acquire_output_batch(struct OutputWriter *writer,
+                                                uint32_t batchno);
+extern void release_output_batch(struct OutputWriter *writer, struct OutputBatch *batch);
+extern int submit_output_batch(struct OutputWriter *writer, struct OutputBatch *batch);
+extern void abort_output_writer(struct OutputWriter *writer);
+extern char *reserve_output_buffer(struct OutputBuffer *obuf, size_t maxlen);
+extern int pack_output_batch(struct TailseekerConfig *cfg, struct OutputBatch *batch,
+                             struct OutputBuffer *packbuf);
 
 /* misc.c */
 extern int inverse_4x4_matrix(const float *m, float *out);
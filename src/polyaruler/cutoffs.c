@@ -0,0 +1,409 @@
+/*
+ * cutoffs.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Poly(A) score cutoffs at the equal odds of the positive and negative
+ * signal distributions. This follows scripts/calculate-optimal-parameters.py
+ * step by step, including the weighted Gaussian KDE of tailseeker.stats and
+ * the bisection of scipy.optimize.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "polyaruler.h"
+
+
+#define VERY_SMALL_PROBABILITY          0.001
+#define NUM_CLOSEST_CYCLES_EXTRAPOLATION    5
+#define BISECT_XTOL                     2e-12
+#define BISECT_RTOL                     (4 * 2.220446049250313e-16)
+#define BISECT_MAXITER                  100
+
+struct WeightedKDE {
+    double *x;                      /* bins with non-zero counts only */
+    double *weights;
+    int n;
+    double inv_cov;
+    double norm_factor;
+};
+
+struct EqOddsProblem {
+    struct WeightedKDE pos, neg;
+};
+
+
+int
+init_cutoff_table(struct CutoffTable *table, int total_cycles)
+{
+    int i;
+
+    table->values = malloc(sizeof(double) * total_cycles);
+    table->states = malloc(total_cycles);
+    if (table->values == NULL || table->states == NULL) {
+        perror("init_cutoff_table");
+        free_cutoff_table(table);
+        return -1;
+    }
+
+    for (i = 0; i < total_cycles; i++)
+        table->values[i] = NAN;
+    memset(table->states, CUTOFF_UNTRIED, total_cycles);
+
+    return 0;
+}
+
+void
+free_cutoff_table(struct CutoffTable *table)
+{
+    if (table->values != NULL)
+        free(table->values);
+    if (table->states != NULL)
+        free(table->states);
+
+    table->values = NULL;
+    table->states = NULL;
+}
+
+/* Sets up a KDE over the bin positions weighted with the counts. Returns
+ * -1 if the variance is not defined. */
+static int
+setup_weighted_kde(struct WeightedKDE *kde, const uint64_t *counts,
+                   int nbins, double bandwidth, double *xbuf, double *wbuf)
+{
+    double total, mean, var, sumsqweights;
+    int i;
+
+    kde->x = xbuf;
+    kde->weights = wbuf;
+    kde->n = 0;
+
+    total = 0.;
+    for (i = 0; i < nbins; i++)
+        total += counts[i];
+
+    for (i = 0; i < nbins; i++)
+        if (counts[i] > 0) {
+            kde->x[kde->n] = i * (1. / nbins);
+            kde->weights[kde->n] = counts[i] / total;
+            kde->n++;
+        }
+
+    mean = sumsqweights = 0.;
+    for (i = 0; i < kde->n; i++) {
+        mean += kde->weights[i] * kde->x[i];
+        sumsqweights += kde->weights[i] * kde->weights[i];
+    }
+
+    var = 0.;
+    for (i = 0; i < kde->n; i++)
+        var += (kde->x[i] - mean) * kde->weights[i] * (kde->x[i] - mean);
+    var /= 1. - sumsqweights;
+
+    if (!(var > 0.) || !isfinite(var))
+        return -1;
+
+    kde->inv_cov = 1. / var / (bandwidth * bandwidth);
+    kde->norm_factor = sqrt(2 * M_PI * (var * (bandwidth * bandwidth)));
+
+    return 0;
+}
+
+static double
+evaluate_kde(const struct WeightedKDE *kde, double x)
+{
+    double sum;
+    int i;
+
+    sum = 0.;
+    for (i = 0; i < kde->n; i++) {
+        double d = x - kde->x[i];
+        sum += exp(-.5 * (d * d * kde->inv_cov)) * kde->weights[i];
+    }
+
+    return sum / kde->norm_factor;
+}
+
+static double
+log_likelihood_ratio(const struct EqOddsProblem *prob, double x)
+{
+    double pos, neg;
+
+    pos = evaluate_kde(&prob->pos, x);
+    neg = evaluate_kde(&prob->neg, x);
+
+    return log((pos > VERY_SMALL_PROBABILITY ? pos : VERY_SMALL_PROBABILITY) /
+               (neg > VERY_SMALL_PROBABILITY ? neg : VERY_SMALL_PROBABILITY));
+}
+
+/* Returns -1 if the signs at both ends are the same or the search does
+ * not converge. */
+static int
+bisect_log_likelihood_ratio(const struct EqOddsProblem *prob, double xa,
+                            double xb, double *root)
+{
+    double fa, fb, fm, dm, xm;
+    int i;
+
+    fa = log_likelihood_ratio(prob, xa);
+    fb = log_likelihood_ratio(prob, xb);
+    if (fa * fb > 0)
+        return -1;
+    else if (fa == 0) {
+        *root = xa;
+        return 0;
+    }
+    else if (fb == 0) {
+        *root = xb;
+        return 0;
+    }
+
+    dm = xb - xa;
+    for (i = 0; i < BISECT_MAXITER; i++) {
+        dm *= .5;
+        xm = xa + dm;
+        fm = log_likelihood_ratio(prob, xm);
+        if (fm * fa >= 0)
+            xa = xm;
+        if (fm == 0 || fabs(dm) < BISECT_XTOL + BISECT_RTOL * fabs(xm)) {
+            *root = xm;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int
+find_eqodds_point(const struct CutoffSearchParams *params,
+                  struct EqOddsProblem *prob, double *cutoff)
+{
+    int i;
+
+    for (i = 0; i < params->range_high_count; i++) {
+        double r;
+
+        if (bisect_log_likelihood_ratio(prob, params->range_low,
+                                        params->range_high[i], &r) == 0 &&
+                params->range_low < r && r < params->range_high[i]) {
+            *cutoff = r;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static uint64_t
+sum_counts(const uint64_t *counts, int nbins)
+{
+    uint64_t sum=0;
+    int i;
+
+    for (i = 0; i < nbins; i++)
+        sum += counts[i];
+
+    return sum;
+}
+
+/* Searches the cutoffs for the cycles with enough spots in both
+ * distributions. The other cycles are left untried. */
+int
+find_eqodds_cutoffs(const struct CutoffSearchParams *params,
+                    const uint64_t *poscounts, const uint64_t *negcounts,
+                    struct CutoffTable *table)
+{
+    struct EqOddsProblem prob;
+    double *buf;
+    int nbins, cycle;
+
+    nbins = params->sampling_bins;
+    buf = malloc(sizeof(double) * nbins * 4);
+    if (buf == NULL) {
+        perror("find_eqodds_cutoffs");
+        return -1;
+    }
+
+    for (cycle = 0; cycle < params->total_cycles; cycle++) {
+        const uint64_t *pos = poscounts + cycle * nbins;
+        const uint64_t *neg = negcounts + cycle * nbins;
+
+        table->values[cycle] = NAN;
+        table->states[cycle] = CUTOFF_UNTRIED;
+
+        if (sum_counts(pos, nbins) < params->min_spots ||
+                sum_counts(neg, nbins) < params->min_spots)
+            continue;
+
+        table->states[cycle] = CUTOFF_FAILED;
+
+        if (setup_weighted_kde(&prob.pos, pos, nbins, params->kde_bandwidth,
+                               buf, buf + nbins) < 0 ||
+                setup_weighted_kde(&prob.neg, neg, nbins, params->kde_bandwidth,
+                                   buf + nbins * 2, buf + nbins * 3) < 0)
+            continue;
+
+        if (find_eqodds_point(params, &prob, &table->values[cycle]) == 0)
+            table->states[cycle] = CUTOFF_DIRECT;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+/* Same as numpy.median; NAN for no values. */
+static double
+median_cutoff(const double *values, int count)
+{
+    double sorted[NUM_CLOSEST_CYCLES_EXTRAPOLATION];
+
+    if (count <= 0)
+        return NAN;
+
+    memcpy(sorted, values, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), compare_doubles);
+
+    if (count % 2 == 1)
+        return sorted[count / 2];
+    else
+        return (sorted[count / 2 - 1] + sorted[count / 2]) / 2.;
+}
+
+/*
+ * Fills the untried cycles that have negative samples by interpolating the
+ * closest determined cutoffs on both sides, or with the median of the
+ * closest ones on the only available side.
+ */
+void
+infer_missing_cutoffs(const struct CutoffSearchParams *params,
+                      const uint64_t *negtotal, struct CutoffTable *table)
+{
+    int nbins, cycle, left, right;
+    char *missing;
+
+    nbins = params->sampling_bins;
+    missing = malloc(params->total_cycles);
+    if (missing == NULL) {
+        perror("infer_missing_cutoffs");
+        return;
+    }
+
+    for (cycle = 0; cycle < params->total_cycles; cycle++)
+        missing[cycle] = (table->states[cycle] == CUTOFF_UNTRIED &&
+                          sum_counts(negtotal + cycle * nbins, nbins) > 0);
+
+    for (left = 0; left < params->total_cycles; left = right + 1) {
+        double closest[NUM_CLOSEST_CYCLES_EXTRAPOLATION];
+        int leftside, rightside, nclosest, c;
+
+        /* Find a run of missing cycles from left to right. */
+        while (left < params->total_cycles && !missing[left])
+            left++;
+        if (left >= params->total_cycles)
+            break;
+        for (right = left; right + 1 < params->total_cycles &&
+                           missing[right + 1]; right++)
+            ;
+
+        for (leftside = left - 1; leftside >= 0 &&
+                table->states[leftside] != CUTOFF_DIRECT; leftside--)
+            ;
+        for (rightside = right + 1; rightside < params->total_cycles &&
+                table->states[rightside] != CUTOFF_DIRECT; rightside++)
+            ;
+
+        if (leftside >= 0 && rightside < params->total_cycles) {
+            /* Linear interpolation as numpy.interp does */
+            double slope = (table->values[rightside] - table->values[leftside]) /
+                           (rightside - leftside);
+
+            for (c = left; c <= right; c++) {
+                table->values[c] = slope * (c - leftside) +
+                                   table->values[leftside];
+                table->states[c] = CUTOFF_INFERRED;
+            }
+            continue;
+        }
+
+        nclosest = 0;
+        if (leftside >= 0) {
+            for (c = leftside; c >= 0 &&
+                    nclosest < NUM_CLOSEST_CYCLES_EXTRAPOLATION; c--)
+                if (table->states[c] == CUTOFF_DIRECT)
+                    closest[nclosest++] = table->values[c];
+        }
+        else {
+            for (c = rightside; c < params->total_cycles &&
+                    nclosest < NUM_CLOSEST_CYCLES_EXTRAPOLATION; c++)
+                if (table->states[c] == CUTOFF_DIRECT)
+                    closest[nclosest++] = table->values[c];
+        }
+
+        for (c = left; c <= right; c++) {
+            table->values[c] = median_cutoff(closest, nclosest);
+            table->states[c] = CUTOFF_INFERRED;
+        }
+    }
+
+    free(missing);
+}
+
+/* Takes the run-wide cutoffs for the cycles of a tile that are not
+ * determined directly. */
+void
+fill_missing_cutoffs(const struct CutoffSearchParams *params,
+                     const uint64_t *negtotal,
+                     const struct CutoffTable *runwide,
+                     struct CutoffTable *table)
+{
+    int nbins, cycle;
+
+    nbins = params->sampling_bins;
+
+    for (cycle = 0; cycle < params->total_cycles; cycle++) {
+        if (table->states[cycle] == CUTOFF_DIRECT ||
+                sum_counts(negtotal + cycle * nbins, nbins) == 0)
+            continue;
+
+        table->values[cycle] = runwide->values[cycle];
+        if (runwide->states[cycle] == CUTOFF_DIRECT ||
+                runwide->states[cycle] == CUTOFF_INFERRED)
+            table->states[cycle] = CUTOFF_INFERRED;
+        else
+            table->states[cycle] = CUTOFF_FAILED;
+    }
+}
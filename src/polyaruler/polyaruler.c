@@ -30,409 +30,574 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <zlib.h>
-#include <math.h>
-#include <assert.h>
-#include "../sigproc-flags.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <htslib/bgzf.h>
 #include "../signal-packs.h"
+#include "polyaruler.h"
+#include "../utils.h"
 
+#define MANIFEST_LINEBUF_SIZE   8192
+#define TILE_PLACEHOLDER        "{tile}"
 
-#define SCORE_LINEBUF_SIZE      16384
-#define MAX_NUM_CYCLES          1024
-#define TAGINFO_LINEBUF_SIZE    2048
+/* A line of the manifest: tile, signals, taginfo and output */
+struct ManifestEntry {
+    const struct ScoreCutoffEntry *cutoffs;
+    char *signals_file;
+    char *taginfo_file;
+    char *output_file;
+    size_t lineno;
+};
 
+struct Manifest {
+    struct ManifestEntry *entries;
+    size_t size;
+};
 
-static unpacked_score_t *
-load_score_cutoffs(const char *filename, const char *tileid,
-                   ssize_t *ncycles)
+
+static struct RulingWorker *
+setup_ruling_workers(int threads, size_t sigdist_size)
 {
-    FILE *fp;
-    char linebuf[SCORE_LINEBUF_SIZE], *bptr, *cutofftok;
-    size_t tileid_len;
-    unpacked_score_t *cutoffs;
+    struct RulingWorker *workers;
     int i;
 
-    tileid_len = strlen(tileid);
-    fp = fopen(filename, "r");
-    if (fp == NULL) {
-        fprintf(stderr, "Cannot open %s.\n", filename);
+    workers = calloc(threads, sizeof(struct RulingWorker));
+    if (workers == NULL) {
+        perror("setup_ruling_workers");
         return NULL;
     }
 
-    /* Search for the line for the designated tile. */
-    for (;;) {
-        if (fgets(linebuf, sizeof(linebuf), fp) == NULL) {
-            fprintf(stderr, "No poly(A) score cutoffs found for tile %s.\n",
-                    tileid);
-            fclose(fp);
-            return NULL;
+    for (i = 0; i < threads; i++) {
+        workers[i].pos_score_counts = malloc(sigdist_size);
+        if (workers[i].pos_score_counts == NULL) {
+            perror("setup_ruling_workers");
+            goto onError;
         }
-
-        if (strlen(linebuf) >= tileid_len &&
-                memcmp(linebuf, tileid, tileid_len) == 0 &&
-                linebuf[tileid_len] == '\t')
-            break;
+        memset(workers[i].pos_score_counts, 0, sigdist_size);
     }
 
-    fclose(fp);
+    return workers;
 
-    cutoffs = malloc(sizeof(unpacked_score_t) * MAX_NUM_CYCLES);
-    if (cutoffs == NULL)
-        return NULL;
+  onError:
+    for (i = 0; i < threads; i++)
+        if (workers[i].pos_score_counts != NULL)
+            free(workers[i].pos_score_counts);
+    free(workers);
 
-    bptr = linebuf + tileid_len + 1;
-    for (i = 0; (cutofftok = strsep(&bptr, "\t\r\n, ")) != NULL; i++) {
-        if (*cutofftok == 0)
-            break;
+    return NULL;
+}
+
+static void
+free_ruling_workers(struct RulingWorker *workers, int threads)
+{
+    int i;
+
+    for (i = 0; i < threads; i++)
+        if (workers[i].pos_score_counts != NULL)
+            free(workers[i].pos_score_counts);
+    free(workers);
+}
+
+/* Writes the positive signal distributions summed over the workers and
+ * clears them for the next group of signals. */
+static int
+write_summed_dists(struct RulingWorker *workers, int threads,
+                   const char *filename, int ncycles, int nbins)
+{
+    size_t nelements, j;
+    int i, r;
+
+    nelements = (size_t)ncycles * nbins;
+
+    for (i = 1; i < threads; i++)
+        for (j = 0; j < nelements; j++)
+            workers[0].pos_score_counts[j] += workers[i].pos_score_counts[j];
+
+    r = write_signal_samples_dists(filename, workers[0].pos_score_counts,
+                                   ncycles, nbins);
+
+    for (i = 0; i < threads; i++)
+        memset(workers[i].pos_score_counts, 0,
+               nelements * sizeof(cluster_count_t));
+
+    return r;
+}
+
+static int16_t *
+process_polya_ruling(const char *filename, const struct RulingParams *settings,
+                     struct RulingWorker *workers, int threads,
+                     size_t *ret_elements)
+{
+    BGZF *fp;
+    ssize_t nunits;
+    struct RulingParams params;
+    struct RulingBatch batch;
+    int i;
+
+    memset(&batch, 0, sizeof(batch));
+    for (i = 0; i < threads; i++)
+        workers[i].rec = NULL;
+
+    params = *settings;
+    params.polya_measurements = NULL;
+
+    fp = open_signal_dump(filename, threads, &params);
+    if (fp == NULL)
+        goto onError;
+
+    params.polya_measurements = malloc(sizeof(int16_t) * params.total_clusters);
+    if (params.polya_measurements == NULL) {
+        perror("process_polya_ruling");
+        goto onError;
+    }
+
+    memset(params.polya_measurements, 0xff,
+           sizeof(int16_t) * params.total_clusters); /* fill with -1 */
+
+    for (i = 0; i < threads; i++) {
+        workers[i].rec = malloc(params.record_size);
+        if (workers[i].rec == NULL) {
+            perror("process_polya_ruling");
+            goto onError;
+        }
+    }
 
-        if (i >= MAX_NUM_CYCLES) {
-            fprintf(stderr, "Exceeded the maximum allowed number of cycles. "
-                            "Adjust MAX_NUM_CYCLES in " __FILE__ ".\n");
-            free(cutoffs);
-            return NULL;
+    while ((nunits = read_ruling_batch(fp, &params, &batch,
+                                       RULING_BATCH_SIZE)) > 0)
+        if (rule_batch(workers, threads, &params, &batch) < 0) {
+            fprintf(stderr, "Broken signal record in %s.\n", filename);
+            goto onError;
         }
 
-        cutoffs[i] = 1 + (int)(atof(cutofftok) *
-                               (double)(SIGNALPACKET_SCORE_MAX - 1));
-        if (cutoffs[i] >= SIGNALPACKET_SCORE_MAX)
-            cutoffs[i] = SIGNALPACKET_SCORE_MAX;
+    if (nunits < 0)
+        goto onError;
+
+    *ret_elements = params.total_clusters;
+    goto onExit;
+
+  onError:
+    if (params.polya_measurements != NULL) {
+        free(params.polya_measurements);
+        params.polya_measurements = NULL;
     }
 
-    *ncycles = i;
+  onExit:
+    if (fp != NULL)
+        bgzf_close(fp);
+
+    for (i = 0; i < threads; i++)
+        if (workers[i].rec != NULL) {
+            free(workers[i].rec);
+            workers[i].rec = NULL;
+        }
 
-    return cutoffs;
+    free_ruling_batch(&batch);
+
+    return params.polya_measurements;
 }
 
+/* Measures the poly(A) tails in a signal dump and writes them into the
+ * taginfo. Returns the exit status of the program. */
 static int
-measure_polya_length(const signal_packet_t *read_scores,
-                     ssize_t read_num_cycles,
-                     int first_cycle,
-                     const unpacked_score_t *score_cutoffs,
-                     ssize_t cutoffs_num_cycles,
-                     float downhill_ext_weight)
+rule_signal_dump(const char *tile_id, const char *signals_file,
+                 const char *taginfo_file, const char *output_file,
+                 const struct RulingParams *settings,
+                 struct RulingWorker *workers, int threads)
 {
-    ssize_t i, physical_cycle;
-    int score_cumsum, score_cumsum_max, score_argmax_cycle;
-    int downhill_ext;
-
-    score_cumsum = score_cumsum_max = 0;
-    score_argmax_cycle = -1;
-    physical_cycle = first_cycle;
+    int16_t *polya_measurements;
+    size_t nclusters;
+    BGZF *out;
+    int r;
 
-    for (i = 0; i < read_num_cycles && physical_cycle < cutoffs_num_cycles;
-            i++, physical_cycle++) {
-        unpacked_score_t cutoff = score_cutoffs[physical_cycle];
+    nclusters = 0;
 
-        if (cutoff == 0) /* NaN in the integer representation */
-            continue;
+    /* Measure the lengths of poly(A) tails */
+    polya_measurements = process_polya_ruling(signals_file, settings,
+                                              workers, threads, &nclusters);
+    if (polya_measurements == NULL)
+        return 2;
 
-        score_cumsum += -1 + (read_scores[i].score >= cutoff) * 2;
-        if (score_cumsum > score_cumsum_max) {
-            score_cumsum_max = score_cumsum;
-            score_argmax_cycle = i;
+    out = NULL;
+    if (output_file != NULL) {
+        out = bgzf_open(output_file, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Failed to open %s.\n", output_file);
+            free(polya_measurements);
+            return 3;
         }
+
+        if (threads > 1 && bgzf_mt(out, threads, 256) < 0)
+            fprintf(stderr, "Failed to start the compression threads.\n");
     }
 
-    downhill_ext = -1;
+    /* Apply the measurements to the existing taginfo */
+    r = output_corrected_polya_measurements(taginfo_file,
+                polya_measurements, nclusters, tile_id, out);
+    free(polya_measurements);
 
-    /* Try extending the poly(A) until entropy continuously decreases. */
-    if (score_argmax_cycle >= 0)
-        for (i = score_argmax_cycle + 1; i < read_num_cycles; i++)
-            if (read_scores[i].score > 0) { /* Non-dark signals */
-                if (read_scores[i].downhill > 0)
-                    downhill_ext = i;
-                else
-                    break;
-            }
+    if (out != NULL && bgzf_close(out) < 0)
+        r = -1;
 
-    if (downhill_ext >= 0)
-        return score_argmax_cycle + 1 +
-            (int)roundf((downhill_ext - score_argmax_cycle) *
-                        downhill_ext_weight);
-    else
-        return score_argmax_cycle + 1;
+    return (r < 0) ? 3 : 0;
 }
 
 static void
-add_polya_score_sample(cluster_count_t *samplecounts,
-                       signal_packet_t *scores, int length,
-                       int firstcycle, int sampling_bins)
+free_manifest(struct Manifest *manifest)
 {
-    cluster_count_t *sptr;
-    int i, binno;
-
-    sptr = samplecounts + (firstcycle * sampling_bins);
-    for (i = 0; i < length; i++, scores++, sptr += sampling_bins)
-        if (scores->score > 0) {
-            binno = ((scores->score - 1.) / (SIGNALPACKET_SCORE_MAX - 1)) *
-                    sampling_bins;
-            if (binno >= sampling_bins)
-                binno = sampling_bins - 1;
-
-            sptr[binno]++;
-        }   
+    size_t i;
+
+    for (i = 0; i < manifest->size; i++) {
+        free(manifest->entries[i].signals_file);
+        free(manifest->entries[i].taginfo_file);
+        free(manifest->entries[i].output_file);
+    }
+
+    if (manifest->entries != NULL)
+        free(manifest->entries);
 }
 
-static int 
-write_signal_samples_dists(const char *filename,
-                           const cluster_count_t *counts,
-                           int total_cycles, int sampling_bins)
+static int
+compare_manifest_entries(const void *a, const void *b)
 {
-    uint32_t header_elements[3];
-    gzFile fp;
+    const struct ManifestEntry *ea = a, *eb = b;
     int r;
 
-    fp = gzopen(filename, "wb");
-    if (fp == NULL) {
-        fprintf(stderr, "Cannot open %s to write.\n", filename);
-        return -1; 
-    }   
-
-    header_elements[0] = sizeof(cluster_count_t);
-    header_elements[1] = total_cycles;
-    header_elements[2] = sampling_bins;
-
-    r = (gzwrite(fp, header_elements, sizeof(header_elements)) < 0 ||
-         gzwrite(fp, counts, sizeof(cluster_count_t) *
-                    total_cycles * sampling_bins) < 0) ? -1 : 0;
-    gzclose(fp);
+    r = strcmp(ea->cutoffs->tile_id, eb->cutoffs->tile_id);
+    if (r != 0)
+        return r;
 
-    return r;
+    return (ea->lineno > eb->lineno) - (ea->lineno < eb->lineno);
 }
 
-static int16_t *
-process_polya_ruling(const char *filename,
-                     const unpacked_score_t *score_cutoffs,
-                     ssize_t cutoffs_num_cycles, int minimum_polya_len,
-                     float downhill_ext_weight, int dist_sampling_bins,
-                     float dist_sampling_gap, const char *sigdist_output,
-                     size_t *ret_elements)
+/* Loads the manifest and groups the entries by tile. */
+static int
+load_manifest(const char *filename, const struct ScoreCutoffMap *cutoffmap,
+              struct Manifest *manifest)
 {
-    gzFile fp;
-    ssize_t record_size, bytesread, sigdist_size;
-    int16_t *polya_measurements;
-    int r;
-    cluster_count_t *pos_score_counts;
-    struct {
-        uint32_t elemsize;
-        uint32_t total_clusters;
-        uint32_t max_cycles;
-    } header;
-    struct TSRecord {
-        struct SignalRecordHeader header;
-        signal_packet_t scores[];
-    } *rec;
-
-    sigdist_size = cutoffs_num_cycles * dist_sampling_bins * sizeof(cluster_count_t);
-    pos_score_counts = malloc(sigdist_size);
-    if (pos_score_counts == NULL) {
-        perror("process_polya_ruling");
-        return NULL;
-    }
-    memset(pos_score_counts, 0, sigdist_size);
+    FILE *fp;
+    char linebuf[MANIFEST_LINEBUF_SIZE], *bptr, *tokens[4];
+    struct ManifestEntry *entry;
+    size_t capacity, lineno;
+    int i;
 
-    fp = gzopen(filename, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "Cannot open the input file: %s\n", filename);
-        free(pos_score_counts);
-        return NULL;
-    }
+    memset(manifest, 0, sizeof(*manifest));
+    capacity = 0;
 
-    if (gzread(fp, &header, sizeof(header)) != sizeof(header)) {
-        fprintf(stderr, "Failed to read the header from %s.\n", filename);
-        gzclose(fp);
-        free(pos_score_counts);
-        return NULL;
-    }
-
-    if (header.elemsize != sizeof(signal_packet_t)) {
-        fprintf(stderr, "The file %s was written in a machine with "
-                        "different architecture.\n", filename);
-        gzclose(fp);
-        free(pos_score_counts);
-        return NULL;
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s.\n", filename);
+        return -1;
     }
 
-    polya_measurements = malloc(sizeof(int16_t) * header.total_clusters);
-    if (polya_measurements == NULL) {
-        perror("process_polya_ruling");
-        gzclose(fp);
-        free(pos_score_counts);
-        return NULL;
-    }
+    for (lineno = 1; fgets(linebuf, sizeof(linebuf), fp) != NULL; lineno++) {
+        if (strchr(linebuf, '\n') == NULL && !feof(fp)) {
+            fprintf(stderr, "Too long line in %s:%zu.\n", filename, lineno);
+            goto onError;
+        }
 
-    memset(polya_measurements, 0xff,
-           sizeof(int16_t) * header.total_clusters); /* fill with -1 */
-    record_size = sizeof(struct SignalRecordHeader) +
-                  header.max_cycles * sizeof(signal_packet_t);
-    rec = malloc(record_size);
-    if (rec == NULL) {
-        perror("process_polya_ruling");
-        gzclose(fp);
-        free(pos_score_counts);
-        free(polya_measurements);
-        return NULL;
-    }
+        if (linebuf[0] == '\n' || linebuf[0] == '\0' || linebuf[0] == '#')
+            continue;
 
-    for (;;) {
-        int polya_len;
+        bptr = linebuf;
+        for (i = 0; i < 4; i++) {
+            tokens[i] = strsep(&bptr, "\t\r\n");
+            if (tokens[i] == NULL || *tokens[i] == '\0') {
+                fprintf(stderr, "Expected four tab-separated fields in "
+                                "%s:%zu.\n", filename, lineno);
+                goto onError;
+            }
+        }
 
-        bytesread = gzread(fp, (void *)rec, record_size);
-        if (bytesread == 0)
-            break;
+        if (manifest->size >= capacity) {
+            struct ManifestEntry *newentries;
 
-        if (bytesread < record_size) {
-            fprintf(stderr, "Unexpected end of file.\n");
-            gzclose(fp);
-            free(pos_score_counts);
-            return NULL;
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            newentries = realloc(manifest->entries,
+                                 sizeof(struct ManifestEntry) * capacity);
+            if (newentries == NULL) {
+                perror("load_manifest");
+                goto onError;
+            }
+            manifest->entries = newentries;
         }
 
-        polya_len = measure_polya_length(rec->scores,
-                rec->header.valid_cycle_count, rec->header.first_cycle,
-                score_cutoffs, cutoffs_num_cycles, downhill_ext_weight);
+        entry = &manifest->entries[manifest->size];
+        entry->cutoffs = find_score_cutoffs(cutoffmap, tokens[0]);
+        if (entry->cutoffs == NULL)
+            goto onError;
+
+        entry->signals_file = strdup(tokens[1]);
+        entry->taginfo_file = strdup(tokens[2]);
+        entry->output_file = strdup(tokens[3]);
+        entry->lineno = lineno;
+        manifest->size++;
+
+        if (entry->signals_file == NULL || entry->taginfo_file == NULL ||
+                entry->output_file == NULL) {
+            perror("load_manifest");
+            goto onError;
+        }
 
-        if (polya_len >= minimum_polya_len) {
-            int sampling_len;
-            polya_measurements[rec->header.clusterno] = polya_len;
-            sampling_len = polya_len - (int)(polya_len * dist_sampling_gap);
-            add_polya_score_sample(pos_score_counts, rec->scores,
-                sampling_len, rec->header.first_cycle, dist_sampling_bins);
+        if (entry->cutoffs->num_cycles !=
+                manifest->entries[0].cutoffs->num_cycles) {
+            fprintf(stderr, "Cutoffs for tiles %s and %s differ in the "
+                            "number of cycles.\n", entry->cutoffs->tile_id,
+                            manifest->entries[0].cutoffs->tile_id);
+            goto onError;
         }
     }
 
-    free(rec);
-    gzclose(fp);
+    fclose(fp);
+    fp = NULL;
+
+    if (manifest->size == 0) {
+        fprintf(stderr, "No tiles are listed in %s.\n", filename);
+        goto onError;
+    }
 
-    r = write_signal_samples_dists(sigdist_output, pos_score_counts,
-                    cutoffs_num_cycles, dist_sampling_bins);
-    free(pos_score_counts);
-    if (r < 0)
-        return NULL;
+    qsort(manifest->entries, manifest->size, sizeof(struct ManifestEntry),
+          compare_manifest_entries);
 
-    *ret_elements = header.total_clusters;
+    return 0;
 
-    return polya_measurements;
+  onError:
+    if (fp != NULL)
+        fclose(fp);
+    free_manifest(manifest);
+    memset(manifest, 0, sizeof(*manifest));
+    return -1;
 }
 
+/* Processes the tiles in the manifest with the same set of workers. The
+ * positive signal distributions are written per tile when the output name
+ * has "{tile}" in it. Otherwise, they are summed over all tiles. */
 static int
-output_corrected_polya_measurements(const char *taginfo_file,
-                                    int16_t *polya_measurements,
-                                    size_t nclusters,
-                                    const char *tile_id)
+process_manifest(const char *manifest_file, const char *cutoffs_file,
+                 struct RulingParams *settings, const char *sigdist_file,
+                 int threads)
 {
-    gzFile fp;
+    struct ScoreCutoffMap cutoffmap;
+    struct Manifest manifest;
+    struct RulingWorker *workers;
+    const struct ManifestEntry *entry;
+    size_t i;
+    int per_tile_dists, ncycles, r;
 
-    fp = gzopen(taginfo_file, "rt");
-    if (fp == NULL)
-        return -1;
+    workers = NULL;
+    memset(&manifest, 0, sizeof(manifest));
 
-    for (;;) {
-        char linebuf[TAGINFO_LINEBUF_SIZE];
-        char *bptr, *token, *mods, *umi;
-        uint32_t clusterno, flags;
-        int i;
-
-        if (gzgets(fp, linebuf, TAGINFO_LINEBUF_SIZE) == NULL) {
-            int errno;
-            (void)gzerror(fp, &errno);
-            if (errno == 0)
-                break; /* end-of-file */
-            else {
-                fprintf(stderr, "Error occurred on reading %s.\n",
-                        taginfo_file);
-                gzclose(fp);
-                return -1;
+    if (load_score_cutoff_map(cutoffs_file, &cutoffmap) < 0)
+        return 1;
+
+    r = 1;
+    if (load_manifest(manifest_file, &cutoffmap, &manifest) < 0)
+        goto onExit;
+
+    ncycles = manifest.entries[0].cutoffs->num_cycles;
+    workers = setup_ruling_workers(threads, (size_t)ncycles *
+                    settings->dist_sampling_bins * sizeof(cluster_count_t));
+    if (workers == NULL)
+        goto onExit;
+
+    per_tile_dists = (strstr(sigdist_file, TILE_PLACEHOLDER) != NULL);
+
+    for (i = 0; i < manifest.size; i++) {
+        entry = &manifest.entries[i];
+
+        settings->score_cutoffs = entry->cutoffs->cutoffs;
+        settings->cutoffs_num_cycles = entry->cutoffs->num_cycles;
+
+        r = rule_signal_dump(entry->cutoffs->tile_id, entry->signals_file,
+                             entry->taginfo_file, entry->output_file,
+                             settings, workers, threads);
+        if (r != 0)
+            goto onExit;
+
+        /* Write out the distributions after the last signals of a tile. */
+        if (per_tile_dists && (i + 1 == manifest.size ||
+                               entry[1].cutoffs != entry->cutoffs)) {
+            char *filename;
+
+            filename = replace_placeholder(sigdist_file, TILE_PLACEHOLDER,
+                                           entry->cutoffs->tile_id);
+            if (filename == NULL) {
+                perror("process_manifest");
+                r = 1;
+                goto onExit;
+            }
+
+            r = write_summed_dists(workers, threads, filename, ncycles,
+                                   settings->dist_sampling_bins);
+            free(filename);
+            if (r < 0) {
+                r = 1;
+                goto onExit;
             }
         }
+    }
 
-        bptr = linebuf;
-        token = strsep(&bptr, "\t\n\r");
-        if (token == NULL)
-            continue;
+    if (!per_tile_dists &&
+            write_summed_dists(workers, threads, sigdist_file, ncycles,
+                               settings->dist_sampling_bins) < 0) {
+        r = 1;
+        goto onExit;
+    }
 
-        clusterno = atoi(token);
-        if (polya_measurements[clusterno] < 0) {
-            /* Poly(A) length is not revised. Bypass the line. */
-            token[strlen(token)] = '\t';
-            fputs(tile_id, stdout);
-            fputc('\t', stdout);
-            fputs(linebuf, stdout);
-            continue;
-        }
+    r = 0;
 
-        mods = umi = NULL;
-        flags = 0;
+  onExit:
+    if (workers != NULL)
+        free_ruling_workers(workers, threads);
+    free_manifest(&manifest);
+    free_score_cutoff_map(&cutoffmap);
 
-        for (i = 0; (token = strsep(&bptr, "\t\n\r")) != NULL; i++)
-            switch (i) {
-            case 0: flags = atoi(token); break;
-            case 1: /*polya_prelim = atoi(token);*/ break;
-            case 2: mods = token; break;
-            case 3: umi = token; break;
-            default: break;
-            }
+    return r;
+}
 
-        flags |= PAFLAG_MEASURED_FROM_FLUORESCENCE;
-        printf("%s\t%d\t%d\t%d\t%s\t%s\n", tile_id, clusterno, flags,
-               polya_measurements[clusterno], mods, umi);
+static int
+process_single_tile(const char *tile_id, const char *signals_file,
+                    const char *cutoffs_file, const char *taginfo_file,
+                    const char *output_file, struct RulingParams *settings,
+                    const char *sigdist_file, int threads)
+{
+    struct ScoreCutoffMap cutoffmap;
+    const struct ScoreCutoffEntry *cutoffs;
+    struct RulingWorker *workers;
+    int r;
+
+    if (strlen(tile_id) > MAX_TILE_ID_LEN) {
+        fprintf(stderr, "Too long tile id: %s\n", tile_id);
+        return 1;
     }
 
-    return 0;
+    /* Load per-cycle poly(A) score cutoffs table */
+    if (load_score_cutoff_map(cutoffs_file, &cutoffmap) < 0)
+        return 1;
+
+    r = 1;
+    workers = NULL;
+
+    cutoffs = find_score_cutoffs(&cutoffmap, tile_id);
+    if (cutoffs == NULL)
+        goto onExit;
+
+    settings->score_cutoffs = cutoffs->cutoffs;
+    settings->cutoffs_num_cycles = cutoffs->num_cycles;
+
+    workers = setup_ruling_workers(threads, (size_t)cutoffs->num_cycles *
+                    settings->dist_sampling_bins * sizeof(cluster_count_t));
+    if (workers == NULL)
+        goto onExit;
+
+    r = rule_signal_dump(tile_id, signals_file, taginfo_file, output_file,
+                         settings, workers, threads);
+    if (r != 0)
+        goto onExit;
+
+    if (write_summed_dists(workers, threads, sigdist_file,
+                           cutoffs->num_cycles,
+                           settings->dist_sampling_bins) < 0)
+        r = 2;
+
+  onExit:
+    if (workers != NULL)
+        free_ruling_workers(workers, threads);
+    free_score_cutoff_map(&cutoffmap);
+
+    return r;
+}
+
+static void
+print_usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [--threads N] [--output FILE] {tile id} "
+                    "{signals} {cutoffs} {min polya} {downhill ext weight} "
+                    "{taginfo} {sampling bin count} {positive sampling gap} "
+                    "{positive sampling output}\n", progname);
+    fprintf(stderr, "       %s [--threads N] --manifest FILE {cutoffs} "
+                    "{min polya} {downhill ext weight} {sampling bin count} "
+                    "{positive sampling gap} {positive sampling output}\n",
+                    progname);
 }
 
 int
 main(int argc, char *argv[])
 {
-    ssize_t cutoffs_num_cycles;
-    unpacked_score_t *score_cutoffs;
-    int16_t *polya_measurements;
-    size_t nclusters;
-    const char *tile_id, *signals_file, *cutoffs_file, *taginfo_file;
-    const char *sigdist_file;
-    float downhill_ext_weight, dist_sampling_gap;
-    int minimum_polya_len, dist_sampling_bins;
-
-    if (argc < 10) {
-        fprintf(stderr, "Usage: %s {tile id} {signals} {cutoffs} {min polya} "
-                        "{downhill ext weight} {taginfo} {sampling bin count} "
-                        "{positive sampling gap} {positive sampling output}\n",
-                        argv[0]);
-        return 1;
+    struct RulingParams settings;
+    const char *progname, *output_file, *manifest_file;
+    int threads;
+
+    struct option long_options[] =
+    {
+        {"threads",     required_argument,  0,  't'},
+        {"output",      required_argument,  0,  'o'},
+        {"manifest",    required_argument,  0,  'm'},
+        {0, 0, 0, 0}
+    };
+
+    progname = argv[0];
+    threads = 1;
+    output_file = NULL;
+    manifest_file = NULL;
+
+    while (1) {
+        int option_index=0;
+        int c;
+
+        c = getopt_long(argc, argv, "t:o:m:", long_options, &option_index);
+
+        /* Detect the end of the options. */
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 't': /* --threads */
+                threads = atoi(optarg);
+                break;
+
+            case 'o': /* --output */
+                output_file = optarg;
+                break;
+
+            case 'm': /* --manifest */
+                manifest_file = optarg;
+                break;
+
+            default:
+                print_usage(progname);
+                return 1;
+        }
     }
 
-    tile_id = argv[1];
-    signals_file = argv[2];
-    cutoffs_file = argv[3];
-    minimum_polya_len = atoi(argv[4]);
-    downhill_ext_weight = atof(argv[5]);
-    taginfo_file = argv[6];
-    dist_sampling_bins = atoi(argv[7]);
-    dist_sampling_gap = atof(argv[8]);
-    sigdist_file = argv[9];
+    memset(&settings, 0, sizeof(settings));
+    argv += optind - 1;
 
-    /* Load per-cycle poly(A) score cutoffs table */
-    score_cutoffs = load_score_cutoffs(cutoffs_file, tile_id, &cutoffs_num_cycles);
-    if (score_cutoffs == NULL)
-        return 1;
+    if (manifest_file != NULL) {
+        /* Outputs are given in the manifest. */
+        if (argc - optind < 6 || threads < 1 || output_file != NULL) {
+            print_usage(progname);
+            return 1;
+        }
 
-    /* Measure the lengths of poly(A) tails */
-    polya_measurements = process_polya_ruling(signals_file, score_cutoffs,
-            cutoffs_num_cycles, minimum_polya_len, downhill_ext_weight,
-            dist_sampling_bins, dist_sampling_gap, sigdist_file,
-            &nclusters);
-    free(score_cutoffs);
-    if (polya_measurements == NULL)
-        return 2;
+        settings.minimum_polya_len = atoi(argv[2]);
+        settings.downhill_ext_weight = atof(argv[3]);
+        settings.dist_sampling_bins = atoi(argv[4]);
+        settings.dist_sampling_gap = atof(argv[5]);
 
-    /* Apply the measurements to the existing taginfo */
-    if (output_corrected_polya_measurements(taginfo_file,
-                polya_measurements, nclusters, tile_id) < 0) {
-        free(polya_measurements);
-        return 3;
+        return process_manifest(manifest_file, argv[1], &settings, argv[6],
+                                threads);
     }
 
-    free(polya_measurements);
+    if (argc - optind < 9 || threads < 1) {
+        print_usage(progname);
+        return 1;
+    }
 
-    return 0;
+    settings.minimum_polya_len = atoi(argv[4]);
+    settings.downhill_ext_weight = atof(argv[5]);
+    settings.dist_sampling_bins = atoi(argv[7]);
+    settings.dist_sampling_gap = atof(argv[8]);
+
+    return process_single_tile(argv[1], argv[2], argv[3], argv[6],
+                               output_file, &settings, argv[9], threads);
 }
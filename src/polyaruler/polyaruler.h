@@ -0,0 +1,161 @@
+/*
+ * polyaruler.h
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+#ifndef _TAILSEQ_POLYARULER_H_
+#define _TAILSEQ_POLYARULER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <htslib/bgzf.h>
+#include "../signal-packs.h"
+
+
+#define SCORE_LINEBUF_SIZE      16384
+#define MAX_NUM_CYCLES          1024
+#define TAGINFO_LINEBUF_SIZE    2048
+#define TAGINFO_READ_BUFFER_SIZE    1024*1024
+#define MAX_TILE_ID_LEN         63
+#define RULING_BATCH_SIZE       16*1024*1024
+
+/* Poly(A) score cutoffs of the tiles, sorted by the tile ids */
+struct ScoreCutoffEntry {
+    char tile_id[MAX_TILE_ID_LEN + 1];
+    ssize_t num_cycles;
+    unpacked_score_t *cutoffs;
+};
+
+struct ScoreCutoffMap {
+    struct ScoreCutoffEntry *entries;
+    size_t size;
+};
+
+struct TSRecord {
+    struct SignalRecordHeader header;
+    signal_packet_t scores[];
+};
+
+/* Records or version 2 chunks read at once and measured in parallel.
+ * Version 1 records are kept without the zero padding. */
+struct RulingBatch {
+    char *data;
+    size_t size, capacity;
+    size_t *units;                  /* offsets of the records or chunks */
+    size_t nunits, units_capacity;
+};
+
+struct RulingParams {
+    const unpacked_score_t *score_cutoffs;
+    ssize_t cutoffs_num_cycles;
+    int minimum_polya_len;
+    float downhill_ext_weight;
+    int dist_sampling_bins;
+    float dist_sampling_gap;
+
+    uint32_t score_bits;
+    uint32_t max_cycles;
+    uint32_t total_clusters;
+    size_t record_size;             /* version 1 only */
+
+    int16_t *polya_measurements;    /* written at distinct clusters */
+};
+
+struct RulingWorker {
+    pthread_t thread;
+    const struct RulingParams *params;
+    const struct RulingBatch *batch;
+    size_t first_unit, end_unit;
+
+    struct TSRecord *rec;
+    cluster_count_t *pos_score_counts;
+    int error;
+};
+
+/* Parameters for searching the equal-odds poly(A) score cutoffs */
+struct CutoffSearchParams {
+    int total_cycles;
+    int sampling_bins;
+    int min_spots;
+    double kde_bandwidth;
+    double range_low;
+    double *range_high;
+    int range_high_count;
+};
+
+/* States of the cutoffs. The letters are also the marks written in the
+ * cutoff bases report. */
+#define CUTOFF_UNTRIED          0
+#define CUTOFF_FAILED           'x'
+#define CUTOFF_DIRECT           'd'
+#define CUTOFF_INFERRED         'i'
+
+struct CutoffTable {
+    double *values;                 /* NAN if not available */
+    char *states;
+};
+
+/* ruler.c */
+extern unpacked_score_t unpack_score_cutoff(double cutoff);
+extern int load_score_cutoff_map(const char *filename,
+                                 struct ScoreCutoffMap *map);
+extern const struct ScoreCutoffEntry *
+    find_score_cutoffs(const struct ScoreCutoffMap *map, const char *tileid);
+extern void free_score_cutoff_map(struct ScoreCutoffMap *map);
+extern cluster_count_t *load_signal_samples_dists(const char *filename,
+                                                  int *total_cycles,
+                                                  int *sampling_bins);
+extern int write_signal_samples_dists(const char *filename,
+                                      const cluster_count_t *counts,
+                                      int total_cycles, int sampling_bins);
+extern BGZF *open_signal_dump(const char *filename, int threads,
+                              struct RulingParams *params);
+extern ssize_t read_ruling_batch(BGZF *fp, const struct RulingParams *params,
+                                 struct RulingBatch *batch, size_t limit);
+extern void free_ruling_batch(struct RulingBatch *batch);
+extern int rule_batch(struct RulingWorker *workers, int nworkers,
+                      const struct RulingParams *params,
+                      const struct RulingBatch *batch);
+extern int output_corrected_polya_measurements(const char *taginfo_file,
+                                               int16_t *polya_measurements,
+                                               size_t nclusters,
+                                               const char *tile_id, BGZF *out);
+
+/* cutoffs.c */
+extern int init_cutoff_table(struct CutoffTable *table, int total_cycles);
+extern void free_cutoff_table(struct CutoffTable *table);
+extern int find_eqodds_cutoffs(const struct CutoffSearchParams *params,
+                               const uint64_t *poscounts,
+                               const uint64_t *negcounts,
+                               struct CutoffTable *table);
+extern void infer_missing_cutoffs(const struct CutoffSearchParams *params,
+                                  const uint64_t *negtotal,
+                                  struct CutoffTable *table);
+extern void fill_missing_cutoffs(const struct CutoffSearchParams *params,
+                                 const uint64_t *negtotal,
+                                 const struct CutoffTable *runwide,
+                                 struct CutoffTable *table);
+
+#endif
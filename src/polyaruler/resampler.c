@@ -0,0 +1,1132 @@
+/*
+ * resampler.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Runs all rounds of the poly(A) length measurement and the cutoff
+ * re-estimation in a single process. The signal records of all tiles are
+ * loaded once and kept in memory, and only the taginfo of the final round
+ * and the final cutoff tables are written.
+ */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <htslib/bgzf.h>
+#include "../contrib/ini.h"
+#include "../signal-packs.h"
+#include "../utils.h"
+#include "polyaruler.h"
+
+
+struct ResamplerSample {
+    char *name;
+    char *signals_file;
+    char *taginfo_file;
+    char *output_file;
+
+    struct RulingParams params;
+    struct RulingBatch batch;       /* all records of the file */
+
+    struct ResamplerSample *next;
+};
+
+struct ResamplerTile {
+    char *id;
+    char *source;
+    char *negative_dists_file;
+    char *positive_dists_output;
+
+    struct ResamplerSample *samples;
+
+    unpacked_score_t *score_cutoffs;
+    struct CutoffTable cutoffs;
+    cluster_count_t *posdists;
+    uint64_t *poscounts, *negcounts;
+
+    struct ResamplerTile *next;
+};
+
+struct ResamplerConfig {
+    int threads;
+    int rounds;
+    char *initial_cutoffs_file;
+    char *cutoffs_output;
+    char *cutoff_bases_output;
+
+    int minimum_polya_len;
+    float downhill_ext_weight;
+    float dist_sampling_gap;
+
+    struct CutoffSearchParams search;
+
+    struct ResamplerTile *tiles;
+    int num_tiles;
+};
+
+/* Run-wide distributions and cutoffs of the tiles from the same source */
+struct ResamplerSource {
+    const char *name;
+    uint64_t *poscounts, *negcounts;
+    struct CutoffTable cutoffs;
+};
+
+struct CutoffJob {
+    const uint64_t *poscounts, *negcounts;
+    struct CutoffTable *table;
+};
+
+struct CutoffJobQueue {
+    const struct CutoffSearchParams *params;
+    struct CutoffJob *jobs;
+    int njobs, next;
+    pthread_mutex_t lock;
+    int error;
+};
+
+
+#define MATCH(n) strcasecmp(name, n) == 0
+#define STARTSWITH(n) strncasecmp(name, n, sizeof(n) - 1) == 0
+
+static int
+feed_options_entry(struct ResamplerConfig *cfg,
+                   const char *name, const char *value)
+{
+    if (MATCH("threads"))
+        cfg->threads = atoi(value);
+    else if (MATCH("rounds"))
+        cfg->rounds = atoi(value);
+    else if (MATCH("total-cycles"))
+        cfg->search.total_cycles = atoi(value);
+    else if (MATCH("initial-cutoffs"))
+        cfg->initial_cutoffs_file = strdup(value);
+    else {
+        fprintf(stderr, "Unknown key \"%s\" in [options].\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+feed_polyA_ruler_entry(struct ResamplerConfig *cfg,
+                       const char *name, const char *value)
+{
+    if (MATCH("minimum-polya-length"))
+        cfg->minimum_polya_len = atoi(value);
+    else if (MATCH("downhill-extension-weight"))
+        cfg->downhill_ext_weight = atof(value);
+    else if (MATCH("signal-resampling-gap"))
+        cfg->dist_sampling_gap = atof(value);
+    else {
+        fprintf(stderr, "Unknown key \"%s\" in [polyA_ruler].\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+feed_polyA_seeder_entry(struct ResamplerConfig *cfg,
+                        const char *name, const char *value)
+{
+    if (MATCH("dist-sampling-bins"))
+        cfg->search.sampling_bins = atoi(value);
+    else if (MATCH("minimum-spots-for-dist-sampling"))
+        cfg->search.min_spots = atoi(value);
+    else if (MATCH("kde-bandwidth-for-dist"))
+        cfg->search.kde_bandwidth = atof(value);
+    else if (MATCH("cutoff-score-search-low"))
+        cfg->search.range_low = atof(value);
+    else if (MATCH("cutoff-score-search-high")) {
+        char *values, *bptr, *token;
+
+        values = bptr = strdup(value);
+        cfg->search.range_high_count = 0;
+        while ((token = strsep(&bptr, ", \t")) != NULL) {
+            double *newrange;
+
+            if (*token == '\0')
+                continue;
+
+            newrange = realloc(cfg->search.range_high, sizeof(double) *
+                               (cfg->search.range_high_count + 1));
+            if (newrange == NULL) {
+                perror("feed_polyA_seeder_entry");
+                free(values);
+                return -1;
+            }
+
+            cfg->search.range_high = newrange;
+            cfg->search.range_high[cfg->search.range_high_count++] = atof(token);
+        }
+        free(values);
+    }
+    else {
+        fprintf(stderr, "Unknown key \"%s\" in [polyA_seeder].\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+feed_output_entry(struct ResamplerConfig *cfg,
+                  const char *name, const char *value)
+{
+    if (MATCH("cutoffs"))
+        cfg->cutoffs_output = strdup(value);
+    else if (MATCH("cutoff-bases"))
+        cfg->cutoff_bases_output = strdup(value);
+    else {
+        fprintf(stderr, "Unknown key \"%s\" in [output].\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct ResamplerSample *
+get_tile_sample(struct ResamplerTile *tile, const char *samplename)
+{
+    struct ResamplerSample *sample, **tail;
+
+    for (tail = &tile->samples; *tail != NULL; tail = &(*tail)->next)
+        if (strcmp((*tail)->name, samplename) == 0)
+            return *tail;
+
+    sample = malloc(sizeof(struct ResamplerSample));
+    if (sample == NULL) {
+        perror("get_tile_sample");
+        return NULL;
+    }
+
+    memset(sample, 0, sizeof(struct ResamplerSample));
+    sample->name = strdup(samplename);
+    *tail = sample;
+
+    return sample;
+}
+
+static int
+feed_tile_entry(struct ResamplerConfig *cfg, const char *tileid,
+                const char *name, const char *value)
+{
+    struct ResamplerTile *tile, **tail;
+    struct ResamplerSample *sample;
+
+    for (tail = &cfg->tiles; *tail != NULL; tail = &(*tail)->next)
+        if (strcmp((*tail)->id, tileid) == 0)
+            break;
+
+    if (*tail == NULL) {
+        if (strlen(tileid) > MAX_TILE_ID_LEN) {
+            fprintf(stderr, "Too long tile id: %s\n", tileid);
+            return -1;
+        }
+
+        tile = malloc(sizeof(struct ResamplerTile));
+        if (tile == NULL) {
+            perror("feed_tile_entry");
+            return -1;
+        }
+
+        memset(tile, 0, sizeof(struct ResamplerTile));
+        tile->id = strdup(tileid);
+        *tail = tile;
+        cfg->num_tiles++;
+    }
+    tile = *tail;
+
+    if (MATCH("source"))
+        tile->source = strdup(value);
+    else if (MATCH("negative-dists"))
+        tile->negative_dists_file = strdup(value);
+    else if (MATCH("positive-dists-output"))
+        tile->positive_dists_output = strdup(value);
+    else if (STARTSWITH("signals:")) {
+        if ((sample = get_tile_sample(tile, name + 8)) == NULL)
+            return -1;
+        sample->signals_file = strdup(value);
+    }
+    else if (STARTSWITH("taginfo:")) {
+        if ((sample = get_tile_sample(tile, name + 8)) == NULL)
+            return -1;
+        sample->taginfo_file = strdup(value);
+    }
+    else if (STARTSWITH("output:")) {
+        if ((sample = get_tile_sample(tile, name + 7)) == NULL)
+            return -1;
+        sample->output_file = strdup(value);
+    }
+    else {
+        fprintf(stderr, "Unknown key \"%s\" in tile %s.\n", name, tileid);
+        return -1;
+    }
+
+    return 0;
+}
+#undef STARTSWITH
+#undef MATCH
+
+static int
+feed_entry(void *user,
+           const char *section, const char *name, const char *value)
+{
+    struct ResamplerConfig *cfg=(struct ResamplerConfig *)user;
+
+#define MATCH(s) strcasecmp(section, s) == 0
+    if (MATCH("options"))
+        return feed_options_entry(cfg, name, value);
+    else if (MATCH("polyA_ruler"))
+        return feed_polyA_ruler_entry(cfg, name, value);
+    else if (MATCH("polyA_seeder"))
+        return feed_polyA_seeder_entry(cfg, name, value);
+    else if (MATCH("output"))
+        return feed_output_entry(cfg, name, value);
+    else if (strncasecmp(section, "tile:", 5) == 0)
+        return feed_tile_entry(cfg, section + 5, name, value);
+    else {
+        fprintf(stderr, "Unknown section [%s] in the configuration.",
+                        section);
+        return -1;
+    }
+#undef MATCH
+
+    return 0;
+}
+
+static int
+check_configuration_requirements(struct ResamplerConfig *cfg)
+{
+    struct ResamplerTile *tile;
+    struct ResamplerSample *sample;
+
+    if (cfg->threads < 1 || cfg->rounds < 1 ||
+            cfg->search.total_cycles <= 0 || cfg->search.sampling_bins <= 0 ||
+            cfg->search.range_high_count == 0 ||
+            cfg->initial_cutoffs_file == NULL ||
+            cfg->cutoffs_output == NULL || cfg->cutoff_bases_output == NULL) {
+        fprintf(stderr, "Required options are missing or out of range.\n");
+        return -1;
+    }
+
+    if (cfg->tiles == NULL) {
+        fprintf(stderr, "No tiles are given.\n");
+        return -1;
+    }
+
+    for (tile = cfg->tiles; tile != NULL; tile = tile->next) {
+        if (tile->source == NULL || tile->negative_dists_file == NULL) {
+            fprintf(stderr, "The source or the negative signal distributions "
+                            "are not given for tile %s.\n", tile->id);
+            return -1;
+        }
+
+        for (sample = tile->samples; sample != NULL; sample = sample->next)
+            if (sample->signals_file == NULL || sample->taginfo_file == NULL ||
+                    sample->output_file == NULL) {
+                fprintf(stderr, "Incomplete files for sample %s in tile %s.\n",
+                        sample->name, tile->id);
+                return -1;
+            }
+    }
+
+    return 0;
+}
+
+static void
+free_config(struct ResamplerConfig *cfg)
+{
+    struct ResamplerTile *tile, *nexttile;
+    struct ResamplerSample *sample, *nextsample;
+
+    for (tile = cfg->tiles; tile != NULL; tile = nexttile) {
+        nexttile = tile->next;
+
+        for (sample = tile->samples; sample != NULL; sample = nextsample) {
+            nextsample = sample->next;
+
+            free(sample->name);
+            if (sample->signals_file != NULL)
+                free(sample->signals_file);
+            if (sample->taginfo_file != NULL)
+                free(sample->taginfo_file);
+            if (sample->output_file != NULL)
+                free(sample->output_file);
+            if (sample->params.polya_measurements != NULL)
+                free(sample->params.polya_measurements);
+            free_ruling_batch(&sample->batch);
+            free(sample);
+        }
+
+        free(tile->id);
+        if (tile->source != NULL)
+            free(tile->source);
+        if (tile->negative_dists_file != NULL)
+            free(tile->negative_dists_file);
+        if (tile->positive_dists_output != NULL)
+            free(tile->positive_dists_output);
+        if (tile->score_cutoffs != NULL)
+            free(tile->score_cutoffs);
+        free_cutoff_table(&tile->cutoffs);
+        if (tile->posdists != NULL)
+            free(tile->posdists);
+        if (tile->poscounts != NULL)
+            free(tile->poscounts);
+        if (tile->negcounts != NULL)
+            free(tile->negcounts);
+        free(tile);
+    }
+
+    if (cfg->initial_cutoffs_file != NULL)
+        free(cfg->initial_cutoffs_file);
+    if (cfg->cutoffs_output != NULL)
+        free(cfg->cutoffs_output);
+    if (cfg->cutoff_bases_output != NULL)
+        free(cfg->cutoff_bases_output);
+    if (cfg->search.range_high != NULL)
+        free(cfg->search.range_high);
+
+    free(cfg);
+}
+
+static struct ResamplerConfig *
+parse_config(const char *filename)
+{
+    struct ResamplerConfig *cfg;
+
+    cfg = (struct ResamplerConfig *)malloc(sizeof(*cfg));
+    if (cfg == NULL)
+        return NULL;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->threads = 1;
+    cfg->rounds = 1;
+    cfg->minimum_polya_len = 8;
+    cfg->downhill_ext_weight = .49f;
+    cfg->dist_sampling_gap = .1f;
+    cfg->search.sampling_bins = 1000;
+    cfg->search.min_spots = 300;
+    cfg->search.kde_bandwidth = .1;
+    cfg->search.range_low = 0.;
+
+    if (ini_parse(filename, feed_entry, cfg) < 0) {
+        fprintf(stderr, "Failed to parse %s.\n", filename);
+        free_config(cfg);
+        return NULL;
+    }
+
+    if (check_configuration_requirements(cfg) < 0) {
+        free_config(cfg);
+        return NULL;
+    }
+
+    return cfg;
+}
+
+/* Loads the signal records of a sample into memory, without the zero
+ * padding of the version 1 records. */
+static int
+load_sample_signals(struct ResamplerConfig *cfg,
+                    struct ResamplerSample *sample)
+{
+    BGZF *fp;
+
+    fp = open_signal_dump(sample->signals_file, cfg->threads, &sample->params);
+    if (fp == NULL)
+        return -1;
+
+    if (read_ruling_batch(fp, &sample->params, &sample->batch,
+                          SIZE_MAX) < 0) {
+        fprintf(stderr, "Failed to load %s.\n", sample->signals_file);
+        bgzf_close(fp);
+        return -1;
+    }
+
+    bgzf_close(fp);
+
+    sample->params.cutoffs_num_cycles = cfg->search.total_cycles;
+    sample->params.minimum_polya_len = cfg->minimum_polya_len;
+    sample->params.downhill_ext_weight = cfg->downhill_ext_weight;
+    sample->params.dist_sampling_bins = cfg->search.sampling_bins;
+    sample->params.dist_sampling_gap = cfg->dist_sampling_gap;
+
+    sample->params.polya_measurements = malloc(sizeof(int16_t) *
+                                               sample->params.total_clusters);
+    if (sample->params.polya_measurements == NULL) {
+        perror("load_sample_signals");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+load_tile(struct ResamplerConfig *cfg, const struct ScoreCutoffMap *cutoffmap,
+          struct ResamplerTile *tile)
+{
+    const struct ScoreCutoffEntry *initial;
+    struct ResamplerSample *sample;
+    cluster_count_t *negdists;
+    size_t distsize, i;
+    int total_cycles, sampling_bins;
+
+    initial = find_score_cutoffs(cutoffmap, tile->id);
+    if (initial == NULL)
+        return -1;
+
+    if (initial->num_cycles != cfg->search.total_cycles) {
+        fprintf(stderr, "Initial cutoffs for tile %s have %d cycles, not %d.\n",
+                tile->id, (int)initial->num_cycles, cfg->search.total_cycles);
+        return -1;
+    }
+
+    /* Updated in every round */
+    tile->score_cutoffs = malloc(sizeof(unpacked_score_t) *
+                                 initial->num_cycles);
+    if (tile->score_cutoffs == NULL) {
+        perror("load_tile");
+        return -1;
+    }
+    memcpy(tile->score_cutoffs, initial->cutoffs,
+           sizeof(unpacked_score_t) * initial->num_cycles);
+
+    negdists = load_signal_samples_dists(tile->negative_dists_file,
+                                         &total_cycles, &sampling_bins);
+    if (negdists == NULL)
+        return -1;
+
+    if (total_cycles != cfg->search.total_cycles ||
+            sampling_bins != cfg->search.sampling_bins) {
+        fprintf(stderr, "Unexpected dimensions of the signal distributions "
+                        "in %s.\n", tile->negative_dists_file);
+        free(negdists);
+        return -1;
+    }
+
+    distsize = (size_t)total_cycles * sampling_bins;
+    tile->posdists = malloc(sizeof(cluster_count_t) * distsize);
+    tile->poscounts = malloc(sizeof(uint64_t) * distsize);
+    tile->negcounts = malloc(sizeof(uint64_t) * distsize);
+    if (tile->posdists == NULL || tile->poscounts == NULL ||
+            tile->negcounts == NULL ||
+            init_cutoff_table(&tile->cutoffs, total_cycles) < 0) {
+        perror("load_tile");
+        free(negdists);
+        return -1;
+    }
+
+    for (i = 0; i < distsize; i++)
+        tile->negcounts[i] = negdists[i];
+    free(negdists);
+
+    for (sample = tile->samples; sample != NULL; sample = sample->next)
+        if (load_sample_signals(cfg, sample) < 0)
+            return -1;
+
+    return 0;
+}
+
+/* Measures all records of a tile with its current cutoffs. Returns the
+ * number of measured poly(A) tails, or -1 on errors. */
+static ssize_t
+measure_tile(struct ResamplerConfig *cfg, struct ResamplerTile *tile,
+             struct RulingWorker *workers)
+{
+    struct ResamplerSample *sample;
+    size_t distsize, i;
+    ssize_t measured;
+    int w;
+
+    distsize = (size_t)cfg->search.total_cycles * cfg->search.sampling_bins;
+    for (w = 0; w < cfg->threads; w++)
+        memset(workers[w].pos_score_counts, 0,
+               sizeof(cluster_count_t) * distsize);
+
+    measured = 0;
+    for (sample = tile->samples; sample != NULL; sample = sample->next) {
+        sample->params.score_cutoffs = tile->score_cutoffs;
+        memset(sample->params.polya_measurements, 0xff,
+               sizeof(int16_t) * sample->params.total_clusters);
+
+        if (rule_batch(workers, cfg->threads, &sample->params,
+                       &sample->batch) < 0) {
+            fprintf(stderr, "Broken signal record in %s.\n",
+                    sample->signals_file);
+            return -1;
+        }
+
+        for (i = 0; i < sample->params.total_clusters; i++)
+            measured += (sample->params.polya_measurements[i] >= 0);
+    }
+
+    for (i = 0; i < distsize; i++) {
+        tile->posdists[i] = workers[0].pos_score_counts[i];
+        for (w = 1; w < cfg->threads; w++)
+            tile->posdists[i] += workers[w].pos_score_counts[i];
+        tile->poscounts[i] = tile->posdists[i];
+    }
+
+    return measured;
+}
+
+static void *
+run_cutoff_jobs(void *arg)
+{
+    struct CutoffJobQueue *queue=(struct CutoffJobQueue *)arg;
+
+    for (;;) {
+        struct CutoffJob *job;
+
+        pthread_mutex_lock(&queue->lock);
+        job = (queue->next < queue->njobs) ? &queue->jobs[queue->next++] : NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (job == NULL)
+            break;
+
+        if (find_eqodds_cutoffs(queue->params, job->poscounts, job->negcounts,
+                                job->table) < 0) {
+            pthread_mutex_lock(&queue->lock);
+            queue->error = -1;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+
+    return NULL;
+}
+
+static int
+run_cutoff_job_queue(struct CutoffJobQueue *queue, int threads)
+{
+    pthread_t *workers;
+    int i, nstarted;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->next = 0;
+    queue->error = 0;
+
+    if (threads > queue->njobs)
+        threads = queue->njobs;
+
+    workers = malloc(sizeof(pthread_t) * (threads > 0 ? threads : 1));
+    if (workers == NULL) {
+        perror("run_cutoff_job_queue");
+        pthread_mutex_destroy(&queue->lock);
+        return -1;
+    }
+
+    for (nstarted = 0; nstarted < threads - 1; nstarted++)
+        if (pthread_create(&workers[nstarted], NULL, run_cutoff_jobs,
+                           queue) != 0) {
+            perror("run_cutoff_job_queue");
+            break;
+        }
+
+    run_cutoff_jobs(queue);
+
+    for (i = 0; i < nstarted; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    pthread_mutex_destroy(&queue->lock);
+
+    return queue->error;
+}
+
+/*
+ * Estimates new cutoffs for every tile from the positive distributions of
+ * the last measurement. Cutoffs of the cycles without enough spots in a
+ * tile come from the run-wide estimation of its source.
+ */
+static int
+estimate_cutoffs(struct ResamplerConfig *cfg, struct ResamplerSource *sources,
+                 int nsources)
+{
+    struct ResamplerTile *tile;
+    struct CutoffJobQueue queue;
+    size_t distsize, i;
+    int s, r;
+
+    distsize = (size_t)cfg->search.total_cycles * cfg->search.sampling_bins;
+
+    for (s = 0; s < nsources; s++) {
+        memset(sources[s].poscounts, 0, sizeof(uint64_t) * distsize);
+        memset(sources[s].negcounts, 0, sizeof(uint64_t) * distsize);
+    }
+
+    for (tile = cfg->tiles; tile != NULL; tile = tile->next) {
+        for (s = 0; strcmp(sources[s].name, tile->source) != 0; s++)
+            ;
+        for (i = 0; i < distsize; i++) {
+            sources[s].poscounts[i] += tile->poscounts[i];
+            sources[s].negcounts[i] += tile->negcounts[i];
+        }
+    }
+
+    memset(&queue, 0, sizeof(queue));
+    queue.params = &cfg->search;
+    queue.jobs = malloc(sizeof(struct CutoffJob) * (nsources + cfg->num_tiles));
+    if (queue.jobs == NULL) {
+        perror("estimate_cutoffs");
+        return -1;
+    }
+
+    for (s = 0; s < nsources; s++) {
+        queue.jobs[queue.njobs].poscounts = sources[s].poscounts;
+        queue.jobs[queue.njobs].negcounts = sources[s].negcounts;
+        queue.jobs[queue.njobs].table = &sources[s].cutoffs;
+        queue.njobs++;
+    }
+
+    for (tile = cfg->tiles; tile != NULL; tile = tile->next) {
+        queue.jobs[queue.njobs].poscounts = tile->poscounts;
+        queue.jobs[queue.njobs].negcounts = tile->negcounts;
+        queue.jobs[queue.njobs].table = &tile->cutoffs;
+        queue.njobs++;
+    }
+
+    r = run_cutoff_job_queue(&queue, cfg->threads);
+    free(queue.jobs);
+    if (r < 0)
+        return -1;
+
+    for (s = 0; s < nsources; s++)
+        infer_missing_cutoffs(&cfg->search, sources[s].negcounts,
+                              &sources[s].cutoffs);
+
+    for (tile = cfg->tiles; tile != NULL; tile = tile->next) {
+        for (s = 0; strcmp(sources[s].name, tile->source) != 0; s++)
+            ;
+        fill_missing_cutoffs(&cfg->search, sources[s].negcounts,
+                             &sources[s].cutoffs, &tile->cutoffs);
+    }
+
+    return 0;
+}
+
+static void
+format_cutoff(char *buf, size_t bufsize, const struct CutoffTable *table,
+              int cycle)
+{
+    if (table->states[cycle] == CUTOFF_UNTRIED ||
+            table->states[cycle] == CUTOFF_FAILED ||
+            isnan(table->values[cycle]))
+        snprintf(buf, bufsize, "nan");
+    else
+        snprintf(buf, bufsize, "%.6f", table->values[cycle]);
+}
+
+/*
+ * Takes the new cutoffs for the next round, going through the same text
+ * representation as the cutoff table. Returns the number of cycles with
+ * changed cutoffs, and the largest change through max_change.
+ */
+static int
+update_score_cutoffs(struct ResamplerConfig *cfg, struct ResamplerTile *tile,
+                     double *max_change)
+{
+    int cycle, changed;
+
+    changed = 0;
+    for (cycle = 0; cycle < cfg->search.total_cycles; cycle++) {
+        unpacked_score_t newcutoff;
+        char buf[64];
+        double change;
+
+        format_cutoff(buf, sizeof(buf), &tile->cutoffs, cycle);
+        newcutoff = unpack_score_cutoff(atof(buf));
+        if (newcutoff == tile->score_cutoffs[cycle])
+            continue;
+
+        change = fabs((double)newcutoff - tile->score_cutoffs[cycle]) /
+                 (SIGNALPACKET_SCORE_MAX - 1);
+        if (change > *max_change)
+            *max_change = change;
+
+        tile->score_cutoffs[cycle] = newcutoff;
+        changed++;
+    }
+
+    return changed;
+}
+
+static int
+compare_tiles_by_id(const void *a, const void *b)
+{
+    return strcmp((*(struct ResamplerTile * const *)a)->id,
+                  (*(struct ResamplerTile * const *)b)->id);
+}
+
+static int
+write_cutoff_tables(struct ResamplerConfig *cfg,
+                    struct ResamplerSource *sources, int nsources)
+{
+    struct ResamplerTile **sorted, *tile;
+    FILE *fp;
+    int i, s, cycle;
+    char buf[64];
+
+    sorted = malloc(sizeof(struct ResamplerTile *) * cfg->num_tiles);
+    if (sorted == NULL) {
+        perror("write_cutoff_tables");
+        return -1;
+    }
+
+    for (i = 0, tile = cfg->tiles; tile != NULL; tile = tile->next)
+        sorted[i++] = tile;
+    qsort(sorted, cfg->num_tiles, sizeof(struct ResamplerTile *),
+          compare_tiles_by_id);
+
+    fp = fopen(cfg->cutoffs_output, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s to write.\n", cfg->cutoffs_output);
+        free(sorted);
+        return -1;
+    }
+
+    for (i = 0; i < cfg->num_tiles; i++) {
+        fprintf(fp, "%s\t", sorted[i]->id);
+        for (cycle = 0; cycle < cfg->search.total_cycles; cycle++) {
+            format_cutoff(buf, sizeof(buf), &sorted[i]->cutoffs, cycle);
+            fprintf(fp, "%s\t", buf);
+        }
+        fputc('\n', fp);
+    }
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write to %s\n", cfg->cutoffs_output);
+        free(sorted);
+        return -1;
+    }
+
+    fp = fopen(cfg->cutoff_bases_output, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s to write.\n", cfg->cutoff_bases_output);
+        free(sorted);
+        return -1;
+    }
+
+    /* Sources and tiles are listed together in the order of their names. */
+    for (i = 0, s = 0; i < cfg->num_tiles || s < nsources; ) {
+        const struct CutoffTable *table;
+        const char *name;
+
+        if (s < nsources && (i >= cfg->num_tiles ||
+                             strcmp(sources[s].name, sorted[i]->id) < 0)) {
+            name = sources[s].name;
+            table = &sources[s++].cutoffs;
+        }
+        else {
+            name = sorted[i]->id;
+            table = &sorted[i++]->cutoffs;
+        }
+
+        fprintf(fp, "%s\t", name);
+        for (cycle = 0; cycle < cfg->search.total_cycles; cycle++)
+            fputc(table->states[cycle] == CUTOFF_UNTRIED ? CUTOFF_FAILED :
+                  table->states[cycle], fp);
+        fputc('\n', fp);
+    }
+
+    free(sorted);
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write to %s\n", cfg->cutoff_bases_output);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+write_final_measurements(struct ResamplerConfig *cfg)
+{
+    struct ResamplerTile *tile;
+    struct ResamplerSample *sample;
+
+    for (tile = cfg->tiles; tile != NULL; tile = tile->next) {
+        for (sample = tile->samples; sample != NULL; sample = sample->next) {
+            BGZF *out;
+            int r;
+
+            out = bgzf_open(sample->output_file, "w");
+            if (out == NULL) {
+                fprintf(stderr, "Failed to open %s.\n", sample->output_file);
+                return -1;
+            }
+
+            if (cfg->threads > 1 && bgzf_mt(out, cfg->threads, 256) < 0)
+                fprintf(stderr, "Failed to start the compression threads.\n");
+
+            r = output_corrected_polya_measurements(sample->taginfo_file,
+                        sample->params.polya_measurements,
+                        sample->params.total_clusters, tile->id, out);
+            if (bgzf_close(out) < 0 || r < 0) {
+                fprintf(stderr, "Failed to write %s.\n", sample->output_file);
+                return -1;
+            }
+        }
+
+        if (tile->positive_dists_output != NULL &&
+                write_signal_samples_dists(tile->positive_dists_output,
+                        tile->posdists, cfg->search.total_cycles,
+                        cfg->search.sampling_bins) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void
+free_sources(struct ResamplerSource *sources, int nsources)
+{
+    int s;
+
+    for (s = 0; s < nsources; s++) {
+        if (sources[s].poscounts != NULL)
+            free(sources[s].poscounts);
+        if (sources[s].negcounts != NULL)
+            free(sources[s].negcounts);
+        free_cutoff_table(&sources[s].cutoffs);
+    }
+
+    free(sources);
+}
+
+static struct ResamplerSource *
+setup_sources(struct ResamplerConfig *cfg, int *nsources)
+{
+    struct ResamplerSource *sources;
+    struct ResamplerTile *tile;
+    size_t distsize;
+    int s;
+
+    sources = calloc(cfg->num_tiles, sizeof(struct ResamplerSource));
+    if (sources == NULL) {
+        perror("setup_sources");
+        return NULL;
+    }
+
+    distsize = (size_t)cfg->search.total_cycles * cfg->search.sampling_bins;
+    *nsources = 0;
+
+    for (tile = cfg->tiles; tile != NULL; tile = tile->next) {
+        for (s = 0; s < *nsources; s++)
+            if (strcmp(sources[s].name, tile->source) == 0)
+                break;
+
+        if (s < *nsources)
+            continue;
+
+        sources[s].name = tile->source;
+        sources[s].poscounts = malloc(sizeof(uint64_t) * distsize);
+        sources[s].negcounts = malloc(sizeof(uint64_t) * distsize);
+        (*nsources)++;
+
+        if (sources[s].poscounts == NULL || sources[s].negcounts == NULL ||
+                init_cutoff_table(&sources[s].cutoffs,
+                                  cfg->search.total_cycles) < 0) {
+            perror("setup_sources");
+            free_sources(sources, *nsources);
+            return NULL;
+        }
+    }
+
+    /* Keep the sources in the order of their names for the report. */
+    for (s = 1; s < *nsources; s++) {
+        struct ResamplerSource key = sources[s];
+        int j;
+
+        for (j = s - 1; j >= 0 && strcmp(sources[j].name, key.name) > 0; j--)
+            sources[j + 1] = sources[j];
+        sources[j + 1] = key;
+    }
+
+    return sources;
+}
+
+static int
+run_resampling(struct ResamplerConfig *cfg)
+{
+    struct ResamplerTile *tile;
+    struct ResamplerSample *sample;
+    struct ResamplerSource *sources;
+    struct RulingWorker *workers;
+    struct ScoreCutoffMap cutoffmap;
+    size_t distsize, maxrecordsize, loadedsize, nrecords;
+    double started, round_started;
+    int nsources, round, w, r;
+
+    r = -1;
+    sources = NULL;
+    nsources = 0;
+    memset(&cutoffmap, 0, sizeof(cutoffmap));
+    distsize = (size_t)cfg->search.total_cycles * cfg->search.sampling_bins;
+
+    workers = calloc(cfg->threads, sizeof(struct RulingWorker));
+    if (workers == NULL) {
+        perror("run_resampling");
+        return -1;
+    }
+
+    /* Load everything once. */
+    started = elapsed_seconds();
+    if (load_score_cutoff_map(cfg->initial_cutoffs_file, &cutoffmap) < 0)
+        goto onError;
+
+    maxrecordsize = loadedsize = nrecords = 0;
+    for (tile = cfg->tiles; tile != NULL; tile = tile->next) {
+        if (load_tile(cfg, &cutoffmap, tile) < 0)
+            goto onError;
+
+        for (sample = tile->samples; sample != NULL; sample = sample->next) {
+            if (sample->params.record_size > maxrecordsize)
+                maxrecordsize = sample->params.record_size;
+            loadedsize += sample->batch.size;
+            nrecords += sample->batch.nunits;
+        }
+    }
+
+    free_score_cutoff_map(&cutoffmap);
+
+    fprintf(stderr, "Loaded signals of %d tiles (%zu records or chunks, "
+                    "%.1f MB) in %.2f s.\n", cfg->num_tiles, nrecords,
+                    loadedsize / 1048576., elapsed_seconds() - started);
+
+    for (w = 0; w < cfg->threads; w++) {
+        workers[w].rec = malloc(maxrecordsize);
+        workers[w].pos_score_counts = malloc(sizeof(cluster_count_t) * distsize);
+        if (workers[w].rec == NULL || workers[w].pos_score_counts == NULL) {
+            perror("run_resampling");
+            goto onError;
+        }
+    }
+
+    sources = setup_sources(cfg, &nsources);
+    if (sources == NULL)
+        goto onError;
+
+    /*
+     * Round N measures the lengths with the cutoffs from round N - 1 and
+     * estimates the cutoffs of round N. The final measurement takes the
+     * cutoffs of the last round. When the cutoffs do not change any more,
+     * the following rounds would repeat the same results, and are skipped.
+     */
+    for (round = 1; ; round++) {
+        ssize_t measured, total_measured;
+        double measure_time, max_change;
+        int changed;
+
+        round_started = elapsed_seconds();
+        total_measured = 0;
+        for (tile = cfg->tiles; tile != NULL; tile = tile->next) {
+            measured = measure_tile(cfg, tile, workers);
+            if (measured < 0)
+                goto onError;
+            total_measured += measured;
+        }
+        measure_time = elapsed_seconds() - round_started;
+
+        if (round > cfg->rounds) {
+            fprintf(stderr, "Final measurement: %zd poly(A) tails in "
+                            "%.2f s.\n", total_measured, measure_time);
+            break;
+        }
+
+        if (estimate_cutoffs(cfg, sources, nsources) < 0)
+            goto onError;
+
+        max_change = 0.;
+        changed = 0;
+        for (tile = cfg->tiles; tile != NULL; tile = tile->next)
+            changed += update_score_cutoffs(cfg, tile, &max_change);
+
+        fprintf(stderr, "Round %d: %zd poly(A) tails measured in %.2f s, "
+                        "cutoffs estimated in %.2f s; %d cycles changed, "
+                        "max change %.6f.\n", round, total_measured,
+                        measure_time,
+                        elapsed_seconds() - round_started - measure_time,
+                        changed, max_change);
+
+        if (changed == 0) {
+            fprintf(stderr, "Cutoffs converged at round %d.\n", round);
+            break;
+        }
+    }
+
+    started = elapsed_seconds();
+    if (write_final_measurements(cfg) < 0 ||
+            write_cutoff_tables(cfg, sources, nsources) < 0)
+        goto onError;
+
+    fprintf(stderr, "Wrote the outputs in %.2f s.\n",
+            elapsed_seconds() - started);
+
+    r = 0;
+
+  onError:
+    free_score_cutoff_map(&cutoffmap);
+
+    if (sources != NULL)
+        free_sources(sources, nsources);
+
+    for (w = 0; w < cfg->threads; w++) {
+        if (workers[w].rec != NULL)
+            free(workers[w].rec);
+        if (workers[w].pos_score_counts != NULL)
+            free(workers[w].pos_score_counts);
+    }
+    free(workers);
+
+    return r;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct ResamplerConfig *cfg;
+    int r;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s {config file}\n", argv[0]);
+        return 1;
+    }
+
+    cfg = parse_config(argv[1]);
+    if (cfg == NULL)
+        return 1;
+
+    r = run_resampling(cfg);
+    free_config(cfg);
+
+    return (r < 0) ? 2 : 0;
+}
@@ -0,0 +1,845 @@
+/*
+ * ruler.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <htslib/bgzf.h>
+#include "../sigproc-flags.h"
+#include "../signal-packs.h"
+#include "../tagpack.h"
+#include "polyaruler.h"
+
+
+/* Brings a cutoff in the cutoff table to the scale of the signal scores. */
+unpacked_score_t
+unpack_score_cutoff(double cutoff)
+{
+    unpacked_score_t unpacked;
+
+    unpacked = 1 + (int)(cutoff * (double)(SIGNALPACKET_SCORE_MAX - 1));
+    if (unpacked >= SIGNALPACKET_SCORE_MAX)
+        unpacked = SIGNALPACKET_SCORE_MAX;
+
+    return unpacked;
+}
+
+static ssize_t
+parse_score_cutoffs(char *bptr, unpacked_score_t *cutoffs)
+{
+    char *cutofftok;
+    ssize_t i;
+
+    for (i = 0; (cutofftok = strsep(&bptr, "\t\r\n, ")) != NULL; i++) {
+        if (*cutofftok == 0)
+            break;
+
+        if (i >= MAX_NUM_CYCLES) {
+            fprintf(stderr, "Exceeded the maximum allowed number of cycles. "
+                            "Adjust MAX_NUM_CYCLES in " __FILE__ ".\n");
+            return -1;
+        }
+
+        cutoffs[i] = unpack_score_cutoff(atof(cutofftok));
+    }
+
+    return i;
+}
+
+static int
+compare_score_cutoff_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct ScoreCutoffEntry *)a)->tile_id,
+                  ((const struct ScoreCutoffEntry *)b)->tile_id);
+}
+
+static int
+compare_tile_id_to_entry(const void *key, const void *entry)
+{
+    return strcmp((const char *)key,
+                  ((const struct ScoreCutoffEntry *)entry)->tile_id);
+}
+
+/* Loads the cutoffs of all tiles in a table at once so that a tile can be
+ * looked up without scanning the file again. */
+int
+load_score_cutoff_map(const char *filename, struct ScoreCutoffMap *map)
+{
+    FILE *fp;
+    char linebuf[SCORE_LINEBUF_SIZE], *bptr, *tileid;
+    struct ScoreCutoffEntry *entry;
+    size_t capacity, i;
+    ssize_t ncycles;
+
+    memset(map, 0, sizeof(*map));
+    capacity = 0;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s.\n", filename);
+        return -1;
+    }
+
+    while (fgets(linebuf, sizeof(linebuf), fp) != NULL) {
+        if (strchr(linebuf, '\n') == NULL && !feof(fp)) {
+            fprintf(stderr, "Too long line in %s.\n", filename);
+            goto onError;
+        }
+
+        bptr = linebuf;
+        tileid = strsep(&bptr, "\t");
+        if (bptr == NULL) /* blank line */
+            continue;
+
+        if (strlen(tileid) > MAX_TILE_ID_LEN) {
+            fprintf(stderr, "Too long tile id in %s: %s\n", filename, tileid);
+            goto onError;
+        }
+
+        if (map->size >= capacity) {
+            struct ScoreCutoffEntry *newentries;
+
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            newentries = realloc(map->entries,
+                                 sizeof(struct ScoreCutoffEntry) * capacity);
+            if (newentries == NULL) {
+                perror("load_score_cutoff_map");
+                goto onError;
+            }
+            map->entries = newentries;
+        }
+
+        entry = &map->entries[map->size];
+        entry->cutoffs = malloc(sizeof(unpacked_score_t) * MAX_NUM_CYCLES);
+        if (entry->cutoffs == NULL) {
+            perror("load_score_cutoff_map");
+            goto onError;
+        }
+        strcpy(entry->tile_id, tileid);
+        map->size++;
+
+        ncycles = parse_score_cutoffs(bptr, entry->cutoffs);
+        if (ncycles < 0)
+            goto onError;
+        entry->num_cycles = ncycles;
+    }
+
+    fclose(fp);
+    fp = NULL;
+
+    qsort(map->entries, map->size, sizeof(struct ScoreCutoffEntry),
+          compare_score_cutoff_entries);
+
+    for (i = 1; i < map->size; i++)
+        if (strcmp(map->entries[i - 1].tile_id, map->entries[i].tile_id) == 0) {
+            fprintf(stderr, "Duplicated poly(A) score cutoffs for tile %s "
+                            "in %s.\n", map->entries[i].tile_id, filename);
+            goto onError;
+        }
+
+    return 0;
+
+  onError:
+    if (fp != NULL)
+        fclose(fp);
+    free_score_cutoff_map(map);
+    return -1;
+}
+
+const struct ScoreCutoffEntry *
+find_score_cutoffs(const struct ScoreCutoffMap *map, const char *tileid)
+{
+    const struct ScoreCutoffEntry *entry;
+
+    entry = NULL;
+    if (map->size > 0)
+        entry = bsearch(tileid, map->entries, map->size,
+                        sizeof(struct ScoreCutoffEntry),
+                        compare_tile_id_to_entry);
+
+    if (entry == NULL)
+        fprintf(stderr, "No poly(A) score cutoffs found for tile %s.\n",
+                tileid);
+
+    return entry;
+}
+
+void
+free_score_cutoff_map(struct ScoreCutoffMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->size; i++)
+        free(map->entries[i].cutoffs);
+
+    if (map->entries != NULL)
+        free(map->entries);
+
+    map->entries = NULL;
+    map->size = 0;
+}
+
+static int
+measure_polya_length(const signal_packet_t *read_scores,
+                     ssize_t read_num_cycles,
+                     int first_cycle,
+                     const unpacked_score_t *score_cutoffs,
+                     ssize_t cutoffs_num_cycles,
+                     float downhill_ext_weight)
+{
+    ssize_t i, physical_cycle;
+    int score_cumsum, score_cumsum_max, score_argmax_cycle;
+    int downhill_ext;
+
+    score_cumsum = score_cumsum_max = 0;
+    score_argmax_cycle = -1;
+    physical_cycle = first_cycle;
+
+    for (i = 0; i < read_num_cycles && physical_cycle < cutoffs_num_cycles;
+            i++, physical_cycle++) {
+        unpacked_score_t cutoff = score_cutoffs[physical_cycle];
+
+        if (cutoff == 0) /* NaN in the integer representation */
+            continue;
+
+        score_cumsum += -1 + (read_scores[i].score >= cutoff) * 2;
+        if (score_cumsum > score_cumsum_max) {
+            score_cumsum_max = score_cumsum;
+            score_argmax_cycle = i;
+        }
+    }
+
+    downhill_ext = -1;
+
+    /* Try extending the poly(A) until entropy continuously decreases. */
+    if (score_argmax_cycle >= 0)
+        for (i = score_argmax_cycle + 1; i < read_num_cycles; i++)
+            if (read_scores[i].score > 0) { /* Non-dark signals */
+                if (read_scores[i].downhill > 0)
+                    downhill_ext = i;
+                else
+                    break;
+            }
+
+    if (downhill_ext >= 0)
+        return score_argmax_cycle + 1 +
+            (int)roundf((downhill_ext - score_argmax_cycle) *
+                        downhill_ext_weight);
+    else
+        return score_argmax_cycle + 1;
+}
+
+static void
+add_polya_score_sample(cluster_count_t *samplecounts,
+                       signal_packet_t *scores, int length,
+                       int firstcycle, int sampling_bins)
+{
+    cluster_count_t *sptr;
+    int i, binno;
+
+    sptr = samplecounts + (firstcycle * sampling_bins);
+    for (i = 0; i < length; i++, scores++, sptr += sampling_bins)
+        if (scores->score > 0) {
+            binno = ((scores->score - 1.) / (SIGNALPACKET_SCORE_MAX - 1)) *
+                    sampling_bins;
+            if (binno >= sampling_bins)
+                binno = sampling_bins - 1;
+
+            sptr[binno]++;
+        }   
+}
+
+cluster_count_t *
+load_signal_samples_dists(const char *filename, int *total_cycles,
+                          int *sampling_bins)
+{
+    uint32_t header_elements[3];
+    cluster_count_t *counts;
+    size_t size;
+    gzFile fp;
+
+    fp = gzopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s.\n", filename);
+        return NULL;
+    }
+
+    if (gzread(fp, header_elements, sizeof(header_elements)) !=
+            sizeof(header_elements) ||
+            header_elements[0] != sizeof(cluster_count_t)) {
+        fprintf(stderr, "Unrecognized signal distributions in %s.\n",
+                filename);
+        gzclose(fp);
+        return NULL;
+    }
+
+    size = sizeof(cluster_count_t) * header_elements[1] * header_elements[2];
+    counts = malloc(size);
+    if (counts == NULL) {
+        perror("load_signal_samples_dists");
+        gzclose(fp);
+        return NULL;
+    }
+
+    if (gzread(fp, counts, size) != size) {
+        fprintf(stderr, "Unexpected end of file in %s.\n", filename);
+        free(counts);
+        gzclose(fp);
+        return NULL;
+    }
+
+    gzclose(fp);
+
+    *total_cycles = header_elements[1];
+    *sampling_bins = header_elements[2];
+
+    return counts;
+}
+
+int
+write_signal_samples_dists(const char *filename,
+                           const cluster_count_t *counts,
+                           int total_cycles, int sampling_bins)
+{
+    uint32_t header_elements[3];
+    gzFile fp;
+    int r;
+
+    fp = gzopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open %s to write.\n", filename);
+        return -1; 
+    }   
+
+    header_elements[0] = sizeof(cluster_count_t);
+    header_elements[1] = total_cycles;
+    header_elements[2] = sampling_bins;
+
+    r = (gzwrite(fp, header_elements, sizeof(header_elements)) < 0 ||
+         gzwrite(fp, counts, sizeof(cluster_count_t) *
+                    total_cycles * sampling_bins) < 0) ? -1 : 0;
+    gzclose(fp);
+
+    return r;
+}
+
+static void
+rule_signal_record(struct TSRecord *rec,
+                   const unpacked_score_t *score_cutoffs,
+                   ssize_t cutoffs_num_cycles, int minimum_polya_len,
+                   float downhill_ext_weight, int dist_sampling_bins,
+                   float dist_sampling_gap, int16_t *polya_measurements,
+                   cluster_count_t *pos_score_counts)
+{
+    int polya_len;
+
+    polya_len = measure_polya_length(rec->scores,
+            rec->header.valid_cycle_count, rec->header.first_cycle,
+            score_cutoffs, cutoffs_num_cycles, downhill_ext_weight);
+
+    if (polya_len >= minimum_polya_len) {
+        int sampling_len;
+        polya_measurements[rec->header.clusterno] = polya_len;
+        sampling_len = polya_len - (int)(polya_len * dist_sampling_gap);
+        add_polya_score_sample(pos_score_counts, rec->scores,
+            sampling_len, rec->header.first_cycle, dist_sampling_bins);
+    }
+}
+
+/*
+ * Decodes a record of a version 2 chunk into rec, with the scores brought
+ * back to the full range. Returns the position of the next record, or NULL
+ * if the record is broken.
+ */
+static const uint8_t *
+decode_signal_record_v2(const uint8_t *p, const uint8_t *end,
+                        struct TSRecord *rec, uint32_t prev_clusterno,
+                        int score_bits, uint32_t max_cycles)
+{
+    uint32_t delta, first_cycle, ncycles, acc, scoremax, packetmask;
+    int i, accbits;
+
+    if ((p = get_signalpack_varint(p, end, &delta)) == NULL ||
+            (p = get_signalpack_varint(p, end, &first_cycle)) == NULL ||
+            (p = get_signalpack_varint(p, end, &ncycles)) == NULL ||
+            ncycles > max_cycles ||
+            SIGNALPACK_V2_PACKED_SIZE(score_bits, ncycles) > end - p)
+        return NULL;
+
+    rec->header.clusterno = prev_clusterno + delta;
+    rec->header.first_cycle = first_cycle;
+    rec->header.valid_cycle_count = ncycles;
+
+    scoremax = SIGNALPACK_V2_SCORE_MAX(score_bits);
+    packetmask = (1 << score_bits) - 1;
+    acc = 0;
+    accbits = 0;
+    for (i = 0; i < ncycles; i++) {
+        uint32_t packet, score;
+
+        for (; accbits < score_bits; accbits += 8)
+            acc |= (uint32_t)*p++ << accbits;
+
+        packet = acc & packetmask;
+        acc >>= score_bits;
+        accbits -= score_bits;
+
+        score = packet & scoremax;
+        if (score > 0)
+            score = 1 + (uint32_t)((uint64_t)(score - 1) *
+                        (SIGNALPACKET_SCORE_MAX - 1) / (scoremax - 1));
+        rec->scores[i].score = score;
+        rec->scores[i].downhill = packet >> (score_bits - 1);
+    }
+
+    return p;
+}
+
+static int
+rule_signal_chunk(struct RulingWorker *worker, const char *unit)
+{
+    const struct RulingParams *params = worker->params;
+    struct SignalChunkHeader chunkheader;
+    const uint8_t *p, *end;
+    uint32_t i, clusterno;
+
+    memcpy(&chunkheader, unit, sizeof(chunkheader));
+    p = (const uint8_t *)unit + sizeof(chunkheader);
+    end = p + chunkheader.payload_size;
+    clusterno = chunkheader.first_clusterno;
+
+    for (i = 0; i < chunkheader.nrecords; i++) {
+        p = decode_signal_record_v2(p, end, worker->rec, clusterno,
+                                    params->score_bits, params->max_cycles);
+        if (p == NULL || worker->rec->header.clusterno >= params->total_clusters)
+            return -1;
+        clusterno = worker->rec->header.clusterno;
+
+        rule_signal_record(worker->rec, params->score_cutoffs,
+                params->cutoffs_num_cycles, params->minimum_polya_len,
+                params->downhill_ext_weight, params->dist_sampling_bins,
+                params->dist_sampling_gap, params->polya_measurements,
+                worker->pos_score_counts);
+    }
+
+    return 0;
+}
+
+static void *
+run_ruling_worker(void *arg)
+{
+    struct RulingWorker *worker = (struct RulingWorker *)arg;
+    const struct RulingParams *params = worker->params;
+    size_t u;
+
+    for (u = worker->first_unit; u < worker->end_unit; u++) {
+        const char *unit = worker->batch->data + worker->batch->units[u];
+
+        if (params->score_bits != SIGNALPACK_V1_SCORE_BITS) {
+            if (rule_signal_chunk(worker, unit) < 0) {
+                worker->error = -1;
+                break;
+            }
+            continue;
+        }
+
+        memcpy(&worker->rec->header, unit, sizeof(struct SignalRecordHeader));
+        memcpy(worker->rec->scores, unit + sizeof(struct SignalRecordHeader),
+               sizeof(signal_packet_t) * worker->rec->header.valid_cycle_count);
+        if (worker->rec->header.clusterno >= params->total_clusters) {
+            worker->error = -1;
+            break;
+        }
+
+        rule_signal_record(worker->rec, params->score_cutoffs,
+                params->cutoffs_num_cycles, params->minimum_polya_len,
+                params->downhill_ext_weight, params->dist_sampling_bins,
+                params->dist_sampling_gap, params->polya_measurements,
+                worker->pos_score_counts);
+    }
+
+    return NULL;
+}
+
+static int
+reserve_ruling_batch(struct RulingBatch *batch, size_t size)
+{
+    if (batch->size + size > batch->capacity) {
+        size_t newcapacity = batch->capacity > 0 ? batch->capacity : 65536;
+        char *newdata;
+
+        while (newcapacity < batch->size + size)
+            newcapacity *= 2;
+
+        newdata = realloc(batch->data, newcapacity);
+        if (newdata == NULL)
+            return -1;
+        batch->data = newdata;
+        batch->capacity = newcapacity;
+    }
+
+    if (batch->nunits >= batch->units_capacity) {
+        size_t newcapacity = batch->units_capacity > 0 ?
+                             batch->units_capacity * 2 : 1024;
+        size_t *newunits;
+
+        newunits = realloc(batch->units, sizeof(size_t) * newcapacity);
+        if (newunits == NULL)
+            return -1;
+        batch->units = newunits;
+        batch->units_capacity = newcapacity;
+    }
+
+    return 0;
+}
+
+/* Opens a signal dump of either version and fills the format fields of
+ * params. */
+BGZF *
+open_signal_dump(const char *filename, int threads,
+                 struct RulingParams *params)
+{
+    BGZF *fp;
+    struct {
+        uint32_t elemsize;          /* or SIGNALPACK_V2_MAGIC */
+        uint32_t total_clusters;
+        uint32_t max_cycles;
+    } header;
+
+    fp = bgzf_open(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open the input file: %s\n", filename);
+        return NULL;
+    }
+
+    /* BGZF blocks are decompressed in parallel by the htslib threads. */
+    if (threads > 1 && bgzf_mt(fp, threads, 256) < 0)
+        fprintf(stderr, "Failed to start the decompression threads.\n");
+
+    if (bgzf_read(fp, &header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "Failed to read the header from %s.\n", filename);
+        goto onError;
+    }
+
+    if (header.elemsize == SIGNALPACK_V2_MAGIC) {
+        if (bgzf_read(fp, &params->score_bits, sizeof(params->score_bits)) !=
+                sizeof(params->score_bits) ||
+                (params->score_bits != 8 && params->score_bits != 12)) {
+            fprintf(stderr, "Unsupported signal format in %s.\n", filename);
+            goto onError;
+        }
+    }
+    else if (header.elemsize == sizeof(signal_packet_t))
+        params->score_bits = SIGNALPACK_V1_SCORE_BITS;
+    else {
+        fprintf(stderr, "The file %s was written in a machine with "
+                        "different architecture.\n", filename);
+        goto onError;
+    }
+
+    params->max_cycles = header.max_cycles;
+    params->total_clusters = header.total_clusters;
+    params->record_size = sizeof(struct SignalRecordHeader) +
+                          header.max_cycles * sizeof(signal_packet_t);
+
+    return fp;
+
+  onError:
+    bgzf_close(fp);
+    return NULL;
+}
+
+/* Fills the batch with up to limit bytes of records or chunks. Returns the
+ * number of units read, or -1 on errors. */
+ssize_t
+read_ruling_batch(BGZF *fp, const struct RulingParams *params,
+                  struct RulingBatch *batch, size_t limit)
+{
+    batch->size = batch->nunits = 0;
+
+    while (batch->size < limit) {
+        struct SignalChunkHeader chunkheader;
+        struct SignalRecordHeader recheader;
+        ssize_t bytesread;
+
+        if (params->score_bits == SIGNALPACK_V1_SCORE_BITS) {
+            if (reserve_ruling_batch(batch, params->record_size) < 0)
+                goto onNoMemory;
+
+            bytesread = bgzf_read(fp, batch->data + batch->size,
+                                  params->record_size);
+            if (bytesread == 0)
+                break;
+            else if (bytesread != params->record_size)
+                goto onTruncated;
+
+            memcpy(&recheader, batch->data + batch->size, sizeof(recheader));
+            if (recheader.valid_cycle_count < 0 ||
+                    recheader.valid_cycle_count > params->max_cycles)
+                goto onBroken;
+
+            batch->units[batch->nunits++] = batch->size;
+            batch->size += sizeof(recheader) +
+                           sizeof(signal_packet_t) * recheader.valid_cycle_count;
+            continue;
+        }
+
+        bytesread = bgzf_read(fp, &chunkheader, sizeof(chunkheader));
+        if (bytesread == 0)
+            break;
+        else if (bytesread != sizeof(chunkheader))
+            goto onTruncated;
+
+        if (reserve_ruling_batch(batch, sizeof(chunkheader) +
+                                 chunkheader.payload_size) < 0)
+            goto onNoMemory;
+
+        memcpy(batch->data + batch->size, &chunkheader, sizeof(chunkheader));
+        if (bgzf_read(fp, batch->data + batch->size + sizeof(chunkheader),
+                      chunkheader.payload_size) != chunkheader.payload_size)
+            goto onTruncated;
+
+        batch->units[batch->nunits++] = batch->size;
+        batch->size += sizeof(chunkheader) + chunkheader.payload_size;
+    }
+
+    return batch->nunits;
+
+  onTruncated:
+    fprintf(stderr, "Unexpected end of file.\n");
+    return -1;
+
+  onBroken:
+    fprintf(stderr, "Broken signal record.\n");
+    return -1;
+
+  onNoMemory:
+    perror("read_ruling_batch");
+    return -1;
+}
+
+void
+free_ruling_batch(struct RulingBatch *batch)
+{
+    if (batch->data != NULL)
+        free(batch->data);
+    if (batch->units != NULL)
+        free(batch->units);
+
+    memset(batch, 0, sizeof(*batch));
+}
+
+/* Measures the units in the batch, split evenly among the workers. */
+int
+rule_batch(struct RulingWorker *workers, int nworkers,
+           const struct RulingParams *params, const struct RulingBatch *batch)
+{
+    int i, nstarted;
+
+    if ((size_t)nworkers > batch->nunits)
+        nworkers = batch->nunits;
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].params = params;
+        workers[i].batch = batch;
+        workers[i].error = 0;
+        workers[i].first_unit = batch->nunits * i / nworkers;
+        workers[i].end_unit = batch->nunits * (i + 1) / nworkers;
+    }
+
+    if (nworkers == 0)
+        return 0;
+    else if (nworkers == 1) {
+        run_ruling_worker(&workers[0]);
+        return workers[0].error;
+    }
+
+    for (nstarted = 0; nstarted < nworkers; nstarted++)
+        if (pthread_create(&workers[nstarted].thread, NULL, run_ruling_worker,
+                           &workers[nstarted]) != 0) {
+            perror("rule_batch");
+            break;
+        }
+
+    /* Whatever could not be started is run here. */
+    for (i = nstarted; i < nworkers; i++)
+        run_ruling_worker(&workers[i]);
+
+    for (i = 0; i < nstarted; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    for (i = 0; i < nworkers; i++)
+        if (workers[i].error < 0)
+            return -1;
+
+    return 0;
+}
+
+/* The revised taginfo goes to stdout, or to a BGZF file if out is set. */
+static int
+put_output(BGZF *out, const char *data, size_t length)
+{
+    if (out != NULL)
+        return (bgzf_write(out, data, length) < 0) ? -1 : 0;
+    else
+        return (fwrite(data, 1, length, stdout) != length) ? -1 : 0;
+}
+
+static int
+output_corrected_polya_measurements_packed(const char *taginfo_file,
+                                           int16_t *polya_measurements,
+                                           size_t nclusters,
+                                           const char *tile_id, BGZF *out)
+{
+    struct TagPackReader *reader;
+    struct TagPackTagInfo record;
+    int r;
+
+    reader = open_tagpack(taginfo_file, TAGPACK_TYPE_TAGINFO);
+    if (reader == NULL)
+        return -1;
+
+    while ((r = tagpack_next_taginfo(reader, &record)) > 0) {
+        char linebuf[TAGINFO_LINEBUF_SIZE];
+        int flags, polya_len, length;
+
+        flags = record.flags;
+        polya_len = record.polya_len;
+        if (polya_measurements[record.clusterno] >= 0) {
+            flags |= PAFLAG_MEASURED_FROM_FLUORESCENCE;
+            polya_len = polya_measurements[record.clusterno];
+        }
+
+        length = snprintf(linebuf, TAGINFO_LINEBUF_SIZE,
+                          "%s\t%u\t%d\t%d\t%.*s\t%.*s\n", tile_id,
+                          (unsigned int)record.clusterno, flags, polya_len,
+                          record.modlen, record.mods, record.umilen, record.umi);
+        if (length >= TAGINFO_LINEBUF_SIZE ||
+                put_output(out, linebuf, length) < 0) {
+            r = -1;
+            break;
+        }
+    }
+
+    close_tagpack(reader);
+
+    return r;
+}
+
+int
+output_corrected_polya_measurements(const char *taginfo_file,
+                                    int16_t *polya_measurements,
+                                    size_t nclusters,
+                                    const char *tile_id, BGZF *out)
+{
+    gzFile fp;
+    size_t tile_id_len;
+
+    if (tagpack_probe(taginfo_file) == 1)
+        return output_corrected_polya_measurements_packed(taginfo_file,
+                    polya_measurements, nclusters, tile_id, out);
+
+    fp = gzopen(taginfo_file, "rt");
+    if (fp == NULL)
+        return -1;
+
+    gzbuffer(fp, TAGINFO_READ_BUFFER_SIZE);
+    tile_id_len = strlen(tile_id);
+
+    for (;;) {
+        char linebuf[TAGINFO_LINEBUF_SIZE];
+        char outbuf[TAGINFO_LINEBUF_SIZE + MAX_TILE_ID_LEN + 16];
+        char *bptr, *token, *mods, *umi;
+        uint32_t clusterno, flags;
+        int i, length;
+
+        if (gzgets(fp, linebuf, TAGINFO_LINEBUF_SIZE) == NULL) {
+            int errno;
+            (void)gzerror(fp, &errno);
+            if (errno == 0)
+                break; /* end-of-file */
+            else {
+                fprintf(stderr, "Error occurred on reading %s.\n",
+                        taginfo_file);
+                gzclose(fp);
+                return -1;
+            }
+        }
+
+        bptr = linebuf;
+        token = strsep(&bptr, "\t\n\r");
+        if (token == NULL)
+            continue;
+
+        clusterno = atoi(token);
+        if (polya_measurements[clusterno] < 0) {
+            /* Poly(A) length is not revised. Bypass the line. */
+            token[strlen(token)] = '\t';
+            length = strlen(linebuf);
+            memcpy(outbuf, tile_id, tile_id_len);
+            outbuf[tile_id_len] = '\t';
+            memcpy(outbuf + tile_id_len + 1, linebuf, length);
+            length += tile_id_len + 1;
+        }
+        else {
+            mods = umi = NULL;
+            flags = 0;
+
+            for (i = 0; (token = strsep(&bptr, "\t\n\r")) != NULL; i++)
+                switch (i) {
+                case 0: flags = atoi(token); break;
+                case 1: /*polya_prelim = atoi(token);*/ break;
+                case 2: mods = token; break;
+                case 3: umi = token; break;
+                default: break;
+                }
+
+            flags |= PAFLAG_MEASURED_FROM_FLUORESCENCE;
+            length = snprintf(outbuf, sizeof(outbuf), "%s\t%d\t%d\t%d\t%s\t%s\n",
+                              tile_id, clusterno, flags,
+                              polya_measurements[clusterno], mods, umi);
+            if (length >= sizeof(outbuf))
+                length = -1;
+        }
+
+        if (length < 0 || put_output(out, outbuf, length) < 0) {
+            fprintf(stderr, "Failed to write the revised taginfo.\n");
+            gzclose(fp);
+            return -1;
+        }
+    }
+
+    gzclose(fp);
+
+    return 0;
+}
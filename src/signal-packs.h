@@ -40,6 +40,69 @@ typedef struct SignalPacket {
     unsigned int score      : SIGNALPACKET_SCORE_BITWIDTH;
 } signal_packet_t;
 
+/*
+ * Version 2 of the signal dumps starts with SignalFileHeaderV2 instead of
+ * the element size, and stores the records in chunks. A record is the
+ * cluster number delta from the previous record in the chunk (from
+ * first_clusterno for the first one), the first cycle and the valid cycle
+ * count in LEB128 varints, followed by the packets of the valid cycles.
+ * Packets are score_bits wide and packed from the least significant bit.
+ * The highest bit of a packet is the downhill flag, and the rest is the
+ * score requantized to the narrower range; 0 remains a dark cycle.
+ */
+#define SIGNALPACK_V2_MAGIC             0x32675354  /* "TSg2" */
+#define SIGNALPACK_V1_SCORE_BITS        24
+#define SIGNALPACK_MAX_VARINT_LEN       5
+
+struct SignalFileHeaderV2 {
+    uint32_t magic;
+    uint32_t total_clusters;
+    uint32_t max_cycles;
+    uint32_t score_bits;            /* 8 or 12, with the downhill flag */
+};
+
+struct SignalChunkHeader {
+    uint32_t nrecords;
+    uint32_t first_clusterno;
+    uint32_t last_clusterno;
+    uint32_t payload_size;          /* bytes following the header */
+};
+
+#define SIGNALPACK_V2_SCORE_MAX(bits)   ((1 << ((bits) - 1)) - 1)
+#define SIGNALPACK_V2_PACKED_SIZE(bits, ncycles) (((ncycles) * (bits) + 7) / 8)
+#define SIGNALPACK_V2_MAX_RECORD_SIZE(bits, ncycles) \
+    (SIGNALPACK_MAX_VARINT_LEN * 3 + SIGNALPACK_V2_PACKED_SIZE(bits, ncycles))
+
+static inline uint8_t *
+put_signalpack_varint(uint8_t *p, uint32_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+
+    return p;
+}
+
+/* Returns NULL if the varint runs over end. */
+static inline const uint8_t *
+get_signalpack_varint(const uint8_t *p, const uint8_t *end, uint32_t *value)
+{
+    uint32_t v;
+    int shift;
+
+    for (v = 0, shift = 0; p < end && shift < 35; shift += 7) {
+        v |= (uint32_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            *value = v;
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
 /* A storage type that are wide enough to store an score value. */
 typedef uint32_t unpacked_score_t;
 
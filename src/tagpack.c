@@ -0,0 +1,758 @@
+/*
+ * tagpack.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "tagpack.h"
+
+#define TAGPACK_READ_BUFFER_SIZE    1024*1024
+
+static const char packed_bases[4] = { 'A', 'C', 'G', 'T' };
+
+
+static inline int
+pack_base(char base)
+{
+    switch (base) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+    }
+}
+
+
+void
+tagpack_init_file_header(struct TagPackFileHeader *header, int type,
+                         int fivep_length, int umi_length)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, TAGPACK_MAGIC, sizeof(header->magic));
+    header->version = TAGPACK_VERSION;
+    header->type = type;
+    header->fivep_length = fivep_length;
+    header->umi_length = umi_length;
+}
+
+
+void
+tagpack_init_end_marker(struct TagPackBlockHeader *block)
+{
+    memset(block, 0, sizeof(*block));
+}
+
+
+/* Appends a seqqual row to buf, which must have
+ * TAGPACK_SEQQUAL_ROW_SIZE(len5, len3) bytes free. */
+size_t
+tagpack_stage_seqqual(char *buf, uint32_t clusterno,
+                      const char *seq5, const char *qual5, int len5,
+                      const char *seq3, const char *qual3, int len3)
+{
+    struct TagPackSeqQualRow row;
+    char *p;
+
+    row.clusterno = clusterno;
+    row.len5 = len5;
+    row.len3 = len3;
+
+    p = buf;
+    memcpy(p, &row, sizeof(row));
+    p += sizeof(row);
+    memcpy(p, seq5, len5);
+    p += len5;
+    memcpy(p, qual5, len5);
+    p += len5;
+    memcpy(p, seq3, len3);
+    p += len3;
+    memcpy(p, qual3, len3);
+    p += len3;
+
+    return p - buf;
+}
+
+
+/* Appends a taginfo row header to buf, which must have
+ * TAGPACK_TAGINFO_ROW_SIZE(modlen, umilen) bytes free. Returns where the
+ * caller puts the modification sequence and then the UMI. */
+char *
+tagpack_stage_taginfo(char *buf, uint32_t clusterno, int flags,
+                      int polya_len, int modlen, int umilen)
+{
+    struct TagPackTagInfoRow row;
+
+    memset(&row, 0, sizeof(row));
+    row.clusterno = clusterno;
+    row.flags = flags;
+    row.polya_len = polya_len;
+    row.modlen = modlen;
+    row.umilen = umilen;
+    memcpy(buf, &row, sizeof(row));
+
+    return buf + sizeof(row);
+}
+
+
+static ssize_t
+encode_seqqual_block(const char *rows, size_t rowsize, char *out)
+{
+    struct TagPackSeqQualRow row;
+    struct TagPackBlockHeader block;
+    const char *rp, *rowsend;
+    uint32_t *clusternos, nexceptions, i;
+    uint16_t *len3s;
+    size_t nbases, b;
+    char *payload, *exception_pos, *exception_base, *packed, *quals;
+    int len5;
+
+    /* Count the records and bases first to lay out the columns. */
+    block.nrecords = nexceptions = 0;
+    nbases = 0;
+    len5 = -1;
+    rowsend = rows + rowsize;
+    for (rp = rows; rp < rowsend; ) {
+        memcpy(&row, rp, sizeof(row));
+        rp += sizeof(row);
+
+        if (len5 < 0)
+            len5 = row.len5;
+        else if (row.len5 != len5)
+            return -1;
+
+        for (i = 0; i < row.len5; i++)
+            nexceptions += (pack_base(rp[i]) < 0);
+        for (i = 0; i < row.len3; i++)
+            nexceptions += (pack_base(rp[row.len5 * 2 + i]) < 0);
+
+        rp += (row.len5 + row.len3) * 2;
+        nbases += row.len5 + row.len3;
+        if (++block.nrecords > TAGPACK_MAX_BLOCK_RECORDS)
+            return -1;
+    }
+
+    payload = out + sizeof(block);
+    clusternos = (uint32_t *)payload;
+    len3s = (uint16_t *)(payload + block.nrecords * sizeof(uint32_t));
+    memcpy((char *)len3s + block.nrecords * sizeof(uint16_t), &nexceptions,
+           sizeof(nexceptions));
+    exception_pos = (char *)len3s + block.nrecords * sizeof(uint16_t) +
+                    sizeof(nexceptions);
+    exception_base = exception_pos + nexceptions * sizeof(uint32_t);
+    packed = exception_base + nexceptions;
+    quals = packed + (nbases + 3) / 4;
+    memset(packed, 0, (nbases + 3) / 4);
+
+    b = 0;
+    i = 0;
+    for (rp = rows; rp < rowsend; i++) {
+        const char *seq5, *qual5, *seq3, *qual3;
+        int j, code;
+
+        memcpy(&row, rp, sizeof(row));
+        seq5 = rp + sizeof(row);
+        qual5 = seq5 + row.len5;
+        seq3 = qual5 + row.len5;
+        qual3 = seq3 + row.len3;
+        rp = qual3 + row.len3;
+
+        memcpy(&clusternos[i], &row.clusterno, sizeof(uint32_t));
+        memcpy(&len3s[i], &row.len3, sizeof(uint16_t));
+
+        if (i == 0)
+            block.first_clusterno = row.clusterno;
+        block.last_clusterno = row.clusterno;
+
+        for (j = 0; j < row.len5 + row.len3; j++, b++) {
+            char base = (j < row.len5) ? seq5[j] : seq3[j - row.len5];
+
+            code = pack_base(base);
+            if (code < 0) {
+                uint32_t pos = b;
+
+                memcpy(exception_pos, &pos, sizeof(pos));
+                exception_pos += sizeof(pos);
+                *exception_base++ = base;
+                code = 0;
+            }
+
+            packed[b >> 2] |= code << ((b & 3) * 2);
+        }
+
+        memcpy(quals, qual5, row.len5);
+        quals += row.len5;
+        memcpy(quals, qual3, row.len3);
+        quals += row.len3;
+    }
+
+    if (block.nrecords == 0)
+        block.first_clusterno = block.last_clusterno = 0;
+    block.payload_size = quals - payload;
+    memcpy(out, &block, sizeof(block));
+
+    return quals - out;
+}
+
+
+static inline uint32_t
+hash_umi(const char *umi, int length)
+{
+    uint32_t h = 2166136261U;
+    int i;
+
+    for (i = 0; i < length; i++)
+        h = (h ^ (unsigned char)umi[i]) * 16777619U;
+
+    return h;
+}
+
+
+static ssize_t
+encode_taginfo_block(const char *rows, size_t rowsize, char *out)
+{
+    struct TagPackTagInfoRow row;
+    struct TagPackBlockHeader block;
+    const char *rp, *rowsend;
+    uint32_t i, n, ndict, hashmask;
+    uint16_t *slots;
+    char *payload, *col_flags, *col_polya, *col_modlen, *col_umi_index;
+    char *dict, *mods;
+    int umilen;
+
+    block.nrecords = 0;
+    umilen = -1;
+    rowsend = rows + rowsize;
+    for (rp = rows; rp < rowsend; ) {
+        memcpy(&row, rp, sizeof(row));
+        rp += sizeof(row) + row.modlen + row.umilen;
+
+        if (umilen < 0)
+            umilen = row.umilen;
+        else if (row.umilen != umilen)
+            return -1;
+
+        if (++block.nrecords > TAGPACK_MAX_BLOCK_RECORDS)
+            return -1;
+    }
+
+    n = block.nrecords;
+    for (hashmask = 15; hashmask < n * 2; hashmask = hashmask * 2 + 1)
+        /* do nothing */;
+
+    /* slot values are the dictionary indices plus one */
+    slots = calloc(hashmask + 1, sizeof(uint16_t));
+    if (slots == NULL)
+        return -1;
+
+    payload = out + sizeof(block);
+    col_flags = payload + n * sizeof(uint32_t);
+    col_polya = col_flags + n * sizeof(int32_t);
+    col_modlen = col_polya + n * sizeof(int16_t);
+    col_umi_index = col_modlen + n * sizeof(uint16_t);
+    dict = col_umi_index + n * sizeof(uint16_t) + sizeof(uint32_t);
+
+    ndict = 0;
+    i = 0;
+    for (rp = rows; rp < rowsend; i++) {
+        const char *umi;
+        uint32_t slot;
+        uint16_t index;
+        int16_t polya_len;
+
+        memcpy(&row, rp, sizeof(row));
+        umi = rp + sizeof(row) + row.modlen;
+        rp = umi + row.umilen;
+
+        memcpy(payload + i * sizeof(uint32_t), &row.clusterno, sizeof(uint32_t));
+        memcpy(col_flags + i * sizeof(int32_t), &row.flags, sizeof(int32_t));
+        polya_len = row.polya_len;
+        memcpy(col_polya + i * sizeof(int16_t), &polya_len, sizeof(int16_t));
+        memcpy(col_modlen + i * sizeof(uint16_t), &row.modlen, sizeof(uint16_t));
+
+        if (i == 0)
+            block.first_clusterno = row.clusterno;
+        block.last_clusterno = row.clusterno;
+
+        for (slot = hash_umi(umi, umilen) & hashmask; slots[slot] != 0;
+             slot = (slot + 1) & hashmask)
+            if (memcmp(dict + (slots[slot] - 1) * umilen, umi, umilen) == 0)
+                break;
+
+        if (slots[slot] == 0) {
+            memcpy(dict + ndict * umilen, umi, umilen);
+            slots[slot] = ++ndict;
+        }
+
+        index = slots[slot] - 1;
+        memcpy(col_umi_index + i * sizeof(uint16_t), &index, sizeof(uint16_t));
+    }
+
+    free(slots);
+
+    memcpy(col_umi_index + n * sizeof(uint16_t), &ndict, sizeof(ndict));
+
+    mods = dict + ndict * (umilen > 0 ? umilen : 0);
+    for (rp = rows; rp < rowsend; ) {
+        memcpy(&row, rp, sizeof(row));
+        memcpy(mods, rp + sizeof(row), row.modlen);
+        mods += row.modlen;
+        rp += sizeof(row) + row.modlen + row.umilen;
+    }
+
+    if (n == 0)
+        block.first_clusterno = block.last_clusterno = 0;
+    block.payload_size = mods - payload;
+    memcpy(out, &block, sizeof(block));
+
+    return mods - out;
+}
+
+
+/*
+ * Converts the staged rows into a block with its header. out must have
+ * TAGPACK_BLOCK_BOUND(rowsize) bytes. Returns the size of the block, or -1
+ * if the rows don't fit in a block.
+ */
+ssize_t
+tagpack_encode_block(int type, const char *rows, size_t rowsize, char *out)
+{
+    switch (type) {
+        case TAGPACK_TYPE_SEQQUAL:
+            return encode_seqqual_block(rows, rowsize, out);
+        case TAGPACK_TYPE_TAGINFO:
+            return encode_taginfo_block(rows, rowsize, out);
+        default:
+            return -1;
+    }
+}
+
+
+/* Returns 1 if the file is in the block format, 0 if not, -1 on errors. */
+int
+tagpack_probe(const char *filename)
+{
+    char magic[4];
+    gzFile fp;
+    int r;
+
+    fp = gzopen(filename, "rb");
+    if (fp == NULL)
+        return -1;
+
+    r = gzread(fp, magic, sizeof(magic));
+    gzclose(fp);
+
+    if (r < 0)
+        return -1;
+
+    return (r == sizeof(magic) && memcmp(magic, TAGPACK_MAGIC, sizeof(magic)) == 0);
+}
+
+
+struct TagPackReader *
+open_tagpack(const char *filename, int type)
+{
+    struct TagPackReader *reader;
+
+    reader = malloc(sizeof(*reader));
+    if (reader == NULL) {
+        perror("open_tagpack");
+        return NULL;
+    }
+
+    memset(reader, 0, sizeof(*reader));
+
+    reader->filename = strdup(filename);
+    if (reader->filename == NULL) {
+        perror("open_tagpack");
+        goto onError;
+    }
+
+    reader->fp = gzopen(filename, "rb");
+    if (reader->fp == NULL) {
+        fprintf(stderr, "Failed to open %s.\n", filename);
+        goto onError;
+    }
+
+    gzbuffer(reader->fp, TAGPACK_READ_BUFFER_SIZE);
+
+    if (gzread(reader->fp, &reader->header, sizeof(reader->header)) !=
+            sizeof(reader->header) ||
+            memcmp(reader->header.magic, TAGPACK_MAGIC,
+                   sizeof(reader->header.magic)) != 0) {
+        fprintf(stderr, "%s is not in the block format.\n", filename);
+        goto onError;
+    }
+
+    if (reader->header.version != TAGPACK_VERSION ||
+            reader->header.type != type) {
+        fprintf(stderr, "%s has an unsupported version or type.\n", filename);
+        goto onError;
+    }
+
+    return reader;
+
+  onError:
+    close_tagpack(reader);
+    return NULL;
+}
+
+
+void
+close_tagpack(struct TagPackReader *reader)
+{
+    if (reader->fp != NULL)
+        gzclose(reader->fp);
+
+    if (reader->filename != NULL)
+        free(reader->filename);
+    if (reader->payload != NULL)
+        free(reader->payload);
+    if (reader->clusterno != NULL)
+        free(reader->clusterno);
+    if (reader->offsets != NULL)
+        free(reader->offsets);
+    if (reader->len3 != NULL)
+        free(reader->len3);
+    if (reader->flags != NULL)
+        free(reader->flags);
+    if (reader->polya_len != NULL)
+        free(reader->polya_len);
+    if (reader->modlen != NULL)
+        free(reader->modlen);
+    if (reader->umi_index != NULL)
+        free(reader->umi_index);
+    if (reader->bases != NULL)
+        free(reader->bases);
+
+    free(reader);
+}
+
+
+/* Returns 1 if a block follows, 0 at the end of the file, or -1 on errors. */
+static int
+read_block_header(struct TagPackReader *reader)
+{
+    reader->nrecords = reader->next = 0;
+
+    if (gzread(reader->fp, &reader->block, sizeof(reader->block)) !=
+            sizeof(reader->block)) {
+        fprintf(stderr, "%s is truncated.\n", reader->filename);
+        return -1;
+    }
+
+    if (reader->block.nrecords == 0) {
+        reader->eof = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static int
+grow_columns(struct TagPackReader *reader, uint32_t nrecords)
+{
+    void *p;
+
+    if (nrecords <= reader->records_capacity)
+        return 0;
+
+#define GROW_COLUMN(col)                                                \
+    p = realloc(reader->col, sizeof(*reader->col) * nrecords);          \
+    if (p == NULL)                                                      \
+        return -1;                                                      \
+    reader->col = p;
+
+    GROW_COLUMN(clusterno)
+    GROW_COLUMN(offsets)
+    GROW_COLUMN(len3)
+    GROW_COLUMN(flags)
+    GROW_COLUMN(polya_len)
+    GROW_COLUMN(modlen)
+    GROW_COLUMN(umi_index)
+#undef GROW_COLUMN
+
+    reader->records_capacity = nrecords;
+    return 0;
+}
+
+
+static int
+decode_seqqual_block(struct TagPackReader *reader)
+{
+    const char *p, *end, *exception_pos, *exception_base, *packed;
+    uint32_t n, nexceptions, i;
+    size_t nbases, b;
+    int len5;
+
+    n = reader->nrecords;
+    len5 = reader->header.fivep_length;
+    p = reader->payload;
+    end = reader->payload + reader->block.payload_size;
+
+    if (n * (sizeof(uint32_t) + sizeof(uint16_t)) + sizeof(uint32_t) >
+            reader->block.payload_size)
+        return -1;
+
+    memcpy(reader->clusterno, p, n * sizeof(uint32_t));
+    p += n * sizeof(uint32_t);
+    memcpy(reader->len3, p, n * sizeof(uint16_t));
+    p += n * sizeof(uint16_t);
+    memcpy(&nexceptions, p, sizeof(nexceptions));
+    p += sizeof(nexceptions);
+
+    for (i = 0, nbases = 0; i < n; i++) {
+        reader->offsets[i] = nbases;
+        nbases += len5 + reader->len3[i];
+    }
+
+    exception_pos = p;
+    exception_base = exception_pos + (size_t)nexceptions * sizeof(uint32_t);
+    packed = exception_base + nexceptions;
+    reader->quals = packed + (nbases + 3) / 4;
+    if (exception_base > end || reader->quals + nbases != end)
+        return -1;
+
+    if (nbases > reader->bases_capacity) {
+        char *newbases = realloc(reader->bases, nbases);
+        if (newbases == NULL)
+            return -1;
+        reader->bases = newbases;
+        reader->bases_capacity = nbases;
+    }
+
+    for (b = 0; b < nbases; b++)
+        reader->bases[b] = packed_bases[(packed[b >> 2] >> ((b & 3) * 2)) & 3];
+
+    for (i = 0; i < nexceptions; i++) {
+        uint32_t pos;
+
+        memcpy(&pos, exception_pos + i * sizeof(uint32_t), sizeof(pos));
+        if (pos >= nbases)
+            return -1;
+        reader->bases[pos] = exception_base[i];
+    }
+
+    return 0;
+}
+
+
+static int
+decode_taginfo_block(struct TagPackReader *reader)
+{
+    const char *p, *end;
+    uint32_t n, ndict, i;
+    size_t modsize;
+
+    n = reader->nrecords;
+    p = reader->payload;
+    end = reader->payload + reader->block.payload_size;
+
+    if (n * (sizeof(uint32_t) + sizeof(int32_t) + sizeof(int16_t) +
+             sizeof(uint16_t) * 2) + sizeof(uint32_t) > reader->block.payload_size)
+        return -1;
+
+    memcpy(reader->clusterno, p, n * sizeof(uint32_t));
+    p += n * sizeof(uint32_t);
+    memcpy(reader->flags, p, n * sizeof(int32_t));
+    p += n * sizeof(int32_t);
+    memcpy(reader->polya_len, p, n * sizeof(int16_t));
+    p += n * sizeof(int16_t);
+    memcpy(reader->modlen, p, n * sizeof(uint16_t));
+    p += n * sizeof(uint16_t);
+    memcpy(reader->umi_index, p, n * sizeof(uint16_t));
+    p += n * sizeof(uint16_t);
+    memcpy(&ndict, p, sizeof(ndict));
+    p += sizeof(ndict);
+
+    reader->dict = p;
+    reader->mods = p + (size_t)ndict * reader->header.umi_length;
+
+    for (i = 0, modsize = 0; i < n; i++) {
+        if (reader->umi_index[i] >= ndict)
+            return -1;
+        reader->offsets[i] = modsize;
+        modsize += reader->modlen[i];
+    }
+
+    if (reader->mods > end || reader->mods + modsize != end)
+        return -1;
+
+    return 0;
+}
+
+
+static int
+decode_block(struct TagPackReader *reader)
+{
+    uint32_t size = reader->block.payload_size;
+    int r;
+
+    if (size > reader->payload_capacity) {
+        char *newpayload = realloc(reader->payload, size);
+        if (newpayload == NULL) {
+            perror("decode_block");
+            return -1;
+        }
+        reader->payload = newpayload;
+        reader->payload_capacity = size;
+    }
+
+    if (gzread(reader->fp, reader->payload, size) != (int)size) {
+        fprintf(stderr, "%s is truncated.\n", reader->filename);
+        return -1;
+    }
+
+    if (grow_columns(reader, reader->block.nrecords) < 0) {
+        perror("decode_block");
+        return -1;
+    }
+
+    reader->nrecords = reader->block.nrecords;
+    reader->next = 0;
+
+    if (reader->header.type == TAGPACK_TYPE_SEQQUAL)
+        r = decode_seqqual_block(reader);
+    else
+        r = decode_taginfo_block(reader);
+
+    if (r < 0) {
+        fprintf(stderr, "%s has a corrupted block.\n", reader->filename);
+        reader->nrecords = 0;
+    }
+
+    return r;
+}
+
+
+/* Loads blocks until a record is available. Returns 1, 0 at the end of the
+ * file, or -1 on errors. */
+static int
+fill_records(struct TagPackReader *reader)
+{
+    int r;
+
+    while (reader->next >= reader->nrecords) {
+        if (reader->eof)
+            return 0;
+        if ((r = read_block_header(reader)) <= 0)
+            return r;
+        if (decode_block(reader) < 0)
+            return -1;
+    }
+
+    return 1;
+}
+
+
+/* Returns 1 with the next record, 0 at the end of the file, or -1. */
+int
+tagpack_next_seqqual(struct TagPackReader *reader,
+                     struct TagPackSeqQual *record)
+{
+    uint32_t i;
+    int r;
+
+    if ((r = fill_records(reader)) <= 0)
+        return r;
+
+    i = reader->next++;
+    record->clusterno = reader->clusterno[i];
+    record->len5 = reader->header.fivep_length;
+    record->len3 = reader->len3[i];
+    record->seq5 = reader->bases + reader->offsets[i];
+    record->qual5 = reader->quals + reader->offsets[i];
+    record->seq3 = record->seq5 + record->len5;
+    record->qual3 = record->qual5 + record->len5;
+
+    return 1;
+}
+
+
+int
+tagpack_next_taginfo(struct TagPackReader *reader,
+                     struct TagPackTagInfo *record)
+{
+    uint32_t i;
+    int r;
+
+    if ((r = fill_records(reader)) <= 0)
+        return r;
+
+    i = reader->next++;
+    record->clusterno = reader->clusterno[i];
+    record->flags = reader->flags[i];
+    record->polya_len = reader->polya_len[i];
+    record->modlen = reader->modlen[i];
+    record->mods = reader->mods + reader->offsets[i];
+    record->umilen = reader->header.umi_length;
+    record->umi = reader->dict + (size_t)reader->umi_index[i] * record->umilen;
+
+    return 1;
+}
+
+
+/*
+ * Moves on so that the next record read is the first one with a cluster
+ * number not less than clusterno. Blocks that end before it are skipped
+ * without decoding. Returns 0, or -1 on errors.
+ */
+int
+tagpack_skip_to(struct TagPackReader *reader, uint32_t clusterno)
+{
+    int r;
+
+    for (;;) {
+        if (reader->next < reader->nrecords) {
+            if (reader->clusterno[reader->nrecords - 1] >= clusterno) {
+                while (reader->clusterno[reader->next] < clusterno)
+                    reader->next++;
+                return 0;
+            }
+            reader->next = reader->nrecords;
+        }
+
+        if (reader->eof)
+            return 0;
+
+        if ((r = read_block_header(reader)) <= 0)
+            return r;
+
+        if (reader->block.last_clusterno < clusterno) {
+            if (gzseek(reader->fp, reader->block.payload_size, SEEK_CUR) < 0) {
+                fprintf(stderr, "%s is truncated.\n", reader->filename);
+                return -1;
+            }
+        }
+        else if (decode_block(reader) < 0)
+            return -1;
+    }
+}
@@ -0,0 +1,168 @@
+/*
+ * tagpack.h
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+#ifndef _TAILSEQ_TAGPACK_H_
+#define _TAILSEQ_TAGPACK_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/*
+ * Binary block format for the seqqual and taginfo intermediates.
+ *
+ * A file is a file header followed by blocks of records sorted by the
+ * cluster number, and ends with a block header with no records. Each block
+ * header carries the cluster number range and the payload size, thus the
+ * readers skip blocks without decoding them. Payloads are columnar:
+ *
+ *  seqqual: clusterno[n] (u32), len3[n] (u16), nexceptions (u32),
+ *           exception positions (u32) and bases (u8), 2-bit packed bases,
+ *           qualities. Bases of a record are the 5' read and then the 3'
+ *           read. Bases other than A, C, G and T are kept as exceptions.
+ *  taginfo: clusterno[n] (u32), flags[n] (i32), polya_len[n] (i16),
+ *           modlen[n] (u16), umi_index[n] (u16), ndict (u32),
+ *           UMI dictionary, modification sequences.
+ *
+ * Integers are in the host byte order as in the signal files. The importer
+ * stages records row by row with tagpack_stage_*() and converts the rows
+ * of a job into a block with tagpack_encode_block().
+ */
+
+#define TAGPACK_MAGIC               "TSPK"
+#define TAGPACK_VERSION             1
+#define TAGPACK_TYPE_SEQQUAL        1
+#define TAGPACK_TYPE_TAGINFO        2
+#define TAGPACK_MAX_BLOCK_RECORDS   65535
+
+struct TagPackFileHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t type;
+    uint32_t fivep_length;          /* seqqual only */
+    uint32_t umi_length;            /* taginfo only */
+};
+
+struct TagPackBlockHeader {
+    uint32_t nrecords;              /* 0 marks the end of the file */
+    uint32_t first_clusterno;
+    uint32_t last_clusterno;
+    uint32_t payload_size;
+};
+
+/* Staged rows are followed by the 5' sequence and quality and the 3'
+ * sequence and quality, or by the modification sequence and the UMI. */
+struct TagPackSeqQualRow {
+    uint32_t clusterno;
+    uint16_t len5;
+    uint16_t len3;
+};
+
+struct TagPackTagInfoRow {
+    uint32_t clusterno;
+    int32_t flags;
+    int16_t polya_len;
+    uint16_t modlen;
+    uint16_t umilen;
+};
+
+/* Space needed for the staged rows of a record */
+#define TAGPACK_SEQQUAL_ROW_SIZE(len5, len3)    \
+    (sizeof(struct TagPackSeqQualRow) + ((len5) + (len3)) * 2)
+#define TAGPACK_TAGINFO_ROW_SIZE(modlen, umilen) \
+    (sizeof(struct TagPackTagInfoRow) + (modlen) + (umilen))
+/* Space needed to encode the given size of staged rows */
+#define TAGPACK_BLOCK_BOUND(rowsize)            \
+    (sizeof(struct TagPackBlockHeader) + 8 + (rowsize) * 4)
+
+/* Records returned by the reader point into the decoded block and remain
+ * valid until the next call. The sequences are not NUL-terminated. */
+struct TagPackSeqQual {
+    uint32_t clusterno;
+    int len5, len3;
+    const char *seq5, *qual5;
+    const char *seq3, *qual3;
+};
+
+struct TagPackTagInfo {
+    uint32_t clusterno;
+    int flags;
+    int polya_len;
+    int modlen, umilen;
+    const char *mods, *umi;
+};
+
+struct TagPackReader {
+    gzFile fp;
+    char *filename;
+    struct TagPackFileHeader header;
+    struct TagPackBlockHeader block;
+
+    char *payload;
+    size_t payload_capacity;
+
+    /* decoded columns of the current block */
+    uint32_t nrecords;
+    uint32_t next;
+    uint32_t records_capacity;
+    uint32_t *clusterno;
+    size_t *offsets;                /* seqqual: bases, taginfo: mods */
+    uint16_t *len3;                 /* seqqual only */
+    int32_t *flags;                 /* taginfo only */
+    int16_t *polya_len;
+    uint16_t *modlen;
+    uint16_t *umi_index;
+    char *bases;
+    size_t bases_capacity;
+    const char *quals, *dict, *mods;
+
+    int eof;
+};
+
+extern void tagpack_init_file_header(struct TagPackFileHeader *header,
+                                     int type, int fivep_length,
+                                     int umi_length);
+extern void tagpack_init_end_marker(struct TagPackBlockHeader *block);
+extern size_t tagpack_stage_seqqual(char *buf, uint32_t clusterno,
+                                    const char *seq5, const char *qual5,
+                                    int len5, const char *seq3,
+                                    const char *qual3, int len3);
+extern char *tagpack_stage_taginfo(char *buf, uint32_t clusterno,
+                                   int flags, int polya_len,
+                                   int modlen, int umilen);
+extern ssize_t tagpack_encode_block(int type, const char *rows,
+                                    size_t rowsize, char *out);
+
+extern int tagpack_probe(const char *filename);
+extern struct TagPackReader *open_tagpack(const char *filename, int type);
+extern void close_tagpack(struct TagPackReader *reader);
+extern int tagpack_next_seqqual(struct TagPackReader *reader,
+                                struct TagPackSeqQual *record);
+extern int tagpack_next_taginfo(struct TagPackReader *reader,
+                                struct TagPackTagInfo *record);
+extern int tagpack_skip_to(struct TagPackReader *reader, uint32_t clusterno);
+
+#endif
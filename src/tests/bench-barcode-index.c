@@ -0,0 +1,288 @@
+/*
+ * bench-barcode-index.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Compares barcode assignment through the neighbourhood index against the
+ * linear scan of assign_barcode(). Random barcode sets are checked for
+ * identical assignments first, and then both are timed with 1, 24, 96 and
+ * 384 samples.
+ *
+ * Usage: bench-barcode-index [--check-only]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../importer/tailseq-import.h"
+#include "../utils.h"
+
+#define CHECK_ROUNDS            3000
+#define CHECK_QUERIES           2000
+#define BENCH_INDEX_LENGTH      8
+#define BENCH_MISMATCHES        1
+#define BENCH_READS             2000000
+
+static const int bench_sample_counts[] = {1, 24, 96, 384};
+static uint64_t rng_state = 1;
+
+
+static uint32_t
+random_uint32(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+
+/* The first entry is "Unknown" as in parse_config(). */
+static struct SampleInfo *
+new_barcode_list(int length)
+{
+    struct SampleInfo *head;
+
+    head = calloc(1, sizeof(*head));
+    if (head == NULL || (head->index = malloc(length + 1)) == NULL) {
+        perror("new_barcode_list");
+        exit(1);
+    }
+
+    memset(head->index, 'X', length);
+    head->index[length] = '\0';
+
+    return head;
+}
+
+
+static struct SampleInfo *
+add_barcode(struct SampleInfo *head, const char *index, int length,
+            int maximum_index_mismatches)
+{
+    struct SampleInfo *sample;
+
+    sample = calloc(1, sizeof(*sample));
+    if (sample == NULL || (sample->index = malloc(length + 1)) == NULL) {
+        perror("add_barcode");
+        exit(1);
+    }
+
+    memcpy(sample->index, index, length);
+    sample->index[length] = '\0';
+    sample->maximum_index_mismatches = maximum_index_mismatches;
+    sample->next = head->next;
+    head->next = sample;
+
+    return sample;
+}
+
+
+static void
+free_barcode_list(struct SampleInfo *head)
+{
+    struct SampleInfo *next;
+
+    for (; head != NULL; head = next) {
+        next = head->next;
+        free(head->index);
+        free(head);
+    }
+}
+
+
+/* Small alphabets and lengths make colliding neighbourhoods common. */
+static int
+check_equivalence(void)
+{
+    long nqueries, nindexed, nfallback;
+    int round;
+
+    nqueries = nindexed = nfallback = 0;
+
+    for (round = 0; round < CHECK_ROUNDS; round++) {
+        struct SampleInfo *head, *first;
+        struct BarcodeIndex *bindex;
+        char index[16], query[16];
+        int length, nsamples, nletters, i, k;
+
+        length = 1 + random_uint32() % 10;
+        nsamples = 1 + random_uint32() % 12;
+        nletters = (length < 4) ? 4 : 2 + random_uint32() % 3;
+        head = new_barcode_list(length);
+
+        for (k = 0; k < nsamples; k++) {
+            if (random_uint32() % 8 == 0)
+                memset(index, 'X', length);     /* placeholder */
+            else
+                for (i = 0; i < length; i++)
+                    index[i] = "ACGT"[random_uint32() % nletters];
+
+            add_barcode(head, index, length,
+                        (int)(random_uint32() % 4) - (random_uint32() % 10 == 0));
+        }
+        first = head->next;
+
+        bindex = build_barcode_index(head, length);
+        if (bindex == NULL) {
+            nfallback++;
+            free_barcode_list(head);
+            continue;
+        }
+        nindexed++;
+
+        for (k = 0; k < CHECK_QUERIES; k++) {
+            struct SampleInfo *expected, *found;
+            int expected_mm, found_mm;
+
+            if (k < CHECK_QUERIES / 4 && first->index[0] != 'X') {
+                memcpy(query, first->index, length);
+                query[random_uint32() % length] = "ACGTN"[random_uint32() % 5];
+            }
+            else
+                for (i = 0; i < length; i++)
+                    query[i] = "ACGTN"[random_uint32() % (random_uint32() % 20 ? 4 : 5)];
+
+            expected = assign_barcode(query, length, head, NULL, &expected_mm);
+            found = assign_barcode(query, length, head, bindex, &found_mm);
+            nqueries++;
+
+            if (expected != found || expected_mm != found_mm) {
+                fprintf(stderr, "Mismatch for %.*s: linear %s (%d), index %s (%d)\n",
+                        length, query, expected != NULL ? expected->index : "none",
+                        expected_mm, found != NULL ? found->index : "none", found_mm);
+                return -1;
+            }
+        }
+
+        free_barcode_index(bindex);
+        free_barcode_list(head);
+    }
+
+    printf("bench-barcode-index: %ld queries identical over %ld barcode sets "
+           "(%ld sets not indexable).\n", nqueries, nindexed, nfallback);
+
+    return 0;
+}
+
+
+static int
+run_benchmark(int nsamples)
+{
+    struct SampleInfo *head, **samples;
+    struct BarcodeIndex *bindex;
+    char index[BENCH_INDEX_LENGTH], *reads;
+    double started, linear_time, index_time;
+    long assigned_linear, assigned_index;
+    int i, k, mismatches;
+
+    head = new_barcode_list(BENCH_INDEX_LENGTH);
+    samples = malloc(sizeof(struct SampleInfo *) * nsamples);
+    reads = malloc((size_t)BENCH_READS * BENCH_INDEX_LENGTH);
+    if (samples == NULL || reads == NULL) {
+        perror("run_benchmark");
+        return -1;
+    }
+
+    for (k = 0; k < nsamples; k++) {
+        for (i = 0; i < BENCH_INDEX_LENGTH; i++)
+            index[i] = "ACGT"[random_uint32() % 4];
+        samples[k] = add_barcode(head, index, BENCH_INDEX_LENGTH, BENCH_MISMATCHES);
+    }
+
+    /* reads from the samples with an error in every fourth */
+    for (k = 0; k < BENCH_READS; k++) {
+        char *read = reads + (size_t)k * BENCH_INDEX_LENGTH;
+
+        memcpy(read, samples[random_uint32() % nsamples]->index, BENCH_INDEX_LENGTH);
+        if (random_uint32() % 4 == 0)
+            read[random_uint32() % BENCH_INDEX_LENGTH] = "ACGT"[random_uint32() % 4];
+    }
+
+    bindex = build_barcode_index(head, BENCH_INDEX_LENGTH);
+    if (bindex == NULL) {
+        fprintf(stderr, "Failed to build the barcode index.\n");
+        return -1;
+    }
+
+    assigned_linear = 0;
+    started = elapsed_seconds();
+    for (k = 0; k < BENCH_READS; k++)
+        assigned_linear += assign_barcode(reads + (size_t)k * BENCH_INDEX_LENGTH,
+                                          BENCH_INDEX_LENGTH, head, NULL,
+                                          &mismatches) != NULL;
+    linear_time = elapsed_seconds() - started;
+
+    assigned_index = 0;
+    started = elapsed_seconds();
+    for (k = 0; k < BENCH_READS; k++)
+        assigned_index += assign_barcode(reads + (size_t)k * BENCH_INDEX_LENGTH,
+                                         BENCH_INDEX_LENGTH, head, bindex,
+                                         &mismatches) != NULL;
+    index_time = elapsed_seconds() - started;
+
+    printf("%8d %14.1f %14.1f %10ld\n", nsamples,
+           linear_time / BENCH_READS * 1e9, index_time / BENCH_READS * 1e9,
+           assigned_index);
+
+    free_barcode_index(bindex);
+    free_barcode_list(head);
+    free(samples);
+    free(reads);
+
+    if (assigned_linear != assigned_index) {
+        fprintf(stderr, "The index assigned %ld reads, the linear scan %ld.\n",
+                assigned_index, assigned_linear);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+
+    if (check_equivalence() < 0)
+        return 1;
+
+    if (argc > 1 && strcmp(argv[1], "--check-only") == 0)
+        return 0;
+
+    printf("%d-base indices with up to %d mismatch, %d reads\n",
+           BENCH_INDEX_LENGTH, BENCH_MISMATCHES, BENCH_READS);
+    printf("%8s %14s %14s %10s\n", "samples", "linear ns/rd", "index ns/rd",
+           "assigned");
+
+    for (i = 0; i < sizeof(bench_sample_counts) / sizeof(bench_sample_counts[0]); i++)
+        if (run_benchmark(bench_sample_counts[i]) < 0)
+            return 1;
+
+    return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * bench-fair-sampling.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Measures the throughput of the fair-sampling check against the number of
+ * threads, for the mutex-protected counter table that the importer used to
+ * have and for the lock-free check_sequence_for_fair_sampling(). Every
+ * thread checks its own set of fingerprints over and over. The number of
+ * accepted checks depends only on the fingerprints, so both versions must
+ * accept the same number.
+ *
+ * Usage: bench-fair-sampling [maxthreads [checks-per-thread]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "../importer/tailseq-import.h"
+#include "../utils.h"
+
+#define DEFAULT_MAX_THREADS         32
+#define DEFAULT_CHECKS_PER_THREAD   2000000
+#define FINGERPRINTS_PER_THREAD     65536
+
+struct LockedFairSamplingCount {
+    pthread_mutex_t lock;
+    uint8_t *count;
+};
+
+struct SamplingThread {
+    pthread_t thread;
+    int locked;
+    long nchecks;
+    const char *fingerprints;
+    long accepted;
+};
+
+static struct PolyASeederParameters params;
+static struct FairSamplingCount fair_sampling;
+static struct LockedFairSamplingCount locked_fair_sampling;
+
+
+/* check_sequence_for_fair_sampling() as it was with the mutex */
+static int
+check_sequence_with_mutex(struct LockedFairSamplingCount *fair_sampling,
+                          struct PolyASeederParameters *params,
+                          const char *sequence)
+{
+    const char *end, *hashptr;
+    uint64_t v;
+    int r;
+
+    end = sequence + params->fair_sampling_fingerprint_length;
+
+    v = 0;
+    for (hashptr = sequence; hashptr < end; hashptr++)
+        v = ((v << 3) | ((*hashptr & 7) ^ (v >> 60))) & ((1UL << 63) - 1UL);
+    v %= params->fair_sampling_hash_space_size;
+
+    pthread_mutex_lock(&fair_sampling->lock);
+
+    if (params->fair_sampling_max_count == 0 ||
+            fair_sampling->count[v] < params->fair_sampling_max_count) {
+        fair_sampling->count[v]++;
+        r = 0;
+    }
+    else
+        r = -1;
+
+    pthread_mutex_unlock(&fair_sampling->lock);
+
+    return r;
+}
+
+
+static void *
+run_sampling_thread(void *arg)
+{
+    struct SamplingThread *th = (struct SamplingThread *)arg;
+    size_t fplen = params.fair_sampling_fingerprint_length;
+    long i, accepted;
+
+    accepted = 0;
+
+    for (i = 0; i < th->nchecks; i++) {
+        const char *seq = th->fingerprints + (i % FINGERPRINTS_PER_THREAD) * fplen;
+
+        if (th->locked)
+            accepted += (check_sequence_with_mutex(&locked_fair_sampling, &params,
+                                                   seq) == 0);
+        else
+            accepted += (check_sequence_for_fair_sampling(&fair_sampling, &params,
+                                                          seq) == 0);
+    }
+
+    th->accepted = accepted;
+
+    return NULL;
+}
+
+
+/* Returns the throughput in checks per second, or -1 on failure. */
+static double
+run_round(struct SamplingThread *threads, int nthreads, int locked, long *accepted)
+{
+    double started, elapsed;
+    int i;
+
+    memset(fair_sampling.count, 0, params.fair_sampling_hash_space_size);
+    memset(locked_fair_sampling.count, 0, params.fair_sampling_hash_space_size);
+
+    started = elapsed_seconds();
+
+    for (i = 0; i < nthreads; i++) {
+        threads[i].locked = locked;
+        if (pthread_create(&threads[i].thread, NULL, run_sampling_thread,
+                           (void *)&threads[i]) != 0) {
+            perror("run_round");
+            return -1.;
+        }
+    }
+
+    *accepted = 0;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        *accepted += threads[i].accepted;
+    }
+
+    elapsed = elapsed_seconds() - started;
+
+    return threads[0].nchecks * nthreads / elapsed;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct SamplingThread *threads;
+    char *fingerprints;
+    size_t fplen, i;
+    long nchecks;
+    int maxthreads, nthreads;
+
+    maxthreads = (argc > 1) ? atoi(argv[1]) : DEFAULT_MAX_THREADS;
+    nchecks = (argc > 2) ? atol(argv[2]) : DEFAULT_CHECKS_PER_THREAD;
+    if (maxthreads < 1 || nchecks < 1) {
+        fprintf(stderr, "Usage: %s [maxthreads [checks-per-thread]]\n", argv[0]);
+        return 1;
+    }
+
+    /* defaults of parse_config() */
+    memset(&params, 0, sizeof(params));
+    params.fair_sampling_fingerprint_length = fplen = 30;
+    params.fair_sampling_hash_space_size = 1048576;
+    params.fair_sampling_max_count = 5;
+
+    fair_sampling.count = malloc(params.fair_sampling_hash_space_size);
+    locked_fair_sampling.count = malloc(params.fair_sampling_hash_space_size);
+    pthread_mutex_init(&locked_fair_sampling.lock, NULL);
+    threads = calloc(maxthreads, sizeof(struct SamplingThread));
+    fingerprints = malloc((size_t)maxthreads * FINGERPRINTS_PER_THREAD * fplen);
+    if (fair_sampling.count == NULL || locked_fair_sampling.count == NULL ||
+            threads == NULL || fingerprints == NULL) {
+        perror("main");
+        return 1;
+    }
+
+    srand(1);
+    for (i = 0; i < (size_t)maxthreads * FINGERPRINTS_PER_THREAD * fplen; i++)
+        fingerprints[i] = "ACGT"[rand() % 4];
+
+    for (nthreads = 0; nthreads < maxthreads; nthreads++) {
+        threads[nthreads].nchecks = nchecks;
+        threads[nthreads].fingerprints = fingerprints +
+                (size_t)nthreads * FINGERPRINTS_PER_THREAD * fplen;
+    }
+
+    printf("%8s %16s %16s %8s\n", "threads", "mutex Mchk/s", "atomic Mchk/s",
+           "speedup");
+
+    for (nthreads = 1; nthreads <= maxthreads;
+         nthreads = (nthreads < maxthreads && nthreads * 2 > maxthreads) ?
+                    maxthreads : nthreads * 2) {
+        double locked_rate, atomic_rate;
+        long locked_accepted, atomic_accepted;
+
+        locked_rate = run_round(threads, nthreads, 1, &locked_accepted);
+        atomic_rate = run_round(threads, nthreads, 0, &atomic_accepted);
+        if (locked_rate < 0. || atomic_rate < 0.)
+            return 1;
+
+        printf("%8d %16.1f %16.1f %7.2fx\n", nthreads, locked_rate / 1e6,
+               atomic_rate / 1e6, atomic_rate / locked_rate);
+
+        if (locked_accepted != atomic_accepted) {
+            fprintf(stderr, "The mutex version accepted %ld checks, the atomic "
+                    "version %ld.\n", locked_accepted, atomic_accepted);
+            return 1;
+        }
+
+        if (nthreads == maxthreads)
+            break;
+    }
+
+    pthread_mutex_destroy(&locked_fair_sampling.lock);
+    free(fair_sampling.count);
+    free(locked_fair_sampling.count);
+    free(threads);
+    free(fingerprints);
+
+    return 0;
+}
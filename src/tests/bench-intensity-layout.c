@@ -0,0 +1,297 @@
+/*
+ * bench-intensity-layout.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Compares the intensity layout of the importer, lane sets of 16 clusters
+ * with all cycles of a group in a run, against the former layout of one
+ * buffer of interleaved channels per cycle. A synthetic tile is written as
+ * CIF files and loaded into both layouts, and then the intensities of every
+ * cluster are gathered the way check_balancer() and the poly(A) scorer do.
+ *
+ * Usage: bench-intensity-layout [nclusters [ncycles]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
+#include "../importer/tailseq-import.h"
+#include "../utils.h"
+
+#define DEFAULT_NUM_CLUSTERS    250000
+#define DEFAULT_NUM_CYCLES      100
+
+
+static int
+write_synthetic_cif(const char *filename, int cycleno, uint32_t nclusters)
+{
+    uint8_t header[13];
+    int16_t *values;
+    FILE *fp;
+    size_t i, count;
+    int r;
+
+    count = (size_t)nclusters * NUM_CHANNELS;
+    values = malloc(sizeof(int16_t) * count);
+    if (values == NULL) {
+        perror("write_synthetic_cif");
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+        values[i] = (int16_t)(rand() % 4096 - 512);
+
+    memcpy(header, "CIF", 3);
+    header[3] = 1;                          /* version */
+    header[4] = 2;                          /* data size */
+    header[5] = (cycleno + 1) & 0xff;       /* first cycle */
+    header[6] = (cycleno + 1) >> 8;
+    header[7] = 1;                          /* number of cycles */
+    header[8] = 0;
+    header[9] = nclusters & 0xff;
+    header[10] = (nclusters >> 8) & 0xff;
+    header[11] = (nclusters >> 16) & 0xff;
+    header[12] = (nclusters >> 24) & 0xff;
+
+    fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        perror(filename);
+        free(values);
+        return -1;
+    }
+
+    r = (fwrite(header, sizeof(header), 1, fp) < 1 ||
+         fwrite(values, sizeof(int16_t), count, fp) < count) ? -1 : 0;
+    free(values);
+
+    if (fclose(fp) != 0 || r < 0) {
+        perror(filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* The former layout: channels of a cluster next to each other in a buffer
+ * per cycle. Copied from cifreader.c before the lane sets. */
+static void
+interleave_mapped_channels(struct IntensitySet *out, const struct CIFReader *cif,
+                           uint32_t count)
+{
+    const uint8_t *c0, *c1, *c2, *c3;
+    uint32_t i;
+
+    c0 = cif->mapped + 13;
+    c1 = c0 + (size_t)cif->nclusters * sizeof(int16_t);
+    c2 = c1 + (size_t)cif->nclusters * sizeof(int16_t);
+    c3 = c2 + (size_t)cif->nclusters * sizeof(int16_t);
+    i = 0;
+
+#if defined(USE_SSE2) && __BYTE_ORDER == __LITTLE_ENDIAN
+    for (; i + 8 <= count; i += 8) {
+        __m128i a, b, c, d, ablo, abhi, cdlo, cdhi;
+        __m128i *dst = (__m128i *)(out + i);
+
+        a = _mm_loadu_si128((const __m128i *)(c0 + i * 2));
+        b = _mm_loadu_si128((const __m128i *)(c1 + i * 2));
+        c = _mm_loadu_si128((const __m128i *)(c2 + i * 2));
+        d = _mm_loadu_si128((const __m128i *)(c3 + i * 2));
+
+        ablo = _mm_unpacklo_epi16(a, b);
+        abhi = _mm_unpackhi_epi16(a, b);
+        cdlo = _mm_unpacklo_epi16(c, d);
+        cdhi = _mm_unpackhi_epi16(c, d);
+
+        _mm_storeu_si128(dst + 0, _mm_unpacklo_epi32(ablo, cdlo));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi32(ablo, cdlo));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi32(abhi, cdhi));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi32(abhi, cdhi));
+    }
+#endif
+
+#define LE16AT(p, i) ((int16_t)((p)[(i) * 2] | ((p)[(i) * 2 + 1] << 8)))
+    for (; i < count; i++) {
+        out[i].value[0] = LE16AT(c0, i);
+        out[i].value[1] = LE16AT(c1, i);
+        out[i].value[2] = LE16AT(c2, i);
+        out[i].value[3] = LE16AT(c3, i);
+    }
+#undef LE16AT
+}
+
+
+static void
+fetch_interleaved_intensity(struct IntensitySet *signalout,
+                            struct IntensitySet **intensities,
+                            int firstcycle, int ncycles, uint32_t clusterno)
+{
+    int i;
+
+    for (i = 0; i < ncycles; i++)
+        signalout[i] = intensities[firstcycle + i][clusterno];
+}
+
+
+static uint64_t
+checksum_intensities(const struct IntensitySet *signals, int ncycles)
+{
+    uint64_t sum;
+    int i, chan;
+
+    sum = 0;
+    for (i = 0; i < ncycles; i++)
+        for (chan = 0; chan < NUM_CHANNELS; chan++)
+            sum = sum * 31 + (uint16_t)signals[i].value[chan];
+
+    return sum;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    char tmpdir[PATH_MAX], filename[PATH_MAX + 16];
+    struct CIFReader **readers;
+    struct IntensitySet **interleaved, *signals;
+    struct CIFData *blocked;
+    uint32_t nclusters, clusterno;
+    uint64_t sum_interleaved, sum_blocked;
+    double started, load_interleaved, load_blocked;
+    double gather_interleaved, gather_blocked;
+    int ncycles, cycleno, round, r;
+
+    nclusters = (argc > 1) ? (uint32_t)atol(argv[1]) : DEFAULT_NUM_CLUSTERS;
+    ncycles = (argc > 2) ? atoi(argv[2]) : DEFAULT_NUM_CYCLES;
+    if (nclusters < 1 || ncycles < 1) {
+        fprintf(stderr, "Usage: %s [nclusters [ncycles]]\n", argv[0]);
+        return 1;
+    }
+
+    snprintf(tmpdir, PATH_MAX, "%s/tailseq-bench-XXXXXX",
+             getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp");
+    if (mkdtemp(tmpdir) == NULL) {
+        perror(tmpdir);
+        return 1;
+    }
+
+    readers = calloc(ncycles, sizeof(struct CIFReader *));
+    interleaved = calloc(ncycles, sizeof(struct IntensitySet *));
+    signals = malloc(sizeof(struct IntensitySet) * ncycles);
+    blocked = new_cif_data(nclusters, ncycles);
+    if (readers == NULL || interleaved == NULL || signals == NULL || blocked == NULL) {
+        perror("main");
+        return 1;
+    }
+
+    printf("Writing a synthetic tile of %u clusters and %d cycles.\n",
+           nclusters, ncycles);
+
+    srand(1);
+    r = 0;
+    for (cycleno = 0; cycleno < ncycles && r == 0; cycleno++) {
+        snprintf(filename, sizeof(filename), "%s/%d.cif", tmpdir, cycleno);
+        r = write_synthetic_cif(filename, cycleno, nclusters);
+        if (r == 0) {
+            readers[cycleno] = open_cif_file(filename, 1);
+            unlink(filename);
+            if (readers[cycleno] == NULL || readers[cycleno]->mapped == NULL)
+                r = -1;
+        }
+        if (r == 0) {
+            interleaved[cycleno] = malloc(sizeof(struct IntensitySet) * nclusters);
+            if (interleaved[cycleno] == NULL)
+                r = -1;
+        }
+    }
+    rmdir(tmpdir);
+    if (r < 0) {
+        fprintf(stderr, "Failed to prepare the tile.\n");
+        return 1;
+    }
+
+    /* The importer reuses its buffers from block to block. The first round
+     * only faults in the pages. */
+    for (round = 0; round < 2; round++) {
+        started = elapsed_seconds();
+        for (cycleno = 0; cycleno < ncycles; cycleno++)
+            interleave_mapped_channels(interleaved[cycleno], readers[cycleno],
+                                       nclusters);
+        load_interleaved = elapsed_seconds() - started;
+
+        started = elapsed_seconds();
+        for (cycleno = 0; cycleno < ncycles; cycleno++) {
+            readers[cycleno]->read = 0;
+            if (load_cif_data(readers[cycleno], blocked, cycleno, nclusters) < 0)
+                return 1;
+        }
+        load_blocked = elapsed_seconds() - started;
+    }
+
+    sum_interleaved = 0;
+    started = elapsed_seconds();
+    for (clusterno = 0; clusterno < nclusters; clusterno++) {
+        fetch_interleaved_intensity(signals, interleaved, 0, ncycles, clusterno);
+        sum_interleaved += checksum_intensities(signals, ncycles);
+    }
+    gather_interleaved = elapsed_seconds() - started;
+
+    sum_blocked = 0;
+    started = elapsed_seconds();
+    for (clusterno = 0; clusterno < nclusters; clusterno++) {
+        fetch_intensity(signals, blocked, 0, ncycles, clusterno);
+        sum_blocked += checksum_intensities(signals, ncycles);
+    }
+    gather_blocked = elapsed_seconds() - started;
+
+    printf("%-12s %10s %10s %14s\n", "layout", "load (s)", "gather (s)",
+           "gather ns/cl");
+    printf("%-12s %10.3f %10.3f %14.1f\n", "interleaved", load_interleaved,
+           gather_interleaved, gather_interleaved / nclusters * 1e9);
+    printf("%-12s %10.3f %10.3f %14.1f\n", "blocked", load_blocked,
+           gather_blocked, gather_blocked / nclusters * 1e9);
+
+    for (cycleno = 0; cycleno < ncycles; cycleno++) {
+        close_cif_file(readers[cycleno]);
+        free(interleaved[cycleno]);
+    }
+    free(readers);
+    free(interleaved);
+    free(signals);
+    free_cif_data(blocked);
+
+    if (sum_interleaved != sum_blocked) {
+        fprintf(stderr, "The layouts gave different intensities.\n");
+        return 1;
+    }
+
+    return 0;
+}
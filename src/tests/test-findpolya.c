@@ -0,0 +1,229 @@
+/*
+ * test-findpolya.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Checks that the linear-time poly(A) locator gives the same answers as the
+ * exhaustive scan. All short sequences are tried with the default weights,
+ * and then random and adversarial sequences with random parameters.
+ *
+ * Usage: test-findpolya [ncases [seed]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../importer/tailseq-import.h"
+
+#define DEFAULT_NUM_CASES       300000
+#define MAX_SEQUENCE_LEN        300
+
+static const char BASES[] = "ACGTN";
+static uint64_t rng_state;
+static long ncompared, nfound;
+
+
+static uint32_t
+random_uint32(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+
+static void
+set_default_weights(struct PolyAFinderParameters *params)
+{
+    memset(params, 0, sizeof(*params));
+    params->max_terminal_modifications = 20;
+    params->min_polya_length = 5;
+    params->weights_polyA[(int)'T'] = 2;
+    params->weights_polyA[(int)'A'] = params->weights_polyA[(int)'C'] =
+        params->weights_polyA[(int)'G'] = -9;
+    params->weights_polyA[(int)'N'] = -1;
+    params->weights_nonA[(int)'A'] = 0;
+    params->weights_nonA[(int)'T'] = -1;
+    params->weights_nonA[(int)'C'] = params->weights_nonA[(int)'G'] = -4;
+    params->weights_nonA[(int)'N'] = 0;
+}
+
+
+/* Small weights make ties between the candidate intervals common. */
+static void
+set_random_weights(struct PolyAFinderParameters *params)
+{
+    const char *base;
+
+    memset(params, 0, sizeof(*params));
+    for (base = BASES; *base != '\0'; base++) {
+        params->weights_polyA[(int)*base] = (short)(random_uint32() % 9) - 5;
+        params->weights_nonA[(int)*base] = (short)(random_uint32() % 7) - 4;
+    }
+
+    params->max_terminal_modifications = random_uint32() % 30;
+    params->min_polya_length = random_uint32() % 12;
+}
+
+
+static int
+compare_finders(const char *seq, size_t seqlen, struct PolyAFinderParameters *params)
+{
+    uint32_t expected, found;
+
+    params->exhaustive_search = 1;
+    expected = find_polya(seq, seqlen, params);
+    params->exhaustive_search = 0;
+    found = find_polya(seq, seqlen, params);
+
+    ncompared++;
+    nfound += (expected != 0);
+
+    if (expected == found)
+        return 0;
+
+    fprintf(stderr, "Mismatch for \"%.*s\" (max_terminal_modifications=%zu, "
+            "min_polya_length=%zu): exhaustive [%u, %u), linear [%u, %u)\n",
+            (int)seqlen, seq, params->max_terminal_modifications,
+            params->min_polya_length, expected >> 16, expected & 0xffff,
+            found >> 16, found & 0xffff);
+    return -1;
+}
+
+
+/* Every sequence of the given length over the alphabet. */
+static int
+enumerate_sequences(const char *alphabet, int seqlen,
+                    struct PolyAFinderParameters *params)
+{
+    char seq[MAX_SEQUENCE_LEN + 1];
+    int digits[MAX_SEQUENCE_LEN];
+    int nletters, i;
+
+    nletters = strlen(alphabet);
+    for (i = 0; i < seqlen; i++) {
+        digits[i] = 0;
+        seq[i] = alphabet[0];
+    }
+    seq[seqlen] = '\0';
+
+    while (1) {
+        if (compare_finders(seq, seqlen, params) < 0)
+            return -1;
+
+        for (i = 0; i < seqlen && ++digits[i] == nletters; i++) {
+            digits[i] = 0;
+            seq[i] = alphabet[0];
+        }
+        if (i == seqlen)
+            return 0;
+        seq[i] = alphabet[digits[i]];
+    }
+}
+
+
+static void
+generate_sequence(char *seq, size_t seqlen, int kind)
+{
+    size_t i, period;
+
+    period = 2 + random_uint32() % 5;
+
+    for (i = 0; i < seqlen; i++)
+        switch (kind) {
+        case 0: /* random */
+            seq[i] = BASES[random_uint32() % 5];
+            break;
+        case 1: /* T-rich with sparse errors */
+            seq[i] = (random_uint32() % 10 != 0) ? 'T' : BASES[random_uint32() % 5];
+            break;
+        case 2: /* T and A alternating */
+            seq[i] = (i % 2 == 0) ? 'T' : 'A';
+            break;
+        case 3: /* periodic, e.g. TTA or TTTTC */
+            seq[i] = (i % period == period - 1) ? BASES[random_uint32() % 3] : 'T';
+            break;
+        case 4: /* non-T head followed by a T stretch */
+            seq[i] = (i < period * 3) ? BASES[random_uint32() % 5] : 'T';
+            break;
+        default: /* T and A at random */
+            seq[i] = (random_uint32() % 2 == 0) ? 'T' : 'A';
+            break;
+        }
+
+    seq[seqlen] = '\0';
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct PolyAFinderParameters params;
+    char seq[MAX_SEQUENCE_LEN + 1];
+    long ncases, caseno;
+    int seqlen;
+
+    ncases = (argc > 1) ? atol(argv[1]) : DEFAULT_NUM_CASES;
+    rng_state = (argc > 2) ? (uint64_t)atoll(argv[2]) : 1;
+    if (rng_state == 0)
+        rng_state = 1;
+
+    /* all short sequences with the default weights */
+    set_default_weights(&params);
+    for (seqlen = 0; seqlen <= 7; seqlen++)
+        if (enumerate_sequences(BASES, seqlen, &params) < 0)
+            return 1;
+    for (seqlen = 8; seqlen <= 14; seqlen++)
+        if (enumerate_sequences("AT", seqlen, &params) < 0)
+            return 1;
+
+    params.max_terminal_modifications = 3;
+    params.min_polya_length = 1;
+    for (seqlen = 0; seqlen <= 7; seqlen++)
+        if (enumerate_sequences(BASES, seqlen, &params) < 0)
+            return 1;
+
+    for (caseno = 0; caseno < ncases; caseno++) {
+        if (random_uint32() % 2 == 0)
+            set_default_weights(&params);
+        else
+            set_random_weights(&params);
+
+        seqlen = (random_uint32() % 4 == 0) ? random_uint32() % 16 :
+                 random_uint32() % (MAX_SEQUENCE_LEN + 1);
+        generate_sequence(seq, seqlen, random_uint32() % 6);
+
+        if (compare_finders(seq, seqlen, &params) < 0)
+            return 1;
+    }
+
+    printf("test-findpolya: %ld cases identical (%ld with a poly(A)).\n",
+           ncompared, nfound);
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * test-polya-score.c
+ *
+ * Copyright (c) 2016 Hyeshik Chang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * - Hyeshik Chang <hyeshik@snu.ac.kr>
+ */
+
+/*
+ * Checks that compute_polya_score_lanes() gives bit-identical scores and
+ * entropies to the scalar score_lane_cycle() on random groups of lanes.
+ * The static routines are reached by including signalproc.c.
+ *
+ * Usage: test-polya-score [ngroups [seed]]
+ */
+
+#define SCORE_LANE_REFERENCE
+#include "../importer/signalproc.c"
+
+#define DEFAULT_NUM_GROUPS      200000
+
+
+static uint64_t rng_state;
+
+static uint32_t
+random_uint32(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+
+static float
+random_float(float low, float high)
+{
+    return low + (high - low) * (random_uint32() / 4294967296.f);
+}
+
+
+static int16_t
+random_intensity(int mode)
+{
+    switch (mode) {
+    case 0: /* anything */
+        return (int16_t)random_uint32();
+    case 1: /* around zero, many dark or all-negative spots */
+        return (int16_t)(random_uint32() % 101) - 50;
+    case 2: /* bright in a single channel now and then */
+        return (random_uint32() % 4 == 0) ? (int16_t)(random_uint32() % 8000) : 0;
+    default: /* typical */
+        return (int16_t)(random_uint32() % 4000) - 200;
+    }
+}
+
+
+static void
+randomize_parameters(struct PolyARulerParameters *params, float *range_low,
+                     float *range_bandwidth)
+{
+    int i;
+
+    for (i = 0; i < NUM_CHANNELS * NUM_CHANNELS; i++)
+        params->colormatrix[i] = (i % (NUM_CHANNELS + 1) == 0) ?
+                                 random_float(.5f, 2.f) : random_float(-.6f, .6f);
+
+    params->dark_cycles_threshold = random_float(0.f, 600.f);
+    precalc_score_tables(params, random_float(1.f, 40.f), random_float(.1f, .9f));
+
+    for (i = 0; i < NUM_CHANNELS * INTENSITY_LANES; i++) {
+        range_low[i] = random_float(-300.f, 800.f);
+        range_bandwidth[i] = (random_uint32() % 16 == 0) ? random_float(.01f, 1.f) :
+                             random_float(1.f, 5000.f);
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct PolyARulerParameters params;
+    struct IntensityLaneSet lanes;
+    float range_low[NUM_CHANNELS * INTENSITY_LANES];
+    float range_bandwidth[NUM_CHANNELS * INTENSITY_LANES];
+    float scores[INTENSITY_LANES], entropies[INTENSITY_LANES];
+    long ngroups, groupno, checked, dark;
+
+    ngroups = (argc > 1) ? atol(argv[1]) : DEFAULT_NUM_GROUPS;
+    rng_state = (argc > 2) ? (uint64_t)atoll(argv[2]) : 1;
+    if (rng_state == 0)
+        rng_state = 1;
+
+#ifndef USE_SSE2
+    printf("test-polya-score: built without USE_SSE2, nothing to compare.\n");
+    return 0;
+#endif
+
+    checked = dark = 0;
+
+    for (groupno = 0; groupno < ngroups; groupno++) {
+        uint32_t active_lanes;
+        int lane, chan, mode;
+
+        if (groupno % 64 == 0)
+            randomize_parameters(&params, range_low, range_bandwidth);
+
+        mode = random_uint32() % 4;
+        for (chan = 0; chan < NUM_CHANNELS; chan++)
+            for (lane = 0; lane < INTENSITY_LANES; lane++)
+                lanes.value[chan][lane] = random_intensity(mode);
+
+        /* partially filled groups at the end of a block */
+        active_lanes = (random_uint32() % 4 == 0) ? random_uint32() & 0xffff : 0xffff;
+
+        compute_polya_score_lanes(&lanes, 0, 1, active_lanes, range_low,
+                                  range_bandwidth, &params, scores, entropies);
+
+        for (lane = 0; lane < INTENSITY_LANES; lane++) {
+            float score, entropy;
+
+            if (!(active_lanes & (1 << lane)))
+                continue;
+
+            score_lane_cycle(&lanes, lane, range_low, range_bandwidth, &params,
+                             &score, &entropy);
+
+            if (memcmp(&score, &scores[lane], sizeof(float)) != 0 ||
+                    memcmp(&entropy, &entropies[lane], sizeof(float)) != 0) {
+                fprintf(stderr, "Mismatch in group %ld lane %d: score %.9g vs %.9g, "
+                        "entropy %.9g vs %.9g\n", groupno, lane, scores[lane], score,
+                        entropies[lane], entropy);
+                fprintf(stderr, "Intensities:");
+                for (chan = 0; chan < NUM_CHANNELS; chan++)
+                    fprintf(stderr, " %d", lanes.value[chan][lane]);
+                fprintf(stderr, "\n");
+                return 1;
+            }
+
+            checked++;
+            dark += isnan(score);
+        }
+    }
+
+    printf("test-polya-score: %ld lanes identical (%ld dark).\n", checked, dark);
+
+    return 0;
+}
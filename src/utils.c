@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 #include "htslib/bgzf.h"
 
 
@@ -76,3 +77,14 @@ bgzf_printf(BGZF *fp, const char *format, ...)
 
     return r;
 }
+
+
+double
+elapsed_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
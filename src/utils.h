@@ -30,6 +30,7 @@
 extern char *replace_placeholder(const char *format, const char *old,
                                  const char *new);
 extern int bgzf_printf(BGZF *fp, const char *format, ...);
+extern double elapsed_seconds(void);
 
 static inline int
 min_int(int a, int b)
@@ -222,37 +222,68 @@ rule calculate_optimal_parameters:
         external_script('{PYTHON3_CMD} {SCRIPTSDIR}/calculate-optimal-parameters.py')
 
 
-# A single job of this task is generally very light (<~1s). The tasks are
-# processed as grouped within a same tile to save the overheads by
-# the pipeline itself.
-rule measure_polya_lengths_from_fluorescence:
-    input:
-        signals=expand('scratch/signals/{sample}_{{tile}}.sigpack', sample=ALL_SAMPLES),
-        taginfo=expand('scratch/taginfo/{sample}_{{tile}}.txt.gz', sample=ALL_SAMPLES),
-        score_cutoffs=lambda wc: (
-            'scratch/sigdists-r{round:02d}/signal-cutoffs.txt'.format(round=int(wc.round)-1))
-    output:
-        taginfo=map(temp, expand('scratch/taginfo-fl-r{{round,[^0].|.[^0]}}/'
-                                 '{sample}_{{tile,[^_]+}}.txt.gz', sample=ALL_SAMPLES)),
-        sigdists=temp('scratch/sigdists-r{round,[^0].|.[^0]}/pos_{tile}.sigdists')
-    params: CONF=CONF.confdata, BINDIR=BINDIR, BGZIP_CMD=BGZIP_CMD
-    run:
-        external_script('{PYTHON3_CMD} {SCRIPTSDIR}/measure-polya-lengths.py')
-
-
 TARGETS.extend(['stats/polya-score-cutoffs-bases.txt',
                 'stats/polya-score-cutoffs.txt'])
-rule finalize_measurement_params:
-    input:
-        cutoff_values='scratch/sigdists-r{round:02d}/signal-cutoffs.txt'.format(
-                        round=CONF['polyA_ruler']['signal_resampling_rounds']),
-        cutoff_bases='scratch/stats/polya-score-cutoffs-bases-r{round:02d}.txt'.format(
-                        round=CONF['polyA_ruler']['signal_resampling_rounds'])
-    output:
-        cutoff_values='stats/polya-score-cutoffs.txt',
-        cutoff_bases='stats/polya-score-cutoffs-bases.txt'
-    shell: 'cp {input.cutoff_values} {output.cutoff_values} && \
-            cp {input.cutoff_bases} {output.cutoff_bases}'
+if (CONF['performance']['in_memory_resampling'] and
+        CONF['polyA_ruler']['signal_resampling_rounds'] >= 1):
+    # All rounds of the signal resampling are done in a single process that
+    # keeps the signals of every tile in memory. Needs memory as large as the
+    # total size of the signal dumps.
+    rule resample_polya_lengths_in_memory:
+        input:
+            signals=expand('scratch/signals/{sample}_{tile}.sigpack',
+                           sample=ALL_SAMPLES, tile=TILES),
+            taginfo=expand('scratch/taginfo/{sample}_{tile}.txt.gz',
+                           sample=ALL_SAMPLES, tile=TILES),
+            negdists=expand('scratch/sigdists-r00/neg_{tile}.sigdists', tile=TILES),
+            score_cutoffs='scratch/sigdists-r00/signal-cutoffs.txt'
+        output:
+            resampler_conf=temp('scratch/resampler-conf.ini'),
+            taginfo=map(temp, expand('scratch/taginfo-fl-r{round:02d}/{sample}_{tile}.txt.gz',
+                        round=CONF['polyA_ruler']['signal_resampling_rounds'] + 1,
+                        sample=ALL_SAMPLES, tile=TILES)),
+            cutoff_values='stats/polya-score-cutoffs.txt',
+            cutoff_bases='stats/polya-score-cutoffs-bases.txt'
+        params:
+            conf=CONF.confdata, tileinfo=TILES, total_cycles=NUM_CYCLES,
+            samples=ALL_SAMPLES
+        threads: THREADS_MAXIMUM_CORE
+        run:
+            external_script('{PYTHON3_CMD} {SCRIPTSDIR}/generate-resampler-conf.py')
+            shell('{BINDIR}/tailseq-polya-resampler {output.resampler_conf}')
+else:
+    # All tiles of a round are measured in a single job, which shares a
+    # loaded cutoff table and the worker threads over the tiles.
+    rule measure_polya_lengths_from_fluorescence:
+        input:
+            signals=expand('scratch/signals/{sample}_{tile}.sigpack',
+                           sample=ALL_SAMPLES, tile=TILES),
+            taginfo=expand('scratch/taginfo/{sample}_{tile}.txt.gz',
+                           sample=ALL_SAMPLES, tile=TILES),
+            score_cutoffs=lambda wc: (
+                'scratch/sigdists-r{round:02d}/signal-cutoffs.txt'.format(round=int(wc.round)-1))
+        output:
+            manifest=temp('scratch/polyaruler-manifest/r{round,[^0].|.[^0]}.txt'),
+            taginfo=map(temp, expand('scratch/taginfo-fl-r{{round}}/{sample}_{tile}.txt.gz',
+                                     sample=ALL_SAMPLES, tile=TILES)),
+            sigdists=map(temp, expand('scratch/sigdists-r{{round}}/pos_{tile}.sigdists',
+                                      tile=TILES))
+        params: CONF=CONF.confdata, BINDIR=BINDIR, tiles=sorted(TILES), samples=ALL_SAMPLES
+        threads: THREADS_MAXIMUM_CORE
+        run:
+            external_script('{PYTHON3_CMD} {SCRIPTSDIR}/measure-polya-lengths.py')
+
+    rule finalize_measurement_params:
+        input:
+            cutoff_values='scratch/sigdists-r{round:02d}/signal-cutoffs.txt'.format(
+                            round=CONF['polyA_ruler']['signal_resampling_rounds']),
+            cutoff_bases='scratch/stats/polya-score-cutoffs-bases-r{round:02d}.txt'.format(
+                            round=CONF['polyA_ruler']['signal_resampling_rounds'])
+        output:
+            cutoff_values='stats/polya-score-cutoffs.txt',
+            cutoff_bases='stats/polya-score-cutoffs-bases.txt'
+        shell: 'cp {input.cutoff_values} {output.cutoff_values} && \
+                cp {input.cutoff_bases} {output.cutoff_bases}'
 
 
 TARGETS.extend(expand('taginfo/{sample}.txt.gz', sample=ALL_SAMPLES))
@@ -269,13 +300,12 @@ rule merge_and_deduplicate_taginfo:
     run:
         sorted_input = sorted(input)
         if wildcards.sample in EXP_SAMPLES:
-            shell('zcat {sorted_input} | \
-                env BGZIP_OPT="-@ {threads}" sort -t "\t" -k6,6 -k1,1 -k2,2n \
-                    --compress-program={BINDIR}/bgzip-wrap --parallel={threads} | \
-                {BINDIR}/tailseq-dedup-perfect {output.duptrace} | \
-                env BGZIP_OPT="-@ {threads}" sort -t "\t" -k1,1 -k2,2n \
-                    --compress-program={BINDIR}/bgzip-wrap --parallel={threads} | \
-                {BGZIP_CMD} -@ {threads} -c > {output.taginfo}')
+            # Tags are grouped by UMI and put back in the tile and cluster
+            # order within the deduplicator.
+            tempdir = make_scratch_dir('dedup-perfect')
+            shell('{BINDIR}/tailseq-dedup-perfect --threads {threads} \
+                    --temp-dir {tempdir} --output {output.taginfo} \
+                    {output.duptrace} {sorted_input}')
         elif wildcards.sample in SPIKEIN_SAMPLES:
             shell('{SCRIPTSDIR}/bgzf-merge.py --output {output.taginfo} {sorted_input}')
             shell('echo -n "" | gzip -c - > {output.duptrace}')